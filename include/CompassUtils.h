@@ -246,6 +246,20 @@ public:
             updateSettings = true;
         }
 
+        if (!doc.containsKey("Duty Cycle"))
+        {
+            JsonObject Duty_Cycle = doc.createNestedObject("Duty Cycle");
+            Duty_Cycle["cfgType"] = 8;
+            Duty_Cycle["cfgVal"] = 10;
+            Duty_Cycle["dftVal"] = 10;
+            Duty_Cycle["maxVal"] = 100;
+            Duty_Cycle["minVal"] = 1;
+            Duty_Cycle["incVal"] = 1;
+            Duty_Cycle["signed"] = false;
+
+            updateSettings = true;
+        }
+
         if (!doc.containsKey("Silent Mode"))
         {
             doc["Silent Mode"] = false;
@@ -258,6 +272,18 @@ public:
             updateSettings = true;
         }
 
+        if (!doc.containsKey("Listen Before Talk"))
+        {
+            doc["Listen Before Talk"] = false;
+            updateSettings = true;
+        }
+
+        if (!doc.containsKey("Compact Messages"))
+        {
+            doc["Compact Messages"] = false;
+            updateSettings = true;
+        }
+
         if (!doc.containsKey("WiFi Provisioning"))
         {
             JsonObject provisioningMode = doc.createNestedObject("WiFi Provisioning");
@@ -371,6 +397,10 @@ public:
             ArduinoLora.SetSpreadingFactor(7);
             ArduinoLora.SetSignalBandwidth(125E3);
 
+            ArduinoLora.SetCompactEncoding(doc["Compact Messages"].as<bool>());
+            ArduinoLora.SetDutyCycle(doc["Duty Cycle"]["cfgVal"].as<uint8_t>());
+            ArduinoLora.SetListenBeforeTalk(doc["Listen Before Talk"].as<bool>());
+
             #if HARDWARE_VERSION == 1
             ArduinoLora.SetTXPower(20);
             #endif
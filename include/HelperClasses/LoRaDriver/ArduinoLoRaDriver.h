@@ -1,9 +1,69 @@
 #include "LoraDriverInterface.h"
+#include "LoraPacketPool.h"
+#include "LoraCompactCodec.h"
+#include "LoraDutyCycleScheduler.h"
+#include <RHLoRaAirtime.h>
+#include <RHListenBeforeTalk.h>
 #include <LoRa.h>
 
+// SX127x register the FIFO is read and written through
+#define SX127X_REG_FIFO 0x00
+#define SX127X_REG_OP_MODE 0x01
+#define SX127X_REG_FIFO_ADDR_PTR 0x0D
+#define SX127X_REG_FIFO_TX_BASE_ADDR 0x0E
+#define SX127X_REG_FIFO_RX_BASE_ADDR 0x0F
+#define SX127X_REG_IRQ_FLAGS 0x12
+#define SX127X_REG_PAYLOAD_LENGTH 0x22
+#define SX127X_MODE_LONG_RANGE_CAD 0x87
+#define SX127X_IRQ_CAD_DONE 0x04
+#define SX127X_IRQ_CAD_DETECTED 0x01
+#define SX127X_MAX_PAYLOAD_LENGTH 255
+
+// The LoRa library puts both the transmitted and received packets at the start of the FIFO, so loading
+// a packet to send would overwrite a received one that is still waiting to be read. Keep them in separate halves.
+#define SX127X_FIFO_TX_BASE 0x80
+#define SX127X_FIFO_RX_BASE 0x00
+
 class ArduinoLoRaDriver : public LoraDriverInterface
 {
 public:
+    enum ReceiveMode
+    {
+        RECEIVE_MODE_POLLING,
+        RECEIVE_MODE_INTERRUPT
+    };
+
+    // Times spent on each stage of the last and all successful sends.
+    // Airtime is calculated from the modem settings, transmit time is how long endPacket blocked.
+    struct SendStats
+    {
+        uint32_t packetsSent;
+        uint32_t failures;
+        uint32_t lastSerializeMicros;
+        uint32_t lastFifoLoadMicros;
+        uint32_t lastAirtimeMicros;
+        uint32_t lastTransmitMicros;
+        uint64_t totalSerializeMicros;
+        uint64_t totalFifoLoadMicros;
+        uint64_t totalAirtimeMicros;
+        uint32_t deferrals;
+        uint64_t totalDeferralMicros;
+    };
+
+    // Latencies are measured from the DIO0 RxDone interrupt, so they are only
+    // collected in interrupt mode
+    struct ReceiveStats
+    {
+        uint32_t packetsReceived;
+        uint32_t packetsDropped;
+        uint32_t interrupts;
+        uint32_t lastWakeLatencyMicros;
+        uint32_t maxWakeLatencyMicros;
+        uint32_t lastLatencyMicros;
+        uint32_t maxLatencyMicros;
+        uint64_t totalLatencyMicros;
+    };
+
     ArduinoLoRaDriver(SPIClass *spi, int cs, int reset, int dio0, uint32_t loraFrequency, uint32_t spiFrequency = 1000000) :
         _spi(spi),
         _spiFrequency(spiFrequency),
@@ -12,7 +72,10 @@ public:
         _dio0(dio0),
         _loraFrequency(loraFrequency)
     {
-
+        // Init sets 4/8, and the LoRa library leaves the payload CRC off
+        RHLoRaDefaultModemParams(&_modem);
+        _modem.codingRate4 = 8;
+        _modem.crc = false;
     }
 
     bool Init()
@@ -51,79 +114,240 @@ public:
         }
         #endif
 
-        LoRa.setCodingRate4(8);
-        LoRa.setSpreadingFactor(7);
-        LoRa.setSignalBandwidth(125E3);
+        SetCodingRate4(8);
+        SetSpreadingFactor(7);
+        SetSignalBandwidth(125E3);
         LoRa.setSPIFrequency(_spiFrequency);
+
+        _initialized = result;
+        if (result)
+        {
+            WriteRegister(SX127X_REG_FIFO_TX_BASE_ADDR, SX127X_FIFO_TX_BASE);
+            WriteRegister(SX127X_REG_FIFO_RX_BASE_ADDR, SX127X_FIFO_RX_BASE);
+            ApplyReceiveMode();
+        }
+
         return result;
     }
 
     bool ReceiveMessage(JsonDocument &doc, size_t timeout = 0)
     {
+        if (_receiveMode == RECEIVE_MODE_INTERRUPT)
+        {
+            return ReceiveMessageOnInterrupt(doc, timeout);
+        }
+
         auto startTime = xTaskGetTickCount();
 
         do
         {
-            size_t msgSize = 0;
-            uint8_t buffer[256];
-            memset(buffer, 0, sizeof(buffer));
+            auto msgSize = LoRa.parsePacket();
 
-            if (LoRa.parsePacket() == 0) continue;
+            if (msgSize <= 0) continue;
 
-            while (LoRa.available())
-            {
-                buffer[msgSize] = (uint8_t)(LoRa.read() & 0xFF);
-                msgSize++;
-            }
+            if (!ReadPacket(msgSize)) continue;
+
+            return DeserializePacket(doc);
+        }
+        while ((xTaskGetTickCount() - startTime) < timeout);
 
-            if (msgSize == 0) continue;
+        return false;
+    }
 
+    // Selects between polling the radio for packets and sleeping until DIO0 signals RxDone.
+    // May be called before or after Init.
+    void SetReceiveMode(ReceiveMode mode)
+    {
+        if (mode == RECEIVE_MODE_INTERRUPT && _dio0 < 0)
+        {
             #if DEBUG == 1
-            // Serial.print("Message of length ");
-            // Serial.print(msgSize);
-            // Serial.print(" received: ");
-            // for (auto i = 0; i < msgSize; i++)
-            // {
-            //     Serial.print(buffer[i], HEX);
-            //     Serial.print(" ");
-            // }
-            // Serial.println();
+            Serial.println("ArduinoLoRaDriver::SetReceiveMode: DIO0 is not connected, staying in polling mode");
             #endif
+            return;
+        }
 
-            auto result = deserializeMsgPack(doc, (const uint8_t *)buffer, sizeof(buffer));
+        _receiveMode = mode;
 
-#if DEBUG == 1
-            Serial.print("Deserialization result: ");
-            Serial.println(result.code());
-#endif
-            return result.code() == DeserializationError::Ok;
+        if (_initialized)
+        {
+            ApplyReceiveMode();
         }
-        while ((xTaskGetTickCount() - startTime) < timeout);
+    }
 
-        return false;
+    ReceiveMode GetReceiveMode()
+    {
+        return _receiveMode;
     }
 
-    bool SendMessage(JsonDocument &doc)
+    ReceiveStats GetReceiveStats()
     {
-        auto msgSize = measureMsgPack(doc);
-        // uint8_t buffer[msgSize];
-        // memset(buffer, 0, msgSize);
+        auto stats = _receiveStats;
+        stats.interrupts = _interruptCount;
+        return stats;
+    }
 
-        // serializeMsgPack(doc, buffer, sizeof(buffer));
+    void ResetReceiveStats()
+    {
+        memset(&_receiveStats, 0, sizeof(_receiveStats));
+        _interruptCount = 0;
+    }
 
+    // Buffer the last received message was deserialized from.
+    // Keep a copy of the handle to use the document after the next call to ReceiveMessage.
+    LoraPacket LastPacket()
+    {
+        return _lastPacket;
+    }
+
+    bool SendMessage(JsonDocument &doc)
+    {
         #if DEBUG == 1
         Serial.print("Sending message: ");
         serializeJson(doc, Serial);
         Serial.println();
         #endif
 
-        if (LoRa.beginPacket())
+        auto packet = LoraPacketPool::Acquire();
+
+        if (!packet.IsValid())
         {
-            serializeMsgPack(doc, LoRa);
-            return LoRa.endPacket() == 1;
+            #if DEBUG == 1
+            Serial.println("ArduinoLoRaDriver::SendMessage: No free packet buffers");
+            #endif
+            _sendStats.failures++;
+            return false;
         }
-        
-        return false;
+
+        auto serializeStart = esp_timer_get_time();
+        size_t msgSize = 0;
+        if (_compactEncoding)
+        {
+            msgSize = LoraCompactCodec::Encode(doc, packet.Data(), SX127X_MAX_PAYLOAD_LENGTH);
+        }
+        if (msgSize == 0)
+        {
+            msgSize = serializeMsgPack(doc, packet.Data(), packet.Capacity());
+        }
+        auto serializeEnd = esp_timer_get_time();
+
+        // A message that fills the whole buffer may have been truncated, and would not fit the FIFO anyway
+        if (msgSize == 0 || msgSize > SX127X_MAX_PAYLOAD_LENGTH)
+        {
+            #if DEBUG == 1
+            Serial.println("ArduinoLoRaDriver::SendMessage: Message too long");
+            #endif
+            _sendStats.failures++;
+            return false;
+        }
+
+        packet.SetLength(msgSize);
+
+        // Hold the packet back until the duty cycle budget and retry spacing allow it
+        auto airtime = GetAirtimeMicros(msgSize);
+        auto deferral = _scheduler.DelayMicros(airtime, esp_timer_get_time());
+        if (deferral > 0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(deferral / 1000) + 1);
+            _sendStats.deferrals++;
+            _sendStats.totalDeferralMicros += deferral;
+        }
+
+        if (!WaitForClearChannel())
+        {
+            #if DEBUG == 1
+            Serial.println("ArduinoLoRaDriver::SendMessage: Channel busy, giving up");
+            #endif
+            if (_receiveMode == RECEIVE_MODE_INTERRUPT)
+            {
+                LoRa.receive();
+            }
+            _sendStats.failures++;
+            return false;
+        }
+
+        if (!LoRa.beginPacket())
+        {
+            if (_receiveMode == RECEIVE_MODE_INTERRUPT)
+            {
+                LoRa.receive();
+            }
+            _sendStats.failures++;
+            return false;
+        }
+
+        auto fifoLoadStart = esp_timer_get_time();
+        WriteFifo(packet.Data(), packet.Length());
+        auto fifoLoadEnd = esp_timer_get_time();
+
+        auto result = LoRa.endPacket() == 1;
+        auto txEnd = esp_timer_get_time();
+
+        // Transmitting leaves the radio in standby
+        if (_receiveMode == RECEIVE_MODE_INTERRUPT)
+        {
+            LoRa.receive();
+        }
+
+        // The channel was used whether or not the transmission completed
+        _scheduler.OnTransmit(airtime, txEnd);
+
+        if (!result)
+        {
+            _sendStats.failures++;
+            return false;
+        }
+
+        _sendStats.packetsSent++;
+        _sendStats.lastSerializeMicros = (uint32_t)(serializeEnd - serializeStart);
+        _sendStats.lastFifoLoadMicros = (uint32_t)(fifoLoadEnd - fifoLoadStart);
+        _sendStats.lastAirtimeMicros = airtime;
+        _sendStats.lastTransmitMicros = (uint32_t)(txEnd - fifoLoadEnd);
+        _sendStats.totalSerializeMicros += _sendStats.lastSerializeMicros;
+        _sendStats.totalFifoLoadMicros += _sendStats.lastFifoLoadMicros;
+        _sendStats.totalAirtimeMicros += _sendStats.lastAirtimeMicros;
+
+        return true;
+    }
+
+    // Sends message types with a compact schema in the fixed binary layout instead of MessagePack.
+    // Nodes on older firmware cannot decode it, so leave it off until every node on the channel is updated.
+    void SetCompactEncoding(bool enabled)
+    {
+        _compactEncoding = enabled;
+    }
+
+    SendStats GetSendStats()
+    {
+        return _sendStats;
+    }
+
+    void ResetSendStats()
+    {
+        memset(&_sendStats, 0, sizeof(_sendStats));
+    }
+
+    // Runs CAD before every transmission and backs off while the channel is busy.
+    // Worth turning on where many devices share a frequency.
+    void SetListenBeforeTalk(bool enabled)
+    {
+        _lbt.setMode(enabled ? RHListenBeforeTalk::ModeCad : RHListenBeforeTalk::ModeOff);
+    }
+
+    const RHListenBeforeTalk::Stats &GetListenBeforeTalkStats()
+    {
+        return _lbt.stats();
+    }
+
+    // Limits this radio to the given percentage of airtime, averaged over LORA_DUTY_CYCLE_WINDOW_MS
+    void SetDutyCycle(uint8_t percent)
+    {
+        _scheduler.SetDutyCycle(percent);
+    }
+
+    // Time on air of a packet with the given payload length at the current modem settings
+    uint32_t GetAirtimeMicros(size_t length)
+    {
+        return RHLoRaAirtime(&_modem, (uint8_t)length);
     }
 
     void SetTXPower(int txPower)
@@ -140,14 +364,265 @@ public:
     void SetSpreadingFactor(int sf)
     {
         LoRa.setSpreadingFactor(sf);
+        _modem.spreadingFactor = sf;
     }
 
     void SetSignalBandwidth(uint32_t sbw)
     {
         LoRa.setSignalBandwidth(sbw);
+        _modem.bandwidth = sbw;
+    }
+
+    void SetCodingRate4(int denominator)
+    {
+        LoRa.setCodingRate4(denominator);
+        _modem.codingRate4 = denominator;
     }
 
 protected:
+    static void IRAM_ATTR Dio0Interrupt(void *arg)
+    {
+        auto driver = (ArduinoLoRaDriver *)arg;
+        driver->_rxDoneMicros = esp_timer_get_time();
+        driver->_rxDone = true;
+        driver->_interruptCount++;
+
+        auto task = driver->_rxTask;
+        if (task != nullptr)
+        {
+            BaseType_t higherPriorityTaskWoken = pdFALSE;
+            vTaskNotifyGiveFromISR(task, &higherPriorityTaskWoken);
+
+            if (higherPriorityTaskWoken)
+            {
+                portYIELD_FROM_ISR();
+            }
+        }
+    }
+
+    void ApplyReceiveMode()
+    {
+        if (_receiveMode == RECEIVE_MODE_INTERRUPT)
+        {
+            _rxDone = false;
+            attachInterruptArg(digitalPinToInterrupt(_dio0), Dio0Interrupt, this, RISING);
+            LoRa.receive();
+        }
+        else
+        {
+            if (_dio0 >= 0)
+            {
+                detachInterrupt(digitalPinToInterrupt(_dio0));
+            }
+            LoRa.idle();
+        }
+    }
+
+    // The radio sits in continuous receive, and the ISR notifies whichever task is waiting here.
+    // The ISR does no SPI, so the packet is still read on the calling task.
+    bool ReceiveMessageOnInterrupt(JsonDocument &doc, size_t timeout)
+    {
+        _rxTask = xTaskGetCurrentTaskHandle();
+        auto startTime = xTaskGetTickCount();
+
+        do
+        {
+            if (!_rxDone)
+            {
+                auto elapsed = xTaskGetTickCount() - startTime;
+                ulTaskNotifyTake(pdTRUE, elapsed < timeout ? timeout - elapsed : 0);
+            }
+
+            if (!_rxDone) continue;
+
+            _rxDone = false;
+            int64_t rxDoneMicros = _rxDoneMicros;
+            auto wakeLatency = (uint32_t)(esp_timer_get_time() - rxDoneMicros);
+
+            // Reads and clears the IRQ flags. Leaves the radio idle or, after a CRC error, in single receive.
+            auto msgSize = LoRa.parsePacket();
+            auto packetRead = msgSize > 0 && ReadPacket(msgSize);
+            LoRa.receive();
+
+            if (!packetRead) continue;
+
+            auto result = DeserializePacket(doc);
+
+            auto latency = (uint32_t)(esp_timer_get_time() - rxDoneMicros);
+            _receiveStats.lastWakeLatencyMicros = wakeLatency;
+            _receiveStats.lastLatencyMicros = latency;
+            _receiveStats.totalLatencyMicros += latency;
+            if (wakeLatency > _receiveStats.maxWakeLatencyMicros)
+            {
+                _receiveStats.maxWakeLatencyMicros = wakeLatency;
+            }
+            if (latency > _receiveStats.maxLatencyMicros)
+            {
+                _receiveStats.maxLatencyMicros = latency;
+            }
+
+            return result;
+        }
+        while ((xTaskGetTickCount() - startTime) < timeout);
+
+        return false;
+    }
+
+    // Copies the packet LoRa.parsePacket() found into a pooled buffer
+    bool ReadPacket(size_t msgSize)
+    {
+        auto packet = LoraPacketPool::Acquire();
+
+        if (!packet.IsValid())
+        {
+            #if DEBUG == 1
+            Serial.println("ArduinoLoRaDriver::ReadPacket: No free packet buffers, dropping packet");
+            #endif
+            _receiveStats.packetsDropped++;
+            return false;
+        }
+
+        ReadFifo(packet.Data(), msgSize);
+        packet.SetLength(msgSize);
+
+        #if DEBUG == 1
+        // Serial.print("Message of length ");
+        // Serial.print(msgSize);
+        // Serial.print(" received: ");
+        // for (auto i = 0; i < msgSize; i++)
+        // {
+        //     Serial.print(packet.Data()[i], HEX);
+        //     Serial.print(" ");
+        // }
+        // Serial.println();
+        #endif
+
+        _rxPacket = std::move(packet);
+        return true;
+    }
+
+    // Loads the whole packet into the FIFO in a single SPI transaction, at the transmit base address
+    // rather than where LoRa.beginPacket() left the FIFO address, so a received packet still waiting
+    // in the receive half is not overwritten. Packets of up to 128 octets each cannot overlap.
+    void WriteFifo(const uint8_t *buffer, size_t length)
+    {
+        WriteRegister(SX127X_REG_FIFO_ADDR_PTR, SX127X_FIFO_TX_BASE);
+
+        _spi->beginTransaction(SPISettings(_spiFrequency, MSBFIRST, SPI_MODE0));
+        digitalWrite(_cs, LOW);
+        _spi->transfer(SX127X_REG_FIFO | 0x80);
+        _spi->writeBytes(buffer, length);
+        digitalWrite(_cs, HIGH);
+        _spi->endTransaction();
+
+        WriteRegister(SX127X_REG_PAYLOAD_LENGTH, length);
+    }
+
+    // The backoff policy is shared with the RadioHead drivers. Backoffs are scaled by the measured
+    // transmit time of the previous packet, and sleep the calling task rather than spinning.
+    bool WaitForClearChannel()
+    {
+        auto action = _lbt.begin(_sendStats.lastTransmitMicros);
+
+        while (action == RHListenBeforeTalk::ActionBackoff)
+        {
+            if (_lbt.backoff() > 0)
+            {
+                vTaskDelay(pdMS_TO_TICKS(_lbt.backoff() / 1000) + 1);
+            }
+
+            action = _lbt.cadResult(ChannelActivityDetected());
+        }
+
+        return action == RHListenBeforeTalk::ActionTransmit;
+    }
+
+    // The LoRa library has no CAD support, so drive the modem registers directly.
+    // CAD takes about 2 symbols, so poll the IRQ flags rather than remapping DIO0 away from RxDone.
+    bool ChannelActivityDetected()
+    {
+        LoRa.idle();
+        WriteRegister(SX127X_REG_IRQ_FLAGS, SX127X_IRQ_CAD_DONE | SX127X_IRQ_CAD_DETECTED);
+        WriteRegister(SX127X_REG_OP_MODE, SX127X_MODE_LONG_RANGE_CAD);
+
+        auto startTime = xTaskGetTickCount();
+        uint8_t flags = ReadRegister(SX127X_REG_IRQ_FLAGS);
+
+        while (!(flags & SX127X_IRQ_CAD_DONE) && (xTaskGetTickCount() - startTime) < pdMS_TO_TICKS(100))
+        {
+            vTaskDelay(1);
+            flags = ReadRegister(SX127X_REG_IRQ_FLAGS);
+        }
+
+        WriteRegister(SX127X_REG_IRQ_FLAGS, SX127X_IRQ_CAD_DONE | SX127X_IRQ_CAD_DETECTED);
+        LoRa.idle();
+
+        // Treat a CAD that never finished as a busy channel
+        return !(flags & SX127X_IRQ_CAD_DONE) || (flags & SX127X_IRQ_CAD_DETECTED);
+    }
+
+    uint8_t ReadRegister(uint8_t address)
+    {
+        _spi->beginTransaction(SPISettings(_spiFrequency, MSBFIRST, SPI_MODE0));
+        digitalWrite(_cs, LOW);
+        _spi->transfer(address & 0x7F);
+        auto value = _spi->transfer(0x00);
+        digitalWrite(_cs, HIGH);
+        _spi->endTransaction();
+
+        return value;
+    }
+
+    void WriteRegister(uint8_t address, uint8_t value)
+    {
+        _spi->beginTransaction(SPISettings(_spiFrequency, MSBFIRST, SPI_MODE0));
+        digitalWrite(_cs, LOW);
+        _spi->transfer(address | 0x80);
+        _spi->transfer(value);
+        digitalWrite(_cs, HIGH);
+        _spi->endTransaction();
+    }
+
+    bool DeserializePacket(JsonDocument &doc)
+    {
+        // Both decoders leave strings in doc pointing into the packet buffer (non-const input puts
+        // ArduinoJson in zero-copy mode). Hold on to it until the next packet replaces the contents of doc.
+        _lastPacket = std::move(_rxPacket);
+        _receiveStats.packetsReceived++;
+
+        // Compact frames are always accepted, whatever this node sends
+        if (LoraCompactCodec::IsCompactFrame(_lastPacket.Data(), _lastPacket.Length()))
+        {
+            auto decoded = LoraCompactCodec::Decode(_lastPacket.Data(), _lastPacket.Length(), doc);
+
+#if DEBUG == 1
+            Serial.print("Compact decode result: ");
+            Serial.println(decoded);
+#endif
+            return decoded;
+        }
+
+        auto result = deserializeMsgPack(doc, _lastPacket.Data(), _lastPacket.Length());
+
+#if DEBUG == 1
+        Serial.print("Deserialization result: ");
+        Serial.println(result.code());
+#endif
+        return result.code() == DeserializationError::Ok;
+    }
+
+    // Reads the received packet out of the FIFO in a single SPI transaction.
+    // LoRa.parsePacket() has already pointed the FIFO address at the start of the packet.
+    void ReadFifo(uint8_t *buffer, size_t length)
+    {
+        _spi->beginTransaction(SPISettings(_spiFrequency, MSBFIRST, SPI_MODE0));
+        digitalWrite(_cs, LOW);
+        _spi->transfer(SX127X_REG_FIFO & 0x7F);
+        _spi->transfer(buffer, length);
+        digitalWrite(_cs, HIGH);
+        _spi->endTransaction();
+    }
+
     SPIClass *_spi = nullptr;
     uint32_t _spiFrequency;
 
@@ -157,4 +632,24 @@ protected:
 
     uint32_t _loraFrequency;
 
+    bool _initialized = false;
+    bool _compactEncoding = false;
+
+    LoraPacket _rxPacket;
+    LoraPacket _lastPacket;
+
+    ReceiveMode _receiveMode = RECEIVE_MODE_POLLING;
+    ReceiveStats _receiveStats = {};
+    SendStats _sendStats = {};
+
+    RHLoRaModemParams _modem;
+    LoraDutyCycleScheduler _scheduler;
+    RHListenBeforeTalk _lbt = RHListenBeforeTalk(RHListenBeforeTalk::ModeOff);
+
+    // Shared with Dio0Interrupt
+    volatile bool _rxDone = false;
+    volatile int64_t _rxDoneMicros = 0;
+    volatile uint32_t _interruptCount = 0;
+    TaskHandle_t volatile _rxTask = nullptr;
+
 };
\ No newline at end of file
@@ -0,0 +1,359 @@
+#pragma once
+
+#include <ArduinoJson.h>
+
+// First byte of a compact frame. 0xC1 is never used by MessagePack, so nodes running older
+// firmware reject compact frames as bad input, and newer nodes can tell the two formats apart.
+#define LORA_COMPACT_FRAME_MARKER 0xC1
+
+// Key holding the message type in every message document
+#define LORA_COMPACT_TYPE_KEY "MsgType"
+
+// Timestamps go over the air as seconds since 2024-01-01T00:00:00Z. This is a fixed offset rather than a
+// delta from the sender's previous message, so every frame decodes on its own when packets are lost.
+#define LORA_COMPACT_TIME_EPOCH 1704067200UL
+
+// Fixed point scale for latitude and longitude, about 1 cm resolution
+#define LORA_COMPACT_LATLON_SCALE 1e7
+
+// Fixed layout binary encoding for the message types the compass sends most often.
+// Frame layout:
+//   marker (0xC1), message type, 16 bit field presence mask, then each present field in schema order.
+// Only documents whose keys and value types are all covered by the schema for their message type
+// are encoded. Everything else returns 0 from Encode so the caller can fall back to MessagePack.
+namespace LoraCompactCodec
+{
+    enum FieldKind
+    {
+        FIELD_UINT8,         // 1 byte
+        FIELD_VARUINT,       // LEB128, 1 to 5 bytes
+        FIELD_BOOL,          // 1 byte
+        FIELD_LATLON,        // Degrees as a little endian int32 in 1e-7 degree units
+        FIELD_EPOCH_SECONDS, // Unix time as a LEB128 offset from LORA_COMPACT_TIME_EPOCH
+        FIELD_STRING         // Null terminated
+    };
+
+    struct Field
+    {
+        const char *key;
+        FieldKind kind;
+    };
+
+    // Schemas for the types registered in main.cpp. The keys must match the ones
+    // MessageBase and MessagePing serialize; test/test_lora_compact_codec checks that they do.
+    struct MessageBaseSchema
+    {
+        static const uint8_t Type = 0x01;
+        static const size_t FieldCount = 4;
+
+        static const Field *Fields()
+        {
+            static const Field fields[FieldCount] =
+            {
+                {"Sender", FIELD_VARUINT},
+                {"Recipient", FIELD_VARUINT},
+                {"MsgID", FIELD_VARUINT},
+                {"SenderName", FIELD_STRING},
+            };
+            return fields;
+        }
+    };
+
+    struct MessagePingSchema
+    {
+        static const uint8_t Type = 0x02;
+        static const size_t FieldCount = 10;
+
+        static const Field *Fields()
+        {
+            static const Field fields[FieldCount] =
+            {
+                {"Sender", FIELD_VARUINT},
+                {"Recipient", FIELD_VARUINT},
+                {"MsgID", FIELD_VARUINT},
+                {"SenderName", FIELD_STRING},
+                {"Lat", FIELD_LATLON},
+                {"Lng", FIELD_LATLON},
+                {"Time", FIELD_EPOCH_SECONDS},
+                {"Red", FIELD_UINT8},
+                {"Green", FIELD_UINT8},
+                {"Blue", FIELD_UINT8},
+            };
+            return fields;
+        }
+    };
+
+    inline bool WriteVarUInt(uint32_t value, uint8_t *buffer, size_t capacity, size_t &index)
+    {
+        do
+        {
+            if (index >= capacity) return false;
+
+            uint8_t byte = value & 0x7F;
+            value >>= 7;
+            buffer[index++] = value ? (byte | 0x80) : byte;
+        }
+        while (value);
+
+        return true;
+    }
+
+    inline bool ReadVarUInt(const uint8_t *buffer, size_t length, size_t &index, uint32_t &value)
+    {
+        value = 0;
+
+        for (uint8_t shift = 0; shift < 35; shift += 7)
+        {
+            if (index >= length) return false;
+
+            uint8_t byte = buffer[index++];
+            value |= (uint32_t)(byte & 0x7F) << shift;
+
+            if (!(byte & 0x80)) return true;
+        }
+
+        return false;
+    }
+
+    template <typename Schema>
+    class Codec
+    {
+    public:
+        static_assert(Schema::FieldCount <= 16, "Presence mask only has room for 16 fields");
+
+        static size_t Encode(JsonObjectConst message, uint8_t *buffer, size_t capacity)
+        {
+            auto fields = Schema::Fields();
+            uint16_t present = 0;
+
+            // Refuse anything the schema would not carry losslessly
+            for (JsonPairConst kv : message)
+            {
+                if (strcmp(kv.key().c_str(), LORA_COMPACT_TYPE_KEY) == 0) continue;
+
+                int fieldIndex = FindField(kv.key().c_str());
+                if (fieldIndex < 0 || !Encodable(fields[fieldIndex].kind, kv.value())) return 0;
+
+                present |= 1 << fieldIndex;
+            }
+
+            if (capacity < 4) return 0;
+
+            size_t index = 0;
+            buffer[index++] = LORA_COMPACT_FRAME_MARKER;
+            buffer[index++] = Schema::Type;
+            buffer[index++] = present & 0xFF;
+            buffer[index++] = present >> 8;
+
+            for (size_t i = 0; i < Schema::FieldCount; i++)
+            {
+                if (!(present & (1 << i))) continue;
+
+                if (!EncodeField(fields[i].kind, message[fields[i].key], buffer, capacity, index)) return 0;
+            }
+
+            return index;
+        }
+
+        // Strings in doc point into buffer, which must outlive it
+        static bool Decode(uint8_t *buffer, size_t length, JsonDocument &doc)
+        {
+            if (length < 4 || buffer[0] != LORA_COMPACT_FRAME_MARKER || buffer[1] != Schema::Type) return false;
+
+            auto fields = Schema::Fields();
+            uint16_t present = buffer[2] | (buffer[3] << 8);
+            size_t index = 4;
+
+            doc.clear();
+            doc[LORA_COMPACT_TYPE_KEY] = (uint8_t)Schema::Type;
+
+            for (size_t i = 0; i < Schema::FieldCount; i++)
+            {
+                if (!(present & (1 << i))) continue;
+
+                if (!DecodeField(fields[i], buffer, length, index, doc)) return false;
+            }
+
+            return index == length && !doc.overflowed();
+        }
+
+    protected:
+        static int FindField(const char *key)
+        {
+            auto fields = Schema::Fields();
+
+            for (size_t i = 0; i < Schema::FieldCount; i++)
+            {
+                if (strcmp(fields[i].key, key) == 0) return i;
+            }
+
+            return -1;
+        }
+
+        static bool Encodable(FieldKind kind, JsonVariantConst value)
+        {
+            switch (kind)
+            {
+                case FIELD_UINT8:
+                    return value.is<uint8_t>();
+                case FIELD_VARUINT:
+                    return value.is<uint32_t>();
+                case FIELD_BOOL:
+                    return value.is<bool>();
+                case FIELD_LATLON:
+                    return value.is<double>() && fabs(value.as<double>()) <= 180.0;
+                case FIELD_EPOCH_SECONDS:
+                    return value.is<uint32_t>() && value.as<uint32_t>() >= LORA_COMPACT_TIME_EPOCH;
+                case FIELD_STRING:
+                    return value.is<const char *>();
+            }
+
+            return false;
+        }
+
+        static bool EncodeField(FieldKind kind, JsonVariantConst value, uint8_t *buffer, size_t capacity, size_t &index)
+        {
+            switch (kind)
+            {
+                case FIELD_UINT8:
+                case FIELD_BOOL:
+                {
+                    if (index >= capacity) return false;
+                    buffer[index++] = kind == FIELD_BOOL ? (uint8_t)value.as<bool>() : value.as<uint8_t>();
+                    return true;
+                }
+                case FIELD_VARUINT:
+                    return WriteVarUInt(value.as<uint32_t>(), buffer, capacity, index);
+                case FIELD_EPOCH_SECONDS:
+                    return WriteVarUInt(value.as<uint32_t>() - LORA_COMPACT_TIME_EPOCH, buffer, capacity, index);
+                case FIELD_LATLON:
+                {
+                    if (index + 4 > capacity) return false;
+                    auto fixed = (int32_t)lround(value.as<double>() * LORA_COMPACT_LATLON_SCALE);
+                    auto bits = (uint32_t)fixed;
+                    buffer[index++] = bits & 0xFF;
+                    buffer[index++] = (bits >> 8) & 0xFF;
+                    buffer[index++] = (bits >> 16) & 0xFF;
+                    buffer[index++] = (bits >> 24) & 0xFF;
+                    return true;
+                }
+                case FIELD_STRING:
+                {
+                    auto str = value.as<const char *>();
+                    auto size = strlen(str) + 1;
+                    if (index + size > capacity) return false;
+                    memcpy(buffer + index, str, size);
+                    index += size;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        static bool DecodeField(const Field &field, uint8_t *buffer, size_t length, size_t &index, JsonDocument &doc)
+        {
+            switch (field.kind)
+            {
+                case FIELD_UINT8:
+                case FIELD_BOOL:
+                {
+                    if (index >= length) return false;
+                    if (field.kind == FIELD_BOOL)
+                    {
+                        doc[field.key] = buffer[index++] != 0;
+                    }
+                    else
+                    {
+                        doc[field.key] = buffer[index++];
+                    }
+                    return true;
+                }
+                case FIELD_VARUINT:
+                case FIELD_EPOCH_SECONDS:
+                {
+                    uint32_t value;
+                    if (!ReadVarUInt(buffer, length, index, value)) return false;
+                    doc[field.key] = field.kind == FIELD_EPOCH_SECONDS ? value + LORA_COMPACT_TIME_EPOCH : value;
+                    return true;
+                }
+                case FIELD_LATLON:
+                {
+                    if (index + 4 > length) return false;
+                    uint32_t bits = buffer[index] | (buffer[index + 1] << 8) | (buffer[index + 2] << 16) | ((uint32_t)buffer[index + 3] << 24);
+                    index += 4;
+                    doc[field.key] = (int32_t)bits / LORA_COMPACT_LATLON_SCALE;
+                    return true;
+                }
+                case FIELD_STRING:
+                {
+                    auto str = (const char *)buffer + index;
+                    auto end = (const uint8_t *)memchr(str, 0, length - index);
+                    if (end == nullptr) return false;
+                    // const char * is stored by reference, not copied
+                    doc[field.key] = str;
+                    index = end - buffer + 1;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+    };
+
+    // Dispatches on the message type to the matching schema. The chain of
+    // comparisons is generated from the schema list at compile time.
+    template <typename... Schemas>
+    struct Registry;
+
+    template <>
+    struct Registry<>
+    {
+        static size_t Encode(uint8_t, JsonObjectConst, uint8_t *, size_t)
+        {
+            return 0;
+        }
+
+        static bool Decode(uint8_t, uint8_t *, size_t, JsonDocument &)
+        {
+            return false;
+        }
+    };
+
+    template <typename First, typename... Rest>
+    struct Registry<First, Rest...>
+    {
+        static size_t Encode(uint8_t type, JsonObjectConst message, uint8_t *buffer, size_t capacity)
+        {
+            return type == First::Type ? Codec<First>::Encode(message, buffer, capacity) : Registry<Rest...>::Encode(type, message, buffer, capacity);
+        }
+
+        static bool Decode(uint8_t type, uint8_t *buffer, size_t length, JsonDocument &doc)
+        {
+            return type == First::Type ? Codec<First>::Decode(buffer, length, doc) : Registry<Rest...>::Decode(type, buffer, length, doc);
+        }
+    };
+
+    typedef Registry<MessageBaseSchema, MessagePingSchema> Messages;
+
+    inline bool IsCompactFrame(const uint8_t *buffer, size_t length)
+    {
+        return length >= 4 && buffer[0] == LORA_COMPACT_FRAME_MARKER;
+    }
+
+    // Returns the encoded length, or 0 if the message has no schema or does not fit one
+    inline size_t Encode(JsonDocument &doc, uint8_t *buffer, size_t capacity)
+    {
+        JsonObjectConst message = doc.as<JsonObjectConst>();
+        if (message.isNull() || !message[LORA_COMPACT_TYPE_KEY].is<uint8_t>()) return 0;
+
+        return Messages::Encode(message[LORA_COMPACT_TYPE_KEY].as<uint8_t>(), message, buffer, capacity);
+    }
+
+    inline bool Decode(uint8_t *buffer, size_t length, JsonDocument &doc)
+    {
+        if (!IsCompactFrame(buffer, length)) return false;
+
+        return Messages::Decode(buffer[1], buffer, length, doc);
+    }
+}
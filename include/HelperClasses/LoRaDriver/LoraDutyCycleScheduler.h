@@ -0,0 +1,110 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Period over which the duty cycle is averaged. Bursts of up to this window
+// times the duty cycle of airtime go out back to back.
+#ifndef LORA_DUTY_CYCLE_WINDOW_MS
+#define LORA_DUTY_CYCLE_WINDOW_MS 10000
+#endif
+
+// Token bucket that limits a radio's share of the channel, counted in microseconds of airtime.
+// Tokens are kept in hundredths of a microsecond so any whole percentage refills without rounding.
+//
+// After every transmission the next one is also held off for a random time of up to one airtime,
+// so nodes that heard the same packet, or are retrying the same broadcast, do not answer in lockstep.
+class LoraDutyCycleScheduler
+{
+public:
+    LoraDutyCycleScheduler(uint8_t dutyCyclePercent = 100, uint32_t windowMs = LORA_DUTY_CYCLE_WINDOW_MS) :
+        _windowMicros((uint64_t)windowMs * 1000)
+    {
+        SetDutyCycle(dutyCyclePercent);
+        _tokens = _capacity;
+    }
+
+    void SetDutyCycle(uint8_t percent)
+    {
+        if (percent < 1) percent = 1;
+        if (percent > 100) percent = 100;
+
+        _percent = percent;
+        _capacity = _windowMicros * percent;
+
+        if (_tokens > _capacity)
+        {
+            _tokens = _capacity;
+        }
+    }
+
+    uint8_t GetDutyCycle()
+    {
+        return _percent;
+    }
+
+    // Returns how long to wait before a packet with the given airtime may start, 0 if it can go now
+    uint32_t DelayMicros(uint32_t airtimeMicros, int64_t now)
+    {
+        Refill(now);
+
+        int64_t delay = 0;
+
+        if (now < _nextAllowed)
+        {
+            delay = _nextAllowed - now;
+        }
+
+        // A packet longer than the whole bucket waits for a full bucket
+        auto needed = Needed(airtimeMicros);
+        if (_percent < 100 && _tokens < needed)
+        {
+            int64_t refillDelay = (needed - _tokens + _percent - 1) / _percent;
+            if (refillDelay > delay)
+            {
+                delay = refillDelay;
+            }
+        }
+
+        return (uint32_t)delay;
+    }
+
+    // Accounts for a packet that has just finished transmitting
+    void OnTransmit(uint32_t airtimeMicros, int64_t now)
+    {
+        Refill(now);
+
+        auto needed = Needed(airtimeMicros);
+        _tokens = _tokens > needed ? _tokens - needed : 0;
+
+        _nextAllowed = now + (airtimeMicros > 0 ? random(0, airtimeMicros) : 0);
+    }
+
+protected:
+    uint64_t Needed(uint32_t airtimeMicros)
+    {
+        uint64_t needed = (uint64_t)airtimeMicros * 100;
+        return needed < _capacity ? needed : _capacity;
+    }
+
+    void Refill(int64_t now)
+    {
+        if (_lastRefill != 0 && now > _lastRefill)
+        {
+            _tokens += (uint64_t)(now - _lastRefill) * _percent;
+
+            if (_tokens > _capacity)
+            {
+                _tokens = _capacity;
+            }
+        }
+
+        _lastRefill = now;
+    }
+
+    uint64_t _windowMicros;
+    uint64_t _capacity = 0;
+    uint64_t _tokens = 0;
+    uint8_t _percent = 100;
+    int64_t _lastRefill = 0;
+    int64_t _nextAllowed = 0;
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+// Number of packet buffers shared by the LoRa drivers
+#ifndef LORA_PACKET_POOL_SIZE
+#define LORA_PACKET_POOL_SIZE 4
+#endif
+
+// The SX127x FIFO holds at most 255 bytes of payload, so one extra byte
+// leaves room for ArduinoJson to null terminate a string at the end of a packet
+#define LORA_PACKET_BUFFER_SIZE 256
+
+class LoraPacketPool;
+
+// Reference counted handle to a buffer taken from LoraPacketPool.
+// Copying the handle shares the buffer, and the buffer goes back to the pool
+// when the last handle is released or destroyed.
+class LoraPacket
+{
+public:
+    LoraPacket() : _slot(nullptr)
+    {
+
+    }
+
+    LoraPacket(const LoraPacket &other) : _slot(other._slot)
+    {
+        Retain();
+    }
+
+    LoraPacket(LoraPacket &&other) : _slot(other._slot)
+    {
+        other._slot = nullptr;
+    }
+
+    ~LoraPacket()
+    {
+        Release();
+    }
+
+    LoraPacket &operator=(const LoraPacket &other)
+    {
+        if (this != &other)
+        {
+            Release();
+            _slot = other._slot;
+            Retain();
+        }
+
+        return *this;
+    }
+
+    LoraPacket &operator=(LoraPacket &&other)
+    {
+        if (this != &other)
+        {
+            Release();
+            _slot = other._slot;
+            other._slot = nullptr;
+        }
+
+        return *this;
+    }
+
+    bool IsValid() const
+    {
+        return _slot != nullptr;
+    }
+
+    uint8_t *Data()
+    {
+        return _slot != nullptr ? _slot->data : nullptr;
+    }
+
+    size_t Length() const
+    {
+        return _slot != nullptr ? _slot->length : 0;
+    }
+
+    void SetLength(size_t length)
+    {
+        if (_slot != nullptr)
+        {
+            _slot->length = length < LORA_PACKET_BUFFER_SIZE ? length : LORA_PACKET_BUFFER_SIZE;
+        }
+    }
+
+    size_t Capacity() const
+    {
+        return LORA_PACKET_BUFFER_SIZE;
+    }
+
+    void Release()
+    {
+        if (_slot != nullptr)
+        {
+            _slot->refCount.fetch_sub(1, std::memory_order_acq_rel);
+            _slot = nullptr;
+        }
+    }
+
+protected:
+    friend class LoraPacketPool;
+
+    struct Slot
+    {
+        std::atomic<uint8_t> refCount;
+        size_t length;
+        uint8_t data[LORA_PACKET_BUFFER_SIZE];
+    };
+
+    explicit LoraPacket(Slot *slot) : _slot(slot)
+    {
+
+    }
+
+    void Retain()
+    {
+        if (_slot != nullptr)
+        {
+            _slot->refCount.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    Slot *_slot;
+};
+
+// Fixed pool of packet buffers so the radio path never allocates or
+// puts a 256 byte buffer on the task stack. Safe to use from several tasks.
+class LoraPacketPool
+{
+public:
+    // Returns a free buffer with a length of 0, or an invalid packet if all are in use
+    static LoraPacket Acquire()
+    {
+        auto slots = Slots();
+
+        for (size_t i = 0; i < LORA_PACKET_POOL_SIZE; i++)
+        {
+            uint8_t expected = 0;
+            if (slots[i].refCount.compare_exchange_strong(expected, 1, std::memory_order_acq_rel))
+            {
+                slots[i].length = 0;
+                return LoraPacket(&slots[i]);
+            }
+        }
+
+        return LoraPacket();
+    }
+
+    static size_t Available()
+    {
+        auto slots = Slots();
+        size_t count = 0;
+
+        for (size_t i = 0; i < LORA_PACKET_POOL_SIZE; i++)
+        {
+            if (slots[i].refCount.load(std::memory_order_relaxed) == 0)
+            {
+                count++;
+            }
+        }
+
+        return count;
+    }
+
+protected:
+    static LoraPacket::Slot *Slots()
+    {
+        static LoraPacket::Slot slots[LORA_PACKET_POOL_SIZE];
+        return slots;
+    }
+};
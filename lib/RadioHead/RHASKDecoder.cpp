@@ -0,0 +1,226 @@
+// RHASKDecoder.cpp
+//
+// Host side decoder for RH_ASK baseband, for testing decode robustness and throughput
+// without radio hardware
+
+#include <RHASKDecoder.h>
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <RHCRC.h>
+
+// 4 bit to 6 bit symbols, as in RH_ASK. Each 6-bit symbol has 3 1s and 3 0s
+// with at most 3 consecutive identical bits
+static const uint8_t symbols[16] =
+{
+    0xd,  0xe,  0x13, 0x15, 0x16, 0x19, 0x1a, 0x1c,
+    0x23, 0x25, 0x26, 0x29, 0x2a, 0x2c, 0x32, 0x34
+};
+
+// Reverse of symbols[], indexed by 6 bit symbol
+static const uint8_t reverseSymbols[64] =
+{
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x01, 0xff,
+    0xff, 0xff, 0xff, 0x02, 0xff, 0x03, 0x04, 0xff, 0xff, 0x05, 0x06, 0xff, 0x07, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0x08, 0xff, 0x09, 0x0a, 0xff, 0xff, 0x0b, 0x0c, 0xff, 0x0d, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0x0e, 0xff, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+RHASKDecoder::RHASKDecoder(uint16_t channels)
+    :
+    _channels(channels),
+    _handler(NULL),
+    _handlerArg(NULL)
+{
+    _pllRamp = new uint8_t[channels];
+    _integrator = new uint8_t[channels];
+    _lastSample = new uint8_t[channels];
+    _bits = new uint16_t[channels];
+    _active = new uint8_t[channels];
+    _bitCount = new uint8_t[channels];
+    _event = new uint8_t[channels];
+    _buf = new uint8_t[channels][RH_ASK_MAX_PAYLOAD_LEN];
+    _bufLen = new uint8_t[channels];
+    _count = new uint8_t[channels];
+    _stats = new Stats[channels];
+    reset();
+}
+
+RHASKDecoder::~RHASKDecoder()
+{
+    delete[] _pllRamp;
+    delete[] _integrator;
+    delete[] _lastSample;
+    delete[] _bits;
+    delete[] _active;
+    delete[] _bitCount;
+    delete[] _event;
+    delete[] _buf;
+    delete[] _bufLen;
+    delete[] _count;
+    delete[] _stats;
+}
+
+void RHASKDecoder::setHandler(Handler handler, void* arg)
+{
+    _handler = handler;
+    _handlerArg = arg;
+}
+
+void RHASKDecoder::reset()
+{
+    memset(_pllRamp, 0, _channels);
+    memset(_integrator, 0, _channels);
+    memset(_lastSample, 0, _channels);
+    memset(_bits, 0, _channels * sizeof(uint16_t));
+    memset(_active, 0, _channels);
+    memset(_bitCount, 0, _channels);
+    memset(_event, 0, _channels);
+    memset(_bufLen, 0, _channels);
+    memset(_count, 0, _channels);
+    memset(_stats, 0, _channels * sizeof(Stats));
+}
+
+RHASKDecoder::Stats RHASKDecoder::totalStats()
+{
+    Stats total;
+    memset(&total, 0, sizeof(total));
+    for (uint16_t c = 0; c < _channels; c++)
+    {
+	total.good += _stats[c].good;
+	total.badFcs += _stats[c].badFcs;
+	total.badLength += _stats[c].badLength;
+	total.badSymbols += _stats[c].badSymbols;
+	total.starts += _stats[c].starts;
+    }
+    return total;
+}
+
+uint8_t RHASKDecoder::encodeSymbol(uint8_t nybble)
+{
+    return symbols[nybble & 0xf];
+}
+
+uint8_t RHASKDecoder::decodeSymbol(uint8_t symbol)
+{
+    return reverseSymbols[symbol & 0x3f];
+}
+
+// The same steps as RH_ASK::receiveTimer() for one sample time on every channel, without branches,
+// so the compiler can vectorise the loop. Sets event for each channel that has completed a pair
+// of symbols or found the start symbol, and returns non-zero if any have
+static uint8_t __attribute__((noinline)) pllStep(const uint8_t* __restrict__ samples, uint8_t* __restrict__ pllRamp,
+						 uint8_t* __restrict__ integrator, uint8_t* __restrict__ lastSample,
+						 uint16_t* __restrict__ bits, const uint8_t* __restrict__ active,
+						 uint8_t* __restrict__ bitCount, uint8_t* __restrict__ event, uint16_t channels)
+{
+    uint8_t any = 0;
+    for (uint16_t c = 0; c < channels; c++)
+    {
+	uint8_t sample = samples[c] != 0;
+	uint8_t ramp = pllRamp[c];
+	uint8_t integral = integrator[c] + sample;
+
+	// On a transition, advance if ramp > 80, retard if < 80. Else advance by the standard 20
+	uint8_t transitionInc = ramp < RH_ASK_RAMP_TRANSITION ? RH_ASK_RAMP_INC_RETARD : RH_ASK_RAMP_INC_ADVANCE;
+	ramp += sample != lastSample[c] ? transitionInc : RH_ASK_RAMP_INC;
+	lastSample[c] = sample;
+
+	// At the end of a bit, shift it into the last 12 bits: a 1 if 5 or more of the 8 samples were high
+	uint8_t endOfBit = ramp >= RH_ASK_RX_RAMP_LEN;
+	uint16_t oldBits = bits[c];
+	uint16_t newBits = endOfBit ? (oldBits >> 1) | (integral >= 5 ? 0x800 : 0) : oldBits;
+	bits[c] = newBits;
+	pllRamp[c] = endOfBit ? ramp - RH_ASK_RX_RAMP_LEN : ramp;
+	integrator[c] = endOfBit ? 0 : integral;
+
+	// Then either a pair of symbols is complete, or perhaps the start symbol has arrived
+	uint8_t count = bitCount[c] + (endOfBit & active[c]);
+	bitCount[c] = count;
+	uint8_t symbolsDone = active[c] ? count >= 12 : newBits == RH_ASK_DECODER_START_SYMBOL;
+	uint8_t e = endOfBit & symbolsDone;
+	event[c] = e;
+	any |= e;
+    }
+    return any;
+}
+
+void RHASKDecoder::decode(const uint8_t* samples, uint32_t numSamples)
+{
+    for (uint32_t t = 0; t < numSamples; t++, samples += _channels)
+    {
+	if (pllStep(samples, _pllRamp, _integrator, _lastSample, _bits, _active, _bitCount, _event, _channels))
+	{
+	    // Usually only a few channels have events. memchr finds them faster than a loop
+	    uint8_t* end = _event + _channels;
+	    uint8_t* e = _event;
+	    while ((e = (uint8_t*)memchr(e, 1, end - e)) != NULL)
+		symbolsReceived(e++ - _event);
+	}
+    }
+}
+
+void RHASKDecoder::symbolsReceived(uint16_t c)
+{
+    _event[c] = 0;
+    if (!_active[c])
+    {
+	// Have start symbol, start collecting message
+	_active[c] = 1;
+	_bitCount[c] = 0;
+	_bufLen[c] = 0;
+	_stats[c].starts++;
+	return;
+    }
+
+    // Have 12 bits of encoded message == 1 byte encoded
+    // The 6 lsbits are the high nybble
+    _bitCount[c] = 0;
+    uint8_t hi = decodeSymbol(_bits[c] & 0x3f);
+    uint8_t lo = decodeSymbol(_bits[c] >> 6);
+    if (hi == RH_ASK_DECODER_BAD_SYMBOL)
+    {
+	_stats[c].badSymbols++;
+	hi = 0; // As RH_ASK
+    }
+    if (lo == RH_ASK_DECODER_BAD_SYMBOL)
+    {
+	_stats[c].badSymbols++;
+	lo = 0;
+    }
+    uint8_t thisByte = (hi << 4) | lo;
+
+    if (_bufLen[c] == 0)
+    {
+	// The first byte is the byte count, including the byte count itself,
+	// the 4 byte header and the 2 byte FCS
+	_count[c] = thisByte;
+	if (_count[c] < 7 || _count[c] > RH_ASK_MAX_PAYLOAD_LEN)
+	{
+	    _active[c] = 0;
+	    _stats[c].badLength++;
+	    return;
+	}
+    }
+    _buf[c][_bufLen[c]++] = thisByte;
+    if (_bufLen[c] >= _count[c])
+    {
+	_active[c] = 0;
+	messageReceived(c);
+    }
+}
+
+void RHASKDecoder::messageReceived(uint16_t c)
+{
+    // The CRC covers the byte count, headers and user data
+    if (RHcrc_ccitt_update_buf(0xffff, _buf[c], _bufLen[c]) != 0xf0b8)
+    {
+	_stats[c].badFcs++;
+	return;
+    }
+    _stats[c].good++;
+    if (_handler)
+	_handler(_handlerArg, c, _buf[c] + 1, _bufLen[c] - 3);
+}
+
+#endif
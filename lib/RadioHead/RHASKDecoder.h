@@ -0,0 +1,141 @@
+// RHASKDecoder.h
+//
+// Host side decoder for RH_ASK baseband, for testing decode robustness and throughput
+// without radio hardware
+#ifndef RHASKDecoder_h
+#define RHASKDecoder_h
+
+#include <RadioHead.h>
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <RH_ASK.h>
+
+// Value of the last 12 bits received when the start symbol has been seen, as in RH_ASK
+#define RH_ASK_DECODER_START_SYMBOL 0xb38
+
+// Marks a 6 bit value that is not a valid RH_ASK symbol in the reverse symbol table
+#define RH_ASK_DECODER_BAD_SYMBOL 0xff
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHASKDecoder RHASKDecoder.h <RHASKDecoder.h>
+/// \brief Decodes RH_ASK messages from sampled receiver output, for many channels at once
+///
+/// RH_ASK decodes its input one sample at a time in a timer interrupt: a software PLL finds
+/// the bit boundaries in the 8x oversampled receiver output, an integrate and dump filter decides
+/// each bit, and the 6 bit symbols are decoded back into 4 bit nybbles. RHASKDecoder runs exactly the
+/// same pipeline (with the same RH_ASK_RAMP_* constants) on Linux, on recorded or generated samples,
+/// so that the robustness of the decoder to noise and clock error, and the decode rate, can be measured
+/// at scale without any hardware.
+///
+/// It decodes any number of independent channels (eg captures from different receivers) in lockstep.
+/// The state of the channels is kept in parallel arrays, so that for each sample time the PLL and
+/// bit decision of all the channels are computed by a single branch free loop, which the compiler
+/// vectorises (build with -O3, and preferably -march=native). Only a channel that has just completed
+/// a symbol pair or a start symbol, about once every 96 samples, is then handled on its own.
+/// Symbols are decoded with a 64 entry reverse lookup table, rather than the search RH_ASK does on
+/// processors short of RAM.
+///
+/// Samples are given as octets, 0 for low and anything else for high, interleaved: all the channels
+/// for the first sample time, then all the channels for the next, and so on.
+/// Each good message (ie one with a correct FCS) is passed to the message handler,
+/// if one has been set with setHandler(), and counted in the channel statistics.
+///
+/// See tools/askDecode.cpp for a program that uses it.
+class RHASKDecoder
+{
+public:
+    /// Called with each good message
+    /// \param[in] arg The arg passed to setHandler()
+    /// \param[in] channel The channel it was received on
+    /// \param[in] buf The message, starting with the 4 headers (to, from, id, flags)
+    /// \param[in] len Length of the message including the headers
+    typedef void (*Handler)(void* arg, uint16_t channel, const uint8_t* buf, uint8_t len);
+
+    /// Decode statistics for a channel
+    typedef struct
+    {
+	uint32_t good;        ///< Messages received with a correct FCS
+	uint32_t badFcs;      ///< Messages received with an incorrect FCS
+	uint32_t badLength;   ///< Messages dropped because of an impossible byte count
+	uint32_t badSymbols;  ///< 6 bit values that were not valid symbols
+	uint32_t starts;      ///< Start symbols seen
+    } Stats;
+
+    /// Constructor
+    /// \param[in] channels The number of channels to decode at once
+    RHASKDecoder(uint16_t channels = 1);
+
+    /// Destructor
+    ~RHASKDecoder();
+
+    /// Sets the function to call with each good message
+    /// \param[in] handler The function, or NULL for none
+    /// \param[in] arg Passed to the handler
+    void setHandler(Handler handler, void* arg = NULL);
+
+    /// Decodes samples from all the channels, continuing from where the last call left off
+    /// \param[in] samples numSamples sample times, each of channels() octets
+    /// \param[in] numSamples The number of sample times
+    void decode(const uint8_t* samples, uint32_t numSamples);
+
+    /// Restarts all the channels as if no samples had been seen, and clears the statistics
+    void reset();
+
+    /// \return The number of channels
+    uint16_t channels() { return _channels; }
+
+    /// \param[in] channel The channel
+    /// \return The decode statistics for the channel
+    const Stats& stats(uint16_t channel) { return _stats[channel]; }
+
+    /// \return The decode statistics summed over all the channels
+    Stats totalStats();
+
+    /// Converts a nybble into the 6 bit symbol RH_ASK sends for it
+    /// \param[in] nybble The value to encode, 0 to 15
+    /// \return The symbol
+    static uint8_t encodeSymbol(uint8_t nybble);
+
+    /// Converts a 6 bit symbol into the nybble it encodes
+    /// \param[in] symbol The symbol, 0 to 63
+    /// \return The nybble, or RH_ASK_DECODER_BAD_SYMBOL if symbol is not a valid symbol
+    static uint8_t decodeSymbol(uint8_t symbol);
+
+private:
+    /// Handles a channel that has completed a symbol pair or found a start symbol
+    void symbolsReceived(uint16_t channel);
+
+    /// Checks the FCS of a complete message on a channel and delivers it
+    void messageReceived(uint16_t channel);
+
+    /// Number of channels
+    uint16_t    _channels;
+
+    /// PLL state of each channel, as in RH_ASK. Kept in separate arrays so that the
+    /// loop over the channels in decode() vectorises
+    uint8_t*    _pllRamp;
+    uint8_t*    _integrator;
+    uint8_t*    _lastSample;
+    uint16_t*   _bits;
+    uint8_t*    _active;
+    uint8_t*    _bitCount;
+
+    /// Set for channels that have symbols to be handled after the current sample time
+    uint8_t*    _event;
+
+    /// Message being received on each channel
+    uint8_t   (*_buf)[RH_ASK_MAX_PAYLOAD_LEN];
+    uint8_t*    _bufLen;
+    uint8_t*    _count;
+
+    /// Statistics for each channel
+    Stats*      _stats;
+
+    /// Message handler
+    Handler     _handler;
+    void*       _handlerArg;
+};
+
+#endif
+#endif
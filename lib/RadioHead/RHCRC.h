@@ -11,9 +11,32 @@
 
 #include <RadioHead.h>
 
+// How the CRCs are computed, trading code size for speed:
+// 0: bit at a time, no tables. Smallest, and the default on small processors
+// 1: one 256 entry lookup table per CRC (about 1.5kB in all), a byte at a time
+// 4 or 8: as 1, and the buffer functions for the CRC-16 and CCITT CRCs take 4 or 8 octets
+//    at a time ("slice-by-N"), with N-1 more tables for each, built in RAM the first time they are used
+// On AVR the tables are kept in program memory.
+#ifndef RH_CRC_TABLES
+ #if (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+  #define RH_CRC_TABLES 8
+ #elif (RH_PLATFORM == RH_PLATFORM_ESP32) || (RH_PLATFORM == RH_PLATFORM_ESP8266)
+  #define RH_CRC_TABLES 1
+ #else
+  #define RH_CRC_TABLES 0
+ #endif
+#endif
+
 extern uint16_t RHcrc16_update(uint16_t crc, uint8_t a);
 extern uint16_t RHcrc_xmodem_update (uint16_t crc, uint8_t data);
 extern uint16_t RHcrc_ccitt_update (uint16_t crc, uint8_t data);
 extern uint8_t  RHcrc_ibutton_update(uint8_t crc, uint8_t data);
 
+// These update the CRC with len octets from buf at once. They give the same result as
+// calling the single octet versions for each octet in turn, but are faster
+extern uint16_t RHcrc16_update_buf(uint16_t crc, const uint8_t* buf, uint16_t len);
+extern uint16_t RHcrc_xmodem_update_buf(uint16_t crc, const uint8_t* buf, uint16_t len);
+extern uint16_t RHcrc_ccitt_update_buf(uint16_t crc, const uint8_t* buf, uint16_t len);
+extern uint8_t  RHcrc_ibutton_update_buf(uint8_t crc, const uint8_t* buf, uint16_t len);
+
 #endif
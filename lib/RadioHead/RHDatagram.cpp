@@ -49,6 +49,23 @@ bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to
     return false;
 }
 
+bool RHDatagram::sendto(RHPacketBuffer& packet, uint8_t address)
+{
+    return sendto(packet.data(), packet.len(), address);
+}
+
+bool RHDatagram::recvfrom(RHPacketBuffer& packet, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+{
+    packet.reset(0);
+    uint8_t len = packet.tailroom();
+    if (recvfrom(packet.data(), &len, from, to, id, flags))
+    {
+	packet.put(len);
+	return true;
+    }
+    return false;
+}
+
 bool RHDatagram::available()
 {
     return _driver.available();
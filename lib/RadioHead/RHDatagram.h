@@ -7,6 +7,7 @@
 #define RHDatagram_h
 
 #include <RHGenericDriver.h>
+#include <RHPacketBuffer.h>
 
 // This is the maximum possible message size for radios supported by RadioHead.
 // Not all radios support this length, and many are much smaller
@@ -70,6 +71,13 @@ public:
     /// \return true if the message not too loing fot eh driver, and the message was transmitted.
     bool sendto(uint8_t* buf, uint8_t len, uint8_t address);
 
+    /// Sends the message in a RHPacketBuffer to the node(s) with the given address.
+    /// Same as sendto() above.
+    /// \param[in] packet The message to send
+    /// \param[in] address The address to send the message to.
+    /// \return true if the message not too long for the driver, and the message was transmitted.
+    bool sendto(RHPacketBuffer& packet, uint8_t address);
+
     /// Turns the receiver on if it not already on.
     /// If there is a valid message available for this node, copy it to buf and return true
     /// The SRC address is placed in *from if present and not NULL.
@@ -87,6 +95,16 @@ public:
     /// \return true if a valid message was copied to buf
     bool recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// Same as recvfrom() above, but receives the message into a RHPacketBuffer, 
+    /// replacing anything that was in it. The message starts at packet.data(), with no headroom.
+    /// \param[out] packet Buffer to receive the message into
+    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the FROM address
+    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the TO address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a valid message was received into packet
+    bool recvfrom(RHPacketBuffer& packet, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
     /// Tests whether a new message is available
     /// from the Driver.
     /// On most drivers, this will also put the Driver into RHModeRx mode until
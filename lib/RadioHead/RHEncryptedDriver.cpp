@@ -10,19 +10,50 @@
 
 RHEncryptedDriver::RHEncryptedDriver(RHGenericDriver& driver, BlockCipher& blockcipher)
     : _driver(driver),
-      _blockcipher(blockcipher)
+      _blockcipher(&blockcipher),
+      _aead(NULL),
+      _nonceCounter(0),
+      _nonceCounterValid(false)
 {
-    _buffer = (uint8_t *)calloc(_driver.maxMessageLength(), sizeof(uint8_t));
+    memset(_rxCounters, 0, sizeof(_rxCounters));
+    allocateBuffer();
+}
+
+RHEncryptedDriver::RHEncryptedDriver(RHGenericDriver& driver, AuthenticatedCipher& cipher)
+    : _driver(driver),
+      _blockcipher(NULL),
+      _aead(&cipher),
+      _nonceCounter(0),
+      _nonceCounterValid(false)
+{
+    memset(_rxCounters, 0, sizeof(_rxCounters));
+    allocateBuffer();
+}
+
+void RHEncryptedDriver::allocateBuffer()
+{
+    int len = _driver.maxMessageLength();
+    if (len > RH_ENCRYPTED_DRIVER_BUFFER_LEN)
+	len = RH_ENCRYPTED_DRIVER_BUFFER_LEN;
+    _buffer = (uint8_t *)calloc(len, sizeof(uint8_t));
+    _bufferLen = _buffer ? len : 0;
 }
 
 bool RHEncryptedDriver::recv(uint8_t* buf, uint8_t* len)
 {
+    if (!_buffer)
+	return false;
+    if (_aead)
+	return recvAuthenticated(buf, len);
+
     int h = 0; // Index of output _buffer
 
+    if (len && *len > _bufferLen)
+	*len = _bufferLen;
     bool status = _driver.recv(_buffer, len);
     if (status && buf && len)
     {
-	int blockSize = _blockcipher.blockSize(); // Size of blocks used by encryption
+	int blockSize = _blockcipher->blockSize(); // Size of blocks used by encryption
 	int nbBlocks = *len / blockSize; 	  // Number of blocks in that message
 	if (nbBlocks * blockSize == *len)
 	{
@@ -30,7 +61,7 @@ bool RHEncryptedDriver::recv(uint8_t* buf, uint8_t* len)
 	    for (int k = 0; k < nbBlocks; k++)
 	    {
 		// Decrypt each block
-		_blockcipher.decryptBlock(&buf[h], &_buffer[k*blockSize]); // Decrypt that block into buf	
+		_blockcipher->decryptBlock(&buf[h], &_buffer[k*blockSize]); // Decrypt that block into buf	
 		h += blockSize;
 #ifdef STRICT_CONTENT_LEN	
 		if (k == 0)
@@ -51,21 +82,22 @@ bool RHEncryptedDriver::recv(uint8_t* buf, uint8_t* len)
 
 bool RHEncryptedDriver::send(const uint8_t* data, uint8_t len)
 {
+    if (!_buffer)
+	return false;
     if (len > maxMessageLength())
 	return false;
     
+    if (_aead)
+	return sendAuthenticated(data, len);
+
     bool status = true;
-    int blockSize = _blockcipher.blockSize(); // Size of blocks used by encryption
+    int blockSize = _blockcipher->blockSize(); // Size of blocks used by encryption
 	
     if (len == 0) // PassThru
 	return _driver.send(data, len);
 
-    if (_cipheringBlocks.blockSize != blockSize)
-    {
-	// Cipher has changed it's block size
-	_cipheringBlocks.inputBlock = (uint8_t *)realloc(_cipheringBlocks.inputBlock, blockSize);
-	_cipheringBlocks.blockSize = blockSize;	
-    }
+    if (blockSize > RH_ENCRYPTED_DRIVER_MAX_BLOCK_SIZE)
+	return false;
 	
     int max_message_length = maxMessageLength();
 #ifdef STRICT_CONTENT_LEN	
@@ -87,17 +119,17 @@ bool RHEncryptedDriver::send(const uint8_t* data, uint8_t len)
 	int h = 0; // h is block content index
 #ifdef STRICT_CONTENT_LEN
 	if (k == 0)
-	    _cipheringBlocks.inputBlock[h++] = len; // put in first byte of first block the message length
+	    _inputBlock[h++] = len; // put in first byte of first block the message length
 #endif		
 	while (h < blockSize)
 	{	
 	    // Copy each msg byte into inputBlock, and trail with 0 if necessary
 	    if (j < len)
-		_cipheringBlocks.inputBlock[h++] = data[j++];
+		_inputBlock[h++] = data[j++];
 	    else
-		_cipheringBlocks.inputBlock[h++] = 0; // Completing with trailing 0
+		_inputBlock[h++] = 0; // Completing with trailing 0
 	}
-	_blockcipher.encryptBlock(&_buffer[k * blockSize], _cipheringBlocks.inputBlock); // Cipher that message into _buffer
+	_blockcipher->encryptBlock(&_buffer[k * blockSize], _inputBlock); // Cipher that message into _buffer
     }
 //    Serial.println(max_message_length);
 //    Serial.println(nbBlocks);
@@ -119,17 +151,17 @@ bool RHEncryptedDriver::send(const uint8_t* data, uint8_t len)
 	    int h = 0;
 #ifdef STRICT_CONTENT_LEN
 	    if (k == 0 && i == 0)
-		_cipheringBlocks.inputBlock[h++] = len; // put in first byte of first block of first message the message length
+		_inputBlock[h++] = len; // put in first byte of first block of first message the message length
 #endif			
 	    while (h < blockSize)
 	    {		
 		// Copy each msg byte into inputBlock, and trail with 0 if necessary
 		if (j < len)
-		    _cipheringBlocks.inputBlock[h++] = data[j++];
+		    _inputBlock[h++] = data[j++];
 		else
-		    _cipheringBlocks.inputBlock[h++] = 0;
+		    _inputBlock[h++] = 0;
 	    }
-	    _blockcipher.encryptBlock(&_buffer[k * blockSize], _cipheringBlocks.inputBlock); // Cipher that message into buffer
+	    _blockcipher->encryptBlock(&_buffer[k * blockSize], _inputBlock); // Cipher that message into buffer
 	}
 //	printBuffer("multiple send", _buffer, k * blockSize);
 	if (!_driver.send(_buffer, k * blockSize))  // We now send that message with it's new length
@@ -141,10 +173,17 @@ bool RHEncryptedDriver::send(const uint8_t* data, uint8_t len)
 
 uint8_t RHEncryptedDriver::maxMessageLength()
 {
-    int driver_len = _driver.maxMessageLength();
+    int driver_len = _bufferLen;
+
+    if (_aead)
+    {
+	if (driver_len < RH_ENCRYPTED_DRIVER_NONCE_LEN + RH_ENCRYPTED_DRIVER_TAG_LEN)
+	    return 0;
+	return driver_len - RH_ENCRYPTED_DRIVER_NONCE_LEN - RH_ENCRYPTED_DRIVER_TAG_LEN;
+    }
     
 #ifndef ALLOW_MULTIPLE_MSG
-    driver_len = ((int)(driver_len/_blockcipher.blockSize()) ) * _blockcipher.blockSize();
+    driver_len = ((int)(driver_len/_blockcipher->blockSize()) ) * _blockcipher->blockSize();
 #endif
 
 #ifdef STRICT_CONTENT_LEN
@@ -153,4 +192,108 @@ uint8_t RHEncryptedDriver::maxMessageLength()
     return driver_len;
 }
 
+void RHEncryptedDriver::startAuthenticated(const uint8_t* counter, uint8_t to, uint8_t from, uint8_t id, uint8_t flags)
+{
+    // The IV is unique as long as the counter does not repeat for this sender
+    uint8_t iv[RH_ENCRYPTED_DRIVER_MAX_IV_LEN];
+    size_t ivLen = _aead->ivSize();
+    if (ivLen > sizeof(iv))
+	ivLen = sizeof(iv);
+    memset(iv, 0, sizeof(iv));
+    iv[0] = from;
+    memcpy(iv + 1, counter, RH_ENCRYPTED_DRIVER_NONCE_LEN);
+    _aead->setIV(iv, ivLen);
+
+    // The headers are sent in clear, but must not be changed either
+    uint8_t headers[4] = { to, from, id, flags };
+    _aead->addAuthData(headers, sizeof(headers));
+}
+
+RHEncryptedDriver::RxCounter* RHEncryptedDriver::rxCounter(uint8_t address, bool create)
+{
+    RxCounter* oldest = NULL;
+    uint8_t i;
+    for (i = 0; i < RH_ENCRYPTED_DRIVER_PEERS; i++)
+    {
+	RxCounter* c = &_rxCounters[i];
+	if (c->used && c->address == address)
+	    return c;
+	if (!oldest || (oldest->used && (!c->used || (long)(c->lastUsed - oldest->lastUsed) < 0)))
+	    oldest = c;
+    }
+    if (!create)
+	return NULL;
+
+    memset(oldest, 0, sizeof(RxCounter));
+    oldest->address = address;
+    oldest->used = true;
+    return oldest;
+}
+
+bool RHEncryptedDriver::sendAuthenticated(const uint8_t* data, uint8_t len)
+{
+    // Never reuse a counter, whether from before a restart or after wrapping round
+    if (!_nonceCounterValid)
+	return false;
+    if (_nonceCounter == 0xffffffff)
+	_nonceCounterValid = false; // This is the last one
+
+    uint8_t* counter = _buffer;
+    counter[0] = _nonceCounter >> 24;
+    counter[1] = _nonceCounter >> 16;
+    counter[2] = _nonceCounter >> 8;
+    counter[3] = _nonceCounter;
+    _nonceCounter++;
+    startAuthenticated(counter, _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags);
+
+    // The whole payload in one call, straight into the message after the counter
+    uint8_t* ciphertext = _buffer + RH_ENCRYPTED_DRIVER_NONCE_LEN;
+    _aead->encrypt(ciphertext, data, len);
+    _aead->computeTag(ciphertext + len, RH_ENCRYPTED_DRIVER_TAG_LEN);
+    return _driver.send(_buffer, RH_ENCRYPTED_DRIVER_NONCE_LEN + len + RH_ENCRYPTED_DRIVER_TAG_LEN);
+}
+
+bool RHEncryptedDriver::recvAuthenticated(uint8_t* buf, uint8_t* len)
+{
+    uint8_t messageLen = _bufferLen;
+    if (!_driver.recv(_buffer, &messageLen))
+	return false;
+    if (messageLen < RH_ENCRYPTED_DRIVER_NONCE_LEN + RH_ENCRYPTED_DRIVER_TAG_LEN)
+    {
+	_rxBad++;
+	return false; // Too short to have been sent by us
+    }
+
+    uint8_t dataLen = messageLen - RH_ENCRYPTED_DRIVER_NONCE_LEN - RH_ENCRYPTED_DRIVER_TAG_LEN;
+    uint8_t from = _driver.headerFrom();
+    uint32_t counter = ((uint32_t)_buffer[0] << 24) | ((uint32_t)_buffer[1] << 16) | ((uint32_t)_buffer[2] << 8) | _buffer[3];
+    RxCounter* known = rxCounter(from, false);
+    if (known && counter <= known->counter)
+    {
+	_rxBad++;
+	return false; // Replayed, or older than one already accepted
+    }
+    startAuthenticated(_buffer, _driver.headerTo(), from, _driver.headerId(), _driver.headerFlags());
+
+    // Decrypt in place, and only give it to the caller if the tag matches
+    uint8_t* data = _buffer + RH_ENCRYPTED_DRIVER_NONCE_LEN;
+    _aead->decrypt(data, data, dataLen);
+    if (!_aead->checkTag(data + dataLen, RH_ENCRYPTED_DRIVER_TAG_LEN))
+    {
+	_rxBad++;
+	return false;
+    }
+    // Only an authentic message may move the counter on, or take the place of another sender's
+    RxCounter* c = known ? known : rxCounter(from, true);
+    c->counter = counter;
+    c->lastUsed = millis();
+    if (buf && len)
+    {
+	if (*len > dataLen)
+	    *len = dataLen;
+	memcpy(buf, data, *len);
+    }
+    return true;
+}
+
 #endif
@@ -15,6 +15,7 @@
 #include <RHGenericDriver.h>
 #if defined(RH_ENABLE_ENCRYPTION_MODULE) || defined(DOXYGEN)
 #include <BlockCipher.h>
+#include <AuthenticatedCipher.h>
 
 // Undef this if trailing 0 on each enrypted message is ok.
 // This defined means a first byte of the payload is used to encode content length
@@ -26,6 +27,36 @@
 // With STRICT_CONTENT_LEN, receiver will try to extract length from every message !!!!
 //#define ALLOW_MULTIPLE_MSG  
 
+// Largest buffer each RHEncryptedDriver allocates for the encrypted message. Messages
+// are limited to this, even if the underlying driver could carry more
+#ifndef RH_ENCRYPTED_DRIVER_BUFFER_LEN
+ #define RH_ENCRYPTED_DRIVER_BUFFER_LEN 255
+#endif
+
+// Largest block size supported for block ciphers. All the arduinolibs block ciphers use 16
+#define RH_ENCRYPTED_DRIVER_MAX_BLOCK_SIZE 16
+
+// With an authenticated cipher, number of octets of the nonce counter sent in front of each message
+#define RH_ENCRYPTED_DRIVER_NONCE_LEN 4
+
+// With an authenticated cipher, number of octets of the authentication tag sent after each message.
+// 4 is the same as the LoRaWAN MIC. Up to the tagSize() of the cipher (16) for stronger authentication
+#ifndef RH_ENCRYPTED_DRIVER_TAG_LEN
+ #define RH_ENCRYPTED_DRIVER_TAG_LEN 4
+#endif
+
+// Largest IV used with an authenticated cipher
+#define RH_ENCRYPTED_DRIVER_MAX_IV_LEN 16
+
+// With an authenticated cipher, number of senders whose counters are remembered for replay protection
+#ifndef RH_ENCRYPTED_DRIVER_PEERS
+ #if (RH_PLATFORM == RH_PLATFORM_ESP32) || (RH_PLATFORM == RH_PLATFORM_ESP8266) || (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+  #define RH_ENCRYPTED_DRIVER_PEERS 16
+ #else
+  #define RH_ENCRYPTED_DRIVER_PEERS 4
+ #endif
+#endif
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHEncryptedDriver RHEncryptedDriver <RHEncryptedDriver.h>
 /// \brief Virtual Driver to encrypt/decrypt data. Can be used with any other RadioHead driver.
@@ -40,6 +71,47 @@
 /// In order to enable this module you must uncomment #define RH_ENABLE_ENCRYPTION_MODULE at the bottom of RadioHead.h
 /// But ensure you have installed the Crypto directory from arduinolibs first:
 /// http://rweather.github.io/arduinolibs/index.html
+///
+/// \par Block ciphers and authenticated ciphers
+///
+/// With a BlockCipher such as AES128 or Speck, each message is encrypted block by block (ECB) and padded
+/// up to a whole number of blocks, plus a length octet with STRICT_CONTENT_LEN. A 20 octet message
+/// is sent as 32 octets, and identical messages are sent as identical ciphertext.
+///
+/// With an AuthenticatedCipher such as ChaChaPoly, GCM<AES128> or EAX<AES128>, each message is instead
+/// sent as a RH_ENCRYPTED_DRIVER_NONCE_LEN octet counter, the whole payload encrypted in one call
+/// to the cipher with no padding, and a RH_ENCRYPTED_DRIVER_TAG_LEN octet authentication tag:
+/// \code
+/// counter (4) | ciphertext (len) | tag (4)
+/// \endcode
+/// The IV is made from the FROM header and the counter, so every message is encrypted differently,
+/// and the TO, FROM, ID and FLAGS headers are authenticated with the payload.
+/// Messages that have been tampered with, or encrypted with another key, fail the tag check
+/// and are discarded by recv() and counted by rxBad(). Set the headers through the RHEncryptedDriver
+/// (as the managers do), not directly on the underlying driver, so that it knows what they are.
+///
+/// \code
+/// #include <ChaChaPoly.h>
+/// RH_RF95 driver;
+/// ChaChaPoly cipher;
+/// RHEncryptedDriver myDriver(driver, cipher);
+/// ...
+///   cipher.setKey(key, 32);
+///   myDriver.setNonceCounter(savedCounter); // See below
+/// \endcode
+///
+/// With an authenticated cipher, the counter must never repeat for the same key and FROM address,
+/// or the messages sent with the repeated values can be decrypted by an eavesdropper. So send() refuses
+/// to send until setNonceCounter() has been called, and after the counter has used all its values.
+/// A node must restore the counter after every restart to a value higher than any it used before,
+/// eg by saving nonceCounter() to EEPROM every 256 messages, and adding 256 when restoring it.
+///
+/// Receivers keep the highest counter accepted from each of the last RH_ENCRYPTED_DRIVER_PEERS FROM addresses
+/// they heard from, and discard (and count in rxBad()) any message whose counter is not higher, so a recorded
+/// message is not accepted if it is sent again. The counter of the sender heard from least recently is
+/// forgotten when a new one is heard, and all of them when the receiver restarts, so until it next hears
+/// from a forgotten sender, a message recorded from that sender earlier would be accepted once.
+/// Define RH_ENCRYPTED_DRIVER_PEERS to at least the number of nodes in your network to avoid this.
 
 class RHEncryptedDriver : public RHGenericDriver
 {
@@ -51,6 +123,14 @@ public:
     /// the blockcipher has had its key set before sending or receiving messages.
     RHEncryptedDriver(RHGenericDriver& driver, BlockCipher& blockcipher);
 
+    /// Constructor.
+    /// Adds an authenticated ciphering layer to messages sent and received by the actual transport driver,
+    /// with no padding.
+    /// \param[in] driver The RadioHead driver to use to transport messages.
+    /// \param[in] cipher The authenticated cipher (from arduinolibs, eg ChaChaPoly) that encrypts, decrypts
+    /// and authenticates data. Ensure that the cipher has had its key set before sending or receiving messages.
+    RHEncryptedDriver(RHGenericDriver& driver, AuthenticatedCipher& cipher);
+
     /// Calls the real driver's init()
     /// \return The value returned from the driver init() method;
     virtual bool init() { return _driver.init();};
@@ -137,15 +217,15 @@ public:
 
     /// Sets the TO header to be sent in all subsequent messages
     /// \param[in] to The new TO header value
-    virtual void           setHeaderTo(uint8_t to){ _driver.setHeaderTo(to);};
+    virtual void           setHeaderTo(uint8_t to){ _txHeaderTo = to; _driver.setHeaderTo(to);};
 
     /// Sets the FROM header to be sent in all subsequent messages
     /// \param[in] from The new FROM header value
-    virtual void           setHeaderFrom(uint8_t from){ _driver.setHeaderFrom(from);};
+    virtual void           setHeaderFrom(uint8_t from){ _txHeaderFrom = from; _driver.setHeaderFrom(from);};
 
     /// Sets the ID header to be sent in all subsequent messages
     /// \param[in] id The new ID header value
-    virtual void           setHeaderId(uint8_t id){ _driver.setHeaderId(id);};
+    virtual void           setHeaderId(uint8_t id){ _txHeaderId = id; _driver.setHeaderId(id);};
 
     /// Sets and clears bits in the FLAGS header to be sent in all subsequent messages
     /// First it clears he FLAGS according to the clear argument, then sets the flags according to the 
@@ -154,7 +234,7 @@ public:
     /// \param[in] clear bitmask of flags to clear. Defaults to RH_FLAGS_APPLICATION_SPECIFIC
     ///            which clears the application specific flags, resulting in new application specific flags
     ///            identical to the set.
-    virtual void           setHeaderFlags(uint8_t set, uint8_t clear = RH_FLAGS_APPLICATION_SPECIFIC) { _driver.setHeaderFlags(set, clear);};
+    virtual void           setHeaderFlags(uint8_t set, uint8_t clear = RH_FLAGS_APPLICATION_SPECIFIC) { RHGenericDriver::setHeaderFlags(set, clear); _driver.setHeaderFlags(set, clear);};
 
     /// Tells the receiver to accept messages with any TO address, not just messages
     /// addressed to thisAddress or the broadcast address
@@ -183,6 +263,10 @@ public:
     /// \return The most recent RSSI measurement in dBm.
     int16_t        lastRssi() { return _driver.lastRssi();};
 
+    /// Returns the Signal-to-noise ratio (SNR) of the last received message, if the underlying driver measures it
+    /// \return SNR of the last received message in dB, or RH_SNR_UNKNOWN
+    int            lastSNR() { return _driver.lastSNR();};
+
     /// Returns the operating mode of the library.
     /// \return the current mode, one of RF69_MODE_*
     RHMode          mode() { return _driver.mode();};
@@ -202,8 +286,9 @@ public:
     /// which were rejected and not delivered to the application.
     /// Caution: not all drivers can correctly report this count. Some underlying hardware only report
     /// good packets.
+    /// Messages that fail authentication with an authenticated cipher are counted here too.
     /// \return The number of bad packets received.
-    virtual uint16_t       rxBad() { return _driver.rxBad();};
+    virtual uint16_t       rxBad() { return _driver.rxBad() + _rxBad;};
 
     /// Returns the count of the number of 
     /// good received packets
@@ -215,25 +300,71 @@ public:
     /// \return The number of packets successfully transmitted
     virtual uint16_t       txGood() { return _driver.txGood();};
 
+    /// Sets the counter that goes into the IV of the next message sent with an authenticated cipher,
+    /// and allows messages to be sent. It is incremented for every message. Must be called after every
+    /// restart with a value higher than any used before, see above.
+    /// \param[in] counter The new counter value
+    void                   setNonceCounter(uint32_t counter) { _nonceCounter = counter; _nonceCounterValid = true;};
+
+    /// Returns the counter that will be used for the next message sent with an authenticated cipher
+    /// \return The counter value
+    uint32_t               nonceCounter() { return _nonceCounter;};
+
 private:
-    /// The underlying transport river we are to use
-    RHGenericDriver&        _driver;
-    
-    /// The CipherBlock we are to use for encrypting/decrypting
-    BlockCipher&	    _blockcipher;
-    
-    /// Struct for with buffers for ciphering
+    /// Allocates _buffer for the longest message the underlying driver can carry
+    void                    allocateBuffer();
+
+    /// Encrypts and sends a message with the authenticated cipher
+    bool                    sendAuthenticated(const uint8_t* data, uint8_t len);
+
+    /// Receives, authenticates and decrypts a message with the authenticated cipher
+    bool                    recvAuthenticated(uint8_t* buf, uint8_t* len);
+
+    /// Sets up the authenticated cipher for a message: the IV from the FROM header and the counter,
+    /// and the headers as authenticated data
+    void                    startAuthenticated(const uint8_t* counter, uint8_t to, uint8_t from, uint8_t id, uint8_t flags);
+
+    /// Highest counter accepted from a sender, for replay protection
     typedef struct
     {
-	size_t  blockSize    = 0;
-	uint8_t *inputBlock  = NULL;
-	//uint8_t *outputBlock = NULL;		
-    } CipherBlocks;
+	bool          used;      ///< This entry is in use
+	uint8_t       address;   ///< FROM address of the sender
+	uint32_t      counter;   ///< Highest counter accepted from the sender
+	unsigned long lastUsed;  ///< millis() when a message from the sender was last accepted
+    } RxCounter;
+
+    /// Finds the replay protection entry for a sender
+    /// \param[in] address The FROM address of the sender
+    /// \param[in] create If true and the sender has no entry, reuses the least recently used one
+    /// \return The entry, or NULL if there is none and create is false
+    RxCounter*              rxCounter(uint8_t address, bool create);
+
+    /// The underlying transport river we are to use
+    RHGenericDriver&        _driver;
     
-    CipherBlocks            _cipheringBlocks;
+    /// The CipherBlock we are to use for encrypting/decrypting, or NULL
+    BlockCipher*	    _blockcipher;
     
+    /// The authenticated cipher we are to use for encrypting/decrypting, or NULL
+    AuthenticatedCipher*    _aead;
+
+    /// Counter for the IV of the next message sent with the authenticated cipher
+    uint32_t                _nonceCounter;
+
+    /// True once setNonceCounter() has been called, until the counter runs out
+    bool                    _nonceCounterValid;
+
+    /// Highest counter accepted from recent senders, for replay protection
+    RxCounter               _rxCounters[RH_ENCRYPTED_DRIVER_PEERS];
+
+    /// Plaintext of the block being encrypted
+    uint8_t                 _inputBlock[RH_ENCRYPTED_DRIVER_MAX_BLOCK_SIZE];
+
     /// Buffer to store encrypted/decrypted message
     uint8_t*                _buffer;
+
+    /// Size of _buffer, 0 if it could not be allocated
+    uint8_t                 _bufferLen;
 };
 
 /// @example nrf24_encrypted_client.pde
@@ -242,6 +373,7 @@ private:
 /// @example rf95_encrypted_server.pde
 /// @example serial_encrypted_reliable_datagram_client.pde
 /// @example serial_encrypted_reliable_datagram_server.pde
+/// @example simulator_encrypted_authenticated.pde
 
 
 #else // RH_ENABLE_ENCRYPTION_MODULE
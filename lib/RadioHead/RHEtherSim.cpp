@@ -0,0 +1,484 @@
+// RHEtherSim.cpp
+//
+// In-process discrete event simulation of the 'Luminiferous Ether' for RH_SIM drivers
+
+#include <RadioHead.h>
+
+// This can only build on Linux and compatible systems
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <RHEtherSim.h>
+#include <RH_SIM.h>
+#include <algorithm>
+
+RHEtherSim* RHEtherSim::_instance = NULL;
+
+// Why a reception did not result in a delivery
+typedef enum
+{
+    RHEtherSimLossNone = 0,
+    RHEtherSimLossMissed,       // Receiver was not listening when the packet started, not counted
+    RHEtherSimLossCollision,
+    RHEtherSimLossHalfDuplex,
+    RHEtherSimLossLink
+} RHEtherSimLoss;
+
+struct RHEtherSim::Node
+{
+    ucontext_t   context;
+    char*        stack;
+    NodeFunction fn;
+    void*        arg;
+    uint32_t     generation; // Wake events for older generations are stale
+    uint32_t     spins;      // Calls to millis() since the node last blocked
+    bool         finished;
+};
+
+struct RHEtherSim::Reception
+{
+    Transmission* tx;
+    RH_SIM*       receiver;
+    uint8_t       loss;      // One of RHEtherSimLoss
+};
+
+struct RHEtherSim::Transmission
+{
+    RH_SIM*                 sender;
+    uint8_t                 len;  // Including the headers
+    uint8_t                 buf[RH_SIM_MAX_PAYLOAD_LEN];
+    std::vector<Reception>  receptions;
+};
+
+RHEtherSim::RHEtherSim(uint32_t seed)
+    : _current(NULL),
+      _now(0),
+      _endTime(RH_ETHER_SIM_FOREVER),
+      _seq(0),
+      _rng(((uint64_t)seed + 1) * 0x9E3779B97F4A7C15ULL),
+      _stopped(false),
+      _defaultLink(1.0)
+{
+    _links = new float[256 * 256];
+    for (uint32_t i = 0; i < 256 * 256; i++)
+	_links[i] = -1.0; // Use the default
+    memset(&_stats, 0, sizeof(_stats));
+    _instance = this;
+}
+
+RHEtherSim::~RHEtherSim()
+{
+    while (!_events.empty())
+	_events.pop();
+    for (size_t i = 0; i < _inFlight.size(); i++)
+	delete _inFlight[i];
+    for (size_t i = 0; i < _nodes.size(); i++)
+    {
+	delete[] _nodes[i]->stack;
+	delete _nodes[i];
+    }
+    for (size_t i = 0; i < _drivers.size(); i++)
+	_drivers[i]->_ether = NULL;
+    delete[] _links;
+    if (_instance == this)
+	_instance = NULL;
+}
+
+RHEtherSim* RHEtherSim::instance()
+{
+    return _instance;
+}
+
+bool RHEtherSim::readConfig(const char* filename)
+{
+    FILE* f = fopen(filename, "r");
+    if (!f)
+    {
+	fprintf(stderr, "RHEtherSim::readConfig could not open config file %s\n", filename);
+	return false;
+    }
+    char line[200];
+    while (fgets(line, sizeof(line), f))
+    {
+	unsigned int a, b;
+	float probability;
+	if (sscanf(line, "probability:%u:%u:%f", &a, &b, &probability) == 3 && a < 256 && b < 256)
+	    setLinkProbability(a, b, probability);
+	else if (sscanf(line, "default:%f", &probability) == 1)
+	    setDefaultLinkProbability(probability);
+    }
+    fclose(f);
+    return true;
+}
+
+void RHEtherSim::setLinkProbability(uint8_t a, uint8_t b, float probability)
+{
+    _links[a * 256 + b] = probability;
+    _links[b * 256 + a] = probability; // Bidirectional
+}
+
+void RHEtherSim::setDefaultLinkProbability(float probability)
+{
+    _defaultLink = probability;
+}
+
+float RHEtherSim::linkProbability(uint8_t from, uint8_t to) const
+{
+    float probability = _links[from * 256 + to];
+    return probability < 0.0 ? _defaultLink : probability;
+}
+
+bool RHEtherSim::spawn(NodeFunction fn, void* arg, size_t stackSize)
+{
+    Node* node = new Node;
+    node->stack = new char[stackSize];
+    node->fn = fn;
+    node->arg = arg;
+    node->generation = 0;
+    node->spins = 0;
+    node->finished = false;
+    if (getcontext(&node->context) < 0)
+    {
+	delete[] node->stack;
+	delete node;
+	return false;
+    }
+    node->context.uc_stack.ss_sp = node->stack;
+    node->context.uc_stack.ss_size = stackSize;
+    node->context.uc_link = &_mainContext; // Back to the scheduler when fn returns
+    makecontext(&node->context, nodeEntry, 0);
+    _nodes.push_back(node);
+    schedule(_now, EventWake, node, node->generation, NULL);
+    return true;
+}
+
+void RHEtherSim::nodeEntry()
+{
+    RHEtherSim* ether = _instance;
+    Node* node = ether->_current;
+    node->fn(node->arg);
+    node->finished = true;
+}
+
+void RHEtherSim::setEndTime(uint64_t endTime)
+{
+    _endTime = endTime;
+}
+
+void RHEtherSim::run()
+{
+    _stopped = false;
+    while (!_stopped && step(_endTime))
+	;
+    if (!_stopped && _endTime != RH_ETHER_SIM_FOREVER && _now < _endTime)
+	_now = _endTime;
+}
+
+void RHEtherSim::stop()
+{
+    _stopped = true;
+}
+
+uint64_t RHEtherSim::now() const
+{
+    return _now;
+}
+
+bool RHEtherSim::step(uint64_t limit)
+{
+    if (_events.empty() || _events.top().time > limit)
+	return false;
+    Event event = _events.top();
+    _events.pop();
+    _now = event.time;
+    if (event.type == EventWake)
+    {
+	if (event.generation == event.node->generation && !event.node->finished)
+	    resume(event.node);
+    }
+    else if (event.type == EventTxEnd)
+    {
+	endTransmission(event.tx);
+    }
+    return true;
+}
+
+void RHEtherSim::schedule(uint64_t time, EventType type, Node* node, uint32_t generation, Transmission* tx)
+{
+    Event event;
+    event.time = time;
+    event.seq = _seq++; // Events at the same time happen in the order they were scheduled
+    event.type = type;
+    event.node = node;
+    event.generation = generation;
+    event.tx = tx;
+    _events.push(event);
+}
+
+void RHEtherSim::resume(Node* node)
+{
+    // Any other wake events pending for this node are now stale
+    node->generation++;
+    node->spins = 0;
+    _current = node;
+    _instance = this;
+    swapcontext(&_mainContext, &node->context);
+    _current = NULL;
+    if (node->finished)
+    {
+	delete[] node->stack;
+	node->stack = NULL;
+    }
+}
+
+void RHEtherSim::sleep(uint64_t us)
+{
+    uint64_t wakeTime = _now + us;
+    Node* node = _current;
+    if (node)
+    {
+	schedule(wakeTime, EventWake, node, node->generation, NULL);
+	swapcontext(&node->context, &_mainContext);
+    }
+    else
+    {
+	// Not in a node: run the simulation for that long
+	while (step(wakeTime))
+	    ;
+	_now = wakeTime;
+    }
+}
+
+void RHEtherSim::block(RH_SIM* driver, uint64_t deadline)
+{
+    Node* node = _current;
+    if (node)
+    {
+	driver->_waiter = node;
+	if (deadline != RH_ETHER_SIM_FOREVER)
+	    schedule(deadline, EventWake, node, node->generation, NULL);
+	swapcontext(&node->context, &_mainContext);
+	driver->_waiter = NULL;
+    }
+    else if (!step(deadline) && deadline != RH_ETHER_SIM_FOREVER)
+    {
+	// Not in a node and nothing happens before the deadline
+	_now = deadline;
+    }
+}
+
+void RHEtherSim::notify(RH_SIM* driver)
+{
+    if (driver->_waiter)
+	schedule(_now, EventWake, driver->_waiter, driver->_waiter->generation, NULL);
+}
+
+unsigned long RHEtherSim::millis()
+{
+    if (_current && ++_current->spins > RH_ETHER_SIM_SPIN_LIMIT)
+	sleep(1000);
+    return (unsigned long)(_now / 1000);
+}
+
+long RHEtherSim::random(long from, long to)
+{
+    if (to <= from)
+	return from;
+    return from + (long)(nextRandom() % (uint64_t)(to - from));
+}
+
+uint64_t RHEtherSim::nextRandom()
+{
+    // xorshift64*
+    _rng ^= _rng >> 12;
+    _rng ^= _rng << 25;
+    _rng ^= _rng >> 27;
+    return _rng * 0x2545F4914F6CDD1DULL;
+}
+
+const RHEtherSim::Stats& RHEtherSim::stats() const
+{
+    return _stats;
+}
+
+void RHEtherSim::printStats()
+{
+    printf("RHEtherSim: %llu ms simulated, %u nodes, %u radios\n",
+	   (unsigned long long)(_now / 1000), (unsigned int)_nodes.size(), (unsigned int)_drivers.size());
+    printf("  transmissions:      %u (%llu ms on air)\n", _stats.transmissions, (unsigned long long)(_stats.airtime / 1000));
+    printf("  deliveries:         %u\n", _stats.deliveries);
+    printf("  collisions:         %u\n", _stats.collisions);
+    printf("  half duplex losses: %u\n", _stats.halfDuplexLosses);
+    printf("  link losses:        %u\n", _stats.linkLosses);
+    printf("  overruns:           %u\n", _stats.overruns);
+}
+
+void RHEtherSim::attach(RH_SIM* driver)
+{
+    _drivers.push_back(driver);
+}
+
+void RHEtherSim::detach(RH_SIM* driver)
+{
+    _drivers.erase(std::remove(_drivers.begin(), _drivers.end(), driver), _drivers.end());
+    for (size_t i = 0; i < driver->_receptions.size(); i++)
+	driver->_receptions[i]->receiver = NULL;
+    driver->_receptions.clear();
+    for (size_t i = 0; i < _inFlight.size(); i++)
+	if (_inFlight[i]->sender == driver)
+	    _inFlight[i]->sender = NULL;
+}
+
+void RHEtherSim::transmit(RH_SIM* sender, const uint8_t* data, uint8_t len)
+{
+    // Anything we were in the middle of receiving is lost
+    abortReceptions(sender);
+
+    Transmission* tx = new Transmission;
+    tx->sender = sender;
+    tx->buf[0] = sender->_txHeaderTo;
+    tx->buf[1] = sender->_txHeaderFrom;
+    tx->buf[2] = sender->_txHeaderId;
+    tx->buf[3] = sender->_txHeaderFlags;
+    memcpy(tx->buf + RH_SIM_HEADER_LEN, data, len);
+    tx->len = len + RH_SIM_HEADER_LEN;
+
+    uint32_t airtime = RHLoRaAirtime(&sender->_modem, tx->len);
+    _stats.transmissions++;
+    _stats.airtime += airtime;
+
+    // Reserve so the receivers can keep pointers to their Reception
+    tx->receptions.reserve(_drivers.size());
+    for (size_t i = 0; i < _drivers.size(); i++)
+    {
+	RH_SIM* receiver = _drivers[i];
+	if (   receiver == sender
+	    || receiver->_frequency != sender->_frequency
+	    || linkProbability(sender->_thisAddress, receiver->_thisAddress) <= 0.0)
+	    continue; // Cant hear it at all
+
+	Reception reception;
+	reception.tx = tx;
+	reception.receiver = receiver;
+	reception.loss = RHEtherSimLossNone;
+	if (receiver->_mode == RHGenericDriver::RHModeTx)
+	{
+	    reception.loss = RHEtherSimLossHalfDuplex;
+	    _stats.halfDuplexLosses++;
+	}
+	else if (receiver->_mode != RHGenericDriver::RHModeRx)
+	    reception.loss = RHEtherSimLossMissed;
+
+	// Overlapping packets destroy each other
+	if (!receiver->_receptions.empty())
+	{
+	    for (size_t j = 0; j < receiver->_receptions.size(); j++)
+	    {
+		Reception* other = receiver->_receptions[j];
+		if (other->loss == RHEtherSimLossNone)
+		{
+		    other->loss = RHEtherSimLossCollision;
+		    _stats.collisions++;
+		}
+	    }
+	    if (reception.loss == RHEtherSimLossNone)
+	    {
+		reception.loss = RHEtherSimLossCollision;
+		_stats.collisions++;
+	    }
+	}
+	tx->receptions.push_back(reception);
+	receiver->_receptions.push_back(&tx->receptions.back());
+    }
+    _inFlight.push_back(tx);
+    schedule(_now + airtime, EventTxEnd, NULL, 0, tx);
+}
+
+void RHEtherSim::endTransmission(Transmission* tx)
+{
+    _inFlight.erase(std::remove(_inFlight.begin(), _inFlight.end(), tx), _inFlight.end());
+
+    RH_SIM* sender = tx->sender;
+    if (sender && sender->_mode == RHGenericDriver::RHModeTx)
+    {
+	sender->_mode = RHGenericDriver::RHModeIdle;
+	sender->_txGood++;
+	notify(sender);
+    }
+
+    for (size_t i = 0; i < tx->receptions.size(); i++)
+    {
+	Reception* reception = &tx->receptions[i];
+	RH_SIM* receiver = reception->receiver;
+	if (!receiver)
+	    continue; // Radio was removed
+	receiver->_receptions.erase(std::remove(receiver->_receptions.begin(), receiver->_receptions.end(), reception),
+				    receiver->_receptions.end());
+
+	if (reception->loss == RHEtherSimLossNone && receiver->_mode != RHGenericDriver::RHModeRx)
+	    reception->loss = RHEtherSimLossMissed; // Stopped listening part way through
+	float probability = linkProbability(sender ? sender->_thisAddress : tx->buf[1], receiver->_thisAddress);
+	if (   reception->loss == RHEtherSimLossNone
+	    && (double)(nextRandom() >> 11) / 9007199254740992.0 >= probability)
+	{
+	    reception->loss = RHEtherSimLossLink;
+	    _stats.linkLosses++;
+	}
+
+	if (reception->loss == RHEtherSimLossNone)
+	{
+	    if (receiver->_rxBufValid)
+	    {
+		_stats.overruns++;
+		receiver->_rxLost++;
+		continue;
+	    }
+	    uint8_t to = tx->buf[0];
+	    if (receiver->_promiscuous || to == receiver->_thisAddress || to == RH_BROADCAST_ADDRESS)
+	    {
+		receiver->_rxHeaderTo    = tx->buf[0];
+		receiver->_rxHeaderFrom  = tx->buf[1];
+		receiver->_rxHeaderId    = tx->buf[2];
+		receiver->_rxHeaderFlags = tx->buf[3];
+		memcpy(receiver->_buf, tx->buf, tx->len);
+		receiver->_bufLen = tx->len;
+		receiver->_rxBufValid = true;
+		// Weaker links lose more packets, so fade the signal with the delivery probability, 
+		// by up to 60 dB of RSSI and 20 dB of SNR, plus a couple of dB of noise
+		int noise = (int)(nextRandom() % 5) - 2;
+		receiver->_lastRssi = RH_SIM_DEFAULT_RSSI - (int16_t)((1.0 - probability) * 60) + noise;
+		receiver->_lastSNR  = RH_SIM_DEFAULT_SNR - (int8_t)((1.0 - probability) * 20) + noise;
+		receiver->_rxGood++;
+		receiver->_mode = RHGenericDriver::RHModeIdle; // Like RH_RF95, wait for the message to be collected
+		_stats.deliveries++;
+		notify(receiver);
+	    }
+	}
+	else if (reception->loss != RHEtherSimLossMissed)
+	{
+	    // Would have been seen as a bad CRC
+	    receiver->_rxBad++;
+	    receiver->_rxLost++;
+	}
+    }
+    delete tx;
+}
+
+void RHEtherSim::abortReceptions(RH_SIM* driver)
+{
+    for (size_t i = 0; i < driver->_receptions.size(); i++)
+    {
+	Reception* reception = driver->_receptions[i];
+	if (reception->loss == RHEtherSimLossNone)
+	{
+	    reception->loss = RHEtherSimLossHalfDuplex;
+	    _stats.halfDuplexLosses++;
+	}
+    }
+}
+
+bool RHEtherSim::channelActive(RH_SIM* driver) const
+{
+    return !driver->_receptions.empty();
+}
+
+#endif
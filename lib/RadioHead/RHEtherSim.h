@@ -0,0 +1,255 @@
+// RHEtherSim.h
+//
+// In-process discrete event simulation of the 'Luminiferous Ether' for RH_SIM drivers
+#ifndef RHEtherSim_h
+#define RHEtherSim_h
+
+#include <RadioHead.h>
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <ucontext.h>
+#include <vector>
+#include <queue>
+#include <functional>
+
+// Default coroutine stack for each simulated node, in octets
+#define RH_ETHER_SIM_DEFAULT_STACK_SIZE (64 * 1024)
+
+// Virtual time that never arrives
+#define RH_ETHER_SIM_FOREVER 0xffffffffffffffffULL
+
+// A node that calls millis() this many times without blocking is assumed to be
+// spinning on the clock, and is made to sleep for 1 ms of virtual time
+#define RH_ETHER_SIM_SPIN_LIMIT 1000
+
+class RH_SIM;
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHEtherSim RHEtherSim.h <RHEtherSim.h>
+/// \brief Discrete event simulator of a shared radio channel for many RH_SIM nodes in one process
+///
+/// \par Overview
+///
+/// RHEtherSim is an in-process replacement for tools/etherSimulator.pl.
+/// Instead of one Linux process per node talking RH_TCP to a Perl server in wall clock time,
+/// every simulated node runs as a coroutine inside a single process, and time is
+/// a virtual clock that jumps straight to the next event. Nodes that are waiting for a packet,
+/// sleeping in delay() or waiting for a transmission to finish cost nothing, so hundreds of nodes
+/// can be simulated for days of virtual time in a few seconds on one CPU core.
+/// The simulation is deterministic for a given random seed.
+///
+/// Each node is a function with the signature void fn(void* arg) that is started with spawn(),
+/// and which typically constructs (or is passed) an RH_SIM driver and a RadioHead manager
+/// such as RHMesh, and then runs the same kind of loop as a normal sketch. The blocking RadioHead
+/// calls (waitAvailableTimeout(), waitPacketSent(), delay() etc) suspend the calling node and
+/// let the others run.
+///
+/// \par The channel model
+///
+/// - The time on air of every packet is computed from the spreading factor, bandwidth,
+///   coding rate and preamble length of the transmitting RH_SIM (see RHLoRaAirtime.h),
+///   with the 4 RadioHead headers counted as payload, as RH_RF95 does.
+/// - A node only hears packets on the same frequency, and only if it was in receive mode
+///   when the packet started.
+/// - Packets that overlap in time at a receiver destroy each other (there is no capture effect).
+/// - A node that starts transmitting loses anything it was receiving (half duplex).
+/// - The probability of correct delivery of a packet that survived the above is given
+///   per pair of node addresses by the topology. A probability of 0 means the nodes are out
+///   of range of each other, so their transmissions do not interfere either.
+/// - The RSSI and SNR of a received packet fall with the delivery probability of its link,
+///   from RH_SIM_DEFAULT_RSSI and RH_SIM_DEFAULT_SNR on a perfect link, so link quality
+///   metrics see weak links as weak.
+///
+/// \par Topology file
+///
+/// readConfig() accepts the same file format as etherSimulator.pl (see tools/chain.conf):
+/// \code
+/// # probability:nodea:nodeb:probability
+/// probability:10:2:0.5
+/// \endcode
+/// In addition, a line of the form
+/// \code
+/// default:0.0
+/// \endcode
+/// sets the probability for all pairs that are not listed, which is 1.0 (everyone hears everyone)
+/// if not given. With default:0.0 only the listed links exist.
+///
+/// \par Running simulations
+///
+/// Build with tools/etherSimBuild, which links the sketch with tools/etherSimMain.cpp.
+/// The sketch provides void simSetup(RHEtherSim& ether) instead of setup() and loop(),
+/// which spawns the nodes and sets the end time. See examples/simulator/simulator_mesh_soak.
+class RHEtherSim
+{
+public:
+    /// Type of the function run by each simulated node
+    typedef void (*NodeFunction)(void* arg);
+
+    /// \brief Counters describing what happened on the simulated channel
+    typedef struct
+    {
+	uint32_t transmissions;     ///< Packets transmitted by all nodes
+	uint32_t deliveries;        ///< Packets that were successfully received by a node
+	uint32_t collisions;        ///< Receptions destroyed by overlapping transmissions
+	uint32_t halfDuplexLosses;  ///< Receptions lost because the receiver was transmitting
+	uint32_t linkLosses;        ///< Receptions lost to the per-link delivery probability
+	uint32_t overruns;          ///< Receptions lost because the receiver had not collected the previous packet
+	uint64_t airtime;           ///< Sum of the time on air of all transmissions, in microseconds
+    } Stats;
+
+    /// A simulated node. Opaque outside RHEtherSim.
+    struct Node;
+
+    /// A packet arriving at one radio. Opaque outside RHEtherSim.
+    struct Reception;
+
+    /// Constructor. The most recently constructed RHEtherSim becomes the one returned by instance().
+    /// \param[in] seed Seed for the random number generator used for link losses and random()
+    RHEtherSim(uint32_t seed = 1);
+
+    /// Destructor. Frees all node stacks. Nodes that have not finished are abandoned.
+    ~RHEtherSim();
+
+    /// Returns the simulator that is currently running a node, or else the most recently created one.
+    static RHEtherSim* instance();
+
+    /// Reads a topology file in the etherSimulator.pl chain.conf format.
+    /// \param[in] filename Name of the file to read
+    /// \return true if the file could be read
+    bool readConfig(const char* filename);
+
+    /// Sets the probability of successful delivery between 2 node addresses (in both directions).
+    /// \param[in] a Address of one node
+    /// \param[in] b Address of the other node
+    /// \param[in] probability 0.0 (out of range) to 1.0 (always delivered)
+    void setLinkProbability(uint8_t a, uint8_t b, float probability);
+
+    /// Sets the delivery probability of all links that have not been set with setLinkProbability()
+    /// \param[in] probability 0.0 (out of range) to 1.0 (always delivered)
+    void setDefaultLinkProbability(float probability);
+
+    /// Returns the probability of a packet from one node address being delivered to another
+    float linkProbability(uint8_t from, uint8_t to) const;
+
+    /// Creates a new simulated node which will start running fn(arg) at the current virtual time
+    /// once run() is called.
+    /// \param[in] fn The function to run
+    /// \param[in] arg Argument passed to fn
+    /// \param[in] stackSize Size of the coroutine stack for the node
+    /// \return true if the node was created
+    bool spawn(NodeFunction fn, void* arg, size_t stackSize = RH_ETHER_SIM_DEFAULT_STACK_SIZE);
+
+    /// Sets the virtual time at which run() returns.
+    /// \param[in] endTime Virtual time in microseconds
+    void setEndTime(uint64_t endTime);
+
+    /// Runs the simulation until the end time, until stop() is called, or until
+    /// there is nothing left to happen.
+    void run();
+
+    /// Makes run() return after the current event. May be called from a node.
+    void stop();
+
+    /// Returns the current virtual time in microseconds since the start of the simulation
+    uint64_t now() const;
+
+    /// Blocks the calling node for the given virtual time. If called from outside any node,
+    /// runs the simulation for that long instead.
+    /// \param[in] us Time to sleep in microseconds
+    void sleep(uint64_t us);
+
+    /// Implements millis() for simulated sketches. Also detects nodes that poll millis()
+    /// in a loop without ever blocking, and advances their clock.
+    unsigned long millis();
+
+    /// Returns a pseudo random number from the simulation's deterministic generator
+    /// \return a number in the range from to to - 1
+    long random(long from, long to);
+
+    /// Returns the channel counters accumulated since the simulator was created
+    const Stats& stats() const;
+
+    /// Prints the channel counters to stdout
+    void printStats();
+
+protected:
+    friend class RH_SIM;
+
+    /// Adds a driver to the set of radios sharing the ether
+    void attach(RH_SIM* driver);
+
+    /// Removes a driver from the set of radios sharing the ether
+    void detach(RH_SIM* driver);
+
+    /// Starts a transmission of the driver's current TX headers and the data.
+    /// The driver is expected to have already entered RHModeTx.
+    void transmit(RH_SIM* sender, const uint8_t* data, uint8_t len);
+
+    /// Blocks the calling node until notify() is called for the driver, or the deadline passes.
+    /// \param[in] driver The driver the node is waiting on
+    /// \param[in] deadline Virtual time in microseconds, or RH_ETHER_SIM_FOREVER
+    void block(RH_SIM* driver, uint64_t deadline);
+
+    /// Wakes the node, if any, that is blocked on the driver.
+    void notify(RH_SIM* driver);
+
+    /// Called by a driver when it starts transmitting or otherwise stops receiving,
+    /// to destroy any partially received packets.
+    void abortReceptions(RH_SIM* driver);
+
+    /// Returns true if any packet is currently arriving at the driver
+    bool channelActive(RH_SIM* driver) const;
+
+private:
+    struct Transmission;
+
+    typedef enum
+    {
+	EventWake = 0,
+	EventTxEnd
+    } EventType;
+
+    struct Event
+    {
+	uint64_t       time;
+	uint64_t       seq;
+	EventType      type;
+	Node*          node;
+	uint32_t       generation;
+	Transmission*  tx;
+
+	bool operator>(const Event& other) const
+	{
+	    return time != other.time ? time > other.time : seq > other.seq;
+	}
+    };
+
+    bool step(uint64_t limit);
+    void schedule(uint64_t time, EventType type, Node* node, uint32_t generation, Transmission* tx);
+    void resume(Node* node);
+    uint64_t nextRandom();
+    void endTransmission(Transmission* tx);
+    static void nodeEntry();
+
+    ucontext_t                  _mainContext;
+    std::vector<Node*>          _nodes;
+    std::vector<RH_SIM*>        _drivers;
+    std::vector<Transmission*>  _inFlight;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event> > _events;
+    Node*                       _current;
+    uint64_t                    _now;
+    uint64_t                    _endTime;
+    uint64_t                    _seq;
+    uint64_t                    _rng;
+    bool                        _stopped;
+    float*                      _links; // 256 x 256 delivery probabilities, < 0 for the default
+    float                       _defaultLink;
+    Stats                       _stats;
+
+    static RHEtherSim*          _instance;
+};
+
+#endif
+
+#endif
@@ -4,6 +4,7 @@
 // $Id: RHGenericDriver.cpp,v 1.24 2020/01/07 23:35:02 mikem Exp $
 
 #include <RHGenericDriver.h>
+#include <RHListenBeforeTalk.h>
 
 RHGenericDriver::RHGenericDriver()
     :
@@ -16,7 +17,9 @@ RHGenericDriver::RHGenericDriver()
     _rxBad(0),
     _rxGood(0),
     _txGood(0),
-    _cad_timeout(0)
+    _cad_timeout(0),
+    _lbt(NULL),
+    _lastAirtime(0)
 {
 }
 
@@ -77,6 +80,23 @@ bool RHGenericDriver::waitPacketSent(uint16_t timeout)
 // Wait until no channel activity detected or timeout
 bool RHGenericDriver::waitCAD()
 {
+    if (_lbt && _lbt->mode() != RHListenBeforeTalk::ModeOff)
+    {
+	RHListenBeforeTalk::Action action = _lbt->begin(_lastAirtime);
+	while (action == RHListenBeforeTalk::ActionBackoff)
+	{
+	    if (_lbt->backoff())
+		delay((_lbt->backoff() + 999) / 1000);
+
+	    bool active = false;
+	    if (startCAD())
+		while (!cadDone(&active))
+		    YIELD;
+	    action = _lbt->cadResult(active);
+	}
+	return action == RHListenBeforeTalk::ActionTransmit;
+    }
+
     if (!_cad_timeout)
 	return true;
 
@@ -106,6 +126,29 @@ bool RHGenericDriver::isChannelActive()
     return false;
 }
 
+void RHGenericDriver::setListenBeforeTalk(RHListenBeforeTalk* lbt)
+{
+    _lbt = lbt;
+}
+
+// subclasses with asynchronous CAD are expected to override this and cadDone()
+bool RHGenericDriver::startCAD()
+{
+    _cad = isChannelActive();
+    return true;
+}
+
+bool RHGenericDriver::cadDone(bool* active)
+{
+    *active = _cad;
+    return true;
+}
+
+uint32_t RHGenericDriver::lastAirtime()
+{
+    return _lastAirtime;
+}
+
 void RHGenericDriver::setPromiscuous(bool promiscuous)
 {
     _promiscuous = promiscuous;
@@ -162,6 +205,11 @@ int16_t RHGenericDriver::lastRssi()
     return _lastRssi;
 }
 
+int RHGenericDriver::lastSNR()
+{
+    return RH_SNR_UNKNOWN;
+}
+
 RHGenericDriver::RHMode  RHGenericDriver::mode()
 {
     return _mode;
@@ -8,6 +8,8 @@
 
 #include <RadioHead.h>
 
+class RHListenBeforeTalk;
+
 // Defines bits of the FLAGS header reserved for use by the RadioHead library and 
 // the flags available for use by applications
 #define RH_FLAGS_RESERVED                 0xf0
@@ -17,6 +19,9 @@
 // Default timeout for waitCAD() in ms
 #define RH_CAD_DEFAULT_TIMEOUT            10000
 
+// Returned by lastSNR() by drivers that do not measure the SNR
+#define RH_SNR_UNKNOWN                    -128
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHGenericDriver RHGenericDriver.h <RHGenericDriver.h>
 /// \brief Abstract base class for a RadioHead driver.
@@ -151,6 +156,31 @@ public:
     /// CAD detection depends on support for isChannelActive() by your particular radio.
     void setCADTimeout(unsigned long cad_timeout);
 
+    /// Makes waitCAD() use a listen-before-talk policy instead of the fixed 100 to 1000ms random delays.
+    /// While the policy is in RHListenBeforeTalk::ModeCad, waitCAD() runs CAD with startCAD()
+    /// and cadDone(), backs off for the times the policy chooses, and returns false if the policy
+    /// gives up. The CAD timeout is not used.
+    /// The same policy object may be shared by several drivers, but its statistics are then combined.
+    /// \param[in] lbt The policy to use, or NULL (the default) for the original behaviour
+    void setListenBeforeTalk(RHListenBeforeTalk* lbt);
+
+    /// Starts Channel Activity Detection without waiting for the result.
+    /// Radios with asynchronous CAD (eg RH_RF95) override this together with cadDone().
+    /// The default runs isChannelActive() to completion.
+    /// \return true if CAD was started
+    virtual bool            startCAD();
+
+    /// Checks whether the CAD started by startCAD() has finished
+    /// \param[out] active Set to true if channel activity was detected, when the CAD has finished
+    /// \return true if the CAD has finished and *active is valid
+    virtual bool            cadDone(bool* active);
+
+    /// Returns the time the last transmission took, from starting the transmitter
+    /// to the end of the packet, for drivers that measure it.
+    /// Used to scale listen-before-talk backoffs.
+    /// \return Time on air in microseconds, or 0 if not known
+    uint32_t                lastAirtime();
+
     /// Determine if the currently selected radio channel is active.
     /// This is expected to be subclassed by specific radios to implement their Channel Activity Detection
     /// if supported. If the radio does not support CAD, returns true immediately. If a RadioHead radio 
@@ -219,6 +249,11 @@ public:
     /// \return The most recent RSSI measurement in dBm.
     virtual int16_t        lastRssi();
 
+    /// Returns the Signal-to-noise ratio (SNR) of the last received message, for drivers
+    /// whose radios measure it (mostly LoRa radios).
+    /// \return SNR of the last received message in dB, or RH_SNR_UNKNOWN
+    virtual int            lastSNR();
+
     /// Returns the operating mode of the library.
     /// \return the current mode, one of RF69_MODE_*
     virtual RHMode          mode();
@@ -311,6 +346,12 @@ protected:
     /// Channel activity timeout in ms
     unsigned int        _cad_timeout;
 
+    /// Listen-before-talk policy used by waitCAD(), if any
+    RHListenBeforeTalk* _lbt;
+
+    /// Measured time on air of the last transmission in microseconds, 0 if unknown
+    uint32_t            _lastAirtime;
+
 private:
 
 };
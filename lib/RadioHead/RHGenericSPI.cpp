@@ -14,6 +14,16 @@ RHGenericSPI::RHGenericSPI(Frequency frequency, BitOrder bitOrder, DataMode data
 {
 }
 
+void RHGenericSPI::transferBuffer(const uint8_t* src, uint8_t* dest, uint8_t len)
+{
+    while (len--)
+    {
+	uint8_t val = transfer(src ? *src++ : 0);
+	if (dest)
+	    *dest++ = val;
+    }
+}
+
 void RHGenericSPI::setBitOrder(BitOrder bitOrder)
 {
     _bitOrder = bitOrder;
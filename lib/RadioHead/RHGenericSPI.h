@@ -89,6 +89,14 @@ public:
     /// \return The octet read from SPI while the data octet was sent
     virtual uint8_t transfer(uint8_t data) = 0;
 
+    /// Transfer a number of octets to and from the SPI interface, as in a burst read or write.
+    /// The base class calls transfer() for each octet. Subclasses may override it with
+    /// the platform's bulk transfer, where there is one.
+    /// \param[in] src The octets to send, or NULL to send 0s
+    /// \param[out] dest Where to put the octets read, or NULL to discard them
+    /// \param[in] len The number of octets to transfer
+    virtual void transferBuffer(const uint8_t* src, uint8_t* dest, uint8_t len);
+
 #if (RH_PLATFORM == RH_PLATFORM_MONGOOSE_OS)
     /// Transfer up to 2 bytes on the SPI interface
     /// \param[in] byte0 The first byte to be sent on the SPI interface
@@ -53,6 +53,22 @@ uint8_t RHHardwareSPI::transfer(uint8_t data)
     return SPI.transfer(data);
 }
 
+#if (RH_PLATFORM == RH_PLATFORM_ESP8266) || (RH_PLATFORM == RH_PLATFORM_ESP32)
+void RHHardwareSPI::transferBuffer(const uint8_t* src, uint8_t* dest, uint8_t len)
+{
+    if (!dest)
+	SPI.writeBytes((uint8_t*)src, len);
+    else if (src)
+	SPI.transferBytes((uint8_t*)src, dest, len);
+    else
+    {
+	// Read in place, sending 0s as transfer(0) would
+	memset(dest, 0, len);
+	SPI.transferBytes(dest, dest, len);
+    }
+}
+#endif
+
 #if (RH_PLATFORM == RH_PLATFORM_MONGOOSE_OS)
 uint8_t RHHardwareSPI::transfer2B(uint8_t byte0, uint8_t byte1)
 {
@@ -36,6 +36,15 @@ public:
     /// \return The octet read from SPI while the data octet was sent
     uint8_t transfer(uint8_t data);
 
+#if (RH_PLATFORM == RH_PLATFORM_ESP8266) || (RH_PLATFORM == RH_PLATFORM_ESP32)
+    /// Transfer a number of octets to and from the SPI interface with SPI.transferBytes(), which moves
+    /// them through the SPI peripheral's 64 byte data buffer rather than one octet at a time
+    /// \param[in] src The octets to send, or NULL to send 0s
+    /// \param[out] dest Where to put the octets read, or NULL to discard them
+    /// \param[in] len The number of octets to transfer
+    void transferBuffer(const uint8_t* src, uint8_t* dest, uint8_t len);
+#endif
+
 #if (RH_PLATFORM == RH_PLATFORM_MONGOOSE_OS)
     /// Transfer (write) 2 bytes on the SPI interface to an NRF device
     /// \param[in] byte0 The first byte to be sent on the SPI interface
@@ -0,0 +1,117 @@
+// RHListenBeforeTalk.cpp
+//
+// Listen-before-talk policy with exponential backoff scaled to packet airtime
+
+#include <RHListenBeforeTalk.h>
+
+RHListenBeforeTalk::RHListenBeforeTalk(Mode mode)
+    :
+    _mode(mode),
+    _maxAttempts(RH_LBT_DEFAULT_MAX_ATTEMPTS),
+    _maxExponent(RH_LBT_DEFAULT_MAX_EXPONENT),
+    _busyCount(0),
+    _airtime(0),
+    _backoff(0)
+{
+    clearStats();
+}
+
+void RHListenBeforeTalk::setMode(Mode mode)
+{
+    _mode = mode;
+}
+
+RHListenBeforeTalk::Mode RHListenBeforeTalk::mode() const
+{
+    return _mode;
+}
+
+void RHListenBeforeTalk::setMaxAttempts(uint8_t attempts)
+{
+    if (attempts < 1)
+	attempts = 1;
+    if (attempts > RH_LBT_MAX_ATTEMPTS)
+	attempts = RH_LBT_MAX_ATTEMPTS;
+    _maxAttempts = attempts;
+}
+
+uint8_t RHListenBeforeTalk::maxAttempts() const
+{
+    return _maxAttempts;
+}
+
+void RHListenBeforeTalk::setMaxExponent(uint8_t exponent)
+{
+    _maxExponent = exponent > 15 ? 15 : exponent;
+}
+
+RHListenBeforeTalk::Action RHListenBeforeTalk::begin(uint32_t measuredAirtime)
+{
+    if (measuredAirtime)
+	_airtime = _airtime ? (_airtime * 3 + measuredAirtime) / 4 : measuredAirtime;
+
+    _busyCount = 0;
+    _backoff = 0;
+    if (_mode == ModeOff)
+	return ActionTransmit;
+
+    _stats.packets++;
+    return ActionBackoff;
+}
+
+RHListenBeforeTalk::Action RHListenBeforeTalk::cadResult(bool channelActive)
+{
+    _stats.cads++;
+    if (_mode == ModeOff || !channelActive)
+    {
+	_stats.clearAtAttempt[_busyCount]++;
+	return ActionTransmit;
+    }
+
+    _stats.busy++;
+    if (++_busyCount >= _maxAttempts)
+    {
+	_stats.giveUps++;
+	return ActionGiveUp;
+    }
+
+    // Random in [window / 2, window), window = airtime * 2^min(busyCount, maxExponent)
+    uint8_t exponent = _busyCount < _maxExponent ? _busyCount : _maxExponent;
+    uint64_t window = (uint64_t)airtime() << exponent;
+    if (window > 0xffffffff)
+	window = 0xffffffff;
+    uint32_t half = (uint32_t)(window / 2);
+#if (RH_PLATFORM == RH_PLATFORM_STM32) // stdlib on STMF103 gets confused if random is redefined
+    uint32_t r = _random(0, 0x10000);
+#elif (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+    uint32_t r = random() & 0xffff;
+#else
+    uint32_t r = random(0, 0x10000);
+#endif
+    _backoff = half + (uint32_t)(((uint64_t)half * (r & 0xffff)) >> 16);
+
+    _stats.backoffTime += _backoff;
+    if (_backoff > _stats.maxBackoff)
+	_stats.maxBackoff = _backoff;
+    return ActionBackoff;
+}
+
+uint32_t RHListenBeforeTalk::backoff() const
+{
+    return _backoff;
+}
+
+uint32_t RHListenBeforeTalk::airtime() const
+{
+    return _airtime ? _airtime : RH_LBT_DEFAULT_AIRTIME;
+}
+
+const RHListenBeforeTalk::Stats& RHListenBeforeTalk::stats() const
+{
+    return _stats;
+}
+
+void RHListenBeforeTalk::clearStats()
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
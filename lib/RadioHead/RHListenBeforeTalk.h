@@ -0,0 +1,135 @@
+// RHListenBeforeTalk.h
+//
+// Listen-before-talk policy with exponential backoff scaled to packet airtime
+
+#ifndef RHListenBeforeTalk_h
+#define RHListenBeforeTalk_h
+
+#include <RadioHead.h>
+
+// Most CAD attempts that can be made for one packet. Also the size of the per-attempt histogram.
+#define RH_LBT_MAX_ATTEMPTS 16
+
+// Default number of CAD attempts before giving up on a packet
+#define RH_LBT_DEFAULT_MAX_ATTEMPTS 8
+
+// Default cap on the backoff exponent: the backoff window stops doubling at 2^5 airtimes
+#define RH_LBT_DEFAULT_MAX_EXPONENT 5
+
+// Airtime assumed until one has been measured, in microseconds.
+// About a 30 octet packet at SF7, 125kHz.
+#define RH_LBT_DEFAULT_AIRTIME 60000
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHListenBeforeTalk RHListenBeforeTalk.h <RHListenBeforeTalk.h>
+/// \brief Listen-before-talk (carrier sense) policy with randomised exponential backoff
+///
+/// \par Overview
+///
+/// RHListenBeforeTalk decides when a radio may transmit, given the results of Channel Activity
+/// Detection (CAD). It never waits or touches the radio itself, so the same policy is used by
+/// blocking RadioHead drivers (through RHGenericDriver::setListenBeforeTalk() and waitCAD()),
+/// and by callers that run CAD asynchronously and do something else during the backoff.
+///
+/// For each packet, call begin(), then run a CAD and pass the result to cadResult():
+/// - ActionTransmit: the channel was clear, send now
+/// - ActionBackoff: the channel was busy, wait backoff() microseconds and run CAD again
+/// - ActionGiveUp: the channel stayed busy for maxAttempts() CADs
+///
+/// After the n'th busy CAD, the backoff is a random time between half and all of
+/// airtime * 2^min(n, maxExponent), where airtime is a running average of the measured time on air
+/// of recent packets. The first backoff therefore lets most of a typical packet go by, and the
+/// window then doubles, so crowded channels spread out quickly without the long fixed delays of
+/// the original waitCAD().
+///
+/// \par Modes
+///
+/// ModeOff passes every packet straight through, so listen before talk can be turned on and
+/// off per deployment without rebuilding. ModeCad applies the policy above.
+class RHListenBeforeTalk
+{
+public:
+    /// \brief Whether listen before talk is applied
+    typedef enum
+    {
+	ModeOff = 0,   ///< Transmit immediately, do not run CAD
+	ModeCad        ///< Run CAD before each transmission and back off while the channel is busy
+    } Mode;
+
+    /// \brief What the caller should do next
+    typedef enum
+    {
+	ActionTransmit = 0, ///< Channel is clear, transmit now
+	ActionBackoff,      ///< Channel is busy, wait backoff() microseconds and run CAD again
+	ActionGiveUp        ///< Too many busy CADs, abandon (or force) this transmission
+    } Action;
+
+    /// \brief Counters accumulated since the last clearStats()
+    typedef struct
+    {
+	uint32_t packets;                           ///< Packets passed through begin() in ModeCad
+	uint32_t cads;                              ///< CADs reported with cadResult()
+	uint32_t busy;                              ///< CADs that found the channel active
+	uint32_t giveUps;                           ///< Packets abandoned after maxAttempts() busy CADs
+	uint64_t backoffTime;                       ///< Sum of all backoffs, in microseconds
+	uint32_t maxBackoff;                        ///< Longest single backoff, in microseconds
+	uint32_t clearAtAttempt[RH_LBT_MAX_ATTEMPTS]; ///< Packets sent after [n] busy CADs
+    } Stats;
+
+    /// Constructor
+    /// \param[in] mode The initial mode
+    RHListenBeforeTalk(Mode mode = ModeCad);
+
+    /// Sets the mode
+    /// \param[in] mode ModeOff or ModeCad
+    void setMode(Mode mode);
+
+    /// \return the current mode
+    Mode mode() const;
+
+    /// Sets the number of CADs to try for each packet before giving up
+    /// \param[in] attempts 1 to RH_LBT_MAX_ATTEMPTS
+    void setMaxAttempts(uint8_t attempts);
+
+    /// \return the number of CADs tried for each packet before giving up
+    uint8_t maxAttempts() const;
+
+    /// Sets the largest power of 2 the airtime is multiplied by to get the backoff window
+    /// \param[in] exponent 0 to 15
+    void setMaxExponent(uint8_t exponent);
+
+    /// Starts the policy for a new packet.
+    /// \param[in] measuredAirtime Measured time on air of the last packet sent in microseconds,
+    /// or 0 if not known. Folded into the running average the backoff is scaled by.
+    /// \return ActionTransmit in ModeOff, else ActionBackoff with a backoff() of 0,
+    /// meaning run the first CAD now
+    Action begin(uint32_t measuredAirtime = 0);
+
+    /// Reports the result of a CAD for the current packet
+    /// \param[in] channelActive true if the CAD detected activity
+    /// \return what to do next
+    Action cadResult(bool channelActive);
+
+    /// \return the time to wait before the next CAD after cadResult() returned ActionBackoff, in microseconds
+    uint32_t backoff() const;
+
+    /// \return the running average airtime the backoff is scaled by, in microseconds
+    uint32_t airtime() const;
+
+    /// \return the counters
+    const Stats& stats() const;
+
+    /// Zeroes the counters
+    void clearStats();
+
+private:
+    Mode     _mode;
+    uint8_t  _maxAttempts;
+    uint8_t  _maxExponent;
+    uint8_t  _busyCount;
+    uint32_t _airtime;
+    uint32_t _backoff;
+    Stats    _stats;
+};
+
+#endif
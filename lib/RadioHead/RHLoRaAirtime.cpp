@@ -0,0 +1,53 @@
+// RHLoRaAirtime.cpp
+//
+// LoRa time-on-air calculations.
+// See the Semtech SX1276/77/78/79 datasheet, section 4.1.1.7
+
+#include <RHLoRaAirtime.h>
+
+void RHLoRaDefaultModemParams(RHLoRaModemParams* params)
+{
+    params->spreadingFactor = 7;
+    params->bandwidth = 125000;
+    params->codingRate4 = 5;
+    params->preambleLength = RH_LORA_DEFAULT_PREAMBLE_LENGTH;
+    params->explicitHeader = true;
+    params->crc = true;
+    params->lowDataRateOptimize = -1;
+}
+
+uint32_t RHLoRaSymbolTime(const RHLoRaModemParams* params)
+{
+    if (!params->bandwidth)
+	return 0;
+    return (uint32_t)(((uint64_t)1000000 << params->spreadingFactor) / params->bandwidth);
+}
+
+uint16_t RHLoRaPayloadSymbols(const RHLoRaModemParams* params, uint8_t payloadLen)
+{
+    int32_t sf = params->spreadingFactor;
+    int32_t de = params->lowDataRateOptimize;
+    if (de < 0)
+	de = RHLoRaSymbolTime(params) > RH_LORA_LOW_DATA_RATE_SYMBOL_TIME;
+    int32_t cr = params->codingRate4 < 5 ? 1 : params->codingRate4 - 4;
+
+    // 8 + max(ceil((8PL - 4SF + 28 + 16CRC - 20IH) / (4(SF - 2DE))) * (CR + 4), 0)
+    int32_t numerator = 8 * (int32_t)payloadLen - 4 * sf + 28
+	+ (params->crc ? 16 : 0)
+	- (params->explicitHeader ? 0 : 20);
+    int32_t denominator = 4 * (sf - 2 * de);
+    if (denominator <= 0)
+	return 8;
+    int32_t blocks = numerator > 0 ? (numerator + denominator - 1) / denominator : 0;
+    return (uint16_t)(8 + blocks * (cr + 4));
+}
+
+uint32_t RHLoRaAirtime(const RHLoRaModemParams* params, uint8_t payloadLen)
+{
+    if (!params->bandwidth)
+	return 0;
+    // Count in quarter symbols so the 4.25 symbols the radio adds to the preamble stay exact
+    uint64_t quarterSymbols = (uint64_t)params->preambleLength * 4 + 17
+	+ (uint64_t)RHLoRaPayloadSymbols(params, payloadLen) * 4;
+    return (uint32_t)(((quarterSymbols * 1000000) << params->spreadingFactor) / ((uint64_t)params->bandwidth * 4));
+}
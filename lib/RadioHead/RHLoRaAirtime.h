@@ -0,0 +1,60 @@
+// RHLoRaAirtime.h
+//
+// Definitions for LoRa time-on-air calculations.
+// Formulae are from the Semtech SX1276/77/78/79 datasheet, section 4.1.1.7
+// and Semtech AN1200.13 "LoRa Modem Designer's Guide".
+
+#ifndef RHLoRaAirtime_h
+#define RHLoRaAirtime_h
+
+#include <RadioHead.h>
+
+// Default number of programmed preamble symbols, as used by RH_RF95 and the SX127x power on default
+#define RH_LORA_DEFAULT_PREAMBLE_LENGTH 8
+
+// Symbol duration above which the SX127x LowDataRateOptimize bit must be set, in microseconds
+#define RH_LORA_LOW_DATA_RATE_SYMBOL_TIME 16000
+
+/// \brief LoRa modem settings that determine the time on air of a packet
+///
+/// The fields correspond directly to the SX127x modem registers, and to the arguments
+/// of RH_RF95::setSpreadingFactor(), setSignalBandwidth(), setCodingRate4() and
+/// the equivalent functions of the Arduino LoRa library.
+typedef struct
+{
+    uint8_t  spreadingFactor;      ///< Spreading factor, 6 to 12
+    uint32_t bandwidth;            ///< Signal bandwidth in Hz, eg 125000
+    uint8_t  codingRate4;          ///< Denominator of the coding rate 4/x, 5 to 8
+    uint16_t preambleLength;       ///< Programmed preamble length in symbols (the radio adds 4.25)
+    bool     explicitHeader;       ///< true if the packet has an explicit (variable length) header
+    bool     crc;                  ///< true if the payload CRC is enabled
+    int8_t   lowDataRateOptimize;  ///< 1 to force on, 0 to force off, -1 to select automatically from the symbol time
+} RHLoRaModemParams;
+
+/// Initialises params with the settings RadioHead and the Arduino LoRa library use by default:
+/// SF7, 125kHz, 4/5, 8 symbol preamble, explicit header, CRC on.
+/// \param[out] params The parameters to initialise
+extern void     RHLoRaDefaultModemParams(RHLoRaModemParams* params);
+
+/// Returns the duration of one LoRa symbol for the given modem settings
+/// \param[in] params The modem settings
+/// \return Symbol duration in microseconds
+extern uint32_t RHLoRaSymbolTime(const RHLoRaModemParams* params);
+
+/// Returns the number of symbols in the payload (including the header) of a packet,
+/// not including the preamble.
+/// \param[in] params The modem settings
+/// \param[in] payloadLen Number of octets in the payload, as loaded into the radio FIFO
+/// \return Number of payload symbols
+extern uint16_t RHLoRaPayloadSymbols(const RHLoRaModemParams* params, uint8_t payloadLen);
+
+/// Returns the time on air of a complete packet, from the start of the preamble to
+/// the end of the last payload symbol.
+/// Integer arithmetic only, so it is cheap enough to call for every packet on
+/// processors without a floating point unit.
+/// \param[in] params The modem settings
+/// \param[in] payloadLen Number of octets in the payload, as loaded into the radio FIFO
+/// \return Time on air in microseconds
+extern uint32_t RHLoRaAirtime(const RHLoRaModemParams* params, uint8_t payloadLen);
+
+#endif
@@ -0,0 +1,349 @@
+// RHLoRaFileOpsGateway.cpp
+//
+// Drives several LoRa-file-ops radios from one event loop, as one RadioHead driver
+
+#include <RHLoRaFileOpsGateway.h>
+
+// This can only build on Linux and compatible systems
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// Route table entry for addresses not heard on any radio yet
+#define RH_LORAFILEOPS_GATEWAY_ALL_RADIOS 0xff
+
+RHLoRaFileOpsGateway::RHLoRaFileOpsGateway()
+    :
+    _numRadios(0),
+    _lastRadio(0),
+    _nextRadio(0),
+    _lastSNR(0),
+    _epollFd(-1),
+    _eventFd(-1),
+    _running(false)
+{
+    memset(_radios, 0, sizeof(_radios));
+    memset(_route, RH_LORAFILEOPS_GATEWAY_ALL_RADIOS, sizeof(_route));
+}
+
+RHLoRaFileOpsGateway::~RHLoRaFileOpsGateway()
+{
+    stop();
+    if (_epollFd != -1)
+	close(_epollFd);
+    if (_eventFd != -1)
+	close(_eventFd);
+}
+
+bool RHLoRaFileOpsGateway::addRadio(RH_LoRaFileOps* radio)
+{
+    if (_numRadios >= RH_LORAFILEOPS_GATEWAY_MAX_RADIOS)
+	return false;
+    _radios[_numRadios++].radio = radio;
+    return true;
+}
+
+uint8_t RHLoRaFileOpsGateway::numRadios() const
+{
+    return _numRadios;
+}
+
+bool RHLoRaFileOpsGateway::init()
+{
+    if (!RHGenericDriver::init())
+	return false;
+    if (_numRadios == 0)
+	return false;
+
+    if (_epollFd == -1)
+	_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (_eventFd == -1)
+	_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_epollFd == -1 || _eventFd == -1)
+    {
+	Serial.print("RHLoRaFileOpsGateway::init epoll setup failed: ");
+	Serial.println(strerror(errno));
+	return false;
+    }
+
+    for (uint8_t i = 0; i < _numRadios; i++)
+    {
+	if (!_radios[i].radio->init())
+	    return false;
+	// Drivers without poll support refuse to be added with EPERM. They are still
+	// tested by the poll() in drain() at every pass
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u32 = i;
+	if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, _radios[i].radio->fd(), &ev) == -1
+	    && errno != EPERM && errno != EEXIST)
+	{
+	    Serial.print("RHLoRaFileOpsGateway::init epoll_ctl failed: ");
+	    Serial.println(strerror(errno));
+	    return false;
+	}
+    }
+    _mode = RHModeRx;
+    return true;
+}
+
+bool RHLoRaFileOpsGateway::start()
+{
+    if (_running || _epollFd == -1)
+	return false;
+    _running = true;
+    if (pthread_create(&_thread, NULL, run, this) != 0)
+    {
+	_running = false;
+	return false;
+    }
+    return true;
+}
+
+void RHLoRaFileOpsGateway::stop()
+{
+    if (!_running)
+	return;
+    // The thread notices within RH_LORAFILEOPS_GATEWAY_POLL_INTERVAL
+    _running = false;
+    pthread_join(_thread, NULL);
+}
+
+void* RHLoRaFileOpsGateway::run(void* arg)
+{
+    RHLoRaFileOpsGateway* gateway = (RHLoRaFileOpsGateway*)arg;
+    while (gateway->_running)
+	gateway->service(RH_LORAFILEOPS_GATEWAY_POLL_INTERVAL);
+    return NULL;
+}
+
+int RHLoRaFileOpsGateway::drain()
+{
+    struct pollfd pfd[RH_LORAFILEOPS_GATEWAY_MAX_RADIOS];
+    for (uint8_t i = 0; i < _numRadios; i++)
+    {
+	pfd[i].fd = _radios[i].radio->fd();
+	pfd[i].events = POLLIN;
+    }
+
+    // Keep going while any radio has more, but give up on one that keeps failing
+    int total = 0;
+    for (int pass = 0; pass < RH_LORAFILEOPS_GATEWAY_QUEUE_LEN; pass++)
+    {
+	if (poll(pfd, _numRadios, 0) <= 0)
+	    break;
+	int got = 0;
+	for (uint8_t i = 0; i < _numRadios; i++)
+	{
+	    if (!(pfd[i].revents & POLLIN))
+		continue;
+	    Radio* r = &_radios[i];
+	    uint32_t head = r->queue.head;
+	    uint32_t tail = __atomic_load_n(&r->queue.tail, __ATOMIC_ACQUIRE);
+	    // If the queue is full, the radio still has to be read, or it would stay readable
+	    RHLoRaFileOpsPacket dropped;
+	    bool full = (head - tail) >= RH_LORAFILEOPS_GATEWAY_QUEUE_LEN;
+	    RHLoRaFileOpsPacket* packet = full ? &dropped : &r->queue.packet[head & (RH_LORAFILEOPS_GATEWAY_QUEUE_LEN - 1)];
+	    if (!r->radio->readPacket(packet))
+	    {
+		r->stats.readErrors++;
+		continue;
+	    }
+	    r->stats.received++;
+	    got++;
+	    if (full)
+		r->stats.overflows++;
+	    else
+		__atomic_store_n(&r->queue.head, head + 1, __ATOMIC_RELEASE);
+	}
+	if (!got)
+	    break;
+	total += got;
+    }
+    return total;
+}
+
+int RHLoRaFileOpsGateway::service(uint16_t timeout)
+{
+    if (_epollFd == -1)
+	return 0;
+
+    int count = drain();
+    unsigned long start = millis();
+    while (count == 0)
+    {
+	unsigned long elapsed = millis() - start;
+	if (elapsed >= timeout)
+	    break;
+	unsigned long wait = timeout - elapsed;
+	if (wait > RH_LORAFILEOPS_GATEWAY_POLL_INTERVAL)
+	    wait = RH_LORAFILEOPS_GATEWAY_POLL_INTERVAL;
+	// Which radios woke us does not matter: drain() tests them all with one poll()
+	struct epoll_event events[RH_LORAFILEOPS_GATEWAY_MAX_RADIOS];
+	epoll_wait(_epollFd, events, RH_LORAFILEOPS_GATEWAY_MAX_RADIOS, wait);
+	count = drain();
+    }
+    if (count && _running)
+    {
+	// If it fails the counter is already at its maximum, and the reader will wake anyway
+	uint64_t one = 1;
+	ssize_t written = write(_eventFd, &one, sizeof(one));
+	(void)written;
+    }
+    return count;
+}
+
+int RHLoRaFileOpsGateway::nextQueued()
+{
+    for (uint8_t n = 0; n < _numRadios; n++)
+    {
+	uint8_t i = (_nextRadio + n) % _numRadios;
+	Queue* q = &_radios[i].queue;
+	uint32_t tail = q->tail;
+	while (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+	{
+	    RHLoRaFileOpsPacket* packet = &q->packet[tail & (RH_LORAFILEOPS_GATEWAY_QUEUE_LEN - 1)];
+	    // Whoever it is for, the sender can be reached on this radio
+	    uint8_t to = packet->buf[0];
+	    _route[packet->buf[1]] = i;
+	    if (_promiscuous || to == _thisAddress || to == RH_BROADCAST_ADDRESS)
+		return i;
+	    // Not for us
+	    __atomic_store_n(&q->tail, ++tail, __ATOMIC_RELEASE);
+	}
+    }
+    return -1;
+}
+
+bool RHLoRaFileOpsGateway::available()
+{
+    if (!_running)
+	service(0);
+    return nextQueued() >= 0;
+}
+
+void RHLoRaFileOpsGateway::waitAvailable(uint16_t /* polldelay */)
+{
+    while (!waitAvailableTimeout(1000))
+	;
+}
+
+bool RHLoRaFileOpsGateway::waitAvailableTimeout(uint16_t timeout, uint16_t /* polldelay */)
+{
+    unsigned long start = millis();
+    while (!available())
+    {
+	unsigned long elapsed = millis() - start;
+	if (elapsed >= timeout)
+	    return false;
+	if (_running)
+	{
+	    // Sleep until the thread queues something
+	    struct pollfd pfd;
+	    pfd.fd = _eventFd;
+	    pfd.events = POLLIN;
+	    if (poll(&pfd, 1, timeout - elapsed) > 0)
+	    {
+		// If it fails another reader got there first
+		uint64_t count;
+		ssize_t got = read(_eventFd, &count, sizeof(count));
+		(void)got;
+	    }
+	}
+	else
+	    service(timeout - elapsed);
+    }
+    return true;
+}
+
+bool RHLoRaFileOpsGateway::recv(uint8_t* buf, uint8_t* len)
+{
+    if (!available())
+	return false;
+    int i = nextQueued();
+    if (i < 0)
+	return false;
+
+    Queue* q = &_radios[i].queue;
+    RHLoRaFileOpsPacket* packet = &q->packet[q->tail & (RH_LORAFILEOPS_GATEWAY_QUEUE_LEN - 1)];
+    _rxHeaderTo    = packet->buf[0];
+    _rxHeaderFrom  = packet->buf[1];
+    _rxHeaderId    = packet->buf[2];
+    _rxHeaderFlags = packet->buf[3];
+    _lastRssi      = packet->rssi;
+    _lastSNR       = packet->snr;
+    if (buf && len)
+    {
+	if (*len > (packet->len - RH_LORAFILEOPS_HEADER_LEN))
+	    *len = packet->len - RH_LORAFILEOPS_HEADER_LEN;
+	memcpy(buf, packet->buf + RH_LORAFILEOPS_HEADER_LEN, *len);
+    }
+    // Give the slot back to the loop
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+
+    _lastRadio = i;
+    _nextRadio = (i + 1) % _numRadios;
+    _rxGood++;
+    return true;
+}
+
+bool RHLoRaFileOpsGateway::send(const uint8_t* data, uint8_t len)
+{
+    if (len > RH_LORAFILEOPS_MAX_MESSAGE_LEN)
+	return false;
+
+    uint8_t route = _route[_txHeaderTo];
+    bool sent = false;
+    for (uint8_t i = 0; i < _numRadios; i++)
+    {
+	if (_txHeaderTo != RH_BROADCAST_ADDRESS
+	    && route != RH_LORAFILEOPS_GATEWAY_ALL_RADIOS
+	    && route != i)
+	    continue;
+	RH_LoRaFileOps* radio = _radios[i].radio;
+	radio->setHeaderTo(_txHeaderTo);
+	radio->setHeaderFrom(_txHeaderFrom);
+	radio->setHeaderId(_txHeaderId);
+	radio->setHeaderFlags(_txHeaderFlags, 0xff);
+	// Returns when the packet has been transmitted
+	if (radio->send(data, len))
+	{
+	    _radios[i].stats.sent++;
+	    sent = true;
+	}
+    }
+    if (sent)
+	_txGood++;
+    return sent;
+}
+
+uint8_t RHLoRaFileOpsGateway::maxMessageLength()
+{
+    return RH_LORAFILEOPS_MAX_MESSAGE_LEN;
+}
+
+uint8_t RHLoRaFileOpsGateway::lastRadio() const
+{
+    return _lastRadio;
+}
+
+int RHLoRaFileOpsGateway::lastSNR()
+{
+    return _lastSNR;
+}
+
+const RHLoRaFileOpsGateway::RadioStats& RHLoRaFileOpsGateway::radioStats(uint8_t radio) const
+{
+    return _radios[radio < _numRadios ? radio : 0].stats;
+}
+
+void RHLoRaFileOpsGateway::setRoute(uint8_t address, uint8_t radio)
+{
+    _route[address] = radio;
+}
+
+#endif
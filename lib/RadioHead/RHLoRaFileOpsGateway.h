@@ -0,0 +1,214 @@
+// RHLoRaFileOpsGateway.h
+//
+// Drives several LoRa-file-ops radios from one event loop, as one RadioHead driver
+#ifndef RHLoRaFileOpsGateway_h
+#define RHLoRaFileOpsGateway_h
+
+#include <RH_LoRaFileOps.h>
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) || defined(DOXYGEN)
+
+#include <pthread.h>
+
+// Maximum number of radios one gateway can drive
+#define RH_LORAFILEOPS_GATEWAY_MAX_RADIOS 8
+
+// Number of received packets that can wait in each radio's queue. Must be a power of 2
+#define RH_LORAFILEOPS_GATEWAY_QUEUE_LEN 32
+
+// How often the radios are polled, in milliseconds. The LoRa-file-ops driver does not
+// detect interrupts, so nothing wakes a sleeping poll() or epoll_wait() when a packet arrives
+#define RH_LORAFILEOPS_GATEWAY_POLL_INTERVAL 5
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHLoRaFileOpsGateway RHLoRaFileOpsGateway.h <RHLoRaFileOpsGateway.h>
+/// \brief Driver that sends and receives through several RH_LoRaFileOps radios at once,
+/// so that one RadioHead manager can route between them
+///
+/// \par Overview
+///
+/// A process using RH_LoRaFileOps directly can only drive one /dev/loraX device,
+/// and pays for a select(), a read() and 2 ioctls for every packet.
+/// RHLoRaFileOpsGateway drives up to RH_LORAFILEOPS_GATEWAY_MAX_RADIOS devices from one loop:
+/// - Each pass tests all the radios for received packets with a single poll() call.
+/// - Each ready radio is read straight into a slot of its own receive queue, a lock-free
+///   ring of RH_LORAFILEOPS_GATEWAY_QUEUE_LEN packets with one writer (the loop) and one reader (recv()).
+///   If the queue is full the packet is dropped and counted in radioStats().
+/// - The RSSI and SNR ioctls are only made if enabled with RH_LoRaFileOps::setReadMetadata()
+///   on that radio, so a gateway that does not need them makes 2 system calls per pass plus one per packet.
+///
+/// The loop can be run either by the caller, through available(), waitAvailableTimeout() or service(),
+/// or on a thread of its own with start(), so that packets keep being collected
+/// while the caller is busy, eg sending.
+///
+/// To its user, the gateway is a single RHGenericDriver. Packets from all the radios are returned
+/// by recv() in turn, with lastRadio() saying which radio each came from, so RHDatagram, RHReliableDatagram,
+/// RHRouter or RHMesh can be used on top of it as the common routing core for all the radios.
+/// send() transmits on the radio that the destination address was last heard on, or on all the
+/// radios for broadcasts and for destinations that have not been heard yet.
+///
+/// \par Usage
+///
+/// \code
+/// #include <RHLoRaFileOpsGateway.h>
+/// #include <RHMesh.h>
+/// RH_LoRaFileOps lora0("/dev/loraSPI0.0");
+/// RH_LoRaFileOps lora1("/dev/loraSPI0.1");
+/// RHLoRaFileOpsGateway gateway;
+/// RHMesh mesh(gateway, 1);
+/// ...
+///   gateway.addRadio(&lora0);
+///   gateway.addRadio(&lora1);
+///   if (!mesh.init())        // Initialises the radios too
+///     Serial.println("init failed");
+///   lora1.setFrequency(915000000);
+///   gateway.start();         // Optional
+/// \endcode
+/// See examples/lorafileops/lorafileops_gateway.
+///
+/// The radios must not be used directly once they have been added to a gateway,
+/// except to change their settings.
+class RHLoRaFileOpsGateway : public RHGenericDriver
+{
+public:
+    /// \brief Counters for one radio
+    typedef struct
+    {
+	uint32_t received;   ///< Packets read from the radio
+	uint32_t overflows;  ///< Packets dropped because the radio's queue was full
+	uint32_t readErrors; ///< Reads that failed or returned a runt packet
+	uint32_t sent;       ///< Packets transmitted on the radio
+    } RadioStats;
+
+    /// Constructor
+    RHLoRaFileOpsGateway();
+
+    /// Destructor. Stops the thread, if running.
+    virtual ~RHLoRaFileOpsGateway();
+
+    /// Adds a radio to the gateway. Call before init().
+    /// \param[in] radio The radio. It must stay in existence as long as the gateway does.
+    /// \return true if it was added, false if there are already RH_LORAFILEOPS_GATEWAY_MAX_RADIOS
+    bool            addRadio(RH_LoRaFileOps* radio);
+
+    /// Returns the number of radios added with addRadio()
+    uint8_t         numRadios() const;
+
+    /// Initialises all the radios, and the event loop.
+    /// \return true if the radios and the loop were all initialised.
+    virtual bool    init();
+
+    /// Starts a thread which runs service() until stop() is called, so that
+    /// packets are collected from the radios in the background. Optional.
+    /// \return true if the thread was started
+    bool            start();
+
+    /// Stops the thread started by start(), and waits for it to finish.
+    void            stop();
+
+    /// Runs one pass of the event loop: waits up to timeout ms for a radio to have a packet,
+    /// then reads every packet that is ready on any radio into its queue.
+    /// Called by available() and waitAvailableTimeout() when there is no thread.
+    /// Do not call it while the thread is running.
+    /// \param[in] timeout Maximum time to wait in milliseconds. 0 only checks.
+    /// \return The number of packets read
+    int             service(uint16_t timeout);
+
+    /// Tests whether a packet for this node has been received on any radio.
+    /// \return true if a new, complete, error-free uncollected message is available to be retreived by recv()
+    virtual bool    available();
+
+    /// Wait until a new message is available from any radio.
+    /// \param[in] polldelay Not used
+    virtual void    waitAvailable(uint16_t polldelay = 0);
+
+    /// Wait until a new message is available from any radio or the timeout expires.
+    /// \param[in] timeout The maximum time to wait in milliseconds
+    /// \param[in] polldelay Not used
+    /// \return true if a message is available as reported by available()
+    virtual bool    waitAvailableTimeout(uint16_t timeout, uint16_t polldelay = 0);
+
+    /// If there is a valid message available for this node from any radio, copy it to buf and return true
+    /// else return false. The radios take turns. Sets the received headers, lastRssi(), lastSNR() and lastRadio().
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Pointer to available space in buf. Set to the actual number of octets copied.
+    /// \return true if a valid message was copied to buf
+    virtual bool    recv(uint8_t* buf, uint8_t* len);
+
+    /// Transmits a message on the radio the destination was last heard on, or on all of them
+    /// for broadcasts and unknown destinations. Returns when the packet has been transmitted.
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send
+    /// \return true if it was transmitted on at least one radio
+    virtual bool    send(const uint8_t* data, uint8_t len);
+
+    /// Returns the maximum message length available in this Driver.
+    /// \return The maximum legal message length
+    virtual uint8_t maxMessageLength();
+
+    /// Returns the index (in the order added) of the radio the last message returned by recv() came from
+    uint8_t         lastRadio() const;
+
+    /// Returns the SNR of the last message returned by recv(), if the radio reads metadata
+    /// \return SNR of the last received message in dB
+    virtual int     lastSNR();
+
+    /// Returns the counters for one radio
+    /// \param[in] radio Index of the radio, in the order added
+    const RadioStats& radioStats(uint8_t radio) const;
+
+    /// Sets the radio to send to a destination address on, as if the destination had been heard on it
+    /// \param[in] address The destination address
+    /// \param[in] radio Index of the radio, or 0xff to send on all radios
+    void            setRoute(uint8_t address, uint8_t radio);
+
+private:
+    /// Single producer, single consumer ring of received packets for one radio
+    typedef struct
+    {
+	RHLoRaFileOpsPacket packet[RH_LORAFILEOPS_GATEWAY_QUEUE_LEN];
+	uint32_t            head  __attribute__((aligned(64))); // Written by the loop
+	uint32_t            tail  __attribute__((aligned(64))); // Written by recv()
+    } Queue;
+
+    typedef struct
+    {
+	RH_LoRaFileOps*     radio;
+	Queue               queue;
+	RadioStats          stats;
+    } Radio;
+
+    /// Thread entry point
+    static void*    run(void* arg);
+
+    /// Reads every ready packet on every radio into the queues
+    int             drain();
+
+    /// Finds the next queued packet for this node, discarding ones that are not,
+    /// starting with the radio after the last one returned
+    /// \return The radio index, or -1 if nothing is queued
+    int             nextQueued();
+
+    Radio           _radios[RH_LORAFILEOPS_GATEWAY_MAX_RADIOS];
+    uint8_t         _numRadios;
+
+    /// Radio the last message came from, and where to start looking for the next one
+    uint8_t         _lastRadio;
+    uint8_t         _nextRadio;
+    int8_t          _lastSNR;
+
+    /// Radio each address was last heard on, 0xff if not heard
+    uint8_t         _route[256];
+
+    /// Waits for the radios, in case the LoRa-file-ops driver ever wakes pollers
+    int             _epollFd;
+
+    /// Written by the thread when it queues packets, so the caller can sleep until then
+    int             _eventFd;
+
+    pthread_t       _thread;
+    volatile bool   _running;
+};
+
+#endif
+#endif
@@ -13,13 +13,31 @@
 
 #include <RHMesh.h>
 
-uint8_t RHMesh::_tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
 
 ////////////////////////////////////////////////////////////////////
 // Constructors
 RHMesh::RHMesh(RHGenericDriver& driver, uint8_t thisAddress) 
     : RHRouter(driver, thisAddress)
 {
+    _arpTimeout = RH_MESH_ARP_TIMEOUT;
+    _numPending = 0;
+    _discoveryFailures = 0;
+    memset(_discoveries, 0, sizeof(_discoveries));
+    memset(_pending, 0, sizeof(_pending));
+#if RH_MESH_REBROADCAST_QUEUE_SIZE > 0
+    for (uint8_t i = 0; i < RH_MESH_REBROADCAST_QUEUE_SIZE; i++)
+	_deferred[i].used = false;
+#endif
+    _numDeferred = 0;
+    _rebroadcastSlots = RH_MESH_REBROADCAST_SLOTS;
+    _rebroadcastThreshold = RH_MESH_REBROADCAST_THRESHOLD;
+    _rebroadcastProbability = 100;
+    _rebroadcasts = 0;
+    _rebroadcastsSuppressed = 0;
+    _answeredSource = RH_BROADCAST_ADDRESS;
+    _answeredId = 0;
+    _answeredCost = 0;
+    _routeReevaluations = 0;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -33,53 +51,470 @@ uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t f
     if (len > RH_MESH_MAX_MESSAGE_LEN)
 	return RH_ROUTER_ERROR_INVALID_LENGTH;
 
-    if (address != RH_BROADCAST_ADDRESS)
+    // Route discovery takes buffers from the pool too, so do it before taking one for the message
+    if (   address != RH_BROADCAST_ADDRESS
+	&& !checkRouteTo(address) && !doArp(address))
+	return RH_ROUTER_ERROR_NO_ROUTE;
+
+    PooledPacket pooled(*this);
+    RHPacketBuffer* packet = pooled.packet();
+    if (!packet)
+	return RH_ROUTER_ERROR_NO_BUFFER;
+    packet->append(buf, len);
+    return sendApplicationMessage(*packet, address, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::sendtoWait(RHPacketBuffer& packet, uint8_t address, uint8_t flags)
+{
+    if (packet.len() > RH_MESH_MAX_MESSAGE_LEN)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
+    if (   address != RH_BROADCAST_ADDRESS
+	&& !checkRouteTo(address) && !doArp(address))
+	return RH_ROUTER_ERROR_NO_ROUTE;
+
+    return sendApplicationMessage(packet, address, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+// Have a route. Contruct an application layer message in place and send it via that route
+uint8_t RHMesh::sendApplicationMessage(RHPacketBuffer& packet, uint8_t address, uint8_t flags)
+{
+    MeshApplicationMessage* a = (MeshApplicationMessage*)packet.push(sizeof(MeshMessageHeader));
+    if (!a)
+	return RH_ROUTER_ERROR_INVALID_LENGTH; // No headroom
+    a->header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
+    uint8_t ret = RHRouter::sendtoWait(packet, address, flags);
+    packet.pull(sizeof(MeshMessageHeader));
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+// Parks the message if there is no route yet, and lets recvfromAck() send it later
+uint8_t RHMesh::sendtoQueued(uint8_t* buf, uint8_t len, uint8_t address, uint8_t flags)
+{
+    if (len > RH_MESH_MAX_MESSAGE_LEN)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
+    if (address == RH_BROADCAST_ADDRESS || checkRouteTo(address))
+	return sendtoWait(buf, len, address, flags);
+
     {
-	RoutingTableEntry* route = getRouteTo(address);
-	if (!route && !doArp(address))
-	    return RH_ROUTER_ERROR_NO_ROUTE;
+	RH_MUTEX_GUARD(_lock);
+	uint8_t i;
+	for (i = 0; i < RH_MESH_PENDING_QUEUE_SIZE; i++)
+	    if (!_pending[i].used)
+		break;
+	if (i >= RH_MESH_PENDING_QUEUE_SIZE)
+	    return RH_ROUTER_ERROR_QUEUE_FULL;
+
+	_pending[i].dest = address;
+	_pending[i].flags = flags;
+	_pending[i].len = len;
+	_pending[i].used = true;
+	memcpy(_pending[i].data, buf, len);
+	_numPending++;
     }
 
-    // Now have a route. Contruct an application layer message and send it via that route
-    MeshApplicationMessage* a = (MeshApplicationMessage*)&_tmpMessage;
-    a->header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
-    memcpy(a->data, buf, len);
-    return RHRouter::sendtoWait(_tmpMessage, sizeof(RHMesh::MeshMessageHeader) + len, address, flags);
+    // Starts the discovery, unless one is already under way or there is no room for it yet
+    processPendingMessages();
+    return RH_ROUTER_ERROR_QUEUED;
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::doArp(uint8_t address)
+void RHMesh::setArpTimeout(uint16_t timeout)
+{
+    _arpTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::pendingMessages()
+{
+    return _numPending;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHMesh::discoveryFailures()
+{
+    return _discoveryFailures;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRebroadcastSlots(uint8_t slots)
+{
+    _rebroadcastSlots = slots;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRebroadcastThreshold(uint8_t threshold)
+{
+    _rebroadcastThreshold = threshold;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRebroadcastProbability(uint8_t percent)
+{
+    _rebroadcastProbability = percent;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHMesh::rebroadcasts()
+{
+    return _rebroadcasts;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHMesh::rebroadcastsSuppressed()
+{
+    return _rebroadcastsSuppressed;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHMesh::routeReevaluations()
+{
+    return _routeReevaluations;
+}
+
+////////////////////////////////////////////////////////////////////
+RHRouter::RoutingTableEntry* RHMesh::checkRouteTo(uint8_t address)
+{
+    RH_MUTEX_GUARD(_lock);
+    RoutingTableEntry* route = getRouteTo(address);
+    if (   route
+	&& linkCost(route->next_hop) >= 2 * route->linkCost + RH_LINK_COST_SCALE)
+    {
+	// The first hop has got much worse since the route was found, so there may 
+	// well be a better one now
+	deleteRouteTo(address);
+	_routeReevaluations++;
+	return NULL;
+    }
+    return route;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::pathCost(uint8_t cost, uint8_t from)
+{
+    uint16_t total = cost + linkCost(from);
+    return total > RH_LINK_COST_MAX ? RH_LINK_COST_MAX : total;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::updateRouteTo(uint8_t dest, uint8_t next_hop, uint8_t cost)
+{
+    RH_MUTEX_GUARD(_lock);
+    RoutingTableEntry* route = getRouteTo(dest);
+    if (route && route->next_hop != next_hop && route->cost && route->cost <= cost)
+	return; // Already have one at least as good
+    addRouteTo(dest, next_hop, Valid, cost);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::sendRouteDiscovery(uint8_t address)
 {
-    // Need to discover a route
     // Broadcast a route discovery message with nothing in it
-    MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)&_tmpMessage;
+    PooledPacket pooled(*this);
+    RHPacketBuffer* packet = pooled.packet();
+    if (!packet)
+	return false;
+    MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)packet->put(RH_MESH_ROUTE_DISCOVERY_HEADER_LEN);
     p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST;
     p->destlen = 1; 
     p->dest = address; // Who we are looking for
-    uint8_t error = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 2, RH_BROADCAST_ADDRESS);
-    if (error !=  RH_ROUTER_ERROR_NONE)
+    p->cost = 0;
+    return RHRouter::sendtoWait(*packet, RH_BROADCAST_ADDRESS) == RH_ROUTER_ERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::processPendingMessages()
+{
+    if (!_numPending)
+	return;
+
+    uint8_t i, j;
+    // Release messages whose route is now known, and still good. Send them directly rather than via
+    // sendtoWait(), which would start a blocking route discovery from here if checkRouteTo() dropped the route.
+    // Only waits for the next hop. The queue is locked while a message is taken off it, not while it is sent
+    for (i = 0; i < RH_MESH_PENDING_QUEUE_SIZE; i++)
+    {
+	PooledPacket pooled(*this);
+	RHPacketBuffer* packet = pooled.packet();
+	if (!packet)
+	    break; // Try again next time
+	uint8_t dest, flags;
+	{
+	    RH_MUTEX_GUARD(_lock);
+	    if (!_pending[i].used || !checkRouteTo(_pending[i].dest))
+		continue;
+	    _pending[i].used = false;
+	    _numPending--;
+	    packet->append(_pending[i].data, _pending[i].len);
+	    dest = _pending[i].dest;
+	    flags = _pending[i].flags;
+	}
+	sendApplicationMessage(*packet, dest, flags);
+    }
+
+    // Retire discoveries that have finished or timed out, and drop the messages that were waiting on a 
+    // timed out one
+    {
+	RH_MUTEX_GUARD(_lock);
+	for (j = 0; j < RH_MESH_MAX_DISCOVERIES; j++)
+	{
+	    if (!_discoveries[j].active)
+		continue;
+	    bool waiting = false;
+	    for (i = 0; i < RH_MESH_PENDING_QUEUE_SIZE; i++)
+		if (_pending[i].used && _pending[i].dest == _discoveries[j].dest)
+		    waiting = true;
+	    if (!waiting)
+	    {
+		_discoveries[j].active = false;
+	    }
+	    else if ((millis() - _discoveries[j].started) >= _arpTimeout)
+	    {
+		_discoveries[j].active = false;
+		for (i = 0; i < RH_MESH_PENDING_QUEUE_SIZE; i++)
+		{
+		    if (_pending[i].used && _pending[i].dest == _discoveries[j].dest)
+		    {
+			_pending[i].used = false;
+			_numPending--;
+			_discoveryFailures++;
+		    }
+		}
+	    }
+	}
+    }
+
+    // Start discoveries for waiting messages that do not have one, while there is room
+    for (i = 0; i < RH_MESH_PENDING_QUEUE_SIZE; i++)
+    {
+	uint8_t dest;
+	{
+	    RH_MUTEX_GUARD(_lock);
+	    if (!_pending[i].used)
+		continue;
+	    uint8_t free = RH_MESH_MAX_DISCOVERIES;
+	    for (j = 0; j < RH_MESH_MAX_DISCOVERIES; j++)
+	    {
+		if (_discoveries[j].active && _discoveries[j].dest == _pending[i].dest)
+		    break;
+		if (!_discoveries[j].active && free == RH_MESH_MAX_DISCOVERIES)
+		    free = j;
+	    }
+	    if (j < RH_MESH_MAX_DISCOVERIES || free == RH_MESH_MAX_DISCOVERIES)
+		continue; // Already under way, or no room yet
+	    dest = _pending[i].dest;
+	    _discoveries[free].dest = dest;
+	    _discoveries[free].active = true;
+	    _discoveries[free].started = millis();
+	}
+	// If the broadcast fails, the discovery times out like an unanswered one
+	sendRouteDiscovery(dest);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::rebroadcast(RHPacketBuffer& packet, uint8_t source, uint8_t id, uint8_t flags, uint8_t hops)
+{
+    if (_rebroadcastProbability < 100)
+    {
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+	uint8_t r = random() % 100;
+#else
+	uint8_t r = random(0, 100);
+#endif
+	if (r >= _rebroadcastProbability)
+	{
+	    _rebroadcastsSuppressed++;
+	    return;
+	}
+    }
+
+#if RH_MESH_REBROADCAST_QUEUE_SIZE > 0
+    // Hold it back for a random time, to see whether enough neighbours rebroadcast it first
+    if (_rebroadcastSlots && _rebroadcastThreshold)
+    {
+	for (uint8_t i = 0; i < RH_MESH_REBROADCAST_QUEUE_SIZE; i++)
+	{
+	    if (_deferred[i].used)
+		continue;
+	    uint32_t slotTime = _driver.lastAirtime() / 1000;
+	    if (slotTime)
+		slotTime++; // Turnaround
+	    else
+		slotTime = RH_MESH_REBROADCAST_SLOT_TIME;
+#if (RH_PLATFORM == RH_PLATFORM_RASPI)
+	    uint8_t slot = random() % _rebroadcastSlots;
+#else
+	    uint8_t slot = random(0, _rebroadcastSlots);
+#endif
+	    // Even slot 0 waits a moment, for the neighbours to get back to receiving
+	    uint32_t delay = 1 + slot * slotTime;
+	    _deferred[i].packet = packet;
+	    _deferred[i].source = source;
+	    _deferred[i].id = id;
+	    _deferred[i].flags = flags;
+	    _deferred[i].hops = hops;
+	    _deferred[i].cost = ((MeshRouteDiscoveryMessage*)packet.data())->cost;
+	    _deferred[i].duplicates = 1; // Counting this one
+	    _deferred[i].due = millis() + delay;
+	    _deferred[i].used = true;
+	    _numDeferred++;
+	    return;
+	}
+    }
+    // No room, rebroadcast now
+#endif
+    _rebroadcasts++;
+    // Keep the originators SOURCE and ID, so nodes that have already seen the request drop it
+    // REVISIT: if this fails what can we do?
+    sendRoutedMessage(packet, RH_BROADCAST_ADDRESS, source, id, flags, hops + 1);
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHMesh::processDeferredRebroadcasts()
+{
+    uint32_t next = 0;
+#if RH_MESH_REBROADCAST_QUEUE_SIZE > 0
+    if (!_numDeferred)
+	return 0;
+
+    // The queue is only used while received messages are handled, under the same lock
+    RH_MUTEX_GUARD(_radioLock);
+
+    for (uint8_t i = 0; i < RH_MESH_REBROADCAST_QUEUE_SIZE; i++)
+    {
+	if (!_deferred[i].used)
+	    continue;
+	long timeLeft = (long)(_deferred[i].due - millis());
+	if (timeLeft <= 0)
+	{
+	    _deferred[i].used = false;
+	    _numDeferred--;
+	    _rebroadcasts++;
+	    sendRoutedMessage(_deferred[i].packet, RH_BROADCAST_ADDRESS, _deferred[i].source, 
+			      _deferred[i].id, _deferred[i].flags, _deferred[i].hops + 1);
+	}
+	else if (!next || (uint32_t)timeLeft < next)
+	    next = timeLeft;
+    }
+#endif
+    return next;
+}
+
+////////////////////////////////////////////////////////////////////
+// Called by RHRouter::recvfromAck for each copy of a broadcast we have already seen.
+// Later copies of a route discovery request may have come by a cheaper path than the first
+void RHMesh::duplicateBroadcast(RoutedMessage* message, uint8_t messageLen)
+{
+    MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)message->data;
+    uint8_t len = messageLen - sizeof(RoutedMessageHeader);
+    if (   messageLen < sizeof(RoutedMessageHeader) + RH_MESH_ROUTE_DISCOVERY_HEADER_LEN
+	|| d->header.msgType != RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST
+	|| message->header.source == _thisAddress)
+	return;
+
+    uint8_t numRoutes = len - RH_MESH_ROUTE_DISCOVERY_HEADER_LEN;
+    uint8_t i;
+    for (i = 0; i < numRoutes; i++)
+	if (d->route[i] == _thisAddress)
+	    return; // A neighbour rebroadcasting our own rebroadcast
+
+    uint8_t source = message->header.source;
+    uint8_t id = message->header.id;
+    uint8_t cost = pathCost(d->cost, headerFrom());
+    updateRouteTo(source, headerFrom(), cost);
+
+    if (   isPhysicalAddress(&d->dest, d->destlen)
+	&& source == _answeredSource && id == _answeredId && cost < _answeredCost)
+    {
+	// We are the destination and have already answered, but this path is cheaper.
+	// Answer again: the originator replaces its route with the cheaper one
+	_answeredCost = cost;
+	PooledPacket pooled(*this);
+	RHPacketBuffer* packet = pooled.packet();
+	if (!packet)
+	    return;
+	packet->append(message->data, len);
+	MeshRouteDiscoveryMessage* r = (MeshRouteDiscoveryMessage*)packet->data();
+	r->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE;
+	r->cost = cost;
+	RHRouter::sendtoWait(*packet, source);
+	return;
+    }
+
+#if RH_MESH_REBROADCAST_QUEUE_SIZE > 0
+    for (i = 0; i < RH_MESH_REBROADCAST_QUEUE_SIZE; i++)
+    {
+	if (   !_deferred[i].used
+	    || _deferred[i].source != source
+	    || _deferred[i].id != id)
+	    continue;
+
+	// Only a copy about as cheap as ours (within one transmission, since ETX is noisy) covers for it
+	bool covered = d->cost <= _deferred[i].cost + RH_LINK_COST_SCALE;
+	if (cost < _deferred[i].cost && len < RH_MESH_MAX_MESSAGE_LEN)
+	{
+	    // Rebroadcast this cheaper path instead, after adding ourselves to it
+	    RHPacketBuffer& packet = _deferred[i].packet;
+	    packet.reset();
+	    packet.append(message->data, len);
+	    *packet.put(1) = _thisAddress;
+	    ((MeshRouteDiscoveryMessage*)packet.data())->cost = cost;
+	    _deferred[i].cost = cost;
+	    _deferred[i].hops = message->header.hops;
+	}
+	if (covered && ++_deferred[i].duplicates >= _rebroadcastThreshold)
+	{
+	    // Enough neighbours have covered it
+	    _deferred[i].used = false;
+	    _numDeferred--;
+	    _rebroadcastsSuppressed++;
+	}
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::doArp(uint8_t address)
+{
+    // Need to discover a route
+    if (!sendRouteDiscovery(address))
 	return false;
     
+    PooledPacket pooled(*this);
+    RHPacketBuffer* packet = pooled.packet();
+    if (!packet)
+	return false;
+
     // Wait for a reply, which will be unicast back to us
     // It will contain the complete route to the destination
-    uint8_t messageLen = sizeof(_tmpMessage);
-    // FIXME: timeout should be configurable
     unsigned long starttime = millis();
     int32_t timeLeft;
-    while ((timeLeft = RH_MESH_ARP_TIMEOUT - (millis() - starttime)) > 0)
+    while ((timeLeft = _arpTimeout - (millis() - starttime)) > 0)
     {
+	// Another thread or task may have received the reply
+	if (hasRouteTo(address))
+	    return true;
+	uint32_t rebroadcastDue = processDeferredRebroadcasts();
+	if (rebroadcastDue && timeLeft > (int32_t)rebroadcastDue)
+	    timeLeft = rebroadcastDue;
+	if (timeLeft > RH_MESH_ARP_POLL)
+	    timeLeft = RH_MESH_ARP_POLL;
 	if (waitAvailableTimeout(timeLeft))
 	{
-	    if (RHRouter::recvfromAck(_tmpMessage, &messageLen))
+	    if (RHRouter::recvfromAck(*packet))
 	    {
-		if (   messageLen > 1
-		       && p->header.msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
-		{
-		    // Got a reply, now add the next hop to the dest to the routing table
-		    // The first hop taken is the first octet
-		    addRouteTo(address, headerFrom());
+		MeshMessageHeader* p = (MeshMessageHeader*)packet->data();
+		// Got a reply. peekAtMessage() has added the route to the dest, with the cost of the path.
+		// Later replies over cheaper paths replace it when they arrive
+		if (   packet->len() > 1
+		    && p->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
+		    && getRouteTo(address))
 		    return true;
-		}
 	    }
 	}
 	YIELD;
@@ -92,15 +527,18 @@ bool RHMesh::doArp(uint8_t address)
 void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 {
     MeshMessageHeader* m = (MeshMessageHeader*)message->data;
-    if (   messageLen > 1 
+    if (   messageLen >= sizeof(RoutedMessageHeader) + RH_MESH_ROUTE_DISCOVERY_HEADER_LEN
 	&& m->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
     {
 	// This is a unicast RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE messages 
 	// being routed back to the originator here. Want to scrape some routing data out of the response
 	// We can find the routes to all the nodes between here and the responding node
 	MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)message->data;
-	addRouteTo(d->dest, headerFrom());
-	uint8_t numRoutes = messageLen - sizeof(RoutedMessageHeader) - sizeof(MeshMessageHeader) - 2;
+	if (message->header.dest == _thisAddress)
+	    updateRouteTo(d->dest, headerFrom(), d->cost); // Keep the cheapest of several replies
+	else
+	    addRouteTo(d->dest, headerFrom());
+	uint8_t numRoutes = messageLen - sizeof(RoutedMessageHeader) - RH_MESH_ROUTE_DISCOVERY_HEADER_LEN;
 	uint8_t i;
 	// Find us in the list of nodes that were traversed to get to the responding node
 	for (i = 0; i < numRoutes; i++)
@@ -132,12 +570,13 @@ uint8_t RHMesh::route(RoutedMessage* message, uint8_t messageLen)
 	if (message->header.source != _thisAddress)
 	{
 	    // This is being proxied, so tell the originator about it
-	    MeshRouteFailureMessage* p = (MeshRouteFailureMessage*)&_tmpMessage;
-	    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
-	    p->dest = message->header.dest; // Who you were trying to deliver to
+	    // message may be either of our buffers, so build this one on the stack
+	    MeshRouteFailureMessage failure;
+	    failure.header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
+	    failure.dest = message->header.dest; // Who you were trying to deliver to
 	    // Make sure there is a route back towards whoever sent the original message
 	    addRouteTo(message->header.source, from);
-	    ret = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 1, message->header.source);
+	    ret = RHRouter::sendtoWait((uint8_t*)&failure, sizeof(RHMesh::MeshMessageHeader) + 1, message->header.source);
 	}
     }
     return ret;
@@ -154,35 +593,48 @@ bool RHMesh::isPhysicalAddress(uint8_t* address, uint8_t addresslen)
 ////////////////////////////////////////////////////////////////////
 bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
 {     
-    uint8_t tmpMessageLen = sizeof(_tmpMessage);
+    PooledPacket pooled(*this);
+    RHPacketBuffer* packet = pooled.packet();
+    if (!packet || !recvfromAck(*packet, source, dest, id, flags, hops))
+	return false;
+    if (*len > packet->len())
+	*len = packet->len();
+    memcpy(buf, packet->data(), *len);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Mesh control messages are answered or rebroadcast from the buffer they were received into
+bool RHMesh::recvfromAck(RHPacketBuffer& packet, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
+{     
     uint8_t _source;
     uint8_t _dest;
     uint8_t _id;
     uint8_t _flags;
     uint8_t _hops;
-    if (RHRouter::recvfromAck(_tmpMessage, &tmpMessageLen, &_source, &_dest, &_id, &_flags, &_hops))
+    processPendingMessages();
+    processDeferredRebroadcasts();
+    // Until the message has been handled, as in RHRouter::recvfromAck()
+    RH_MUTEX_GUARD(_radioLock);
+    if (RHRouter::recvfromAck(packet, &_source, &_dest, &_id, &_flags, &_hops))
     {
-	MeshMessageHeader* p = (MeshMessageHeader*)&_tmpMessage;
+	MeshMessageHeader* p = (MeshMessageHeader*)packet.data();
+	uint8_t tmpMessageLen = packet.len();
 
 	if (   tmpMessageLen >= 1 
 	    && p->msgType == RH_MESH_MESSAGE_TYPE_APPLICATION)
 	{
-	    MeshApplicationMessage* a = (MeshApplicationMessage*)p;
 	    // Handle application layer messages, presumably for our caller
 	    if (source) *source = _source;
 	    if (dest)   *dest   = _dest;
 	    if (id)     *id     = _id;
 	    if (flags)  *flags  = _flags;
 	    if (hops)   *hops   = _hops;
-	    uint8_t msgLen = tmpMessageLen - sizeof(MeshMessageHeader);
-	    if (*len > msgLen)
-		*len = msgLen;
-	    memcpy(buf, a->data, *len);
-	    
+	    packet.pull(sizeof(MeshMessageHeader));
 	    return true;
 	}
 	else if (   _dest == RH_BROADCAST_ADDRESS 
-		 && tmpMessageLen > 1 
+		 && tmpMessageLen >= RH_MESH_ROUTE_DISCOVERY_HEADER_LEN
 		 && p->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST)
 	{
 	    MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)p;
@@ -192,15 +644,16 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 	    if (_source == _thisAddress)
 		return false;
 	    
-	    uint8_t numRoutes = tmpMessageLen - sizeof(MeshMessageHeader) - 2;
+	    uint8_t numRoutes = tmpMessageLen - RH_MESH_ROUTE_DISCOVERY_HEADER_LEN;
 	    uint8_t i;
 	    // Are we already mentioned?
 	    for (i = 0; i < numRoutes; i++)
 		if (d->route[i] == _thisAddress)
 		    return false; // Already been through us. Discard
 	    
-	        
-            addRouteTo(_source, headerFrom()); // The originator needs to be added regardless of node type
+	    // Cost of the path from the originator to here
+	    uint8_t cost = pathCost(d->cost, headerFrom());
+            updateRouteTo(_source, headerFrom(), cost); // The originator needs to be added regardless of node type
 
 	    // Hasnt been past us yet, record routes back to the earlier nodes
             // No need to waste memory if we are not participating in routing
@@ -216,18 +669,32 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 		// as a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
 		// We are certain to have a route there, because we just got it
 		d->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE;
-		RHRouter::sendtoWait((uint8_t*)d, tmpMessageLen, _source);
+		d->cost = cost;
+		// Remember it, to answer again if a copy comes by a cheaper path
+		_answeredSource = _source;
+		_answeredId = _id;
+		_answeredCost = cost;
+		RHRouter::sendtoWait(packet, _source);
 	    }
 	    else if ((i < _max_hops) && _isa_router)
 	    {
 		// Its for someone else, rebroadcast it, after adding ourselves to the list
-		d->route[numRoutes] = _thisAddress;
-		tmpMessageLen++;
-		// Have to impersonate the source
-		// REVISIT: if this fails what can we do?
-		RHRouter::sendtoFromSourceWait(_tmpMessage, tmpMessageLen, RH_BROADCAST_ADDRESS, _source);
+		uint8_t* us = packet.put(1);
+		if (us)
+		{
+		    *us = _thisAddress;
+		    d->cost = cost;
+		    rebroadcast(packet, _source, _id, _flags, _hops);
+		}
 	    }
 	}
+	else if (   _dest == _thisAddress
+		 && tmpMessageLen > 1
+		 && p->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
+	{
+	    // peekAtMessage() has added the route, so messages waiting for it can go now
+	    processPendingMessages();
+	}
     }
     return false;
 }
@@ -239,6 +706,13 @@ bool RHMesh::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, ui
     int32_t timeLeft;
     while ((timeLeft = timeout - (millis() - starttime)) > 0)
     {
+	// Wake up in time to expire route discoveries even if nothing is received
+	processPendingMessages();
+	if (_numPending && timeLeft > _arpTimeout)
+	    timeLeft = _arpTimeout;
+	uint32_t rebroadcastDue = processDeferredRebroadcasts();
+	if (rebroadcastDue && timeLeft > (int32_t)rebroadcastDue)
+	    timeLeft = rebroadcastDue;
 	if (waitAvailableTimeout(timeLeft))
 	{
 	    if (recvfromAck(buf, len, from, to, id, flags, hops))
@@ -249,5 +723,28 @@ bool RHMesh::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, ui
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+bool RHMesh::recvfromAckTimeout(RHPacketBuffer& packet, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags, uint8_t* hops)
+{  
+    unsigned long starttime = millis();
+    int32_t timeLeft;
+    while ((timeLeft = timeout - (millis() - starttime)) > 0)
+    {
+	processPendingMessages();
+	if (_numPending && timeLeft > _arpTimeout)
+	    timeLeft = _arpTimeout;
+	uint32_t rebroadcastDue = processDeferredRebroadcasts();
+	if (rebroadcastDue && timeLeft > (int32_t)rebroadcastDue)
+	    timeLeft = rebroadcastDue;
+	if (waitAvailableTimeout(timeLeft))
+	{
+	    if (recvfromAck(packet, from, to, id, flags, hops))
+		return true;
+	    YIELD;
+	}
+    }
+    return false;
+}
+
 
 
@@ -15,9 +15,57 @@
 #define RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE       2
 #define RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE                  3
 
-// Timeout for address resolution in milliecs
+// Default timeout for address resolution in milliecs. See RHMesh::setArpTimeout()
 #define RH_MESH_ARP_TIMEOUT 4000
 
+// How often doArp() looks for the route while it waits for the reply to a route discovery, in millisecs.
+// With several threads or tasks, another one may have received the reply
+#ifndef RH_MESH_ARP_POLL
+ #define RH_MESH_ARP_POLL 100
+#endif
+
+// Max number of route discoveries that can be in progress at once with sendtoQueued(),
+// and max number of messages that can wait for them.
+// Can be overridden on the compiler command line
+#if (RH_PLATFORM == RH_PLATFORM_ESP32) || (RH_PLATFORM == RH_PLATFORM_ESP8266) || (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+ #ifndef RH_MESH_MAX_DISCOVERIES
+  #define RH_MESH_MAX_DISCOVERIES 8
+ #endif
+ #ifndef RH_MESH_PENDING_QUEUE_SIZE
+  #define RH_MESH_PENDING_QUEUE_SIZE 8
+ #endif
+#else
+ #ifndef RH_MESH_MAX_DISCOVERIES
+  #define RH_MESH_MAX_DISCOVERIES 2
+ #endif
+ #ifndef RH_MESH_PENDING_QUEUE_SIZE
+  #define RH_MESH_PENDING_QUEUE_SIZE 1
+ #endif
+#endif
+
+// Max number of route discovery requests that can be held back at once, waiting to see whether 
+// neighbours rebroadcast them first. Each one needs a whole message buffer, so small platforms
+// rebroadcast at once by default. Can be overridden on the compiler command line
+#ifndef RH_MESH_REBROADCAST_QUEUE_SIZE
+ #if (RH_PLATFORM == RH_PLATFORM_ESP32) || (RH_PLATFORM == RH_PLATFORM_ESP8266) || (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+  #define RH_MESH_REBROADCAST_QUEUE_SIZE 4
+ #else
+  #define RH_MESH_REBROADCAST_QUEUE_SIZE 0
+ #endif
+#endif
+
+// Default number of slots in the random delay before rebroadcasting a route discovery request.
+// A slot is the time on air of the last packet sent, so that neighbours that pick 
+// different slots can hear each other
+#define RH_MESH_REBROADCAST_SLOTS 32
+
+// Slot time used if the driver does not know how long its packets take to send, in milliseconds
+#define RH_MESH_REBROADCAST_SLOT_TIME 50
+
+// Default number of copies of a route discovery request that must be heard (including the first one)
+// before our own rebroadcast is due, for it to be cancelled
+#define RH_MESH_REBROADCAST_THRESHOLD 2
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHMesh RHMesh.h <RHMesh.h>
 /// \brief RHRouter subclass for sending addressed, optionally acknowledged datagrams
@@ -48,7 +96,9 @@
 ///
 /// If a node receives a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST that already has itself 
 /// listed in the visited nodes, it knows it has already seen and rebroadcast this request, 
-/// and threfore ignores it. This prevents broadcast storms.
+/// and threfore ignores it. Relaying nodes keep the SOURCE address and ID of the original request,
+/// so RHRouter also drops every copy of a request after the first one to arrive, whichever path 
+/// it came by (see RHRouter, Broadcasts).
 /// When a node receives a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST it can use the list of 
 /// nodes aready visited to deduce routes back towards the originating (requesting node). 
 /// This also means that when the destination node of the request is reached, it (and all 
@@ -65,9 +115,51 @@
 /// RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE together ensure the original requester and all 
 /// the intermediate nodes know how to route to the source and destination nodes and every node along the path.
 ///
-/// Note that there is a race condition here that can effect routing on multipath routes. For example, 
-/// if the route to the destination can traverse several paths, last reply from the destination 
-/// will be the one used.
+/// \par Flood Control
+///
+/// In a dense network, every node in range of a route discovery request would rebroadcast it,
+/// and most of those rebroadcasts reach nobody new. RHMesh holds a request back for a random 
+/// number of slots, up to RH_MESH_REBROADCAST_SLOTS, before rebroadcasting it. A slot is the time on air of
+/// the last packet the driver sent (or RH_MESH_REBROADCAST_SLOT_TIME if the driver does not 
+/// measure it), so that a neighbour that picked an earlier slot can be heard. If it has heard 
+/// RH_MESH_REBROADCAST_THRESHOLD copies of the request by then, counting the first, its neighbours have 
+/// already been covered and it cancels its own rebroadcast (counter based suppression). Up to RH_MESH_REBROADCAST_QUEUE_SIZE 
+/// requests can be held back at once; beyond that they are rebroadcast immediately. Requests can also be 
+/// rebroadcast with a fixed probability (gossip), see setRebroadcastProbability(). 
+/// Held back requests are sent by recvfromAck(), so it must be called often, as usual.
+/// rebroadcasts() and rebroadcastsSuppressed() show how well this is working, and 
+/// RHRouter::broadcastDuplicates() counts the duplicate copies that were dropped.
+///
+/// \par Queued Sending
+///
+/// sendtoWait() blocks while it discovers a route, for up to the ARP timeout (see setArpTimeout()), 
+/// so a single unreachable node can hold up all the traffic a node sends.
+/// sendtoQueued() does not wait for route discovery. If no route is known, the message is parked in a 
+/// queue of up to RH_MESH_PENDING_QUEUE_SIZE messages, a route discovery request is broadcast and 
+/// sendtoQueued() returns RH_ROUTER_ERROR_QUEUED at once. Up to RH_MESH_MAX_DISCOVERIES discoveries 
+/// for different destinations can be in progress at the same time.
+/// Each call to recvfromAck() (and so recvfromAckTimeout()) moves the discoveries along: 
+/// parked messages are sent as soon as a route to their destination is known, and are dropped 
+/// (and counted by discoveryFailures()) if no route is found before the ARP timeout.
+///
+/// \par Route Selection
+///
+/// Route discovery requests carry the cost of the path they have taken so far, the sum of the
+/// RHReliableDatagram::linkCost() of each hop, which is based on the ETX (expected transmission count) 
+/// and signal quality of the link. Each node adds the cost of the link the request arrived on before 
+/// rebroadcasting it. The first copy of a request to arrive is not necessarily the one that came by 
+/// the cheapest path, so later copies are not simply dropped:
+/// - a node holding a request back (see Flood Control) rebroadcasts the cheapest copy it has heard, and
+///   only counts copies that cost no more than one transmission more than its own towards suppression
+/// - the destination answers again each time a copy arrives by a cheaper path than the one it answered
+/// - every node keeps the cheapest route to the originator, and the originator keeps the cheapest 
+///   route to the destination, from the costs carried in the requests and responses
+///
+/// Each route remembers the cost of the link to its next hop when it was found. If that link gets much 
+/// worse (at least twice the cost plus one transmission), sendtoWait() and sendtoQueued() drop the route 
+/// and discover a new one, rather than waiting for the link to fail completely (see routeReevaluations()).
+/// Note that this changed the format of MeshRouteDiscoveryMessage, so all nodes in a mesh must
+/// use the same version of RHMesh.
 ///
 /// \par Route Failure
 ///
@@ -108,8 +200,8 @@
 /// (https://lowpowerlab.com/shop/moteinomega) or others.
 ///
 /// \par Performance
-/// This class (in the interests of simple implemtenation and low memory use) does not have
-/// message queueing. This means that only one message at a time can be handled. Message transmission 
+/// This class (in the interests of simple implemtenation and low memory use) only queues 
+/// messages waiting for route discovery (see sendtoQueued()). Otherwise only one message at a time can be handled. Message transmission 
 /// failures can have a severe impact on network performance.
 /// If you need high performance mesh networking under all conditions consider XBee or similar.
 class RHMesh : public RHRouter
@@ -119,6 +211,9 @@ public:
     /// The maximum length permitted for the application payload data in a RHMesh message
     #define RH_MESH_MAX_MESSAGE_LEN (RH_ROUTER_MAX_MESSAGE_LEN - sizeof(RHMesh::MeshMessageHeader))
 
+    /// Length of a MeshRouteDiscoveryMessage before the list of visited nodes
+    #define RH_MESH_ROUTE_DISCOVERY_HEADER_LEN (sizeof(RHMesh::MeshMessageHeader) + 3)
+
     /// Structure of the basic RHMesh header.
     typedef struct
     {
@@ -138,7 +233,8 @@ public:
 	MeshMessageHeader   header;  ///< msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_*
 	uint8_t             destlen; ///< Reserved. Must be 1
 	uint8_t             dest;    ///< The address of the destination node whose route is being sought
-	uint8_t             route[RH_MESH_MAX_MESSAGE_LEN - 2]; ///< List of node addresses visited so far. Length is implcit
+	uint8_t             cost;    ///< Cost of the path so far, in 1/RH_LINK_COST_SCALE expected transmissions
+	uint8_t             route[RH_MESH_MAX_MESSAGE_LEN - 3]; ///< List of node addresses visited so far. Length is implcit
     } MeshRouteDiscoveryMessage;
 
     /// Signals a route failure
@@ -172,8 +268,74 @@ public:
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
+    ///         - RH_ROUTER_ERROR_NO_BUFFER No buffer was free in the pool, see Buffers and Multithreading in RHRouter
     uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
 
+    /// Same as sendtoWait() above, but sends the message in a RHPacketBuffer. The RHMesh and RHRouter 
+    /// headers are put in the headroom in front of the message, so the message is not copied. 
+    /// The packet is unchanged when this returns.
+    /// \param [in] packet The application message data. Must have at least RH_PACKET_BUFFER_HEADROOM
+    ///              octets of headroom, as a newly constructed or reset() RHPacketBuffer does
+    /// \param [in] dest The destination node address
+    /// \param [in] flags Optional flags for use by subclasses or application layer, 
+    ///             delivered end-to-end to the dest address.
+    /// \return The result code, as for sendtoWait() above
+    uint8_t sendtoWait(RHPacketBuffer& packet, uint8_t dest, uint8_t flags = 0);
+
+    /// Sends a message to the destination node without waiting for route discovery.
+    /// If a route is known, or dest is RH_BROADCAST_ADDRESS, this is the same as sendtoWait(). 
+    /// Otherwise the message is copied to the pending queue, route discovery for dest is started 
+    /// (unless it is already in progress) and the message is sent by a later call to recvfromAck() 
+    /// once the route is known.
+    /// \param [in] buf The application message data
+    /// \param [in] len Number of octets in the application message data. 0 is permitted
+    /// \param [in] dest The destination node address
+    /// \param [in] flags Optional flags for use by subclasses or application layer, 
+    ///             delivered end-to-end to the dest address.
+    /// \return The result code:
+    ///         - any of the sendtoWait() result codes, if a route was already known
+    ///         - RH_ROUTER_ERROR_QUEUED The message is waiting for route discovery
+    ///         - RH_ROUTER_ERROR_QUEUE_FULL There was no room in the pending queue. The message was not sent
+    uint8_t sendtoQueued(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
+
+    /// Sets how long to wait for a route discovery response, in both sendtoWait() and sendtoQueued()
+    /// \param [in] timeout Timeout in milliseconds. Defaults to RH_MESH_ARP_TIMEOUT
+    void setArpTimeout(uint16_t timeout);
+
+    /// \return The number of messages waiting in the pending queue for route discovery
+    uint8_t pendingMessages();
+
+    /// \return The number of queued messages dropped because no route was found in time
+    uint32_t discoveryFailures();
+
+    /// Sets the number of slots in the random delay before rebroadcasting a route discovery request.
+    /// More slots mean fewer collisions and more suppression in dense networks, but slower route 
+    /// discovery across many hops.
+    /// \param [in] slots Number of slots. 0 rebroadcasts at once, with no counter based suppression.
+    /// Defaults to RH_MESH_REBROADCAST_SLOTS
+    void setRebroadcastSlots(uint8_t slots);
+
+    /// Sets how many copies of a route discovery request must be heard, counting the first one,
+    /// before this node cancels its own rebroadcast
+    /// \param [in] threshold Number of copies. 0 never cancels. Defaults to RH_MESH_REBROADCAST_THRESHOLD
+    void setRebroadcastThreshold(uint8_t threshold);
+
+    /// Sets the probability that this node rebroadcasts a route discovery request at all.
+    /// \param [in] percent Probability in percent. Defaults to 100, always. Values around 60 to 80 
+    /// work well in dense networks, but can stop requests from getting through sparse ones
+    void setRebroadcastProbability(uint8_t percent);
+
+    /// \return The number of route discovery requests this node has rebroadcast
+    uint32_t rebroadcasts();
+
+    /// \return The number of route discovery rebroadcasts this node has cancelled or skipped by 
+    /// counter based or probabilistic suppression
+    uint32_t rebroadcastsSuppressed();
+
+    /// \return The number of routes this node has dropped and rediscovered because the link to 
+    /// their next hop got much worse (see Route Selection)
+    uint32_t routeReevaluations();
+
     /// Starts the receiver if it is not running already, processes and possibly routes any received messages
     /// addressed to other nodes
     /// and delivers any messages addressed to this node.
@@ -199,6 +361,18 @@ public:
     /// \return true if a valid message was received for this node and copied to buf
     bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
 
+    /// Same as recvfromAck() above, but receives into a RHPacketBuffer, replacing anything that was in it.
+    /// The application message payload is left where it was received, starting at packet.data(), 
+    /// so it is not copied at all. Route discovery messages are answered or rebroadcast from the same buffer.
+    /// \param[out] packet Buffer to receive the message into
+    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \param[in] hops If present and not NULL, the referenced uint8_t will be set to the HOPS
+    /// \return true if a valid application message for this node is in packet
+    bool recvfromAck(RHPacketBuffer& packet, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+
     /// Starts the receiver if it is not running already.
     /// Similar to recvfromAck(), this will block until either a valid application layer 
     /// message available for this node
@@ -215,6 +389,17 @@ public:
     /// \return true if a valid message was copied to buf
     bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
 
+    /// Same as recvfromAckTimeout() above, but receives into a RHPacketBuffer, as recvfromAck(RHPacketBuffer&) does.
+    /// \param[out] packet Buffer to receive the message into
+    /// \param[in] timeout Maximum time to wait in milliseconds
+    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \param[in] hops If present and not NULL, the referenced uint8_t will be set to the HOPS
+    /// \return true if a valid application message for this node is in packet
+    bool recvfromAckTimeout(RHPacketBuffer& packet, uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+
 protected:
 
     /// Internal function that inspects messages being received and adjusts the routing table if necessary.
@@ -231,7 +416,7 @@ protected:
     virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
 
     /// Try to resolve a route for the given address. Blocks while discovering the route
-    /// which may take up to 4000 msec.
+    /// which may take up to the ARP timeout (4000 msec by default).
     /// Virtual so subclasses can override.
     /// \param [in] address The physical address to resolve
     /// \return true if the address was resolved and added to the local routing table
@@ -249,9 +434,133 @@ protected:
     /// \return true if the physical address of this node is identical to address
     virtual bool isPhysicalAddress(uint8_t* address, uint8_t addresslen);
 
+    /// Puts the RHMesh application message header in front of the message in packet and 
+    /// sends it, once the route is known. The packet is unchanged when this returns.
+    /// \param [in] packet The application message data
+    /// \param [in] address The destination node address
+    /// \param [in] flags Flags to deliver end-to-end to the dest address
+    /// \return The result code, as for sendtoWait()
+    uint8_t sendApplicationMessage(RHPacketBuffer& packet, uint8_t address, uint8_t flags);
+
+    /// Broadcasts a route discovery request for address, without waiting for the response
+    /// \param [in] address The physical address to resolve
+    /// \return true if the request was sent
+    bool sendRouteDiscovery(uint8_t address);
+
+    /// Drops a route discovery request that has already been rebroadcast, or holds it back to see whether
+    /// neighbours rebroadcast it first, or rebroadcasts it now. 
+    /// \param [in] packet The request, with this node already added to its list of visited nodes
+    /// \param [in] source The originator of the request
+    /// \param [in] id The originator sequence number of the request
+    /// \param [in] flags The originator flags of the request
+    /// \param [in] hops Hops the request has traversed so far
+    void rebroadcast(RHPacketBuffer& packet, uint8_t source, uint8_t id, uint8_t flags, uint8_t hops);
+
+    /// Sends held back route discovery requests whose delay has expired. Called by recvfromAck()
+    /// \return The number of milliseconds until the next held back request is due, or 0 if there are none
+    uint32_t processDeferredRebroadcasts();
+
+    /// Counts neighbours' rebroadcasts of held back requests, and cancels ours if there have been enough
+    /// \param [in] message Pointer to the RHRouter message that was received.
+    /// \param [in] messageLen Length of message in octets
+    virtual void duplicateBroadcast(RoutedMessage* message, uint8_t messageLen);
+
+    /// Looks up the route to address, as getRouteTo() does, but deletes it if the link to its next hop has
+    /// got much worse since it was found: at least twice the cost plus one transmission
+    /// \param [in] address The destination node address
+    /// \return pointer to the RoutingTableEntry for address, or NULL if there is none or it was deleted
+    RoutingTableEntry* checkRouteTo(uint8_t address);
+
+    /// Adds the cost of the link from a neighbour to the cost of a path to that neighbour
+    /// \param [in] cost Cost of the path, as carried in a MeshRouteDiscoveryMessage
+    /// \param [in] from The neighbour the message came from
+    /// \return The cost of the path to this node, saturating at RH_LINK_COST_MAX
+    uint8_t pathCost(uint8_t cost, uint8_t from);
+
+    /// Adds or replaces a route of known cost, unless there is a route via a different next hop that 
+    /// costs the same or less
+    /// \param [in] dest The destination node address
+    /// \param [in] next_hop The address of the next hop towards dest
+    /// \param [in] cost Cost of the path to dest
+    void updateRouteTo(uint8_t dest, uint8_t next_hop, uint8_t cost);
+
+    /// Sends queued messages whose routes are now known, expires route discoveries that have
+    /// timed out, and starts discoveries for queued messages that do not have one yet.
+    /// Called by recvfromAck()
+    void processPendingMessages();
+
+    /// Timeout for route discovery in milliseconds
+    uint16_t _arpTimeout;
+
 private:
-    /// Temporary message buffer
-    static uint8_t _tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
+    /// A route discovery started by sendtoQueued()
+    typedef struct
+    {
+	uint8_t             dest;    ///< Address being resolved
+	bool                active;  ///< Discovery is in progress
+	unsigned long       started; ///< millis() when the request was broadcast
+    } RouteDiscovery;
+
+    /// A message waiting in the pending queue
+    typedef struct
+    {
+	uint8_t             dest;    ///< Destination address
+	uint8_t             flags;   ///< Application flags
+	uint8_t             len;     ///< Length of data. 0 is permitted
+	bool                used;    ///< This slot holds a message
+	uint8_t             data[RH_MESH_MAX_MESSAGE_LEN]; ///< Application payload data
+    } PendingMessage;
+
+    /// Route discoveries in progress
+    RouteDiscovery      _discoveries[RH_MESH_MAX_DISCOVERIES];
+
+    /// Messages waiting for route discovery
+    PendingMessage      _pending[RH_MESH_PENDING_QUEUE_SIZE];
+
+    /// Number of used slots in _pending
+    uint8_t             _numPending;
+
+    /// Count of queued messages dropped by discovery timeout
+    uint32_t            _discoveryFailures;
+
+#if RH_MESH_REBROADCAST_QUEUE_SIZE > 0
+    /// A route discovery request waiting to be rebroadcast
+    typedef struct
+    {
+	RHPacketBuffer      packet;     ///< The request, ready to rebroadcast
+	uint8_t             source;     ///< Originator of the request
+	uint8_t             id;         ///< Originator sequence number
+	uint8_t             flags;      ///< Originator flags
+	uint8_t             hops;       ///< Hops traversed when it reached us
+	uint8_t             cost;       ///< Path cost carried in packet
+	uint8_t             duplicates; ///< Copies of the request heard so far
+	bool                used;       ///< Slot in use
+	unsigned long       due;        ///< millis() when it is to be rebroadcast
+    } DeferredRebroadcast;
+
+    /// Route discovery requests held back
+    DeferredRebroadcast _deferred[RH_MESH_REBROADCAST_QUEUE_SIZE];
+#endif
+
+    /// Number of used slots in _deferred
+    uint8_t             _numDeferred;
+
+    /// Flood control settings, see setRebroadcastSlots() etc
+    uint8_t             _rebroadcastSlots;
+    uint8_t             _rebroadcastThreshold;
+    uint8_t             _rebroadcastProbability;
+
+    /// Flood control counters
+    uint32_t            _rebroadcasts;
+    uint32_t            _rebroadcastsSuppressed;
+
+    /// The last route discovery request this node answered, and the path cost it answered with
+    uint8_t             _answeredSource;
+    uint8_t             _answeredId;
+    uint8_t             _answeredCost;
+
+    /// Count of routes dropped by checkRouteTo()
+    uint32_t            _routeReevaluations;
 
 };
 
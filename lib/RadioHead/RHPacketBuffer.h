@@ -0,0 +1,150 @@
+// RHPacketBuffer.h
+//
+// Message buffer with reserved headroom, so that the RadioHead managers can add
+// and remove their headers in place instead of copying the message at every layer.
+
+#ifndef RHPacketBuffer_h
+#define RHPacketBuffer_h
+
+#include <RadioHead.h>
+
+// Size of the storage in each RHPacketBuffer, the largest message any RadioHead driver can carry
+#ifndef RH_PACKET_BUFFER_SIZE
+ #define RH_PACKET_BUFFER_SIZE 255
+#endif
+
+// Headroom reserved by default in front of the data. Enough for the RHRouter (5 octets)
+// and RHMesh (1 octet) headers
+#ifndef RH_PACKET_BUFFER_HEADROOM
+ #define RH_PACKET_BUFFER_HEADROOM 8
+#endif
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHPacketBuffer RHPacketBuffer.h <RHPacketBuffer.h>
+/// \brief A message buffer with space reserved in front of the data for protocol headers
+///
+/// Each manager layer (RHMesh, RHRouter) puts a header in front of the application data
+/// before handing the message down to the next layer, and removes it again on the way up.
+/// With plain buffers this means copying the whole message at every layer. RHPacketBuffer
+/// keeps some unused headroom in front of the data, so a layer can prepend its header with push()
+/// and strip it with pull() without moving the data at all.
+///
+/// The buffer versions of RHDatagram::sendto(), RHReliableDatagram::sendtoWait(), RHRouter::sendtoWait(),
+/// RHMesh::sendtoWait() and the corresponding recvfrom functions all work this way. On a relay node
+/// a message is forwarded from the buffer it was received into, and a message received with
+/// RHMesh::recvfromAck(RHPacketBuffer&) is delivered without being copied at all.
+///
+/// \code
+/// RHPacketBuffer packet;
+/// memcpy(packet.put(len), data, len);
+/// manager.sendtoWait(packet, address);
+/// ...
+/// if (manager.recvfromAck(packet, &from))
+///     handleMessage(packet.data(), packet.len());
+/// \endcode
+///
+/// A message sent from a RHPacketBuffer is left unchanged, so it can be sent again.
+/// A message received into a RHPacketBuffer replaces anything that was in it.
+class RHPacketBuffer
+{
+public:
+    /// Constructor. The buffer is empty.
+    /// \param[in] headroom Number of octets to keep free in front of the data for headers
+    RHPacketBuffer(uint8_t headroom = RH_PACKET_BUFFER_HEADROOM)
+    {
+	reset(headroom);
+    }
+
+    /// Empties the buffer
+    /// \param[in] headroom Number of octets to keep free in front of the data for headers
+    void reset(uint8_t headroom = RH_PACKET_BUFFER_HEADROOM)
+    {
+	_head = headroom;
+	_len = 0;
+    }
+
+    /// \return Pointer to the first octet of the message
+    uint8_t* data()
+    {
+	return _buf + _head;
+    }
+
+    /// \return The number of octets in the message
+    uint8_t len() const
+    {
+	return _len;
+    }
+
+    /// \return The number of octets free in front of the message
+    uint8_t headroom() const
+    {
+	return _head;
+    }
+
+    /// \return The number of octets free after the end of the message
+    uint8_t tailroom() const
+    {
+	return RH_PACKET_BUFFER_SIZE - _head - _len;
+    }
+
+    /// Adds n octets to the front of the message, for a header
+    /// \param[in] n Number of octets to add
+    /// \return Pointer to the new start of the message, or NULL if there is not enough headroom
+    uint8_t* push(uint8_t n)
+    {
+	if (n > _head)
+	    return NULL;
+	_head -= n;
+	_len += n;
+	return data();
+    }
+
+    /// Removes n octets from the front of the message, once a header has been handled
+    /// \param[in] n Number of octets to remove
+    /// \return Pointer to the new start of the message, or NULL if the message is shorter than n
+    uint8_t* pull(uint8_t n)
+    {
+	if (n > _len)
+	    return NULL;
+	_head += n;
+	_len -= n;
+	return data();
+    }
+
+    /// Adds n octets to the end of the message
+    /// \param[in] n Number of octets to add
+    /// \return Pointer to the first added octet, or NULL if there is not enough tailroom
+    uint8_t* put(uint8_t n)
+    {
+	if (n > tailroom())
+	    return NULL;
+	uint8_t* p = data() + _len;
+	_len += n;
+	return p;
+    }
+
+    /// Copies octets to the end of the message
+    /// \param[in] buf The octets to add
+    /// \param[in] n Number of octets to add
+    /// \return true if there was enough tailroom
+    bool append(const uint8_t* buf, uint8_t n)
+    {
+	uint8_t* p = put(n);
+	if (!p)
+	    return false;
+	memcpy(p, buf, n);
+	return true;
+    }
+
+private:
+    /// Offset of the first octet of the message in _buf
+    uint8_t _head;
+
+    /// Number of octets in the message
+    uint8_t _len;
+
+    /// Message storage, with the headroom at the front
+    uint8_t _buf[RH_PACKET_BUFFER_SIZE];
+};
+
+#endif
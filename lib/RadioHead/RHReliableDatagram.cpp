@@ -22,7 +22,19 @@ RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddr
     _lastSequenceNumber = 0;
     _timeout = RH_DEFAULT_TIMEOUT;
     _retries = RH_DEFAULT_RETRIES;
-    memset(_seenIds, 0, sizeof(_seenIds));
+    _epoch = 0;
+    _adaptiveTimeout = true;
+    _rssiFloor = RH_LINK_RSSI_FLOOR;
+    _snrFloor = RH_LINK_SNR_FLOOR;
+    memset(_peers, 0, sizeof(_peers));
+#if RH_RELIABLE_WINDOW_SIZE > 0
+    memset(_window, 0, sizeof(_window));
+    _windowAddress = RH_BROADCAST_ADDRESS;
+    _windowOutstanding = 0;
+    _windowHeld = NULL;
+    _windowLastSent = 0;
+    _windowFailed = false;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -44,8 +56,109 @@ uint8_t RHReliableDatagram::retries()
     return _retries;
 }
 
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setAdaptiveTimeout(bool adaptive)
+{
+    _adaptiveTimeout = adaptive;
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHReliableDatagram::timeoutFor(uint8_t address)
+{
+    Peer* p = peer(address, false);
+    if (!_adaptiveTimeout || !p || !p->srtt)
+	return _timeout;
+
+    // SRTT + 4 * RTTVAR, but at least 1.5 * SRTT, so a very steady link does not
+    // time out on the smallest extra delay
+    uint32_t srtt = p->srtt >> 3;
+    uint32_t margin = p->rttvar;
+    if (margin < srtt / 2)
+	margin = srtt / 2;
+    if (margin < 10)
+	margin = 10;
+    uint32_t timeout = srtt + margin;
+    return timeout > RH_MAX_TIMEOUT ? RH_MAX_TIMEOUT : timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setEpoch(uint16_t epoch)
+{
+    _epoch = epoch;
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHReliableDatagram::epoch()
+{
+    while (!_epoch)
+    {
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+	_epoch = random() & 0xFFFF;
+#else
+	_epoch = random(0, 0x10000);
+#endif
+    }
+    return _epoch;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setLinkFloors(int16_t rssiFloor, int8_t snrFloor)
+{
+    _rssiFloor = rssiFloor;
+    _snrFloor = snrFloor;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::linkCost(uint8_t address)
+{
+    Peer* p = peer(address, false);
+    if (!p || (!p->etx && !p->heard))
+	return RH_LINK_COST_UNKNOWN;
+
+    // Signal quality: a perfect link until the margin over the floor drops below 
+    // RH_LINK_FADE_MARGIN, then one more expected transmission per dB lost
+    uint16_t signalCost = 0;
+    if (p->heard)
+    {
+	int16_t margin = (p->snr != RH_SNR_UNKNOWN) ? p->snr - _snrFloor : p->rssi - _rssiFloor;
+	if (margin >= RH_LINK_FADE_MARGIN)
+	    signalCost = RH_LINK_COST_SCALE;
+	else if (margin >= 0)
+	    signalCost = RH_LINK_COST_SCALE * (1 + RH_LINK_FADE_MARGIN - margin);
+	else
+	    signalCost = RH_LINK_COST_SCALE * (2 + RH_LINK_FADE_MARGIN);
+    }
+    uint16_t cost = p->etx > signalCost ? p->etx : signalCost;
+    return cost > RH_LINK_COST_MAX ? RH_LINK_COST_MAX : cost;
+}
+
 ////////////////////////////////////////////////////////////////////
 bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
+{
+    // If the peer does not acknowledge the announcement, it would not acknowledge the message either
+    if (address != RH_BROADCAST_ADDRESS && !announceEpoch(address))
+	return false;
+    return transmitWait(buf, len, address, RH_FLAGS_NONE);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::announceEpoch(uint8_t address)
+{
+    // Before the first message to a peer, tell it our boot epoch, so it forgets any IDs
+    // from before we restarted
+    if (peer(address, true)->announced)
+	return true;
+    uint8_t announce[2];
+    announce[0] = epoch();
+    announce[1] = epoch() >> 8;
+    if (!transmitWait(announce, sizeof(announce), address, RH_FLAGS_EPOCH))
+	return false;
+    peer(address, true)->announced = true; // May have been replaced while waiting
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::transmitWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t extraFlags)
 {
     // Assemble the message
     uint8_t thisSequenceNumber = ++_lastSequenceNumber;
@@ -56,21 +169,22 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 
         // Set and clear header flags depending on if this is an
         // initial send or a retry.
-        uint8_t headerFlagsToSet = RH_FLAGS_NONE;
-        // Always clear the ACK flag
-        uint8_t headerFlagsToClear = RH_FLAGS_ACK;
+        uint8_t headerFlagsToSet = extraFlags;
+        // Always clear the ACK and windowed transfer flags
+        uint8_t headerFlagsToClear = (RH_FLAGS_ACK | RH_FLAGS_WINDOW | RH_FLAGS_ACK_REQUEST) & ~extraFlags;
         if (retries == 1) {
             // On an initial send, clear the RETRY flag in case
             // it was previously set
             headerFlagsToClear |= RH_FLAGS_RETRY;
         } else {
             // Not an initial send, set the RETRY flag
-            headerFlagsToSet = RH_FLAGS_RETRY;
+            headerFlagsToSet |= RH_FLAGS_RETRY;
         }
         setHeaderFlags(headerFlagsToSet, headerFlagsToClear);
 
 	sendto(buf, len, address);
 	waitPacketSent();
+	setHeaderFlags(RH_FLAGS_NONE, extraFlags);
 
 	// Never wait for ACKS to broadcasts:
 	if (address == RH_BROADCAST_ADDRESS)
@@ -80,14 +194,7 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 	    _retransmissions++;
 	unsigned long thisSendTime = millis(); // Timeout does not include original transmit time
 
-	// Compute a new timeout, random between _timeout and _timeout*2
-	// This is to prevent collisions on every retransmit
-	// if 2 nodes try to transmit at the same time
-#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
-	uint16_t timeout = _timeout + (_timeout * (random() & 0xFF) / 256);
-#else
-	uint16_t timeout = _timeout + (_timeout * random(0, 256) / 256);
-#endif
+	uint16_t timeout = retransmitTimeout(address, retries);
 	int32_t timeLeft;
         while ((timeLeft = timeout - (millis() - thisSendTime)) > 0)
 	{
@@ -96,17 +203,24 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 		uint8_t from, to, id, flags;
 		if (recvfrom(0, 0, &from, &to, &id, &flags)) // Discards the message
 		{
+		    measuredSignal(from);
 		    // Now have a message: is it our ACK?
 		    if (   from == address 
 			   && to == _thisAddress 
 			   && (flags & RH_FLAGS_ACK) 
+			   && !(flags & RH_FLAGS_WINDOW)
 			   && (id == thisSequenceNumber))
 		    {
-			// Its the ACK we are waiting for
+			// Its the ACK we are waiting for. Only time messages that were sent once, since
+			// an ACK to a retransmitted one could be for any of the transmissions
+			if (retries == 1)
+			    measuredRtt(address, millis() - thisSendTime);
+			measuredDelivery(address, retries, true);
 			return true;
 		    }
 		    else if (   !(flags & RH_FLAGS_ACK)
-				&& (id == _seenIds[from]))
+			     && to == _thisAddress
+			     && seenId(from, id))
 		    {
 			// This is a request we have already received. ACK it again
 			acknowledge(id, from);
@@ -121,9 +235,16 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 	YIELD;
     }
     // Retries exhausted
+    measuredDelivery(address, _retries + 1, false);
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::sendtoWait(RHPacketBuffer& packet, uint8_t address)
+{
+    return sendtoWait(packet.data(), packet.len(), address);
+}
+
 ////////////////////////////////////////////////////////////////////
 bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
 {  
@@ -131,6 +252,9 @@ bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from,
     uint8_t _to;
     uint8_t _id;
     uint8_t _flags;
+    // recvfrom() shortens *len to the message it copies. Put it back if that message is
+    // filtered out, so the next one is not truncated
+    uint8_t bufLen = len ? *len : 0;
     // Get the message before its clobbered by the ACK (shared rx and tx buffer in some drivers
     if (available() && recvfrom(buf, len, &_from, &_to, &_id, &_flags))
     {
@@ -138,6 +262,12 @@ bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from,
 	if (!(_flags & RH_FLAGS_ACK))
 	{
 	    // Its a normal message not an ACK
+	    bool windowed = (_flags & RH_FLAGS_WINDOW) && _to == _thisAddress;
+	    bool announce = !(_flags & RH_FLAGS_WINDOW) && (_flags & RH_FLAGS_EPOCH) && _to == _thisAddress;
+	    bool isNew;
+	    // A restarted peer announces its new epoch before its IDs are checked
+	    if (announce && *len >= 2)
+		receivedEpoch(_from, buf[0] | ((uint16_t)buf[1] << 8));
 	    if (_to ==_thisAddress)
 	    {
 		// In some networks with mixed processor speeds, may need to delay
@@ -148,34 +278,58 @@ bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from,
 		while ((millis() - ts) <= RH_ACK_DELAY)
 		    YIELD;
                 #endif
-
-	        // Its for this node and
-		// Its not a broadcast, so ACK it
-		// Acknowledge message with ACK set in flags and ID set to received ID
-		acknowledge(_id, _from);
 	    }
-            // Filter out retried messages that we have seen before. This explicitly
+	    // Filter out retried messages that we have seen before, by the bitmap of IDs received 
+	    // from each peer. With RH_ENABLE_EXPLICIT_RETRY_DEDUP this
             // only filters out messages that are marked as retries to protect against
             // the scenario where a transmitting device sends just one message and
             // shuts down between transmissions. Devices that do this will report the
             // the same ID each time since their internal sequence number will reset
             // to zero each time the device starts up.
-	    if ((RH_ENABLE_EXPLICIT_RETRY_DEDUP && !(_flags & RH_FLAGS_RETRY)) || _id != _seenIds[_from])
+	    if (windowed)
+		isNew = acknowledgeWindowed(_id, _from, _flags); // Only acked on request
+	    else
+		isNew =    recordId(_from, _id, _flags) 
+		        || (RH_ENABLE_EXPLICIT_RETRY_DEDUP && !(_flags & RH_FLAGS_RETRY));
+	    // Now that the sender is a known peer
+	    measuredSignal(_from);
+	    if (_to ==_thisAddress && !windowed)
+	    {
+	        // Its for this node and
+		// Its not a broadcast, so ACK it
+		// Acknowledge message with ACK set in flags and ID set to received ID
+		acknowledge(_id, _from);
+	    }
+	    if (isNew && !announce)
 	    {
 		if (from)  *from =  _from;
 		if (to)    *to =    _to;
 		if (id)    *id =    _id;
 		if (flags) *flags = _flags;
-		_seenIds[_from] = _id;
 		return true;
 	    }
 	    // Else just re-ack it and wait for a new one
 	}
+	if (len)
+	    *len = bufLen;
     }
     // No message for us available
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::recvfromAck(RHPacketBuffer& packet, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+{
+    packet.reset(0);
+    uint8_t len = packet.tailroom();
+    if (recvfromAck(packet.data(), &len, from, to, id, flags))
+    {
+	packet.put(len);
+	return true;
+    }
+    return false;
+}
+
 bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
 {
     unsigned long starttime = millis();
@@ -205,7 +359,7 @@ void RHReliableDatagram::resetRetransmissions()
 void RHReliableDatagram::acknowledge(uint8_t id, uint8_t from)
 {
     setHeaderId(id);
-    setHeaderFlags(RH_FLAGS_ACK);
+    setHeaderFlags(RH_FLAGS_ACK, RH_FLAGS_WINDOW | RH_FLAGS_ACK_REQUEST);
     // We would prefer to send a zero length ACK,
     // but if an RH_RF22 receives a 0 length message with a CRC error, it will never receive
     // a 0 length message again, until its reset, which makes everything hang :-(
@@ -216,3 +370,468 @@ void RHReliableDatagram::acknowledge(uint8_t id, uint8_t from)
     waitPacketSent();
 }
 
+////////////////////////////////////////////////////////////////////
+RHReliableDatagram::Peer* RHReliableDatagram::peer(uint8_t address, bool create)
+{
+    Peer* oldest = NULL;
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_PEERS; i++)
+    {
+	Peer* p = &_peers[i];
+	if (p->used && p->address == address)
+	{
+	    p->lastUsed = millis();
+	    return p;
+	}
+	if (!oldest || (oldest->used && (!p->used || (long)(p->lastUsed - oldest->lastUsed) < 0)))
+	    oldest = p;
+    }
+    if (!create)
+	return NULL;
+
+    memset(oldest, 0, sizeof(Peer));
+    oldest->address = address;
+    oldest->used = true;
+    oldest->lastUsed = millis();
+    return oldest;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::measuredRtt(uint8_t address, unsigned long rtt)
+{
+    if (!_adaptiveTimeout)
+	return;
+    if (rtt < 1)
+	rtt = 1;
+    if (rtt > RH_MAX_TIMEOUT)
+	rtt = RH_MAX_TIMEOUT;
+
+    Peer* p = peer(address, true);
+    if (!p->srtt)
+    {
+	// First measurement: SRTT = RTT, RTTVAR = RTT / 2
+	p->srtt = rtt << 3;
+	p->rttvar = rtt << 1;
+    }
+    else
+    {
+	// SRTT += (RTT - SRTT) / 8, RTTVAR += (|RTT - SRTT| - RTTVAR) / 4, in fixed point
+	int32_t error = (int32_t)rtt - (int32_t)(p->srtt >> 3);
+	p->srtt += error;
+	if (error < 0)
+	    error = -error;
+	p->rttvar += error - (int32_t)(p->rttvar >> 2);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::measuredDelivery(uint8_t address, uint8_t tries, bool delivered)
+{
+    // A lost message counts as twice the transmissions actually made, so ETX keeps rising 
+    // on a dead link instead of settling at the retry limit
+    int32_t sample = (int32_t)tries * RH_LINK_COST_SCALE * (delivered ? 1 : 2);
+    if (sample > RH_LINK_COST_MAX)
+	sample = RH_LINK_COST_MAX;
+
+    Peer* p = peer(address, true);
+    if (!p->etx)
+	p->etx = sample;
+    else
+	p->etx += (sample - (int32_t)p->etx) / 4; // ETX += (sample - ETX) / 4
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::measuredSignal(uint8_t address)
+{
+    if (address == _thisAddress || address == RH_BROADCAST_ADDRESS)
+	return;
+    // Only for peers we already know. Everything overheard must not push them out
+    Peer* p = peer(address, false);
+    if (!p)
+	return;
+    int16_t rssi = _driver.lastRssi();
+    int snr = _driver.lastSNR();
+
+    if (!p->heard)
+    {
+	p->rssi = rssi;
+	p->snr = snr;
+	p->heard = true;
+    }
+    else
+    {
+	p->rssi += (rssi - p->rssi) / 4;
+	if (snr == RH_SNR_UNKNOWN || p->snr == RH_SNR_UNKNOWN)
+	    p->snr = snr;
+	else
+	    p->snr += (snr - p->snr) / 4;
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHReliableDatagram::retransmitTimeout(uint8_t address, uint8_t tries)
+{
+    uint32_t timeout = timeoutFor(address);
+    Peer* p = peer(address, false);
+    bool measured = _adaptiveTimeout && p && p->srtt;
+
+    // Compute a new timeout, random between timeout and timeout*2 (or timeout*1.25
+    // once the peer has been measured).
+    // This is to prevent collisions on every retransmit
+    // if 2 nodes try to transmit at the same time
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+    uint32_t r = random() & 0xFF;
+#else
+    uint32_t r = random(0, 256);
+#endif
+    timeout += (timeout * (measured ? r / 4 : r)) / 256;
+
+    // Exponential backoff on retries, unless the timeout is fixed
+    if (_adaptiveTimeout && tries > 1)
+	timeout <<= (tries - 1 < 4 ? tries - 1 : 4);
+    return timeout > RH_MAX_TIMEOUT ? RH_MAX_TIMEOUT : timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::recordId(uint8_t from, uint8_t id, uint8_t flags)
+{
+    Peer* p = peer(from, true);
+    bool isNew = true;
+    uint8_t ahead = id - p->seenHighest;
+    uint8_t behind = p->seenHighest - id;
+    if (!p->seen)
+    {
+	p->seen = true;
+	p->seenHighest = id;
+	p->seenBitmap = 1;
+    }
+    else if (ahead != 0 && ahead < 128)
+    {
+	// Newer than anything seen so far
+	p->seenBitmap = ahead < 32 ? (p->seenBitmap << ahead) | 1 : 1;
+	p->seenHighest = id;
+    }
+    else if (behind < 32 && (flags & RH_FLAGS_RETRY))
+    {
+	isNew = !(p->seenBitmap & ((uint32_t)1 << behind));
+	p->seenBitmap |= (uint32_t)1 << behind;
+    }
+    else if (behind < 32 && !(p->seenBitmap & ((uint32_t)1 << behind)))
+    {
+	// A first transmission, arriving after a later ID
+	p->seenBitmap |= (uint32_t)1 << behind;
+    }
+    else
+    {
+	// Only retries can be duplicates. Anything else that lands on an old ID means the
+	// sender's IDs have wrapped while it was talking to other nodes, or it has restarted. 
+	// A retry too old to be in the bitmap is treated the same way
+	p->seenHighest = id;
+	p->seenBitmap = 1;
+    }
+    return isNew;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::seenId(uint8_t from, uint8_t id)
+{
+    Peer* p = peer(from, false);
+    if (!p || !p->seen)
+	return false;
+    uint8_t ahead = id - p->seenHighest;
+    uint8_t behind = p->seenHighest - id;
+    if (ahead != 0 && ahead < 128)
+	return false;
+    return behind < 32 && (p->seenBitmap & ((uint32_t)1 << behind));
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::receivedEpoch(uint8_t from, uint16_t epoch)
+{
+    Peer* p = peer(from, true);
+    // Any IDs we have for it may be from before it restarted. An announcement always comes
+    // before its first message to us, so there is nothing to lose
+    if (p->epoch != epoch)
+	p->seen = false;
+    p->epoch = epoch;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::acknowledgeWindowed(uint8_t id, uint8_t from, uint8_t flags)
+{
+    bool isNew = recordId(from, id, flags);
+
+    if (flags & RH_FLAGS_ACK_REQUEST)
+    {
+	Peer* p = peer(from, true);
+	uint8_t sack[RH_RELIABLE_SACK_LEN];
+	sack[0] = p->seenHighest;
+	sack[1] = p->seenBitmap;
+	sack[2] = p->seenBitmap >> 8;
+	sack[3] = p->seenBitmap >> 16;
+	sack[4] = p->seenBitmap >> 24;
+	setHeaderId(id);
+	setHeaderFlags(RH_FLAGS_ACK | RH_FLAGS_WINDOW, RH_FLAGS_ACK_REQUEST);
+	sendto(sack, sizeof(sack), from);
+	waitPacketSent();
+    }
+    return isNew;
+}
+
+#if RH_RELIABLE_WINDOW_SIZE > 0
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::sendtoWindowed(uint8_t* buf, uint8_t len, uint8_t address)
+{
+    if (address == RH_BROADCAST_ADDRESS)
+	return sendtoWait(buf, len, address);
+    if (len > _driver.maxMessageLength())
+	return false;
+
+    if (_windowOutstanding && address != _windowAddress && !waitWindowed())
+	return false;
+    if (!_windowOutstanding && !announceEpoch(address))
+	return false;
+    _windowAddress = address;
+
+    // Make room. A held back message goes out with an ack request when the window is full
+    while (_windowOutstanding >= RH_RELIABLE_WINDOW_SIZE && !_windowFailed)
+	serviceWindow(true);
+    // A selective ack only covers the 32 IDs up to the highest one received, so the next ID must not 
+    // leave an outstanding message further behind than that, or it could never be acknowledged
+    while (windowSpanFull() && !_windowFailed)
+    {
+	if (_windowHeld)
+	    sendWindowSlot(_windowHeld, true);
+	_windowHeld = NULL;
+	serviceWindow(true);
+    }
+    if (_windowFailed)
+    {
+	_windowFailed = false;
+	return false;
+    }
+
+    WindowSlot* slot = _window;
+    while (slot->used)
+	slot++;
+    slot->used = true;
+    slot->id = ++_lastSequenceNumber;
+    slot->len = len;
+    slot->tries = 0;
+    slot->missing = false;
+    memcpy(slot->data, buf, len);
+    _windowOutstanding++;
+
+    // Send the one held back last time, and hold this one back, unless it fills the window
+    if (_windowHeld)
+	sendWindowSlot(_windowHeld, false);
+    _windowHeld = NULL;
+    if (_windowOutstanding >= RH_RELIABLE_WINDOW_SIZE)
+	sendWindowSlot(slot, true);
+    else
+	_windowHeld = slot;
+
+    // Take in any acks and retransmit as needed, without waiting
+    serviceWindow(false);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::waitWindowed()
+{
+    if (_windowHeld)
+    {
+	sendWindowSlot(_windowHeld, true);
+	_windowHeld = NULL;
+    }
+    while (_windowOutstanding)
+	serviceWindow(true);
+
+    bool ok = !_windowFailed;
+    _windowFailed = false;
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::windowOutstanding()
+{
+    return _windowOutstanding;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::windowSpanFull()
+{
+    uint8_t next = _lastSequenceNumber + 1;
+    for (uint8_t i = 0; i < RH_RELIABLE_WINDOW_SIZE; i++)
+	if (_window[i].used && (uint8_t)(next - _window[i].id) >= 32)
+	    return true;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::sendWindowSlot(WindowSlot* slot, bool ackRequest)
+{
+    uint8_t headerFlagsToSet = RH_FLAGS_WINDOW;
+    uint8_t headerFlagsToClear = RH_FLAGS_ACK | RH_FLAGS_ACK_REQUEST | RH_FLAGS_RETRY;
+    if (slot->tries)
+	headerFlagsToSet |= RH_FLAGS_RETRY;
+    if (ackRequest)
+	headerFlagsToSet |= RH_FLAGS_ACK_REQUEST;
+    unsigned long sinceLast = millis() - _windowLastSent;
+    if (sinceLast < RH_RELIABLE_WINDOW_GAP)
+	delay(RH_RELIABLE_WINDOW_GAP - sinceLast);
+    setHeaderId(slot->id);
+    setHeaderFlags(headerFlagsToSet, headerFlagsToClear);
+    sendto(slot->data, slot->len, _windowAddress);
+    waitPacketSent();
+    _windowLastSent = millis();
+    setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_WINDOW | RH_FLAGS_ACK_REQUEST | RH_FLAGS_RETRY);
+
+    if (slot->tries)
+	_retransmissions++;
+    slot->tries++;
+    slot->sentAt = _windowLastSent;
+    // Only an ack request can be answered, so that is when the clock starts
+    slot->timeout = ackRequest ? retransmitTimeout(_windowAddress, slot->tries) : RH_MAX_TIMEOUT;
+
+    if (ackRequest)
+    {
+	// The selective ack will cover everything sent so far, so time them all from now
+	uint8_t i;
+	for (i = 0; i < RH_RELIABLE_WINDOW_SIZE; i++)
+	{
+	    if (_window[i].used && _window[i].tries && &_window[i] != slot)
+	    {
+		_window[i].sentAt = slot->sentAt;
+		_window[i].timeout = slot->timeout;
+	    }
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::serviceWindow(bool wait)
+{
+    uint8_t i;
+    if (wait)
+    {
+	// Wait for an ack, or until the next message is due to be retransmitted
+	unsigned long now = millis();
+	int32_t timeLeft = RH_MAX_TIMEOUT;
+	for (i = 0; i < RH_RELIABLE_WINDOW_SIZE; i++)
+	{
+	    if (_window[i].used && _window[i].tries)
+	    {
+		int32_t left = _window[i].timeout - (now - _window[i].sentAt);
+		if (left < timeLeft)
+		    timeLeft = left;
+	    }
+	}
+	if (timeLeft > 0)
+	    waitAvailableTimeout(timeLeft);
+    }
+
+    while (available())
+    {
+	uint8_t sack[RH_RELIABLE_SACK_LEN];
+	uint8_t len = sizeof(sack);
+	uint8_t from, to, id, flags;
+	if (!recvfrom(sack, &len, &from, &to, &id, &flags)) // Discards anything but acks
+	    continue;
+	if (   from == _windowAddress
+	    && to == _thisAddress
+	    && (flags & RH_FLAGS_ACK)
+	    && (flags & RH_FLAGS_WINDOW)
+	    && len == RH_RELIABLE_SACK_LEN)
+	{
+	    uint32_t bitmap = sack[1] | ((uint32_t)sack[2] << 8) | ((uint32_t)sack[3] << 16) | ((uint32_t)sack[4] << 24);
+	    // Messages sent before the one that asked for this ack, but not in the bitmap, were lost
+	    WindowSlot* request = NULL;
+	    for (i = 0; i < RH_RELIABLE_WINDOW_SIZE; i++)
+		if (_window[i].used && _window[i].tries && _window[i].id == id)
+		    request = &_window[i];
+	    unsigned long requestSentAt = request ? request->sentAt : 0;
+	    for (i = 0; i < RH_RELIABLE_WINDOW_SIZE; i++)
+	    {
+		WindowSlot* slot = &_window[i];
+		uint8_t behind = sack[0] - slot->id;
+		if (!slot->used || !slot->tries || behind >= 32)
+		    continue;
+		if (bitmap & ((uint32_t)1 << behind))
+		{
+		    // Only the message that asked for this ack can be timed, and only if it was sent once
+		    if (slot == request && slot->tries == 1)
+			measuredRtt(from, millis() - slot->sentAt);
+		    slot->used = false;
+		    _windowOutstanding--;
+		}
+		else if (request && (long)(slot->sentAt - requestSentAt) <= 0)
+		{
+		    slot->missing = true;
+		}
+	    }
+	}
+	else if (!(flags & RH_FLAGS_ACK) && !(flags & RH_FLAGS_WINDOW) && to == _thisAddress && seenId(from, id))
+	{
+	    // This is a request we have already received. ACK it again
+	    acknowledge(id, from);
+	}
+    }
+
+    // If the ack request timed out, resend the newest message to ask again
+    unsigned long now = millis();
+    WindowSlot* probe = NULL;
+    bool timedOut = false;
+    for (i = 0; i < RH_RELIABLE_WINDOW_SIZE; i++)
+    {
+	WindowSlot* slot = &_window[i];
+	if (!slot->used || !slot->tries)
+	    continue;
+	if ((now - slot->sentAt) >= slot->timeout)
+	    timedOut = true;
+	if (!probe || (uint8_t)(_lastSequenceNumber - slot->id) < (uint8_t)(_lastSequenceNumber - probe->id))
+	    probe = slot;
+    }
+    if (timedOut)
+    {
+	if (probe->tries > _retries)
+	{
+	    // Nothing has been heard from the peer for all the retries, so give up on everything sent
+	    for (i = 0; i < RH_RELIABLE_WINDOW_SIZE; i++)
+	    {
+		if (_window[i].used && _window[i].tries)
+		{
+		    _window[i].used = false;
+		    _windowOutstanding--;
+		}
+	    }
+	    _windowFailed = true;
+	    return;
+	}
+	probe->missing = true;
+    }
+
+    // Resend the lost messages, asking for an ack after the last of them
+    WindowSlot* last = NULL;
+    for (i = 0; i < RH_RELIABLE_WINDOW_SIZE; i++)
+    {
+	WindowSlot* slot = &_window[i];
+	if (!slot->used || !slot->missing)
+	    continue;
+	slot->missing = false;
+	if (slot->tries > _retries)
+	{
+	    // Retries exhausted
+	    slot->used = false;
+	    _windowOutstanding--;
+	    _windowFailed = true;
+	    continue;
+	}
+	if (last)
+	    sendWindowSlot(last, false);
+	last = slot;
+    }
+    if (last)
+	sendWindowSlot(last, true);
+}
+#endif
@@ -15,6 +15,17 @@
 /// The retry bit in the header FLAGS. This indicates that the payload is a retry for a
 /// previously sent message.
 #define RH_FLAGS_RETRY 0x40
+/// The window bit in the header FLAGS. This indicates that the message (or ack) belongs to a
+/// windowed transfer started by sendtoWindowed(), and is deduplicated and acknowledged with a
+/// selective ack bitmap.
+#define RH_FLAGS_WINDOW 0x20
+/// The ack request bit in the header FLAGS. Set on the last windowed message of a burst, to ask
+/// the receiver for a selective ack covering the whole burst.
+#define RH_FLAGS_ACK_REQUEST 0x10
+/// The epoch bit in the header FLAGS. Shares its bit with RH_FLAGS_ACK_REQUEST, which only has a meaning
+/// on windowed messages. Set on a message that announces the sender's boot epoch in its 2 octet payload.
+/// Such messages are acknowledged, but not delivered. See Duplicate Detection
+#define RH_FLAGS_EPOCH 0x10
 
 /// This macro enables enhanced message deduplication behavior. This currently defaults
 /// to 0 (off), but this may change to default to 1 (on) in future releases. Consumers who
@@ -37,6 +48,65 @@
 /// The default number of retries
 #define RH_DEFAULT_RETRIES 3
 
+/// Longest retransmit timeout in milliseconds, after measured round trip times and backoff
+#define RH_MAX_TIMEOUT 10000
+
+/// Number of peers whose round trip times are remembered for the adaptive retransmit timeout,
+/// and whose windowed transfers are tracked for duplicate detection
+#ifndef RH_RELIABLE_PEERS
+ #if (RH_PLATFORM == RH_PLATFORM_ESP32) || (RH_PLATFORM == RH_PLATFORM_ESP8266) || (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+  #define RH_RELIABLE_PEERS 16
+ #else
+  #define RH_RELIABLE_PEERS 4
+ #endif
+#endif
+
+/// Max number of unacknowledged messages sendtoWindowed() can have outstanding. Each one needs a 
+/// buffer of RH_MAX_MESSAGE_LEN octets. 0 leaves out windowed sending altogether (receiving 
+/// windowed messages is always supported). Must not be more than 16.
+#ifndef RH_RELIABLE_WINDOW_SIZE
+ #if (RH_PLATFORM == RH_PLATFORM_ESP32) || (RH_PLATFORM == RH_PLATFORM_ESP8266) || (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+  #define RH_RELIABLE_WINDOW_SIZE 8
+ #else
+  #define RH_RELIABLE_WINDOW_SIZE 0
+ #endif
+#endif
+
+#if RH_RELIABLE_WINDOW_SIZE > 16
+ #error RH_RELIABLE_WINDOW_SIZE must be 16 or less
+#endif
+
+/// Gap in milliseconds left between back to back windowed messages, so the receiver has time
+/// to collect one message and restart its receiver before the next one starts
+#ifndef RH_RELIABLE_WINDOW_GAP
+ #define RH_RELIABLE_WINDOW_GAP 10
+#endif
+
+/// Length of the selective ack payload: highest ID seen, then a 32 bit little endian bitmap
+#define RH_RELIABLE_SACK_LEN 5
+
+/// Link costs are in units of 1/RH_LINK_COST_SCALE of an expected transmission, so a perfect 
+/// link costs RH_LINK_COST_SCALE
+#define RH_LINK_COST_SCALE 8
+
+/// Cost of a link to a peer nothing is known about yet: 2 expected transmissions
+#define RH_LINK_COST_UNKNOWN (2 * RH_LINK_COST_SCALE)
+
+/// Highest link cost, for a link that is all but unusable
+#define RH_LINK_COST_MAX 255
+
+/// Default weakest RSSI in dBm, and lowest SNR in dB, at which packets are still reliably received.
+/// RH_LINK_SNR_FLOOR suits LoRa at SF7; higher spreading factors go lower (-20 dB at SF12)
+#ifndef RH_LINK_RSSI_FLOOR
+ #define RH_LINK_RSSI_FLOOR -120
+#endif
+#ifndef RH_LINK_SNR_FLOOR
+ #define RH_LINK_SNR_FLOOR -7
+#endif
+
+/// Margin in dB above the floor beyond which a stronger signal does not make a link any cheaper
+#define RH_LINK_FADE_MARGIN 6
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHReliableDatagram RHReliableDatagram.h <RHReliableDatagram.h>
 /// \brief RHDatagram subclass for sending addressed, acknowledged, retransmitted datagrams.
@@ -53,11 +123,27 @@
 /// You can use RHReliableDatagram to send broadcast messages, with a TO address of RH_BROADCAST_ADDRESS,
 /// however broadcasts are not acknowledged or retransmitted and are therefore NOT actually reliable.
 ///
-/// The retransmit timeout is randomly varied between timeout and timeout*2 to prevent collisions on all
-/// retries when 2 nodes happen to start sending at the same time .
+/// The retransmit timeout adapts to each peer. Round trip times are measured from acknowledgements 
+/// of messages that were not retransmitted, and the timeout is the smoothed round trip time plus 
+/// 4 times its mean deviation, as in TCP. Until a peer has been measured, the timeout is randomly 
+/// varied between timeout and timeout*2 to prevent collisions on all retries when 2 nodes happen 
+/// to start sending at the same time. The timeout doubles on each retry. 
+/// setAdaptiveTimeout(false) restores the fixed timeout.
 ///
 /// Each new message sent by sendtoWait() has its ID incremented.
 ///
+/// \par Link Quality
+///
+/// RHReliableDatagram also keeps an ETX (expected transmission count) estimate for each recent peer,
+/// which managers such as RHMesh use to choose between routes. Every unicast message sent by 
+/// sendtoWait() is a sample: the number of transmissions it took if it was acknowledged, twice 
+/// the maximum if it was not. Samples are smoothed with a moving average (gain 1/4). Since a peer 
+/// may only ever have been heard, not sent to, the RSSI and SNR of everything received from it 
+/// are averaged too, and a signal close to the floor set by setLinkFloors() raises the cost 
+/// even before any message has been lost. linkCost() returns the higher of the two estimates.
+/// Messages that are only overheard, such as those discarded while waiting for an ack, update the 
+/// signal of peers that are already known, but do not take the place of one.
+///
 /// An ack consists of a message with:
 /// - TO set to the from address of the original message
 /// - FROM set to this node address
@@ -65,6 +151,26 @@
 /// - FLAGS with the RH_FLAGS_ACK bit set
 /// - 1 octet of payload containing ASCII '!' (since some drivers cannot handle 0 length payloads)
 ///
+/// \par Duplicate Detection
+///
+/// Each recent peer (up to RH_RELIABLE_PEERS of them) has a bitmap of which of the 32 IDs up to 
+/// the highest one received from it have been seen, so retransmissions are recognised even when 
+/// they arrive reordered or interleaved with other messages, at a constant cost per message.
+/// A message that was already received is acknowledged again but not delivered. Only retransmissions
+/// (with RH_FLAGS_RETRY set) can be duplicates: a first transmission that lands on an ID already in the 
+/// bitmap means the sender's IDs have wrapped round while it was talking to other nodes, and the bitmap
+/// starts again from it.
+///
+/// A node that restarts starts its IDs again from 1, so its retransmissions could be taken for 
+/// duplicates of messages from before the restart. So each node has a 16 bit boot epoch (see setEpoch()), 
+/// and before its first message to each peer it announces it with a 2 octet message with RH_FLAGS_EPOCH set.
+/// Announcements are acknowledged but not delivered. A receiver that had a different epoch for the sender 
+/// starts its bitmap for it afresh. This costs one extra exchange per peer after each restart (or after the 
+/// peer has been forgotten to make room for others), and nothing while both ends keep running.
+/// If the announcement is not acknowledged, the message is not sent and sendtoWait() fails, so an
+/// unreachable peer costs no more time than it would without announcements.
+/// Older versions of RHReliableDatagram deliver the announcements as ordinary messages.
+///
 /// \par Media Access Strategy
 ///
 /// RHReliableDatagram and the underlying drivers always transmit as soon as
@@ -86,6 +192,25 @@
 /// retransmit strategy and configuration lest they hang for a long time
 /// trying to reply to clients that are unreachable.
 ///
+/// \par Windowed Sending
+///
+/// sendtoWait() is stop-and-wait, so it can send at most one message per round trip. 
+/// sendtoWindowed() sends without waiting for the acknowledgement, keeping up to 
+/// RH_RELIABLE_WINDOW_SIZE messages to one destination outstanding, and waitWindowed() 
+/// waits until all of them are acknowledged. Windowed messages have the RH_FLAGS_WINDOW flag set.
+/// Messages are sent back to back, and only the last one of each burst has RH_FLAGS_ACK_REQUEST set, 
+/// since an acknowledgement sent while the sender is transmitting the next message would be lost 
+/// (and would make the receiver miss that message). To know which message is the last, 
+/// sendtoWindowed() holds each message back until the next call, until the window is full or 
+/// until waitWindowed() is called.
+/// The receiver answers an ack request with a selective ack: the highest ID received from the 
+/// sender, and a bitmap of which of the 32 IDs up to it have been received, so one acknowledgement 
+/// covers the whole burst. The messages the bitmap shows missing are retransmitted at once. If no 
+/// selective ack arrives before the retransmit timeout, only the newest message is resent, as a probe 
+/// asking for another one. If the probe is not acknowledged after all retries, the whole window is 
+/// given up on. Windowed messages may be delivered out of order.
+/// examples/simulator/simulator_reliable_windowed compares windowed and stop-and-wait transfers over lossy links.
+///
 /// Caution: if you have a radio network with a mixture of slow and fast
 /// processors and ReliableDatagrams, you may be affected by race conditions
 /// where the fast processor acknowledges a message before the sender is ready
@@ -124,6 +249,41 @@ public:
     /// \return The currently configured maximum number of retries.
     uint8_t retries();
 
+    /// Enables or disables the adaptive retransmit timeout. Enabled by default. 
+    /// When disabled, the timeout is always random between timeout and timeout*2, as set by setTimeout().
+    /// \param[in] adaptive true to adapt the timeout to measured round trip times
+    void setAdaptiveTimeout(bool adaptive);
+
+    /// Returns the retransmit timeout that will be used for the first transmission of the next 
+    /// message to a peer, without the random variation.
+    /// \param[in] address The address of the peer
+    /// \return The timeout in milliseconds
+    uint16_t timeoutFor(uint8_t address);
+
+    /// Returns the estimated cost of sending to a peer, from its ETX and signal quality
+    /// (see Link Quality above).
+    /// \param[in] address The address of the peer
+    /// \return The cost in units of 1/RH_LINK_COST_SCALE expected transmissions: RH_LINK_COST_SCALE 
+    /// for a perfect link, up to RH_LINK_COST_MAX. RH_LINK_COST_UNKNOWN if nothing is known about the peer
+    uint8_t linkCost(uint8_t address);
+
+    /// Sets the boot epoch this node announces to its peers, so they can tell when it has restarted.
+    /// By default a random one is chosen with random() the first time it is needed, which is only 
+    /// different after each restart if the random number generator has been seeded, eg with randomSeed(). 
+    /// Nodes with persistent storage can use a boot counter instead.
+    /// \param[in] epoch The boot epoch. Must not be 0
+    void setEpoch(uint16_t epoch);
+
+    /// Returns the boot epoch of this node, choosing a random one if it has not been set
+    /// \return The boot epoch
+    uint16_t epoch();
+
+    /// Sets the signal levels at which packets are no longer reliably received, for linkCost().
+    /// The SNR floor is used if the driver measures SNR (see RHGenericDriver::lastSNR()), else the RSSI floor.
+    /// \param[in] rssiFloor Weakest usable RSSI in dBm. Defaults to RH_LINK_RSSI_FLOOR
+    /// \param[in] snrFloor Lowest usable SNR in dB. Defaults to RH_LINK_SNR_FLOOR
+    void setLinkFloors(int16_t rssiFloor, int8_t snrFloor);
+
     /// Send the message (with retries) and waits for an ack. Returns true if an acknowledgement is received.
     /// Synchronous: any message other than the desired ACK received while waiting is discarded.
     /// Blocks until an ACK is received or all retries are exhausted (ie up to retries*timeout milliseconds).
@@ -136,6 +296,36 @@ public:
     /// \return true if the message was transmitted and an acknowledgement was received.
     bool sendtoWait(uint8_t* buf, uint8_t len, uint8_t address);
 
+    /// Same as sendtoWait() above, but sends the message in a RHPacketBuffer
+    /// \param[in] packet The message to send
+    /// \param[in] address The address to send the message to.
+    /// \return true if the message was transmitted and an acknowledgement was received.
+    bool sendtoWait(RHPacketBuffer& packet, uint8_t address);
+
+#if RH_RELIABLE_WINDOW_SIZE > 0
+    /// Sends the message without waiting for its acknowledgement, as part of a windowed transfer to address.
+    /// The message is copied, and retransmitted as needed until it is acknowledged or the retries 
+    /// are exhausted. If RH_RELIABLE_WINDOW_SIZE messages are already outstanding, blocks until one 
+    /// of them is acknowledged or given up on. If there are outstanding messages to a different 
+    /// address, waits for them first, as waitWindowed() does.
+    /// Any message other than an acknowledgement received while waiting is discarded, as in sendtoWait().
+    /// If address is RH_BROADCAST_ADDRESS, this is the same as sendtoWait().
+    /// \param[in] buf Pointer to the binary message to send
+    /// \param[in] len Number of octets to send
+    /// \param[in] address The address to send the message to.
+    /// \return false if the message was too long, the peer did not acknowledge the boot epoch announcement
+    /// that starts a transfer to it (see Duplicate Detection), or an earlier message in the transfer has been
+    /// given up on. In the last case the failure is cleared, so the next call starts afresh.
+    bool sendtoWindowed(uint8_t* buf, uint8_t len, uint8_t address);
+
+    /// Blocks until every message sent by sendtoWindowed() has been acknowledged or given up on.
+    /// \return true if all messages since the last call to waitWindowed() were acknowledged
+    bool waitWindowed();
+
+    /// \return The number of messages sent by sendtoWindowed() that have not been acknowledged yet
+    uint8_t windowOutstanding();
+#endif
+
     /// If there is a valid message available for this node, send an acknowledgement to the SRC
     /// address (blocking until this is complete), then copy the message to buf and return true
     /// else return false. 
@@ -159,6 +349,16 @@ public:
     /// - 3. There was a correctly addressed message but it was a duplicate of an earlier correctly received message
     bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// Same as recvfromAck() above, but receives the message into a RHPacketBuffer,
+    /// replacing anything that was in it. The message starts at packet.data(), with no headroom.
+    /// \param[out] packet Buffer to receive the message into
+    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a valid message was received into packet
+    bool recvfromAck(RHPacketBuffer& packet, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
     /// or the timeout expires. Starts the receiver automatically.
     /// You should be sure to call this function frequently enough to not miss any messages.
@@ -188,11 +388,127 @@ protected:
     /// Blocks until the ACK has been sent
     void acknowledge(uint8_t id, uint8_t from);
 
+    /// Sends the message (with retries) and waits for an ack, as sendtoWait() does, 
+    /// without announcing the boot epoch first
+    /// \param[in] buf Pointer to the binary message to send
+    /// \param[in] len Number of octets to send
+    /// \param[in] address The address to send the message to.
+    /// \param[in] extraFlags Extra header FLAGS to set, RH_FLAGS_NONE or RH_FLAGS_EPOCH
+    /// \return true if the message was transmitted and an acknowledgement was received.
+    bool transmitWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t extraFlags);
+
+    /// Announces the boot epoch of this node to a peer, unless it has been announced already
+    /// \param[in] address The address of the peer
+    /// \return true if the epoch has been announced, false if the peer did not acknowledge the announcement
+    bool announceEpoch(uint8_t address);
+
+    /// Records a message ID received from a peer in its bitmap
+    /// \param[in] from The address of the peer
+    /// \param[in] id The message ID
+    /// \param[in] flags The message FLAGS
+    /// \return true if the message is new, false if it is a duplicate
+    bool recordId(uint8_t from, uint8_t id, uint8_t flags);
+
+    /// Tests whether a message ID from a peer has been received, without recording it
+    /// \param[in] from The address of the peer
+    /// \param[in] id The message ID
+    /// \return true if the message is a duplicate
+    bool seenId(uint8_t from, uint8_t id);
+
+    /// Records the boot epoch announced by a peer, and forgets the IDs it sent before it restarted
+    /// \param[in] from The address of the peer
+    /// \param[in] epoch The announced epoch
+    void receivedEpoch(uint8_t from, uint16_t epoch);
+
     /// Checks whether the message currently in the Rx buffer is a new message, not previously received
     /// based on the from address and the sequence.  If it is new, it is acknowledged and returns true
     /// \return true if there is a message received and it is a new message
     bool haveNewMessage();
 
+    /// Per peer state for the adaptive timeout, duplicate detection and link quality
+    typedef struct
+    {
+	uint8_t  address;    ///< Peer address
+	bool     used;       ///< This entry is in use
+	uint32_t srtt;       ///< Smoothed round trip time in 1/8 milliseconds, 0 if not measured yet
+	uint32_t rttvar;     ///< Round trip time mean deviation in 1/4 milliseconds
+	bool     seen;       ///< seenHighest and seenBitmap are valid
+	uint8_t  seenHighest; ///< Highest message ID received from this peer
+	uint32_t seenBitmap; ///< Bit n set if message ID seenHighest - n has been received
+	uint16_t epoch;      ///< Boot epoch of this peer, 0 if not known
+	bool     announced;  ///< Our boot epoch has been announced to this peer
+	uint16_t etx;        ///< Smoothed transmissions per delivered message, in 1/RH_LINK_COST_SCALE. 0 if not measured yet
+	bool     heard;      ///< rssi and snr are valid
+	int16_t  rssi;       ///< Smoothed RSSI of messages received from this peer, dBm
+	int8_t   snr;        ///< Smoothed SNR of messages received from this peer, dB, or RH_SNR_UNKNOWN
+	unsigned long lastUsed; ///< millis() when this entry was last used, for replacement
+    } Peer;
+
+    /// Finds the state for a peer
+    /// \param[in] address The address of the peer
+    /// \param[in] create If true and the peer is not known, replaces the least recently used entry
+    /// \return The peer state, or NULL if the peer is not known and create is false
+    Peer* peer(uint8_t address, bool create);
+
+    /// Folds a round trip time measurement into the peer's timeout
+    /// \param[in] address The address of the peer
+    /// \param[in] rtt The measured round trip time in milliseconds
+    void measuredRtt(uint8_t address, unsigned long rtt);
+
+    /// Folds the outcome of a sendtoWait() into the peer's ETX
+    /// \param[in] address The address of the peer
+    /// \param[in] tries Number of times the message was transmitted
+    /// \param[in] delivered true if it was acknowledged
+    void measuredDelivery(uint8_t address, uint8_t tries, bool delivered);
+
+    /// Folds the RSSI and SNR of the message just received from a peer into its signal quality
+    /// \param[in] address The address of the peer
+    void measuredSignal(uint8_t address);
+
+    /// Returns a retransmit timeout for a peer, with random variation
+    /// \param[in] address The address of the peer
+    /// \param[in] tries How many times the message has been sent, including this time
+    /// \return The timeout in milliseconds
+    uint16_t retransmitTimeout(uint8_t address, uint8_t tries);
+
+    /// Records a windowed message received from a peer, and sends a selective ack if the message 
+    /// has RH_FLAGS_ACK_REQUEST set
+    /// \param[in] id The message ID
+    /// \param[in] from The address of the peer
+    /// \param[in] flags The message FLAGS
+    /// \return true if the message is new, false if it is a duplicate
+    bool acknowledgeWindowed(uint8_t id, uint8_t from, uint8_t flags);
+
+#if RH_RELIABLE_WINDOW_SIZE > 0
+    /// A message sent by sendtoWindowed() that has not been acknowledged yet
+    typedef struct
+    {
+	bool     used;       ///< This slot holds a message
+	uint8_t  id;         ///< Message ID
+	uint8_t  len;        ///< Length of data
+	uint8_t  tries;      ///< Number of times sent so far. 0 while held back
+	bool     missing;    ///< A selective ack showed this message was lost, so resend it now
+	unsigned long sentAt;   ///< millis() at the end of the last transmission
+	uint16_t timeout;    ///< Retransmit after this many milliseconds from sentAt
+	uint8_t  data[RH_MAX_MESSAGE_LEN]; ///< Message payload
+    } WindowSlot;
+
+    /// Handles acknowledgements and retransmissions for the windowed transfer
+    /// \param[in] wait If true, first waits until a message is received or the next retransmit timeout
+    void serviceWindow(bool wait);
+
+    /// \return true if the next message ID would be 32 or more ahead of an outstanding message, 
+    /// out of the range of the selective ack bitmap
+    bool windowSpanFull();
+
+    /// Sends or resends the message in a window slot. 
+    /// \param[in] slot The window slot
+    /// \param[in] ackRequest If true, asks for a selective ack, and restarts the retransmit timeout 
+    /// of every outstanding message, since the ack will cover them all. Otherwise the message
+    /// is not timed until an ack request follows it.
+    void sendWindowSlot(WindowSlot* slot, bool ackRequest);
+#endif
+
 private:
     /// Count of retransmissions we have had to send
     uint32_t _retransmissions;
@@ -209,11 +525,38 @@ private:
     /// Defaults to 3
     uint8_t _retries;
 
-    /// Array of the last seen sequence number indexed by node address that sent it
-    /// It is used for duplicate detection. Duplicated messages are re-acknowledged when received 
-    /// (this is generally due to lost ACKs, causing the sender to retransmit, even though we have already
-    /// received that message)
-    uint8_t _seenIds[256];
+    /// Boot epoch of this node, 0 until chosen
+    uint16_t _epoch;
+
+    /// Whether retransmit timeouts adapt to measured round trip times
+    bool _adaptiveTimeout;
+
+    /// Signal levels for linkCost(), see setLinkFloors()
+    int16_t _rssiFloor;
+    int8_t  _snrFloor;
+
+    /// Round trip time, duplicate detection and link quality state for recent peers
+    Peer _peers[RH_RELIABLE_PEERS];
+
+#if RH_RELIABLE_WINDOW_SIZE > 0
+    /// Messages outstanding in the windowed transfer
+    WindowSlot _window[RH_RELIABLE_WINDOW_SIZE];
+
+    /// Destination of the windowed transfer
+    uint8_t _windowAddress;
+
+    /// Number of used slots in _window
+    uint8_t _windowOutstanding;
+
+    /// The message held back by sendtoWindowed(), or NULL
+    WindowSlot* _windowHeld;
+
+    /// millis() at the end of the last windowed transmission
+    unsigned long _windowLastSent;
+
+    /// Set when a windowed message has been given up on, until reported
+    bool _windowFailed;
+#endif
 };
 
 /// @example rf22_reliable_datagram_client.pde
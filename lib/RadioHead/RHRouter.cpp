@@ -13,16 +13,22 @@
 
 #include <RHRouter.h>
 
-RHRouter::RoutedMessage RHRouter::_tmpMessage;
-
 ////////////////////////////////////////////////////////////////////
 // Constructors
 RHRouter::RHRouter(RHGenericDriver& driver, uint8_t thisAddress) 
     : RHReliableDatagram(driver, thisAddress)
 {
+    RH_RECURSIVE_MUTEX_INIT(_lock);
+    RH_RECURSIVE_MUTEX_INIT(_radioLock);
+    memset(_packetUsed, 0, sizeof(_packetUsed));
     _max_hops = RH_DEFAULT_MAX_HOPS;
     _isa_router = true;
+    _maxRouteAge = 0;
+    resetRouteStats();
     clearRoutingTable();
+    for (uint8_t i = 0; i < RH_ROUTER_SEEN_CACHE_SIZE; i++)
+	_seen[i].source = RH_BROADCAST_ADDRESS;
+    _seenNext = 0;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -47,56 +53,76 @@ void RHRouter::setIsaRouter(bool isa_router)
     _isa_router = isa_router;
 }
 ////////////////////////////////////////////////////////////////////
-void RHRouter::addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state)
+void RHRouter::addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state, uint8_t cost)
 {
-    uint8_t i;
+    RH_MUTEX_GUARD(_lock);
+    if (state == Invalid)
+    {
+	deleteRouteTo(dest);
+	return;
+    }
 
     // First look for an existing entry we can update
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    uint8_t index;
+    uint16_t bucket = findRouteBucket(dest);
+    if (bucket < RH_ROUTING_HASH_SIZE)
     {
-	if (_routes[i].dest == dest)
-	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	    return;
-	}
+	index = _routeIndex[bucket] - 1;
     }
-
-    // Look for an invalid entry we can use
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    else
     {
-	if (_routes[i].state == Invalid)
-	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	    return;
-	}
+	// Need to make room for a new one
+	if (_routeFree == RH_ROUTING_TABLE_SIZE)
+	    retireOldestRoute();
+	index = _routeFree;
+	_routeFree = _routeNext[index];
+
+	// Take the first empty bucket in the probe sequence
+	bucket = routeBucket(dest);
+	while (_routeIndex[bucket])
+	    bucket = (bucket + 1) & (RH_ROUTING_HASH_SIZE - 1);
+	_routeIndex[bucket] = index + 1;
+
+	_routePrev[index] = _routeNext[index] = RH_ROUTING_TABLE_SIZE;
     }
 
-    // Need to make room for a new one
-    retireOldestRoute();
-    // Should be an invalid slot now
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    _routes[index].dest = dest;
+    _routes[index].next_hop = next_hop;
+    _routes[index].state = state;
+    _routes[index].cost = cost;
+    _routes[index].linkCost = linkCost(next_hop);
+    touchRoute(index);
+}
+
+////////////////////////////////////////////////////////////////////
+RHRouter::RoutingTableEntry* RHRouter::getRouteTo(uint8_t dest)
+{
+    RH_MUTEX_GUARD(_lock);
+    uint16_t bucket = findRouteBucket(dest);
+    if (bucket < RH_ROUTING_HASH_SIZE)
     {
-	if (_routes[i].state == Invalid)
+	uint8_t index = _routeIndex[bucket] - 1;
+	if (_maxRouteAge && (millis() - _routes[index].lastUsed) > _maxRouteAge)
+	{
+	    deleteRoute(index);
+	    _routeEvictions++;
+	}
+	else
 	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
+	    _routeHits++;
+	    touchRoute(index);
+	    return &_routes[index];
 	}
     }
+    _routeMisses++;
+    return NULL;
 }
 
 ////////////////////////////////////////////////////////////////////
-RHRouter::RoutingTableEntry* RHRouter::getRouteTo(uint8_t dest)
+bool RHRouter::hasRouteTo(uint8_t dest)
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
-	if (_routes[i].dest == dest && _routes[i].state != Invalid)
-	    return &_routes[i];
-    return NULL;
+    RH_MUTEX_GUARD(_lock);
+    return findRouteBucket(dest) < RH_ROUTING_HASH_SIZE;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -115,7 +141,7 @@ bool RHRouter::getNextValidRoutingTableEntry(RoutingTableEntry *RTE_p, int *last
   
   if (startIndex >= RH_ROUTING_TABLE_SIZE)
   {
-    return true; // finished, safety.
+    return false; // finished, safety.
   }
   else
   {
@@ -143,18 +169,45 @@ bool RHRouter::getNextValidRoutingTableEntry(RoutingTableEntry *RTE_p, int *last
 ////////////////////////////////////////////////////////////////////
 void RHRouter::deleteRoute(uint8_t index)
 {
-    // Delete a route by copying following routes on top of it
-    memcpy(&_routes[index], &_routes[index+1], 
-	   sizeof(RoutingTableEntry) * (RH_ROUTING_TABLE_SIZE - index - 1));
-    _routes[RH_ROUTING_TABLE_SIZE - 1].state = Invalid;
+    if (index >= RH_ROUTING_TABLE_SIZE || _routes[index].state == Invalid)
+	return;
+
+    uint16_t bucket = findRouteBucket(_routes[index].dest);
+    if (bucket < RH_ROUTING_HASH_SIZE)
+    {
+	// Backward shift deletion: pull later entries of the probe sequence into the hole, 
+	// so lookups never have to step over deleted buckets
+	uint16_t hole = bucket;
+	uint16_t next = bucket;
+	while (true)
+	{
+	    next = (next + 1) & (RH_ROUTING_HASH_SIZE - 1);
+	    if (!_routeIndex[next])
+		break;
+	    uint16_t home = routeBucket(_routes[_routeIndex[next] - 1].dest);
+	    // Move it if its home bucket is not cyclically within (hole, next]
+	    if (((next - home) & (RH_ROUTING_HASH_SIZE - 1)) >= ((next - hole) & (RH_ROUTING_HASH_SIZE - 1)))
+	    {
+		_routeIndex[hole] = _routeIndex[next];
+		hole = next;
+	    }
+	}
+	_routeIndex[hole] = 0;
+    }
+
+    unlinkRoute(index);
+    _routes[index].state = Invalid;
+    _routeNext[index] = _routeFree;
+    _routeFree = index;
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::printRoutingTable()
 {
 #ifdef RH_HAVE_SERIAL
+    unsigned long now = millis();
     uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    for (i = _routeNewest; i < RH_ROUTING_TABLE_SIZE; i = _routeNext[i])
     {
 	Serial.print(i, DEC);
 	Serial.print(" Dest: ");
@@ -162,7 +215,11 @@ void RHRouter::printRoutingTable()
 	Serial.print(" Next Hop: ");
 	Serial.print(_routes[i].next_hop, DEC);
 	Serial.print(" State: ");
-	Serial.println(_routes[i].state, DEC);
+	Serial.print(_routes[i].state, DEC);
+	Serial.print(" Cost: ");
+	Serial.print(_routes[i].cost, DEC);
+	Serial.print(" Age: ");
+	Serial.println(now - _routes[i].lastUsed, DEC);
     }
 #endif
 }
@@ -170,14 +227,12 @@ void RHRouter::printRoutingTable()
 ////////////////////////////////////////////////////////////////////
 bool RHRouter::deleteRouteTo(uint8_t dest)
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    RH_MUTEX_GUARD(_lock);
+    uint16_t bucket = findRouteBucket(dest);
+    if (bucket < RH_ROUTING_HASH_SIZE)
     {
-	if (_routes[i].dest == dest)
-	{
-	    deleteRoute(i);
-	    return true;
-	}
+	deleteRoute(_routeIndex[bucket] - 1);
+	return true;
     }
     return false;
 }
@@ -185,40 +240,175 @@ bool RHRouter::deleteRouteTo(uint8_t dest)
 ////////////////////////////////////////////////////////////////////
 void RHRouter::retireOldestRoute()
 {
-    // We just obliterate the first in the table and clear the last
-    deleteRoute(0);
+    RH_MUTEX_GUARD(_lock);
+    // The tail of the LRU list is the one unused for longest
+    if (_routeOldest < RH_ROUTING_TABLE_SIZE)
+    {
+	deleteRoute(_routeOldest);
+	_routeEvictions++;
+    }
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::clearRoutingTable()
 {
+    RH_MUTEX_GUARD(_lock);
     uint8_t i;
     for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    {
 	_routes[i].state = Invalid;
+	_routeNext[i] = i + 1; // Free list in index order, ends at RH_ROUTING_TABLE_SIZE
+    }
+    memset(_routeIndex, 0, sizeof(_routeIndex));
+    _routeFree = 0;
+    _routeNewest = _routeOldest = RH_ROUTING_TABLE_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::setMaxRouteAge(unsigned long maxAge)
+{
+    _maxRouteAge = maxAge;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::routeHits()
+{
+    return _routeHits;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::routeMisses()
+{
+    return _routeMisses;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::routeEvictions()
+{
+    return _routeEvictions;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::resetRouteStats()
+{
+    _routeHits = _routeMisses = _routeEvictions = 0;
+    _broadcastDuplicates = 0;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::routeBucket(uint8_t dest)
+{
+    // Multiplying by an odd number permutes the addresses, so with 256 buckets there are
+    // no collisions at all, and smaller indexes still spread neighbouring addresses out
+    return (uint8_t)(dest * 157) & (RH_ROUTING_HASH_SIZE - 1);
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHRouter::findRouteBucket(uint8_t dest)
+{
+    // The index is never more than half full, so there is always an empty bucket to stop at
+    uint16_t bucket = routeBucket(dest);
+    while (_routeIndex[bucket])
+    {
+	if (_routes[_routeIndex[bucket] - 1].dest == dest)
+	    return bucket;
+	bucket = (bucket + 1) & (RH_ROUTING_HASH_SIZE - 1);
+    }
+    return RH_ROUTING_HASH_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::touchRoute(uint8_t index)
+{
+    _routes[index].lastUsed = millis();
+    if (_routeNewest == index)
+	return;
+    unlinkRoute(index);
+    _routePrev[index] = RH_ROUTING_TABLE_SIZE;
+    _routeNext[index] = _routeNewest;
+    if (_routeNewest < RH_ROUTING_TABLE_SIZE)
+	_routePrev[_routeNewest] = index;
+    _routeNewest = index;
+    if (_routeOldest == RH_ROUTING_TABLE_SIZE)
+	_routeOldest = index;
 }
 
+////////////////////////////////////////////////////////////////////
+void RHRouter::unlinkRoute(uint8_t index)
+{
+    uint8_t prev = _routePrev[index];
+    uint8_t next = _routeNext[index];
+    if (prev < RH_ROUTING_TABLE_SIZE)
+	_routeNext[prev] = next;
+    else if (_routeNewest == index)
+	_routeNewest = next;
+    if (next < RH_ROUTING_TABLE_SIZE)
+	_routePrev[next] = prev;
+    else if (_routeOldest == index)
+	_routeOldest = prev;
+    _routePrev[index] = _routeNext[index] = RH_ROUTING_TABLE_SIZE;
+}
 
+////////////////////////////////////////////////////////////////////
 uint8_t RHRouter::sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags)
 {
     return sendtoFromSourceWait(buf, len, dest, _thisAddress, flags);
 }
 
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::sendtoWait(RHPacketBuffer& packet, uint8_t dest, uint8_t flags)
+{
+    return sendtoFromSourceWait(packet, dest, _thisAddress, flags);
+}
+
 ////////////////////////////////////////////////////////////////////
 // Waits for delivery to the next hop (but not for delivery to the final destination)
 uint8_t RHRouter::sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags)
 {
-    if (((uint16_t)len + sizeof(RoutedMessageHeader)) > _driver.maxMessageLength())
+    PooledPacket pooled(*this);
+    RHPacketBuffer* packet = pooled.packet();
+    if (!packet)
+	return RH_ROUTER_ERROR_NO_BUFFER;
+    packet->reset(sizeof(RoutedMessageHeader));
+    if (!packet->append(buf, len))
 	return RH_ROUTER_ERROR_INVALID_LENGTH;
+    return sendtoFromSourceWait(*packet, dest, source, flags);
+}
 
-    // Construct a RH RouterMessage message
-    _tmpMessage.header.source = source;
-    _tmpMessage.header.dest = dest;
-    _tmpMessage.header.hops = 0;
-    _tmpMessage.header.id = _lastE2ESequenceNumber++;
-    _tmpMessage.header.flags = flags;
-    memcpy(_tmpMessage.data, buf, len);
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::sendtoFromSourceWait(RHPacketBuffer& packet, uint8_t dest, uint8_t source, uint8_t flags)
+{
+    uint8_t id;
+    {
+	RH_MUTEX_GUARD(_lock);
+	id = _lastE2ESequenceNumber++;
+    }
+    return sendRoutedMessage(packet, dest, source, id, flags, 0);
+}
+
+////////////////////////////////////////////////////////////////////
+// Prepends the RHRouter header in the packet headroom, so the payload is never copied
+uint8_t RHRouter::sendRoutedMessage(RHPacketBuffer& packet, uint8_t dest, uint8_t source, uint8_t id, uint8_t flags, uint8_t hops)
+{
+    if (((uint16_t)packet.len() + sizeof(RoutedMessageHeader)) > _driver.maxMessageLength())
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
 
-    return route(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
+    RoutedMessage* message = (RoutedMessage*)packet.push(sizeof(RoutedMessageHeader));
+    if (!message)
+	return RH_ROUTER_ERROR_INVALID_LENGTH; // No headroom
+    message->header.source = source;
+    message->header.dest = dest;
+    message->header.hops = hops;
+    message->header.id = id;
+    message->header.flags = flags;
+    // So that we ignore it if a neighbour repeats it back to us
+    if (dest == RH_BROADCAST_ADDRESS)
+	recordBroadcast(source, id);
+
+    uint8_t ret = route(message, packet.len());
+    // Leave the packet as the caller gave it to us
+    packet.pull(sizeof(RoutedMessageHeader));
+    return ret;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -228,12 +418,15 @@ uint8_t RHRouter::route(RoutedMessage* message, uint8_t messageLen)
     uint8_t next_hop = RH_BROADCAST_ADDRESS;
     if (message->header.dest != RH_BROADCAST_ADDRESS)
     {
+	RH_MUTEX_GUARD(_lock);
 	RoutingTableEntry* route = getRouteTo(message->header.dest);
 	if (!route)
 	    return RH_ROUTER_ERROR_NO_ROUTE;
 	next_hop = route->next_hop;
     }
 
+    // RHReliableDatagram can only wait for one ack at a time
+    RH_MUTEX_GUARD(_radioLock);
     if (!RHReliableDatagram::sendtoWait((uint8_t*)message, messageLen, next_hop))
 	return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
 
@@ -252,13 +445,30 @@ void RHRouter::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 ////////////////////////////////////////////////////////////////////
 bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
 {  
-    uint8_t tmpMessageLen = sizeof(_tmpMessage);
+    PooledPacket pooled(*this);
+    RHPacketBuffer* packet = pooled.packet();
+    if (!packet || !recvfromAck(*packet, source, dest, id, flags, hops))
+	return false;
+    if (*len > packet->len())
+	*len = packet->len();
+    memcpy(buf, packet->data(), *len);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Messages are delivered or forwarded from the buffer they were received into
+bool RHRouter::recvfromAck(RHPacketBuffer& packet, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
+{  
+    // Until it has been handled, since that uses the headers of the message and may answer or forward it
+    RH_MUTEX_GUARD(_radioLock);
     uint8_t _from;
     uint8_t _to;
     uint8_t _id;
     uint8_t _flags;
-    if (RHReliableDatagram::recvfromAck((uint8_t*)&_tmpMessage, &tmpMessageLen, &_from, &_to, &_id, &_flags))
+    if (   RHReliableDatagram::recvfromAck(packet, &_from, &_to, &_id, &_flags)
+	&& packet.len() >= sizeof(RoutedMessageHeader))
     {
+	RoutedMessage* message = (RoutedMessage*)packet.data();
 	// Here we simulate networks with limited visibility between nodes
 	// so we can test routing
 #ifdef RH_TEST_NETWORK
@@ -308,24 +518,29 @@ bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t*
 	}
 #endif
 
-	peekAtMessage(&_tmpMessage, tmpMessageLen);
+	peekAtMessage(message, packet.len());
+	// Drop copies of broadcasts that have already been handled
+	if (   message->header.dest == RH_BROADCAST_ADDRESS
+	    && !recordBroadcast(message->header.source, message->header.id))
+	{
+	    _broadcastDuplicates++;
+	    duplicateBroadcast(message, packet.len());
+	    return false;
+	}
 	// See if its for us or has to be routed
-	if (_tmpMessage.header.dest == _thisAddress || _tmpMessage.header.dest == RH_BROADCAST_ADDRESS)
+	if (message->header.dest == _thisAddress || message->header.dest == RH_BROADCAST_ADDRESS)
 	{
 	    // Deliver it here
-	    if (source) *source  = _tmpMessage.header.source;
-	    if (dest)   *dest    = _tmpMessage.header.dest;
-	    if (id)     *id      = _tmpMessage.header.id;
-	    if (flags)  *flags   = _tmpMessage.header.flags;
-	    if (hops)   *hops    = _tmpMessage.header.hops;
-	    uint8_t msgLen = tmpMessageLen - sizeof(RoutedMessageHeader);
-	    if (*len > msgLen)
-		*len = msgLen;
-	    memcpy(buf, _tmpMessage.data, *len);
+	    if (source) *source  = message->header.source;
+	    if (dest)   *dest    = message->header.dest;
+	    if (id)     *id      = message->header.id;
+	    if (flags)  *flags   = message->header.flags;
+	    if (hops)   *hops    = message->header.hops;
+	    packet.pull(sizeof(RoutedMessageHeader));
 	    return true; // Its for you!
 	}
-	else if (   _tmpMessage.header.dest != RH_BROADCAST_ADDRESS
-		 && _tmpMessage.header.hops++ < _max_hops)
+	else if (   message->header.dest != RH_BROADCAST_ADDRESS
+		 && message->header.hops++ < _max_hops)
 	{
 	    // Maybe it has to be routed to the next hop
 	    // REVISIT: if it fails due to no route or unable to deliver to the next hop, 
@@ -333,13 +548,71 @@ bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t*
 	    
 	    // If we are forwarding packets, do so. Otherwise, drop.
 	    if (_isa_router)
-	        route(&_tmpMessage, tmpMessageLen);
+	        route(message, packet.len());
 	}
 	// Discard it and maybe wait for another
     }
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+RHPacketBuffer* RHRouter::allocatePacket()
+{
+    RH_MUTEX_GUARD(_lock);
+    for (uint8_t i = 0; i < RH_ROUTER_PACKETS; i++)
+    {
+	if (!_packetUsed[i])
+	{
+	    _packetUsed[i] = true;
+	    _packets[i].reset();
+	    return &_packets[i];
+	}
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::freePacket(RHPacketBuffer* packet)
+{
+    RH_MUTEX_GUARD(_lock);
+    _packetUsed[packet - _packets] = false;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::recordBroadcast(uint8_t source, uint8_t id)
+{
+    RH_MUTEX_GUARD(_lock);
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < RH_ROUTER_SEEN_CACHE_SIZE; i++)
+    {
+	if (   _seen[i].source == source
+	    && _seen[i].id == id
+	    && (now - _seen[i].seenAt) < RH_ROUTER_SEEN_TIMEOUT)
+	    return false;
+    }
+    // New one: replace the oldest
+    _seen[_seenNext].source = source;
+    _seen[_seenNext].id = id;
+    _seen[_seenNext].seenAt = now;
+    _seenNext = (_seenNext + 1) % RH_ROUTER_SEEN_CACHE_SIZE;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Subclasses may want to override this to count duplicate broadcasts
+void RHRouter::duplicateBroadcast(RoutedMessage* message, uint8_t messageLen)
+{
+  // Default does nothing
+  (void)message; // Not used
+  (void)messageLen; // Not used
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::broadcastDuplicates()
+{
+    return _broadcastDuplicates;
+}
+
 ////////////////////////////////////////////////////////////////////
 bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
 {  
@@ -357,3 +630,20 @@ bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout,
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+bool RHRouter::recvfromAckTimeout(RHPacketBuffer& packet, uint16_t timeout, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
+{  
+    unsigned long starttime = millis();
+    int32_t timeLeft;
+    while ((timeLeft = timeout - (millis() - starttime)) > 0)
+    {
+	if (waitAvailableTimeout(timeLeft))
+	{
+	    if (recvfromAck(packet, source, dest, id, flags, hops))
+		return true;
+	}
+	YIELD;
+    }
+    return false;
+}
+
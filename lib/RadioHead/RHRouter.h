@@ -12,8 +12,63 @@
 // Default max number of hops we will route
 #define RH_DEFAULT_MAX_HOPS 30
 
-// The default size of the routing table we keep
-#define RH_ROUTING_TABLE_SIZE 10
+// The default size of the routing table we keep. Platforms with plenty of RAM default to one
+// entry for every possible node address. Can be overridden on the compiler command line,
+// up to a maximum of 255.
+#ifndef RH_ROUTING_TABLE_SIZE
+ #if (RH_PLATFORM == RH_PLATFORM_ESP32) || (RH_PLATFORM == RH_PLATFORM_ESP8266) || (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+  #define RH_ROUTING_TABLE_SIZE 255
+ #else
+  #define RH_ROUTING_TABLE_SIZE 10
+ #endif
+#endif
+
+#if RH_ROUTING_TABLE_SIZE > 255
+ #error RH_ROUTING_TABLE_SIZE must be 255 or less
+#endif
+
+// Size of the hash index over the routing table: a power of 2 at least twice
+// RH_ROUTING_TABLE_SIZE, so probe sequences stay short. With 256 buckets every
+// address has a bucket of its own.
+#if RH_ROUTING_TABLE_SIZE > 64
+ #define RH_ROUTING_HASH_SIZE 256
+#elif RH_ROUTING_TABLE_SIZE > 32
+ #define RH_ROUTING_HASH_SIZE 128
+#elif RH_ROUTING_TABLE_SIZE > 16
+ #define RH_ROUTING_HASH_SIZE 64
+#elif RH_ROUTING_TABLE_SIZE > 8
+ #define RH_ROUTING_HASH_SIZE 32
+#else
+ #define RH_ROUTING_HASH_SIZE 16
+#endif
+
+// Number of recently received broadcast messages remembered, so that copies of the same
+// broadcast arriving by other paths can be dropped. Can be overridden on the compiler command line
+#ifndef RH_ROUTER_SEEN_CACHE_SIZE
+ #if (RH_PLATFORM == RH_PLATFORM_ESP32) || (RH_PLATFORM == RH_PLATFORM_ESP8266) || (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+  #define RH_ROUTER_SEEN_CACHE_SIZE 32
+ #else
+  #define RH_ROUTER_SEEN_CACHE_SIZE 8
+ #endif
+#endif
+
+// How long a broadcast is remembered in the seen cache, in milliseconds. Long enough for a flood
+// to die out, short enough that a rebooted node reusing its message IDs is not ignored for long
+#ifndef RH_ROUTER_SEEN_TIMEOUT
+ #define RH_ROUTER_SEEN_TIMEOUT 10000
+#endif
+
+// Number of RHPacketBuffers each instance has for the messages it is sending and receiving.
+// A send or receive takes one for as long as it needs it, and answering or forwarding a received 
+// message takes a second, so 2 are enough for one thread. Allow for two threads or tasks at once
+// where the managers lock themselves
+#ifndef RH_ROUTER_PACKETS
+ #if defined(RH_USE_MUTEX) || (RH_PLATFORM == RH_PLATFORM_ESP32)
+  #define RH_ROUTER_PACKETS 4
+ #else
+  #define RH_ROUTER_PACKETS 2
+ #endif
+#endif
 
 // Error codes
 #define RH_ROUTER_ERROR_NONE              0
@@ -22,6 +77,9 @@
 #define RH_ROUTER_ERROR_TIMEOUT           3
 #define RH_ROUTER_ERROR_NO_REPLY          4
 #define RH_ROUTER_ERROR_UNABLE_TO_DELIVER 5
+#define RH_ROUTER_ERROR_QUEUED            6
+#define RH_ROUTER_ERROR_QUEUE_FULL        7
+#define RH_ROUTER_ERROR_NO_BUFFER         8
 
 // This size of RH_ROUTER_MAX_MESSAGE_LEN is OK for Arduino Mega, but too big for
 // Duemilanove. Size of 50 works with the sample router programs on Duemilanove.
@@ -91,10 +149,49 @@
 /// You can also use addRouteTo() to change a route and 
 /// deleteRouteTo() to delete a route at run time. Youcan also clear the entire routing table
 ///
-/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which is 10)
-/// if more than RH_ROUTING_TABLE_SIZE are added, the oldest (first) one will be removed by calling 
+/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which is 255 
+/// on ESP32, ESP8266, Linux and Raspberry Pi and 10 elsewhere, and can be set on the compiler command line).
+/// If more than RH_ROUTING_TABLE_SIZE are added, the least recently used one will be removed by calling 
 /// retireOldestRoute()
 ///
+/// Routes are found through a hash index on the destination address, so lookups, additions and 
+/// deletions take the same time however large the table is. Each entry records when it was last 
+/// added or looked up, and the entries are kept in least recently used order. 
+/// setMaxRouteAge() can be used to expire routes that have not been used for a while.
+/// routeHits(), routeMisses() and routeEvictions() count how the table is performing, which helps 
+/// when choosing RH_ROUTING_TABLE_SIZE for a network.
+///
+/// \par Broadcasts
+///
+/// RHRouter remembers the SOURCE address and ID of the last RH_ROUTER_SEEN_CACHE_SIZE broadcast 
+/// messages it received (or sent), for RH_ROUTER_SEEN_TIMEOUT milliseconds. A broadcast 
+/// that has been seen before is a copy of one that has already been handled, which has come 
+/// by another path, and is dropped. broadcastDuplicates() counts them. This is what stops the 
+/// route discovery floods of RHMesh from circulating around the network.
+///
+/// \par Buffers and Multithreading
+///
+/// Each RHRouter (and RHMesh) instance has its own pool of RH_ROUTER_PACKETS buffers for the messages 
+/// it is sending and receiving, so any number of instances can be used at once, for example with 
+/// several radios. Each send or receive takes a buffer from the pool for as long as it needs it.
+/// The buffers are RHPacketBuffers, which have room in front of the message for the
+/// RHRouter and RHMesh headers, so each layer adds or removes its header in place and a message
+/// passes through all the layers without being copied. Messages to be forwarded are sent on 
+/// from the buffer they were received into. 
+/// Applications can use RHPacketBuffers themselves, with the buffer versions of sendtoWait() and 
+/// recvfromAck(), to avoid the remaining copy between their own buffer and the pool.
+///
+/// If RH_USE_MUTEX is defined, and always on ESP32 (where they are FreeRTOS mutexes), each instance also 
+/// has two (recursive) mutexes, so several threads or tasks can send and receive through the same instance
+/// without any locking of their own. One is held only while the routing table, the pool and (in RHMesh)
+/// the queues are changed, never while the radio is in use, so they can always be read and changed at once.
+/// The other is held for each exchange with a neighbour (a message and its acknowledgement), and while a 
+/// received message is answered or forwarded, since RHReliableDatagram can only wait for one acknowledgement 
+/// at a time. So messages from several threads still go out one hop at a time, but a thread waiting for a 
+/// route discovery in RHMesh, or for a message in recvfromAckTimeout(), does not hold up the others. 
+/// If the pool runs out, for example with more than two threads, sendtoWait() returns 
+/// RH_ROUTER_ERROR_NO_BUFFER and recvfromAck() returns false.
+///
 /// \par Message Format
 ///
 /// RHRouter add to the lower level RHReliableDatagram (and even lower level RH) class message formats. 
@@ -166,6 +263,9 @@ public:
 	uint8_t      dest;      ///< Destination node address
 	uint8_t      next_hop;  ///< Send via this next hop address
 	uint8_t      state;     ///< State of this route, one of RouteState
+	uint8_t      cost;      ///< Cost of the path to dest in 1/RH_LINK_COST_SCALE expected transmissions, 0 if not known
+	uint8_t      linkCost;  ///< linkCost() of next_hop when the route was added
+	unsigned long lastUsed; ///< millis() when this route was last added, updated or looked up
     } RoutingTableEntry;
 
     /// Constructor. 
@@ -194,32 +294,63 @@ public:
     void setMaxHops(uint8_t max_hops);
 
     /// Adds a route to the local routing table, or updates it if already present.
-    /// If there is not enough room the oldest (first) route will be deleted by calling retireOldestRoute().
+    /// If there is not enough room the least recently used route will be deleted by calling retireOldestRoute().
+    /// Adding a route with a state of Invalid deletes any route to dest.
     /// \param [in] dest The destination node address. RH_BROADCAST_ADDRESS is permitted.
     /// \param [in] next_hop The address of the next hop to send messages destined for dest
     /// \param [in] state The satte of the route. Defaults to Valid
-    void addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state = Valid);
+    /// \param [in] cost The cost of the path to dest, if known (see RHReliableDatagram::linkCost()). 
+    /// Defaults to 0, not known
+    void addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state = Valid, uint8_t cost = 0);
 
-    /// Finds and returns a RoutingTableEntry for the given destination node
+    /// Finds and returns a RoutingTableEntry for the given destination node, and marks it 
+    /// as the most recently used route. Counted in routeHits() or routeMisses().
     /// \param [in] dest The desired destination node address.
-    /// \return pointer to a RoutingTableEntry for dest
+    /// \return pointer to a RoutingTableEntry for dest, or NULL if there is none, or it has 
+    /// not been used for longer than the maximum route age
     RoutingTableEntry* getRouteTo(uint8_t dest);
 
+    /// Tests whether there is a route to the destination node, without using it
+    /// or counting it in routeHits() and routeMisses()
+    /// \param [in] dest The destination node address
+    /// \return true if there is a route
+    bool hasRouteTo(uint8_t dest);
+
     /// Deletes from the local routing table any route for the destination node.
     /// \param [in] dest The destination node address
     /// \return true if the route was present
     bool deleteRouteTo(uint8_t dest);
 
-    /// Deletes the oldest (first) route from the 
+    /// Deletes the least recently used route from the 
     /// local routing table
     void retireOldestRoute();
 
+    /// Sets the maximum age of a route. A route that has not been added, updated or looked up
+    /// for longer than this is deleted the next time it is looked up.
+    /// \param [in] maxAge Maximum age in milliseconds. 0 (the default) means routes never expire.
+    void setMaxRouteAge(unsigned long maxAge);
+
+    /// \return The number of getRouteTo() calls that found a route
+    uint32_t routeHits();
+
+    /// \return The number of getRouteTo() calls that did not find a route, including expired routes
+    uint32_t routeMisses();
+
+    /// \return The number of routes deleted by retireOldestRoute() or setMaxRouteAge() expiry
+    uint32_t routeEvictions();
+
+    /// \return The number of broadcast messages dropped because they had been seen before
+    uint32_t broadcastDuplicates();
+
+    /// Zeroes the routeHits(), routeMisses(), routeEvictions() and broadcastDuplicates() counters
+    void resetRouteStats();
+
     /// Clears all entries from the 
     /// local routing table
     void clearRoutingTable();
 
     /// If RH_HAVE_SERIAL is defined, this will print out the contents of the local 
-    /// routing table using Serial
+    /// routing table using Serial, most recently used first
     void printRoutingTable();
 
     /// Method for iterating through the current routing table
@@ -227,7 +358,7 @@ public:
     ///    caller is responsible for alloocating and deallocating the structure.
     /// \param [inout] lastIndex_p points to the index to start searching from. Set to the
     ///   index of the next valid route found. Set this to -1 to start the search.
-    /// \return false if next entry is valid, true if finished with table.
+    /// \return true if a valid entry was found, false if finished with table.
     bool getNextValidRoutingTableEntry(RoutingTableEntry *RTE_p, int *lastIndex_p); //blase 7/27/20 
 
 
@@ -247,8 +378,21 @@ public:
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
+    ///         - RH_ROUTER_ERROR_NO_BUFFER No buffer was free in the pool, see Buffers and Multithreading
     uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
 
+    /// Same as sendtoWait() above, but sends the message in a RHPacketBuffer. The RHRouter header is
+    /// put in the headroom in front of the message, so the message is not copied. 
+    /// The packet is unchanged when this returns.
+    /// \param [in] packet The application message data. Must have at least 
+    ///              sizeof(RoutedMessageHeader) octets of headroom
+    /// \param [in] dest The destination node address
+    /// \param [in] flags Optional flags for use by subclasses or application layer, 
+    ///             delivered end-to-end to the dest address. The receiver can recover the flags with recvFromAck().
+    /// \return The result code, as for sendtoWait() above. RH_ROUTER_ERROR_INVALID_LENGTH if the 
+    ///         packet does not have enough headroom.
+    uint8_t sendtoWait(RHPacketBuffer& packet, uint8_t dest, uint8_t flags = 0);
+
     /// Similar to sendtoWait() above, but spoofs the source address.
     /// For internal use only during routing
     /// \param [in] buf The application message data.
@@ -263,8 +407,18 @@ public:
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Noyt able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
+    ///         - RH_ROUTER_ERROR_NO_BUFFER No buffer was free in the pool, see Buffers and Multithreading
     uint8_t sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags = 0);
 
+    /// Same as sendtoFromSourceWait() above, but sends the message in a RHPacketBuffer
+    /// For internal use only during routing
+    /// \param [in] packet The application message data, with headroom for the RHRouter header.
+    /// \param [in] dest The destination node address.
+    /// \param [in] source The (fake) originating node address.
+    /// \param [in] flags Optional flags for use by subclasses or application layer.
+    /// \return The result code, as for sendtoFromSourceWait() above.
+    uint8_t sendtoFromSourceWait(RHPacketBuffer& packet, uint8_t dest, uint8_t source, uint8_t flags = 0);
+
     /// Starts the receiver if it is not running already.
     /// If there is a valid message available for this node (or RH_BROADCAST_ADDRESS), 
     /// send an acknowledgement to the last hop
@@ -288,6 +442,19 @@ public:
     /// \return true if a valid message was recvived for this node copied to buf
     bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
 
+    /// Same as recvfromAck() above, but receives into a RHPacketBuffer, replacing anything that was in it.
+    /// The application message payload is left in place, starting at packet.data(): the RHRouter 
+    /// header is pulled off the front, and remains available as headroom. Messages for other nodes
+    /// are forwarded from the same buffer.
+    /// \param[out] packet Buffer to receive the message into
+    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \param[in] hops If present and not NULL, the referenced uint8_t will be set to the HOPS
+    /// \return true if a valid message for this node is in packet
+    bool recvfromAck(RHPacketBuffer& packet, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+
     /// Starts the receiver if it is not running already.
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
     /// or the timeout expires. 
@@ -303,6 +470,17 @@ public:
     /// \return true if a valid message was copied to buf
     bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
 
+    /// Same as recvfromAckTimeout() above, but receives into a RHPacketBuffer, as recvfromAck(RHPacketBuffer&) does.
+    /// \param[out] packet Buffer to receive the message into
+    /// \param[in] timeout Maximum time to wait in milliseconds
+    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \param[in] hops If present and not NULL, the referenced uint8_t will be set to the HOPS
+    /// \return true if a valid message for this node is in packet
+    bool recvfromAckTimeout(RHPacketBuffer& packet, uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+
 protected:
 
     /// Lets sublasses peek at messages going 
@@ -319,7 +497,31 @@ protected:
     /// \param [in] messageLen Length of message in octets
     virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
 
-    /// Deletes a specific rout entry from therouting table
+    /// Sends a message with a complete RHRouter header, for forwarding a message on behalf of 
+    /// its originator. The header is put in the packet headroom, and the packet is unchanged when this returns.
+    /// \param [in] packet The application message data, with headroom for the RHRouter header.
+    /// \param [in] dest The destination node address.
+    /// \param [in] source The originating node address.
+    /// \param [in] id The originator sequence number.
+    /// \param [in] flags The originator flags.
+    /// \param [in] hops Hops traversed so far.
+    /// \return The result code, as for sendtoWait()
+    uint8_t sendRoutedMessage(RHPacketBuffer& packet, uint8_t dest, uint8_t source, uint8_t id, uint8_t flags, uint8_t hops);
+
+    /// Checks a broadcast message against the seen cache, and adds it to the cache if it is new
+    /// \param [in] source The originating node address of the broadcast
+    /// \param [in] id The originator sequence number of the broadcast
+    /// \return true if the broadcast has not been seen in the last RH_ROUTER_SEEN_TIMEOUT milliseconds
+    bool recordBroadcast(uint8_t source, uint8_t id);
+
+    /// Lets subclasses see broadcasts that are dropped because they have been seen before,
+    /// for example to count how many neighbours have already rebroadcast a message.
+    /// Called by recvfromAck()
+    /// \param [in] message Pointer to the RHRouter message that was received.
+    /// \param [in] messageLen Length of message in octets
+    virtual void duplicateBroadcast(RoutedMessage* message, uint8_t messageLen);
+
+    /// Deletes a specific rout entry from therouting table. Other entries keep their index.
     /// \param [in] index The 0 based index of the routing table entry to delete
     void deleteRoute(uint8_t index);
 
@@ -334,13 +536,91 @@ protected:
     /// Flag to set if packets are forwarded or not
     bool _isa_router;
 
+    /// Takes a buffer from the pool
+    /// \return The buffer, reset with the default headroom, or NULL if they are all in use
+    RHPacketBuffer* allocatePacket();
+
+    /// Returns a buffer to the pool
+    /// \param [in] packet A buffer returned by allocatePacket()
+    void freePacket(RHPacketBuffer* packet);
+
+    /// Holds a buffer from the pool until the end of the enclosing block
+    class PooledPacket
+    {
+    public:
+	PooledPacket(RHRouter& router) : _router(router), _packet(router.allocatePacket()) {}
+	~PooledPacket() { if (_packet) _router.freePacket(_packet); }
+	/// \return The buffer, or NULL if the pool was empty
+	RHPacketBuffer* packet() { return _packet; }
+    private:
+	RHRouter&       _router;
+	RHPacketBuffer* _packet;
+    };
+
+    /// Buffers for the messages being sent and received
+    RHPacketBuffer _packets[RH_ROUTER_PACKETS];
+
+    /// Which of _packets are in use
+    bool _packetUsed[RH_ROUTER_PACKETS];
+
+    /// Held while changing the routing table or the pool, if RH_USE_MUTEX is defined or on ESP32. 
+    /// Never held while using the radio
+    RH_DECLARE_MUTEX(_lock)
+
+    /// Held for each exchange with a neighbour, and while a received message is handled,
+    /// if RH_USE_MUTEX is defined or on ESP32
+    RH_DECLARE_MUTEX(_radioLock)
+
 private:
 
-    /// Temporary mesage buffer
-    static RoutedMessage _tmpMessage;
+    /// Returns the bucket in _routeIndex where the search for dest starts
+    uint8_t routeBucket(uint8_t dest);
+
+    /// Returns the bucket in _routeIndex that refers to dest, or RH_ROUTING_HASH_SIZE if none
+    uint16_t findRouteBucket(uint8_t dest);
+
+    /// Moves a routing table entry to the most recently used end of the LRU list
+    void touchRoute(uint8_t index);
+
+    /// Removes a routing table entry from the LRU list
+    void unlinkRoute(uint8_t index);
 
     /// Local routing table
     RoutingTableEntry    _routes[RH_ROUTING_TABLE_SIZE];
+
+    /// Open addressed hash index into _routes. Each bucket holds a _routes index + 1, or 0 if empty
+    uint8_t              _routeIndex[RH_ROUTING_HASH_SIZE];
+
+    /// Doubly linked LRU list through _routes, by index. RH_ROUTING_TABLE_SIZE marks the ends.
+    /// Unused entries are kept on a free list through _routeNext.
+    uint8_t              _routePrev[RH_ROUTING_TABLE_SIZE];
+    uint8_t              _routeNext[RH_ROUTING_TABLE_SIZE];
+    uint8_t              _routeNewest;
+    uint8_t              _routeOldest;
+    uint8_t              _routeFree;
+
+    /// Routes unused for longer than this many milliseconds are expired. 0 means never
+    unsigned long        _maxRouteAge;
+
+    /// Routing table counters
+    uint32_t             _routeHits;
+    uint32_t             _routeMisses;
+    uint32_t             _routeEvictions;
+
+    /// A broadcast message that has been received or sent recently
+    typedef struct
+    {
+	uint8_t         source;  ///< Originator node address, RH_BROADCAST_ADDRESS if the entry is unused
+	uint8_t         id;      ///< Originator sequence number
+	unsigned long   seenAt;  ///< millis() when it was first seen
+    } SeenBroadcast;
+
+    /// Ring of recently seen broadcasts. _seenNext is the oldest entry, which is replaced next
+    SeenBroadcast        _seen[RH_ROUTER_SEEN_CACHE_SIZE];
+    uint8_t              _seenNext;
+
+    /// Count of duplicate broadcasts dropped
+    uint32_t             _broadcastDuplicates;
 };
 
 /// @example rf22_router_client.pde
@@ -79,8 +79,7 @@ uint8_t RH_INTERRUPT_ATTR RHSPIDriver::spiBurstRead(uint8_t reg, uint8_t* dest,
     _spi.beginTransaction();
     selectSlave();
     status = _spi.transfer(reg & ~RH_SPI_WRITE_MASK); // Send the start address with the write mask off
-    while (len--)
-	*dest++ = _spi.transfer(0);
+    _spi.transferBuffer(NULL, dest, len);
     deselectSlave();
     _spi.endTransaction();
     ATOMIC_BLOCK_END;
@@ -94,14 +93,38 @@ uint8_t RH_INTERRUPT_ATTR RHSPIDriver::spiBurstWrite(uint8_t reg, const uint8_t*
     _spi.beginTransaction();
     selectSlave();
     status = _spi.transfer(reg | RH_SPI_WRITE_MASK); // Send the start address with the write mask on
-    while (len--)
-	_spi.transfer(*src++);
+    _spi.transferBuffer(src, NULL, len);
     deselectSlave();
     _spi.endTransaction();
     ATOMIC_BLOCK_END;
     return status;
 }
 
+void RH_INTERRUPT_ATTR RHSPIDriver::spiBatch(Access* accesses, uint8_t count)
+{
+    ATOMIC_BLOCK_START;
+    _spi.beginTransaction();
+    while (count--)
+    {
+	bool write = accesses->reg & RH_SPI_WRITE_MASK;
+	selectSlave();
+	_spi.transfer(accesses->reg); // The address, with the write mask as given
+	if (accesses->data)
+	    _spi.transferBuffer(write ? accesses->data : NULL, write ? NULL : accesses->data, accesses->len);
+	else if (write)
+	{
+	    _spi.transfer(accesses->value);
+	    delayMicroseconds(1); // As in spiWrite()
+	}
+	else
+	    accesses->value = _spi.transfer(0);
+	deselectSlave();
+	accesses++;
+    }
+    _spi.endTransaction();
+    ATOMIC_BLOCK_END;
+}
+
 void RHSPIDriver::setSlaveSelectPin(uint8_t slaveSelectPin)
 {
     _slaveSelectPin = slaveSelectPin;
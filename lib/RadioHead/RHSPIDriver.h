@@ -33,11 +33,25 @@ class RHGenericSPI;
 /// in subclasses if necessaryor an alternative class, RHNRFSPIDriver can be used to access devices like 
 /// Nordic NRF series radios, which have different requirements.
 ///
+/// Each of the read and write routines is one SPI bus transaction: interrupts are disabled,
+/// beginTransaction() is called and the slave is selected. Drivers that make several accesses at a time
+/// (for example to handle an interrupt) can make them all in one bus transaction with spiBatch(),
+/// which only selects the slave anew for each access.
+///
 /// Application developers are not expected to instantiate this class directly: 
 /// it is for the use of Driver developers.
 class RHSPIDriver : public RHGenericDriver
 {
 public:
+    /// \brief One register access in a batch passed to spiBatch()
+    typedef struct
+    {
+	uint8_t  reg;   ///< Register number. Or it with RH_SPI_WRITE_MASK to write it
+	uint8_t  value; ///< Value to write, or the value read, if data is NULL
+	uint8_t  len;   ///< Number of consecutive registers to access through data
+	uint8_t* data;  ///< Values to write or read in burst mode, or NULL to access the one register through value
+    } Access;
+
     /// Constructor
     /// \param[in] slaveSelectPin The controler pin to use to select the desired SPI device. This pin will be driven LOW
     /// during SPI communications with the SPI device that uis iused by this Driver.
@@ -77,6 +91,14 @@ public:
     ///  it may or may not be meaningfule depending on the the type of device being accessed.
     uint8_t           spiBurstWrite(uint8_t reg, const uint8_t* src, uint8_t len);
 
+    /// Makes a number of register accesses, which need not be to consecutive registers, in one SPI bus
+    /// transaction, selecting the slave for each one. Each may read or write a single register or,
+    /// through its data, a number of consecutive registers in burst mode.
+    /// Cheaper than the equivalent spiRead(), spiWrite() and burst calls, each of which is a bus transaction.
+    /// \param[in,out] accesses Array of accesses, made in order. Values read are stored in value or data
+    /// \param[in] count Number of accesses
+    void              spiBatch(Access* accesses, uint8_t count);
+
     /// Set or change the pin to be used for SPI slave select.
     /// This can be called at any time to change the
     /// pin that will be used for slave select in subsquent SPI operations.
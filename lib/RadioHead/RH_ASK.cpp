@@ -69,6 +69,18 @@ RH_DRAM_ATTR static uint8_t symbols[] =
     0x23, 0x25, 0x26, 0x29, 0x2a, 0x2c, 0x32, 0x34
 };
 
+#if !defined(__AVR__)
+// 6 bit to 4 bit symbol converter table, the reverse of symbols[]. Invalid symbols decode to 0.
+// Not used on AVR, where the 64 bytes of RAM are worth more than the time saved
+RH_DRAM_ATTR static const uint8_t symbols6to4[64] =
+{
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  0,
+     0,  0,  0,  2,  0,  3,  4,  0,  0,  5,  6,  0,  7,  0,  0,  0,
+     0,  0,  0,  8,  0,  9, 10,  0,  0, 11, 12,  0, 13,  0,  0,  0,
+     0,  0, 14,  0, 15,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0
+};
+#endif
+
 // This is the value of the start symbol after 6-bit conversion and nybble swapping
 #define RH_ASK_START_SYMBOL 0xb38
 
@@ -678,9 +690,9 @@ bool RH_ASK::send(const uint8_t* data, uint8_t len)
 
     // Encode the message into 6 bit symbols. Each byte is converted into 
     // 2 6-bit symbols, high nybble first, low nybble second
+    crc = RHcrc_ccitt_update_buf(crc, data, len);
     for (i = 0; i < len; i++)
     {
-	crc = RHcrc_ccitt_update(crc, data[i]);
 	p[index++] = symbols[data[i] >> 4];
 	p[index++] = symbols[data[i] & 0xf];
     }
@@ -902,10 +914,13 @@ ISR(RH_ATTINY_MEGA_ASK_TIMER_VECTOR)
 // Convert a 6 bit encoded symbol into its 4 bit decoded equivalent
 uint8_t RH_INTERRUPT_ATTR RH_ASK::symbol_6to4(uint8_t symbol)
 {
+#if !defined(__AVR__)
+    return symbols6to4[symbol & 0x3f];
+#else
     uint8_t i;
     uint8_t count;
     
-    // Linear search :-( Could have a 64 byte reverse lookup table?
+    // Linear search :-( 
     // There is a little speedup here courtesy Ralph Doncaster:
     // The shortcut works because bit 5 of the symbol is 1 for the last 8
     // symbols, and it is 0 for the first 8.
@@ -914,6 +929,7 @@ uint8_t RH_INTERRUPT_ATTR RH_ASK::symbol_6to4(uint8_t symbol)
 	if (symbol == symbols[i]) return i;
 
     return 0; // Not found
+#endif
 }
 
 // Check whether the latest received message is complete and uncorrupted
@@ -921,10 +937,8 @@ uint8_t RH_INTERRUPT_ATTR RH_ASK::symbol_6to4(uint8_t symbol)
 // since it is slow
 void RH_ASK::validateRxBuf()
 {
-    uint16_t crc = 0xffff;
     // The CRC covers the byte count, headers and user data
-    for (uint8_t i = 0; i < _rxBufLen; i++)
-	crc = RHcrc_ccitt_update(crc, _rxBuf[i]);
+    uint16_t crc = RHcrc_ccitt_update_buf(0xffff, _rxBuf, _rxBufLen);
     if (crc != 0xf0b8) // CRC when buffer and expected CRC are CRC'd
     {
 	// Reject and drop the message
@@ -12,12 +12,14 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <poll.h>
 
 RH_LoRaFileOps::RH_LoRaFileOps(const char* port)
     :
     _port(port),
-    _fd(-1)
+    _fd(-1),
+    _lastSNR(0),
+    _readMetadata(true)
 {
 }
 
@@ -48,65 +50,92 @@ bool RH_LoRaFileOps::init()
 
 bool RH_LoRaFileOps::available()
 {
+    if (_fd == -1) return false;
+
     // Test if the port can be read
-    fd_set read_fds;
-    struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
-    FD_ZERO(&read_fds);
-    FD_SET(_fd, &read_fds);
-    if (select(_fd+1, &read_fds, NULL, NULL, &tv) == -1)
+    struct pollfd pfd;
+    pfd.fd = _fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) == -1)
     {
-	Serial.println("Select failed");
+	Serial.println("Poll failed");
 	return false;
     }
-  
-    return FD_ISSET(_fd, &read_fds) ? true : false;
-    
+    return (pfd.revents & POLLIN) ? true : false;
 }
 
-bool RH_LoRaFileOps::recv(uint8_t* buf, uint8_t* len)
+bool RH_LoRaFileOps::readPacket(RHLoRaFileOpsPacket* packet)
 {
     if (_fd == -1) return false;
 
+    // Read the available packet from the driver
+    ssize_t sz = read(_fd, packet->buf, sizeof(packet->buf));
+    packet->timestamp = millis();
+    if (_readMetadata)
+    {
+	// Per page 111, SX1276/77/78/79 datasheet. The RSSI has already been massaged by the driver 
+	packet->snr = getSNR();
+	packet->rssi = getRSSI();
+    }
+    else
+    {
+	packet->snr = 0;
+	packet->rssi = 0;
+    }
+    if (sz < RH_LORAFILEOPS_HEADER_LEN)
+	return false; // Too short to be a real message
+    packet->len = sz;
+    return true;
+}
+
+bool RH_LoRaFileOps::recv(uint8_t* buf, uint8_t* len)
+{
     if (!available()) return false;
 
-    // Read the available packet from the driver
-    uint8_t readbuf[RH_LORAFILEOPS_MAX_PAYLOAD_LEN];
-    ssize_t sz;
-    sz = read(_fd, readbuf, RH_LORAFILEOPS_MAX_PAYLOAD_LEN);
+    RHLoRaFileOpsPacket packet;
+    if (!readPacket(&packet))
+	return false;
 
     // Remember the last signal to noise ratio, LORA mode
-    // Per page 111, SX1276/77/78/79 datasheet
-    _lastSNR = getSNR();
+    _lastSNR = packet.snr;
 
     // Remember the RSSI of this packet, LORA mode
-    // This figure has already been massaged by the driver 
-    _lastRssi = getRSSI();
+    _lastRssi = packet.rssi;
 
     // Test if its really for us
-    if (sz < 4)
-	return false; // Too short to be a real message
     // Extract the 4 headers
-    _rxHeaderTo    = readbuf[0];
-    _rxHeaderFrom  = readbuf[1];
-    _rxHeaderId    = readbuf[2];
-    _rxHeaderFlags = readbuf[3];
+    _rxHeaderTo    = packet.buf[0];
+    _rxHeaderFrom  = packet.buf[1];
+    _rxHeaderId    = packet.buf[2];
+    _rxHeaderFlags = packet.buf[3];
     if (_promiscuous ||
 	_rxHeaderTo == _thisAddress ||
 	_rxHeaderTo == RH_BROADCAST_ADDRESS)
     {
 	// Yes its for us
 	// Skip the 4 headers that are at the beginning of the rxBuf
-	if (*len > (sz - RH_LORAFILEOPS_HEADER_LEN))
-	    *len = sz - RH_LORAFILEOPS_HEADER_LEN;
-	memcpy(buf, readbuf + RH_LORAFILEOPS_HEADER_LEN, *len);
-	Serial.println("recv OK");
+	if (buf && len)
+	{
+	    if (*len > (packet.len - RH_LORAFILEOPS_HEADER_LEN))
+		*len = packet.len - RH_LORAFILEOPS_HEADER_LEN;
+	    memcpy(buf, packet.buf + RH_LORAFILEOPS_HEADER_LEN, *len);
+	}
+	_rxGood++;
 	return true;
     }
 
     // Not for us
     return false;
-  
-    
+}
+
+void RH_LoRaFileOps::setReadMetadata(bool readMetadata)
+{
+    _readMetadata = readMetadata;
+}
+
+int RH_LoRaFileOps::fd() const
+{
+    return _fd;
 }
 
 bool RH_LoRaFileOps::send(const uint8_t* data, uint8_t len)
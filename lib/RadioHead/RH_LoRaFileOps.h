@@ -99,6 +99,16 @@
 #define RH_LORAFILEOPS_MAX_MESSAGE_LEN (RH_LORAFILEOPS_MAX_PAYLOAD_LEN - RH_LORAFILEOPS_HEADER_LEN)
 #endif
 
+/// \brief A packet as read from a lora-file-ops device, with its signal quality
+typedef struct
+{
+    uint32_t timestamp;  ///< millis() when it was read
+    int16_t  rssi;       ///< RSSI as reported by the driver, if metadata reads are enabled
+    int8_t   snr;        ///< SNR in dB, if metadata reads are enabled
+    uint8_t  len;        ///< Number of octets in buf, including the 4 headers
+    uint8_t  buf[RH_LORAFILEOPS_MAX_PAYLOAD_LEN]; ///< The headers (TO, FROM, ID, FLAGS), then the data
+} RHLoRaFileOpsPacket;
+
 /////////////////////////////////////////////////////////////////////
 /// \class RH_LoRaFileOps RH_LoRaFileOps.h <RH_LoRaFileOps.h>
 /// \brief Driver to send and receive unaddressed, unreliable datagrams via a LoRa 
@@ -268,6 +278,23 @@ public:
     /// available in this Driver.
     /// \return The maximum legal message length
     virtual uint8_t maxMessageLength();
+
+    /// Reads the next packet from the device, whoever it is addressed to, with its RSSI and SNR
+    /// (unless disabled with setReadMetadata()) and the time it was read. Does not wait:
+    /// call it when available() or a poll() of fd() says the device is readable.
+    /// Used by recv() and by RHLoRaFileOpsGateway.
+    /// \param[out] packet Where to put the packet
+    /// \return true if a packet with at least the 4 headers was read
+    bool           readPacket(RHLoRaFileOpsPacket* packet);
+
+    /// Enables or disables reading the RSSI and SNR after each packet. Each takes an ioctl,
+    /// which is 2 extra system calls per packet. Enabled by default.
+    /// \param[in] readMetadata true to read RSSI and SNR with each packet
+    void           setReadMetadata(bool readMetadata);
+
+    /// Returns the Unix file descriptor of the open device, for use with poll()
+    /// \return The file descriptor, or -1 if not open
+    int            fd() const;
     
     /// Sets the transmitter and receiver 
     /// centre (carrier) frequency.
@@ -285,7 +312,7 @@ public:
     /// Returns the Signal-to-noise ratio (SNR) of the last received message, as measured
     /// by the receiver.
     /// \return SNR of the last received message in dB
-    int lastSNR();
+    virtual int lastSNR();
 
     /// Sets the transmitter power output level
     /// Be a good neighbour and set the lowest power level you need.
@@ -359,10 +386,14 @@ private:
 
     /// Last measured SNR, dB
     int8_t         _lastSNR;
+
+    /// Whether readPacket() reads the RSSI and SNR
+    bool           _readMetadata;
 };
 
 /// @example lorafileops_client.cpp
 /// @example lorafileops_server.cpp
+/// @example lorafileops_gateway.cpp
 
 #endif
 #endif
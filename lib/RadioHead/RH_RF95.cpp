@@ -32,12 +32,24 @@ PROGMEM static const RH_RF95::ModemConfig MODEM_CONFIG_TABLE[] =
 RH_RF95::RH_RF95(uint8_t slaveSelectPin, uint8_t interruptPin, RHGenericSPI& spi)
     :
     RHSPIDriver(slaveSelectPin, spi),
-    _rxBufValid(0)
+    _rxHead(0),
+    _rxTail(0),
+    _rxOverflows(0),
+    _rxMissed(0),
+    _rxPacketCount(0),
+    _lastRxTime(0)
 {
     _interruptPin = interruptPin;
     _myInterruptIndex = 0xff; // Not allocated yet
     _enableCRC = true;
+    _txStart = 0;
     _useRFO = false;
+    _interruptPending = false;
+    _interruptTime = 0;
+#if RH_RF95_DEFERRED_INTERRUPTS && (RH_PLATFORM == RH_PLATFORM_ESP32)
+    _interruptTask = NULL;
+#endif
+    clearInterruptStats();
 }
 
 bool RH_RF95::init()
@@ -146,108 +158,206 @@ bool RH_RF95::init()
 // On MiniWirelessLoRa, only one of the several interrupt lines (DI0) from the RFM95 is usefuly 
 // connnected to the processor.
 // We use this to get RxDone and TxDone interrupts
-void RH_RF95::handleInterrupt()
+// This is the top half: it does no SPI, so it is short and does not need the SPI bus
+void RH_INTERRUPT_ATTR RH_RF95::handleInterrupt()
+{
+    unsigned long start = micros();
+    _interruptTime = start;
+    _interruptPending = true;
+#if RH_RF95_DEFERRED_INTERRUPTS
+ #if (RH_PLATFORM == RH_PLATFORM_ESP32)
+    // Wake the task in waitForInterrupt(), which will call serviceInterrupt()
+    TaskHandle_t task = _interruptTask;
+    if (task)
+    {
+	BaseType_t higherPriorityTaskWoken = pdFALSE;
+	vTaskNotifyGiveFromISR(task, &higherPriorityTaskWoken);
+	if (higherPriorityTaskWoken)
+	    portYIELD_FROM_ISR();
+    }
+ #endif
+#else
+    serviceInterrupt();
+#endif
+    uint32_t elapsed = micros() - start;
+    _interruptStats.interrupts++;
+    _interruptStats.isrTotalMicros += elapsed;
+    if (elapsed > _interruptStats.isrMaxMicros)
+	_interruptStats.isrMaxMicros = elapsed;
+}
+
+// The bottom half: reads and acts on the interrupt flags noted by handleInterrupt()
+void RH_RF95::serviceInterrupt()
 {
+    if (!_interruptPending)
+	return;
+
     RH_MUTEX_LOCK(lock); // Multithreading support
-    
+    unsigned long start = micros();
+    uint32_t latency = start - _interruptTime;
+    if (latency > _interruptStats.latencyMaxMicros)
+	_interruptStats.latencyMaxMicros = latency;
+
     // we need the RF95 IRQ to be level triggered, or we ……have slim chance of missing events
     // https://github.com/geeksville/Meshtastic-esp32/commit/78470ed3f59f5c84fbd1325bcff1fd95b2b20183
-
-    // Read the interrupt register
-    uint8_t irq_flags = spiRead(RH_RF95_REG_12_IRQ_FLAGS);
-    // Read the RegHopChannel register to check if CRC presence is signalled
-    // in the header. If not it might be a stray (noise) packet.*
-    uint8_t hop_channel = spiRead(RH_RF95_REG_1C_HOP_CHANNEL);
-//    Serial.println(irq_flags, HEX);
-//    Serial.println(_mode, HEX);
-//    Serial.println(hop_channel, HEX);
-//    Serial.println(_enableCRC, HEX);
-
-    // ack all interrupts, 
-    // Sigh: on some processors, for some unknown reason, doing this only once does not actually
-    // clear the radio's interrupt flag. So we do it twice. Why? (kevinh - I think the root cause we want level
-    // triggered interrupts here - not edge.  Because edge allows us to miss handling secondard interrupts that occurred
-    // while this ISR was running.  Better to instead, configure the interrupts as level triggered and clear pending
-    // at the _beginning_ of the ISR.  If any interrupts occur while handling the ISR, the signal will remain asserted and
-    // our ISR will be reinvoked to handle that case)
-    // kevinh: turn this off until root cause is known, because it can cause missed interrupts!
-    // spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Clear all IRQ flags
-    spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Clear all IRQ flags
-
-    // error if:
-    // timeout
-    // bad CRC
-    // CRC is required but it is not present
-    if (_mode == RHModeRx
-	&& (   (irq_flags & (RH_RF95_RX_TIMEOUT | RH_RF95_PAYLOAD_CRC_ERROR))
-	    || (_enableCRC && !(hop_channel & RH_RF95_RX_PAYLOAD_CRC_IS_ON)) ))
-//    if (_mode == RHModeRx && irq_flags & (RH_RF95_RX_TIMEOUT | RH_RF95_PAYLOAD_CRC_ERROR))
-    {
-//	Serial.println("E");
-	_rxBad++;
-        clearRxBuf();
-    }
-    // It is possible to get RX_DONE and CRC_ERROR and VALID_HEADER all at once
-    // so this must be an else
-    else if (_mode == RHModeRx && irq_flags & RH_RF95_RX_DONE)
-    {
-	// Packet received, no CRC error
-//	Serial.println("R");
-	// Have received a packet
-	uint8_t len = spiRead(RH_RF95_REG_13_RX_NB_BYTES);
-
-	// Reset the fifo read ptr to the beginning of the packet
-	spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, spiRead(RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR));
-	spiBurstRead(RH_RF95_REG_00_FIFO, _buf, len);
-	_bufLen = len;
-
-	// Remember the last signal to noise ratio, LORA mode
-	// Per page 111, SX1276/77/78/79 datasheet
-	_lastSNR = (int8_t)spiRead(RH_RF95_REG_19_PKT_SNR_VALUE) / 4;
-
-	// Remember the RSSI of this packet, LORA mode
-	// this is according to the doc, but is it really correct?
-	// weakest receiveable signals are reported RSSI at about -66
-	_lastRssi = spiRead(RH_RF95_REG_1A_PKT_RSSI_VALUE);
-	// Adjust the RSSI, datasheet page 87
-	if (_lastSNR < 0)
-	    _lastRssi = _lastRssi + _lastSNR;
-	else
-	    _lastRssi = (int)_lastRssi * 16 / 15;
-	if (_usingHFport)
-	    _lastRssi -= 157;
-	else
-	    _lastRssi -= 164;
-	    
-	// We have received a message.
-	validateRxBuf(); 
-	if (_rxBufValid)
-	    setModeIdle(); // Got one 
-    }
-    else if (_mode == RHModeTx && irq_flags & RH_RF95_TX_DONE)
-    {
-//	Serial.println("T");
-	_txGood++;
-	setModeIdle();
-    }
-    else if (_mode == RHModeCad && irq_flags & RH_RF95_CAD_DONE)
-    {
-//	Serial.println("C");
-        _cad = irq_flags & RH_RF95_CAD_DETECTED;
-        setModeIdle();
-    }
-    else
+    // DIO0 is edge triggered, so if it is still high after we have cleared the flags,
+    // there is another event (or the clear did not take, as seen on some processors):
+    // go round again rather than wait for an edge that will never come
+    for (uint8_t pass = 0; pass < 3; pass++)
     {
-//	Serial.println("?");
+	_interruptPending = false;
+
+	// Read the interrupt flags, the received packet length, FIFO address, SNR and RSSI, and
+	// RegHopChannel (to check if CRC presence is signalled in the header. If not it might
+	// be a stray (noise) packet) in one burst
+	uint8_t regs[RH_RF95_IRQ_BURST_LEN];
+	spiBurstRead(RH_RF95_IRQ_BURST_FIRST, regs, sizeof(regs));
+	uint8_t irq_flags   = regs[RH_RF95_REG_12_IRQ_FLAGS - RH_RF95_IRQ_BURST_FIRST];
+	uint8_t hop_channel = regs[RH_RF95_REG_1C_HOP_CHANNEL - RH_RF95_IRQ_BURST_FIRST];
+
+	// error if:
+	// timeout
+	// bad CRC
+	// CRC is required but it is not present
+	// It is possible to get RX_DONE and CRC_ERROR and VALID_HEADER all at once
+	// so a packet is only good if there is no error
+	bool rxError = _mode == RHModeRx
+	    && (   (irq_flags & (RH_RF95_RX_TIMEOUT | RH_RF95_PAYLOAD_CRC_ERROR))
+		|| (irq_flags & RH_RF95_RX_DONE && _enableCRC && !(hop_channel & RH_RF95_RX_PAYLOAD_CRC_IS_ON)) );
+	RxPacket* packet = NULL;
+	bool full = false;
+	uint8_t len = regs[RH_RF95_REG_13_RX_NB_BYTES - RH_RF95_IRQ_BURST_FIRST];
+	// The radio counts the good packets it has received
+	uint16_t count = ((uint16_t)regs[RH_RF95_REG_16_RX_PACKET_CNT_VALUE_MSB - RH_RF95_IRQ_BURST_FIRST] << 8)
+	    | regs[RH_RF95_REG_17_RX_PACKET_CNT_VALUE_LSB - RH_RF95_IRQ_BURST_FIRST];
+	// On a later pass, RX_DONE with the count unchanged is the packet we have just handled, whose flag had
+	// not cleared yet when we read it again. Only ack it
+	if (   !rxError && _mode == RHModeRx && irq_flags & RH_RF95_RX_DONE
+	    && (pass == 0 || count != _rxPacketCount))
+	{
+	    // Packet received, no CRC error
+	    // If the radio has received more since the last one we read, they were overwritten in the FIFO 
+	    // before we got to them. The counter can restart when the radio changes mode, so only count 
+	    // what it shows for certain
+	    if (count > _rxPacketCount + 1)
+		_rxMissed += count - _rxPacketCount - 1;
+	    _rxPacketCount = count;
+
+	    if (len > sizeof(_rxQueue[0].buf))
+		_rxBad++; // Too long for us
+	    else if ((uint8_t)(_rxHead - _rxTail) >= RH_RF95_RX_QUEUE_LEN)
+		full = true; // No room. Leave it in the FIFO
+	    else
+		packet = &_rxQueue[_rxHead % RH_RF95_RX_QUEUE_LEN]; // Read it straight into the next free slot
+	}
+
+	// ack the interrupts we are about to handle, and only those, so that an event that happens
+	// while we are handling them is not lost. If there is a packet to read, read it in the same bus transaction
+	if (packet)
+	{
+	    Access accesses[] = {
+		{ RH_RF95_REG_12_IRQ_FLAGS | RH_SPI_WRITE_MASK, irq_flags, 0, NULL },
+		// Reset the fifo read ptr to the beginning of the packet
+		{ RH_RF95_REG_0D_FIFO_ADDR_PTR | RH_SPI_WRITE_MASK, regs[RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR - RH_RF95_IRQ_BURST_FIRST], 0, NULL },
+		{ RH_RF95_REG_00_FIFO, 0, len, packet->buf },
+	    };
+	    spiBatch(accesses, sizeof(accesses) / sizeof(accesses[0]));
+	}
+	else if (full)
+	{
+	    // Only read who it was for, so that packets for other nodes are not counted as lost
+	    uint8_t to = 0;
+	    Access accesses[] = {
+		{ RH_RF95_REG_12_IRQ_FLAGS | RH_SPI_WRITE_MASK, irq_flags, 0, NULL },
+		{ RH_RF95_REG_0D_FIFO_ADDR_PTR | RH_SPI_WRITE_MASK, regs[RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR - RH_RF95_IRQ_BURST_FIRST], 0, NULL },
+		{ RH_RF95_REG_00_FIFO, 0, 1, &to },
+	    };
+	    spiBatch(accesses, sizeof(accesses) / sizeof(accesses[0]));
+	    if (len >= RH_RF95_HEADER_LEN && isForThisNode(to))
+		_rxOverflows++;
+	}
+	else if (irq_flags)
+	    spiWrite(RH_RF95_REG_12_IRQ_FLAGS, irq_flags);
+
+	if (rxError)
+	{
+	    _rxBad++; // Packets already queued are still good
+	}
+	else if (packet)
+	{
+	    packet->len = len;
+	    packet->timestamp = _interruptTime;
+
+	    // The signal to noise ratio of this packet, LORA mode
+	    // Per page 111, SX1276/77/78/79 datasheet
+	    packet->snr = (int8_t)regs[RH_RF95_REG_19_PKT_SNR_VALUE - RH_RF95_IRQ_BURST_FIRST] / 4;
+
+	    // The RSSI of this packet, LORA mode
+	    // this is according to the doc, but is it really correct?
+	    // weakest receiveable signals are reported RSSI at about -66
+	    int16_t rssi = regs[RH_RF95_REG_1A_PKT_RSSI_VALUE - RH_RF95_IRQ_BURST_FIRST];
+	    // Adjust the RSSI, datasheet page 87
+	    if (packet->snr < 0)
+		rssi = rssi + packet->snr;
+	    else
+		rssi = rssi * 16 / 15;
+	    if (_usingHFport)
+		rssi -= 157;
+	    else
+		rssi -= 164;
+	    packet->rssi = rssi;
+
+	    // We have received a message.
+	    validateRxBuf();
+	    // Stay in RX continuous mode, ready for the next one
+	}
+	else if (_mode == RHModeTx && irq_flags & RH_RF95_TX_DONE)
+	{
+	    _txGood++;
+	    // Measured to the TxDone interrupt, not to now, so deferred servicing does not add to it
+	    _lastAirtime = _interruptTime - _txStart;
+	    setModeIdle();
+	}
+	else if (_mode == RHModeCad && irq_flags & RH_RF95_CAD_DONE)
+	{
+	    _cad = irq_flags & RH_RF95_CAD_DETECTED;
+	    setModeIdle();
+	}
+
+	if (!_interruptPending
+	    && (_interruptPin == RH_INVALID_PIN || !digitalRead(_interruptPin)))
+	    break;
     }
-	
-    // Sigh: on some processors, for some unknown reason, doing this only once does not actually
-    // clear the radio's interrupt flag. So we do it twice. Why?
-    spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Clear all IRQ flags
-    spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Clear all IRQ flags
+
+    uint32_t elapsed = micros() - start;
+    _interruptStats.services++;
+    _interruptStats.serviceTotalMicros += elapsed;
+    if (elapsed > _interruptStats.serviceMaxMicros)
+	_interruptStats.serviceMaxMicros = elapsed;
     RH_MUTEX_UNLOCK(lock); 
 }
 
+void RH_RF95::waitForInterrupt(uint16_t timeout, uint16_t polldelay)
+{
+#if RH_RF95_DEFERRED_INTERRUPTS && (RH_PLATFORM == RH_PLATFORM_ESP32)
+    // The interrupt handler notifies the task once it has set _interruptPending,
+    // so an interrupt after the test below still wakes us
+    _interruptTask = xTaskGetCurrentTaskHandle();
+    if (!_interruptPending)
+	ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout));
+    _interruptTask = NULL;
+#else
+    YIELD;
+    if (polldelay)
+	delay(polldelay);
+#endif
+}
+
+void RH_RF95::clearInterruptStats()
+{
+    memset(&_interruptStats, 0, sizeof(_interruptStats));
+}
+
 // These are low level functions that call the interrupt handler for the correct
 // instance of RH_RF95.
 // 3 interrupts allows us to have 3 different devices
@@ -267,27 +377,27 @@ void RH_INTERRUPT_ATTR RH_RF95::isr2()
 	_deviceForInterrupt[2]->handleInterrupt();
 }
 
-// Check whether the latest received message is complete and uncorrupted
+// Check whether the message just read into the next free slot is complete and for us
 void RH_RF95::validateRxBuf()
 {
-    if (_bufLen < 4)
+    RxPacket* packet = &_rxQueue[_rxHead % RH_RF95_RX_QUEUE_LEN];
+    if (packet->len < RH_RF95_HEADER_LEN)
 	return; // Too short to be a real message
-    // Extract the 4 headers
-    _rxHeaderTo    = _buf[0];
-    _rxHeaderFrom  = _buf[1];
-    _rxHeaderId    = _buf[2];
-    _rxHeaderFlags = _buf[3];
-    if (_promiscuous ||
-	_rxHeaderTo == _thisAddress ||
-	_rxHeaderTo == RH_BROADCAST_ADDRESS)
+    if (isForThisNode(packet->buf[0]))
     {
 	_rxGood++;
-	_rxBufValid = true;
+	_rxHead++; // Now recv() can have it
     }
 }
 
+bool RH_RF95::isForThisNode(uint8_t to)
+{
+    return _promiscuous || to == _thisAddress || to == RH_BROADCAST_ADDRESS;
+}
+
 bool RH_RF95::available()
 {
+    serviceInterrupt();
     RH_MUTEX_LOCK(lock); // Multithreading support
     if (_mode == RHModeTx)
     {
@@ -295,16 +405,27 @@ bool RH_RF95::available()
 	return false;
     }
     setModeRx();
+    // Packets are added to the queue by the interrupt handler when good messages are received
+    bool queued = _rxHead != _rxTail;
+    if (queued)
+    {
+	// Describe the oldest one, which recv() will return
+	RxPacket* packet = &_rxQueue[_rxTail % RH_RF95_RX_QUEUE_LEN];
+	_rxHeaderTo    = packet->buf[0];
+	_rxHeaderFrom  = packet->buf[1];
+	_rxHeaderId    = packet->buf[2];
+	_rxHeaderFlags = packet->buf[3];
+	_lastRssi      = packet->rssi;
+	_lastSNR       = packet->snr;
+	_lastRxTime    = packet->timestamp;
+    }
     RH_MUTEX_UNLOCK(lock);
-    return _rxBufValid; // Will be set by the interrupt handler when a good message is received
+    return queued;
 }
 
-void RH_RF95::clearRxBuf()
+uint8_t RH_RF95::rxQueued()
 {
-    ATOMIC_BLOCK_START;
-    _rxBufValid = false;
-    _bufLen = 0;
-    ATOMIC_BLOCK_END;
+    return _rxHead - _rxTail;
 }
 
 bool RH_RF95::recv(uint8_t* buf, uint8_t* len)
@@ -312,20 +433,65 @@ bool RH_RF95::recv(uint8_t* buf, uint8_t* len)
     if (!available())
 	return false;
     RH_MUTEX_LOCK(lock); // Multithread support
+    // The interrupt handler does not touch this slot until we give it back
+    RxPacket* packet = &_rxQueue[_rxTail % RH_RF95_RX_QUEUE_LEN];
     if (buf && len)
     {
-	ATOMIC_BLOCK_START;
-	// Skip the 4 headers that are at the beginning of the rxBuf
-	if (*len > _bufLen-RH_RF95_HEADER_LEN)
-	    *len = _bufLen-RH_RF95_HEADER_LEN;
-	memcpy(buf, _buf+RH_RF95_HEADER_LEN, *len);
-	ATOMIC_BLOCK_END;
+	// Skip the 4 headers that are at the beginning of the packet
+	if (*len > packet->len - RH_RF95_HEADER_LEN)
+	    *len = packet->len - RH_RF95_HEADER_LEN;
+	memcpy(buf, packet->buf + RH_RF95_HEADER_LEN, *len);
     }
-    clearRxBuf(); // This message accepted and cleared
+    _rxTail++; // This message accepted and cleared
     RH_MUTEX_UNLOCK(lock);
     return true;
 }
 
+void RH_RF95::waitAvailable(uint16_t polldelay)
+{
+    while (!available())
+	waitForInterrupt(1000, polldelay);
+}
+
+// Works correctly even on millis() rollover
+bool RH_RF95::waitAvailableTimeout(uint16_t timeout, uint16_t polldelay)
+{
+    unsigned long starttime = millis();
+    unsigned long elapsed;
+    while ((elapsed = millis() - starttime) < timeout)
+    {
+        if (available())
+	    return true;
+	waitForInterrupt(timeout - elapsed, polldelay);
+    }
+    return false;
+}
+
+bool RH_RF95::waitPacketSent()
+{
+    serviceInterrupt();
+    while (_mode == RHModeTx)
+    {
+	waitForInterrupt(1000);
+	serviceInterrupt();
+    }
+    return true;
+}
+
+bool RH_RF95::waitPacketSent(uint16_t timeout)
+{
+    unsigned long starttime = millis();
+    unsigned long elapsed;
+    while ((elapsed = millis() - starttime) < timeout)
+    {
+	serviceInterrupt();
+        if (_mode != RHModeTx) // Any previous transmit finished?
+           return true;
+	waitForInterrupt(timeout - elapsed);
+    }
+    return false;
+}
+
 bool RH_RF95::send(const uint8_t* data, uint8_t len)
 {
     if (len > RH_RF95_MAX_MESSAGE_LEN)
@@ -337,16 +503,17 @@ bool RH_RF95::send(const uint8_t* data, uint8_t len)
     if (!waitCAD()) 
 	return false;  // Check channel activity
 
-    // Position at the beginning of the FIFO
-    spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, 0);
-    // The headers
-    spiWrite(RH_RF95_REG_00_FIFO, _txHeaderTo);
-    spiWrite(RH_RF95_REG_00_FIFO, _txHeaderFrom);
-    spiWrite(RH_RF95_REG_00_FIFO, _txHeaderId);
-    spiWrite(RH_RF95_REG_00_FIFO, _txHeaderFlags);
-    // The message data
-    spiBurstWrite(RH_RF95_REG_00_FIFO, data, len);
-    spiWrite(RH_RF95_REG_22_PAYLOAD_LENGTH, len + RH_RF95_HEADER_LEN);
+    uint8_t headers[RH_RF95_HEADER_LEN] = { _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags };
+    Access accesses[] = {
+	// Position at the beginning of the FIFO
+	{ RH_RF95_REG_0D_FIFO_ADDR_PTR | RH_SPI_WRITE_MASK, 0, 0, NULL },
+	// The headers
+	{ RH_RF95_REG_00_FIFO | RH_SPI_WRITE_MASK, 0, sizeof(headers), headers },
+	// The message data
+	{ RH_RF95_REG_00_FIFO | RH_SPI_WRITE_MASK, 0, len, (uint8_t*)data },
+	{ RH_RF95_REG_22_PAYLOAD_LENGTH | RH_SPI_WRITE_MASK, (uint8_t)(len + RH_RF95_HEADER_LEN), 0, NULL },
+    };
+    spiBatch(accesses, sizeof(accesses) / sizeof(accesses[0]));
     
     RH_MUTEX_LOCK(lock); // Multithreading support
     setModeTx(); // Start the transmitter
@@ -381,9 +548,9 @@ bool RH_RF95::setFrequency(float centre)
 {
     // Frf = FRF / FSTEP
     uint32_t frf = (centre * 1000000.0) / RH_RF95_FSTEP;
-    spiWrite(RH_RF95_REG_06_FRF_MSB, (frf >> 16) & 0xff);
-    spiWrite(RH_RF95_REG_07_FRF_MID, (frf >> 8) & 0xff);
-    spiWrite(RH_RF95_REG_08_FRF_LSB, frf & 0xff);
+    // RH_RF95_REG_06_FRF_MSB, RH_RF95_REG_07_FRF_MID and RH_RF95_REG_08_FRF_LSB in one burst
+    uint8_t frfRegs[] = { (uint8_t)((frf >> 16) & 0xff), (uint8_t)((frf >> 8) & 0xff), (uint8_t)(frf & 0xff) };
+    spiBurstWrite(RH_RF95_REG_06_FRF_MSB, frfRegs, sizeof(frfRegs));
     _usingHFport = (centre >= 779.0);
 
     return true;
@@ -406,6 +573,7 @@ bool RH_RF95::sleep()
 	modeWillChange(RHModeSleep);
 	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_SLEEP);
 	_mode = RHModeSleep;
+	_rxPacketCount = 0; // The radio resets its packet counters in sleep mode
     }
     return true;
 }
@@ -415,8 +583,11 @@ void RH_RF95::setModeRx()
     if (_mode != RHModeRx)
     {
 	modeWillChange(RHModeRx);
-	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_RXCONTINUOUS);
-	spiWrite(RH_RF95_REG_40_DIO_MAPPING1, 0x00); // Interrupt on RxDone
+	Access accesses[] = {
+	    { RH_RF95_REG_01_OP_MODE | RH_SPI_WRITE_MASK, RH_RF95_MODE_RXCONTINUOUS, 0, NULL },
+	    { RH_RF95_REG_40_DIO_MAPPING1 | RH_SPI_WRITE_MASK, 0x00, 0, NULL }, // Interrupt on RxDone
+	};
+	spiBatch(accesses, sizeof(accesses) / sizeof(accesses[0]));
 	_mode = RHModeRx;
     }
 }
@@ -426,8 +597,12 @@ void RH_RF95::setModeTx()
     if (_mode != RHModeTx)
     {
 	modeWillChange(RHModeTx);
-	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_TX);
-	spiWrite(RH_RF95_REG_40_DIO_MAPPING1, 0x40); // Interrupt on TxDone
+	Access accesses[] = {
+	    { RH_RF95_REG_01_OP_MODE | RH_SPI_WRITE_MASK, RH_RF95_MODE_TX, 0, NULL },
+	    { RH_RF95_REG_40_DIO_MAPPING1 | RH_SPI_WRITE_MASK, 0x40, 0, NULL }, // Interrupt on TxDone
+	};
+	spiBatch(accesses, sizeof(accesses) / sizeof(accesses[0]));
+	_txStart = micros();
 	_mode = RHModeTx;
     }
 }
@@ -479,9 +654,13 @@ void RH_RF95::setTxPower(int8_t power, bool useRFO)
 // Sets registers from a canned modem configuration structure
 void RH_RF95::setModemRegisters(const ModemConfig* config)
 {
-    spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1,       config->reg_1d);
-    spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2,       config->reg_1e);
-    spiWrite(RH_RF95_REG_26_MODEM_CONFIG3,       config->reg_26);
+    uint8_t config12[] = { config->reg_1d, config->reg_1e };
+    Access accesses[] = {
+	// RH_RF95_REG_1D_MODEM_CONFIG1 and RH_RF95_REG_1E_MODEM_CONFIG2 in one burst
+	{ RH_RF95_REG_1D_MODEM_CONFIG1 | RH_SPI_WRITE_MASK, 0, sizeof(config12), config12 },
+	{ RH_RF95_REG_26_MODEM_CONFIG3 | RH_SPI_WRITE_MASK, config->reg_26, 0, NULL },
+    };
+    spiBatch(accesses, sizeof(accesses) / sizeof(accesses[0]));
 }
 
 // Set one of the canned FSK Modem configs
@@ -505,6 +684,16 @@ void RH_RF95::setPreambleLength(uint16_t bytes)
 }
 
 bool RH_RF95::isChannelActive()
+{
+    bool active = false;
+    startCAD();
+    while (!cadDone(&active))
+        waitForInterrupt(100);
+
+    return active;
+}
+
+bool RH_RF95::startCAD()
 {
     // Set mode RHModeCad
     if (_mode != RHModeCad)
@@ -514,11 +703,17 @@ bool RH_RF95::isChannelActive()
         spiWrite(RH_RF95_REG_40_DIO_MAPPING1, 0x80); // Interrupt on CadDone
         _mode = RHModeCad;
     }
+    return true;
+}
 
-    while (_mode == RHModeCad)
-        YIELD;
-
-    return _cad;
+bool RH_RF95::cadDone(bool* active)
+{
+    // The interrupt handler leaves CAD mode when CadDone fires
+    serviceInterrupt();
+    if (_mode == RHModeCad)
+	return false;
+    *active = _cad;
+    return true;
 }
 
 void RH_RF95::enableTCXO(bool on)
@@ -36,6 +36,39 @@
  #define RH_RF95_MAX_MESSAGE_LEN (RH_RF95_MAX_PAYLOAD_LEN - RH_RF95_HEADER_LEN)
 #endif
 
+// Define this to 1 to do only the minimum in the DIO0 interrupt handler: note the time and
+// wake the waiting task. The SPI work is then done by serviceInterrupt() in the task.
+// On by default for ESP32, where long SPI transactions in the interrupt handler delay
+// other interrupts and can trip the interrupt watchdog
+#ifndef RH_RF95_DEFERRED_INTERRUPTS
+ #if (RH_PLATFORM == RH_PLATFORM_ESP32)
+  #define RH_RF95_DEFERRED_INTERRUPTS 1
+ #else
+  #define RH_RF95_DEFERRED_INTERRUPTS 0
+ #endif
+#endif
+
+// Number of received packets that can wait in the receive queue for recv(). While there is room,
+// the radio stays in receive mode after each packet, so packets sent back to back are not lost.
+// Must be a power of 2, no more than 128. Each slot takes a little more than
+// RH_RF95_MAX_MESSAGE_LEN + RH_RF95_HEADER_LEN bytes of SRAM, so it is 1 on AVR
+#ifndef RH_RF95_RX_QUEUE_LEN
+ #if defined(__AVR__)
+  #define RH_RF95_RX_QUEUE_LEN 1
+ #else
+  #define RH_RF95_RX_QUEUE_LEN 4
+ #endif
+#endif
+#if (RH_RF95_RX_QUEUE_LEN & (RH_RF95_RX_QUEUE_LEN - 1)) || (RH_RF95_RX_QUEUE_LEN > 128)
+ #error RH_RF95_RX_QUEUE_LEN must be a power of 2, no more than 128
+#endif
+
+// The first and last of the contiguous registers describing an interrupt and a received packet,
+// which serviceInterrupt() reads in one burst
+#define RH_RF95_IRQ_BURST_FIRST RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR
+#define RH_RF95_IRQ_BURST_LAST  RH_RF95_REG_1C_HOP_CHANNEL
+#define RH_RF95_IRQ_BURST_LEN   (RH_RF95_IRQ_BURST_LAST - RH_RF95_IRQ_BURST_FIRST + 1)
+
 // The crystal oscillator frequency of the module
 #define RH_RF95_FXOSC 32000000.0
 
@@ -468,6 +501,28 @@
 /// and from that other device.  Use cli() to disable interrupts and sei() to
 /// reenable them.
 ///
+/// If RH_RF95_DEFERRED_INTERRUPTS is defined to 1 (the default on ESP32), the interrupt service routine
+/// does no SPI at all: it only notes the time of the interrupt and wakes the task waiting in
+/// waitAvailableTimeout(), waitPacketSent() etc. The SPI work is done in that task by serviceInterrupt(),
+/// which reads the interrupt flags and all the packet registers in one burst. This keeps other interrupts
+/// (encoders, buttons) from being delayed by the radio. The time spent in each half is counted, see interruptStats().
+/// In this mode, received packets are only collected while the application calls available(), recv()
+/// or one of the wait functions, or calls serviceInterrupt() itself.
+///
+/// \par Receive queue
+///
+/// Received packets are read from the radio's FIFO into a queue of RH_RF95_RX_QUEUE_LEN slots
+/// (4 by default, 1 on AVR), along with their RSSI, SNR and the micros() time of their RxDone interrupt.
+/// The radio stays in receive mode all the while, so a burst of packets sent back to back
+/// is queued rather than lost while the application is busy with the first one.
+/// recv() returns them in the order received, and lastRssi(), lastSNR() and lastRxTime() describe
+/// the packet last returned by available() or recv(). If the queue is full when a packet arrives,
+/// the packet is left in the FIFO, where the next one overwrites it, and counted in rxOverflows()
+/// if it was addressed to this node.
+/// Packets the radio received but which were overwritten before serviceInterrupt() got to them,
+/// as can happen with RH_RF95_DEFERRED_INTERRUPTS, are counted in rxMissed(), as far as the radio's
+/// valid packet counter shows them. Their addresses are not known, so these include packets for other nodes.
+///
 /// \par Memory
 ///
 /// The RH_RF95 driver requires non-trivial amounts of memory. The sample
@@ -572,6 +627,32 @@
 class RH_RF95 : public RHSPIDriver
 {
 public:
+    /// \brief Counters describing the time spent handling interrupts
+    ///
+    /// All times are in microseconds. With RH_RF95_DEFERRED_INTERRUPTS the interrupt handler
+    /// only notes the interrupt, and the SPI work is counted separately as service time.
+    /// Otherwise the service time is part of the interrupt handler time.
+    typedef struct
+    {
+	uint32_t interrupts;         ///< Number of DIO0 interrupts
+	uint32_t isrMaxMicros;       ///< Longest time spent in the interrupt handler
+	uint32_t isrTotalMicros;     ///< Total time spent in the interrupt handler
+	uint32_t services;           ///< Number of times serviceInterrupt() handled pending interrupts
+	uint32_t serviceMaxMicros;   ///< Longest time taken by serviceInterrupt()
+	uint32_t serviceTotalMicros; ///< Total time taken by serviceInterrupt()
+	uint32_t latencyMaxMicros;   ///< Longest time from an interrupt to serviceInterrupt() starting to handle it
+    } InterruptStats;
+
+    /// \brief A received packet waiting in the receive queue
+    typedef struct
+    {
+	unsigned long timestamp;  ///< micros() at the RxDone interrupt
+	int16_t       rssi;       ///< RSSI in dBm
+	int8_t        snr;        ///< SNR in dB
+	uint8_t       len;        ///< Number of octets in buf, including the headers
+	uint8_t       buf[RH_RF95_MAX_MESSAGE_LEN + RH_RF95_HEADER_LEN];
+    } RxPacket;
+
     /// \brief Defines register values for a set of modem configuration registers
     ///
     /// Defines register values for a set of modem configuration registers
@@ -687,6 +768,61 @@ public:
     /// if CAD was requested and the CAD timeout timed out before clear channel was detected.
     virtual bool    send(const uint8_t* data, uint8_t len);
 
+    /// Blocks until the transmitter is no longer transmitting.
+    /// With RH_RF95_DEFERRED_INTERRUPTS on ESP32, sleeps until the TxDone interrupt.
+    virtual bool    waitPacketSent();
+
+    /// Blocks until the transmitter is no longer transmitting,
+    /// or until the timeout occurs, whichever happens first
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \return true if the radio completed transmission within the timeout period. False if it timed out.
+    virtual bool    waitPacketSent(uint16_t timeout);
+
+    /// Starts the receiver and blocks until a valid received message is available.
+    /// With RH_RF95_DEFERRED_INTERRUPTS on ESP32, sleeps until the RxDone interrupt.
+    /// \param[in] polldelay Time between polling available() in milliseconds, when not sleeping
+    virtual void    waitAvailable(uint16_t polldelay = 0);
+
+    /// Starts the receiver and blocks until a received message is available or a timeout.
+    /// With RH_RF95_DEFERRED_INTERRUPTS on ESP32, sleeps until the RxDone interrupt.
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \param[in] polldelay Time between polling available() in milliseconds, when not sleeping
+    /// \return true if a message is available
+    virtual bool    waitAvailableTimeout(uint16_t timeout, uint16_t polldelay = 0);
+
+    /// Does the SPI work for any interrupt noted by the interrupt handler: reads the interrupt flags
+    /// and packet registers in one burst, the packet from the FIFO in another, and clears the flags
+    /// it handled. With RH_RF95_DEFERRED_INTERRUPTS this is called by available(), recv(),
+    /// the wait functions and cadDone(), so normally you do not need to call it.
+    /// Call it from your own task if you want received packets collected while you are not calling those.
+    /// Without RH_RF95_DEFERRED_INTERRUPTS the interrupt handler calls it, and there is nothing left to do.
+    void            serviceInterrupt();
+
+    /// Returns the counters of time spent handling interrupts
+    /// \return The counters
+    const InterruptStats& interruptStats() { return _interruptStats; }
+
+    /// Sets all the interrupt counters to 0
+    void            clearInterruptStats();
+
+    /// Returns the number of received packets waiting in the receive queue, including the one
+    /// that available() last reported, if not yet collected with recv()
+    /// \return The number of queued packets
+    uint8_t         rxQueued();
+
+    /// Returns the number of packets for this node lost because the receive queue was full when they arrived
+    /// \return The number of lost packets
+    uint16_t        rxOverflows() { return _rxOverflows; }
+
+    /// Returns the number of packets the radio received but which were overwritten in its FIFO
+    /// before they could be read, whoever they were addressed to
+    /// \return The number of missed packets
+    uint16_t        rxMissed() { return _rxMissed; }
+
+    /// Returns the time the packet last returned by available() or recv() was received
+    /// \return micros() at its RxDone interrupt
+    unsigned long   lastRxTime() { return _lastRxTime; }
+
     /// Sets the length of the preamble
     /// in bytes. 
     /// Caution: this should be set to the same 
@@ -756,6 +892,18 @@ public:
     /// \return true if channel is in use.  
     virtual bool    isChannelActive();
 
+    /// Puts the radio into CAD mode and returns without waiting for the result.
+    /// The interrupt handler records the result and returns the radio to idle when CAD is done.
+    /// Used by waitCAD() when a listen-before-talk policy is set with setListenBeforeTalk(), or
+    /// directly by callers that do not want to block during CAD.
+    /// \return true
+    virtual bool    startCAD();
+
+    /// Checks whether the CAD started by startCAD() has finished
+    /// \param[out] active Set to true if the CAD detected channel activity
+    /// \return true if CAD has finished and *active is valid
+    virtual bool    cadDone(bool* active);
+
     /// Enable TCXO mode
     /// Call this immediately after init(), to force your radio to use an external
     /// frequency source, such as a Temperature Compensated Crystal Oscillator (TCXO), if available.
@@ -784,7 +932,7 @@ public:
     /// Returns the Signal-to-noise ratio (SNR) of the last received message, as measured
     /// by the receiver.
     /// \return SNR of the last received message in dB
-    int lastSNR();
+    virtual int lastSNR();
 
     /// brian.n.norman@gmail.com 9th Nov 2018
     /// Sets the radio spreading factor.
@@ -853,13 +1001,24 @@ protected:
     /// This is a low level function to handle the interrupts for one instance of RH_RF95.
     /// Called automatically by isr*()
     /// Should not need to be called by user code.
+    /// Notes the time of the interrupt, then either calls serviceInterrupt() or, with RH_RF95_DEFERRED_INTERRUPTS,
+    /// leaves that to the task, waking it if it is waiting.
     void           handleInterrupt();
 
-    /// Examine the revceive buffer to determine whether the message is for this node
+    /// Waits for the interrupt handler to note an interrupt, or for the timeout.
+    /// With RH_RF95_DEFERRED_INTERRUPTS on ESP32 the calling task sleeps until woken by the interrupt handler,
+    /// otherwise it yields, and then waits for polldelay.
+    /// \param[in] timeout Maximum time to wait in milliseconds
+    /// \param[in] polldelay Time to wait in milliseconds when not sleeping
+    void           waitForInterrupt(uint16_t timeout, uint16_t polldelay = 0);
+
+    /// Examine the packet just read into the next free slot of the receive queue, and add it
+    /// to the queue if the message is for this node
     void validateRxBuf();
 
-    /// Clear our local receive buffer
-    void clearRxBuf();
+    /// \param[in] to The TO header of a received packet
+    /// \return true if a packet with that TO header is for this node (or we are promiscuous)
+    bool isForThisNode(uint8_t to);
 
     /// Called by RH_RF95 when the radio mode is about to change to a new setting.
     /// Can be used by subclasses to implement antenna switching etc.
@@ -894,14 +1053,23 @@ private:
     /// else 0xff
     uint8_t             _myInterruptIndex;
 
-    /// Number of octets in the buffer
-    volatile uint8_t    _bufLen;
-    
-    /// The receiver/transmitter buffer
-    uint8_t             _buf[RH_RF95_MAX_PAYLOAD_LEN];
+    /// The receive queue. Packets are added at _rxHead by serviceInterrupt() and removed at
+    /// _rxTail by recv(). Both count up freely, and are taken modulo RH_RF95_RX_QUEUE_LEN
+    RxPacket            _rxQueue[RH_RF95_RX_QUEUE_LEN];
+    volatile uint8_t    _rxHead;
+    volatile uint8_t    _rxTail;
+
+    /// Number of packets lost, see rxOverflows()
+    volatile uint16_t   _rxOverflows;
+
+    /// Number of packets overwritten in the radio, see rxMissed()
+    volatile uint16_t   _rxMissed;
 
-    /// True when there is a valid message in the buffer
-    volatile bool       _rxBufValid;
+    /// The radio's valid packet counter when the last packet was read
+    uint16_t            _rxPacketCount;
+
+    /// micros() when the packet last returned by available() or recv() was received
+    unsigned long       _lastRxTime;
 
     /// True if we are using the HF port (779.0 MHz and above)
     bool                _usingHFport;
@@ -909,6 +1077,23 @@ private:
     /// Last measured SNR, dB
     int8_t              _lastSNR;
 
+    /// micros() when the transmitter was last started, for measuring airtime
+    volatile unsigned long _txStart;
+
+    /// Set by the interrupt handler, cleared by serviceInterrupt()
+    volatile bool       _interruptPending;
+
+    /// micros() at the last interrupt
+    volatile unsigned long _interruptTime;
+
+    /// Time spent handling interrupts
+    InterruptStats      _interruptStats;
+
+#if RH_RF95_DEFERRED_INTERRUPTS && (RH_PLATFORM == RH_PLATFORM_ESP32)
+    /// The task sleeping in waitForInterrupt(), if any
+    volatile TaskHandle_t _interruptTask;
+#endif
+
     /// If true, sends CRCs in every packet and requires a valid CRC in every received packet
     bool                _enableCRC;
 
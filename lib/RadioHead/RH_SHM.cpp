@@ -0,0 +1,344 @@
+// RH_SHM.cpp
+//
+// Driver to pass RadioHead messages between processes on one Linux host through shared memory
+
+#include <RH_SHM.h>
+
+// This can only build on Linux
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Identifies an initialised RHShmEther with this layout
+#define RH_SHM_MAGIC 0x52485331
+
+// One frame in the ring
+struct __attribute__((aligned(64))) RHShmSlot
+{
+    // 2 * n + 1 while frame n is being written, 2 * n + 2 when it is complete
+    uint64_t seq;
+    uint32_t nodeId;  // Of the sender
+    uint8_t  len;     // Of data
+    uint8_t  to;
+    uint8_t  from;
+    uint8_t  id;
+    uint8_t  flags;
+    uint8_t  data[RH_SHM_MAX_MESSAGE_LEN];
+};
+
+// The layout of the shared memory object. Everything starts as 0 from ftruncate()
+// The counters that every process updates are on their own cache lines
+struct RHShmEther
+{
+    uint32_t magic;       // RH_SHM_MAGIC once initialised
+    uint32_t slots;       // RH_SHM_RING_SLOTS of whoever created it
+    uint32_t nextNodeId;
+    uint64_t head         __attribute__((aligned(64))); // Number of frames claimed by senders
+    uint32_t wakeSeq      __attribute__((aligned(64))); // The futex. Changes with every frame
+    uint32_t waiters;     // Processes sleeping on wakeSeq
+    RHShmSlot slot[RH_SHM_RING_SLOTS];
+};
+
+static uint64_t monotonicMillis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static long futex(uint32_t* addr, int op, uint32_t val, const struct timespec* timeout)
+{
+    // Not FUTEX_PRIVATE_FLAG: the waiters are in other processes
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+RH_SHM::RH_SHM(const char* name)
+    : _name(name),
+      _ether(NULL),
+      _nodeId(0),
+      _rxSeq(0),
+      _rxStallStart(0),
+      _rxBufLen(0),
+      _rxBufValid(false)
+{
+}
+
+RH_SHM::~RH_SHM()
+{
+    if (_ether)
+	munmap(_ether, sizeof(RHShmEther));
+}
+
+bool RH_SHM::init()
+{
+    if (!RHGenericDriver::init())
+	return false;
+
+    // The first process to get here creates and initialises it. The others wait for that
+    bool created = true;
+    int fd = shm_open(_name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0 && errno == EEXIST)
+    {
+	created = false;
+	fd = shm_open(_name, O_RDWR, 0);
+    }
+    if (fd < 0)
+    {
+	fprintf(stderr, "RH_SHM::init could not open shared memory %s: %s\n", _name, strerror(errno));
+	return false;
+    }
+    // Other users may run nodes on the same channel
+    if (created)
+	fchmod(fd, 0666);
+    if (created && ftruncate(fd, sizeof(RHShmEther)) < 0)
+    {
+	fprintf(stderr, "RH_SHM::init could not size shared memory %s: %s\n", _name, strerror(errno));
+	close(fd);
+	shm_unlink(_name);
+	return false;
+    }
+    // Wait for the creator to size it
+    struct stat st;
+    st.st_size = 0;
+    for (int i = 0; fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(RHShmEther) && i < 1000; i++)
+	usleep(1000);
+    if (st.st_size != (off_t)sizeof(RHShmEther))
+    {
+	fprintf(stderr, "RH_SHM::init shared memory %s is the wrong size. Built with a different RH_SHM_RING_SLOTS?\n", _name);
+	close(fd);
+	return false;
+    }
+    void* p = mmap(NULL, sizeof(RHShmEther), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps it open
+    if (p == MAP_FAILED)
+    {
+	fprintf(stderr, "RH_SHM::init could not map shared memory %s: %s\n", _name, strerror(errno));
+	return false;
+    }
+    _ether = (RHShmEther*)p;
+
+    if (created)
+    {
+	_ether->slots = RH_SHM_RING_SLOTS;
+	__atomic_store_n(&_ether->magic, RH_SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    for (int i = 0; __atomic_load_n(&_ether->magic, __ATOMIC_ACQUIRE) != RH_SHM_MAGIC && i < 1000; i++)
+	usleep(1000);
+    if (__atomic_load_n(&_ether->magic, __ATOMIC_ACQUIRE) != RH_SHM_MAGIC || _ether->slots != RH_SHM_RING_SLOTS)
+    {
+	fprintf(stderr, "RH_SHM::init shared memory %s was not initialised\n", _name);
+	munmap(_ether, sizeof(RHShmEther));
+	_ether = NULL;
+	return false;
+    }
+
+    _nodeId = __atomic_add_fetch(&_ether->nextNodeId, 1, __ATOMIC_RELAXED);
+    _rxSeq = __atomic_load_n(&_ether->head, __ATOMIC_ACQUIRE);
+    _mode = RHModeRx;
+    return true;
+}
+
+bool RH_SHM::removeEther(const char* name)
+{
+    return shm_unlink(name) == 0;
+}
+
+void RH_SHM::checkForFrames()
+{
+    while (!_rxBufValid)
+    {
+	uint64_t head = __atomic_load_n(&_ether->head, __ATOMIC_ACQUIRE);
+	if (head - _rxSeq > RH_SHM_RING_SLOTS)
+	{
+	    // Fell behind, and the oldest frames have been overwritten
+	    _rxBad += head - RH_SHM_RING_SLOTS - _rxSeq;
+	    _rxSeq = head - RH_SHM_RING_SLOTS;
+	    _rxStallStart = 0;
+	}
+	if (_rxSeq == head)
+	    return; // Nothing new
+
+	RHShmSlot* slot = &_ether->slot[_rxSeq & (RH_SHM_RING_SLOTS - 1)];
+	uint64_t complete = 2 * _rxSeq + 2;
+	uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	bool lost = seq != complete;
+	if (seq < complete)
+	{
+	    // Claimed, but the sender has not finished writing it yet. A sender that died in the
+	    // middle of send() never will, so give up on it after a while rather than stall for ever
+	    uint64_t now = monotonicMillis();
+	    if (!_rxStallStart)
+		_rxStallStart = now;
+	    if (now - _rxStallStart < RH_SHM_STALE_SLOT_TIMEOUT)
+		return;
+	}
+	if (!lost && slot->nodeId != _nodeId)
+	{
+	    uint8_t to = slot->to;
+	    if (_promiscuous || to == _thisAddress || to == RH_BROADCAST_ADDRESS)
+	    {
+		_rxHeaderTo    = to;
+		_rxHeaderFrom  = slot->from;
+		_rxHeaderId    = slot->id;
+		_rxHeaderFlags = slot->flags;
+		_rxBufLen      = slot->len;
+		if (_rxBufLen > sizeof(_rxBuf))
+		    _rxBufLen = sizeof(_rxBuf);
+		memcpy(_rxBuf, slot->data, _rxBufLen);
+		// If a sender has lapped us while we were copying, the copy may be torn
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == complete)
+		{
+		    _rxGood++;
+		    _rxBufValid = true;
+		}
+		else
+		    lost = true;
+	    }
+	}
+	if (lost)
+	    _rxBad++;
+	_rxSeq++;
+	_rxStallStart = 0;
+    }
+}
+
+bool RH_SHM::available()
+{
+    if (!_ether)
+	return false;
+    checkForFrames();
+    return _rxBufValid;
+}
+
+void RH_SHM::waitAvailable(uint16_t /* polldelay */)
+{
+    waitAvailableTimeout(0); // 0 = Wait forever
+}
+
+bool RH_SHM::waitAvailableTimeout(uint16_t timeout, uint16_t /* polldelay */)
+{
+    if (!_ether)
+	return false;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+	deadline.tv_sec++;
+	deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (true)
+    {
+	// Take the futex value before looking, so that a frame sent after we look
+	// changes it and the wait returns at once
+	uint32_t wakeSeq = __atomic_load_n(&_ether->wakeSeq, __ATOMIC_SEQ_CST);
+	if (available())
+	    return true;
+
+	struct timespec remaining;
+	if (timeout)
+	{
+	    struct timespec now;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+	    remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+	    if (remaining.tv_nsec < 0)
+	    {
+		remaining.tv_sec--;
+		remaining.tv_nsec += 1000000000L;
+	    }
+	    if (remaining.tv_sec < 0)
+		return false;
+	}
+	struct timespec* wait = timeout ? &remaining : NULL;
+	struct timespec stall;
+	if (_rxStallStart)
+	{
+	    // Stuck behind an unfinished frame. Wake up in time to skip it, even if nothing else is sent
+	    uint64_t waited = monotonicMillis() - _rxStallStart;
+	    uint64_t left = waited < RH_SHM_STALE_SLOT_TIMEOUT ? RH_SHM_STALE_SLOT_TIMEOUT - waited : 0;
+	    stall.tv_sec = (left + 1) / 1000;
+	    stall.tv_nsec = ((left + 1) % 1000) * 1000000L;
+	    if (   !wait
+		|| stall.tv_sec < remaining.tv_sec
+		|| (stall.tv_sec == remaining.tv_sec && stall.tv_nsec < remaining.tv_nsec))
+		wait = &stall;
+	}
+	__atomic_add_fetch(&_ether->waiters, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&_ether->wakeSeq, __ATOMIC_SEQ_CST) == wakeSeq)
+	    futex(&_ether->wakeSeq, FUTEX_WAIT, wakeSeq, wait);
+	__atomic_sub_fetch(&_ether->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+bool RH_SHM::recv(uint8_t* buf, uint8_t* len)
+{
+    if (!available())
+	return false;
+
+    if (buf && len)
+    {
+	if (*len > _rxBufLen)
+	    *len = _rxBufLen;
+	memcpy(buf, _rxBuf, *len);
+    }
+    _rxBufValid = false;
+    return true;
+}
+
+bool RH_SHM::send(const uint8_t* data, uint8_t len)
+{
+    if (!_ether || len > RH_SHM_MAX_MESSAGE_LEN)
+	return false;
+    if (!waitCAD())
+	return false;
+
+    // Claim the next slot. Senders never wait for each other
+    uint64_t n = __atomic_fetch_add(&_ether->head, 1, __ATOMIC_ACQ_REL);
+    RHShmSlot* slot = &_ether->slot[n & (RH_SHM_RING_SLOTS - 1)];
+
+    // Mark it as being written, unless the ring has gone all the way round while we were
+    // getting here, in which case the frame is already lost
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    do
+    {
+	if (seq > 2 * n)
+	    return false;
+    } while (!__atomic_compare_exchange_n(&slot->seq, &seq, 2 * n + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->nodeId = _nodeId;
+    slot->len    = len;
+    slot->to     = _txHeaderTo;
+    slot->from   = _txHeaderFrom;
+    slot->id     = _txHeaderId;
+    slot->flags  = _txHeaderFlags;
+    memcpy(slot->data, data, len);
+    __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+    _txGood++;
+
+    // Wake everyone that is waiting. Most frames are sent while nobody is, and then
+    // there is no system call
+    __atomic_add_fetch(&_ether->wakeSeq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_ether->waiters, __ATOMIC_SEQ_CST))
+	futex(&_ether->wakeSeq, FUTEX_WAKE, INT_MAX, NULL);
+    return true;
+}
+
+uint8_t RH_SHM::maxMessageLength()
+{
+    return RH_SHM_MAX_MESSAGE_LEN;
+}
+
+#endif
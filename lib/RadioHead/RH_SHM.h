@@ -0,0 +1,167 @@
+// RH_SHM.h
+//
+// Driver to pass RadioHead messages between processes on one Linux host through shared memory
+#ifndef RH_SHM_h
+#define RH_SHM_h
+
+#include <RHGenericDriver.h>
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+// Maximum message length (including the headers) we are willing to support
+#define RH_SHM_MAX_PAYLOAD_LEN 255
+
+// The length of the headers we add
+#define RH_SHM_HEADER_LEN 4
+
+// This is the maximum message length that can be supported by this driver.
+#define RH_SHM_MAX_MESSAGE_LEN (RH_SHM_MAX_PAYLOAD_LEN - RH_SHM_HEADER_LEN)
+
+// Number of frames in the shared ring. Must be a power of 2. A receiver that falls
+// this many frames behind loses the oldest ones
+#define RH_SHM_RING_SLOTS 4096
+
+// Milliseconds a receiver waits for a frame that has been claimed but not finished before it skips
+// the frame and counts it in rxBad(). Only a sender that died or was stopped in the middle of send() takes this long
+#ifndef RH_SHM_STALE_SLOT_TIMEOUT
+ #define RH_SHM_STALE_SLOT_TIMEOUT 100
+#endif
+
+// Name of the shared memory object used by default. Appears in /dev/shm
+#define RH_SHM_DEFAULT_NAME "/RadioHead"
+
+/// The layout of the shared memory object. Opaque outside RH_SHM.
+struct RHShmEther;
+
+/////////////////////////////////////////////////////////////////////
+/// \class RH_SHM RH_SHM.h <RH_SHM.h>
+/// \brief Driver to send and receive unaddressed, unreliable datagrams between processes on one Linux host
+/// through shared memory
+///
+/// \par Overview
+///
+/// RH_SHM is a drop-in alternative to RH_TCP for running many simulated sketches on one machine.
+/// Instead of sending every frame through a socket to an ether server, which delivers it through another
+/// socket to every other client, the processes share a ring of frames in POSIX shared memory.
+/// Sending a frame is a copy into the next slot of the ring; receiving it is a copy out of it.
+/// Processes that are waiting for a frame sleep on a futex in the shared memory, and are woken by the sender,
+/// so the latency from send() on one process to available() on another is a few microseconds,
+/// and thousands of RHMesh processes can run on one machine.
+///
+/// The ring is a broadcast medium, like the air: every process sees every frame, and filters by the TO header
+/// as other drivers do (unless promiscuous). Any number of processes can send at once without locks:
+/// each sender claims the next slot with an atomic increment, and a sequence number in each slot tells
+/// receivers when it is complete. Each receiver keeps its own place in the ring. A receiver that falls more than
+/// RH_SHM_RING_SLOTS frames behind loses the oldest frames, and counts them in rxBad().
+/// A frame whose sender never finishes writing it (because the process was killed in the middle of send())
+/// is skipped after RH_SHM_STALE_SLOT_TIMEOUT milliseconds, and also counted in rxBad().
+///
+/// There is no channel model: every frame reaches every process, without airtime, collisions or loss.
+/// Use RH_TCP with tools/etherServer.cpp, or RH_SIM, to simulate those.
+///
+/// \par Running simulated sketches
+///
+/// In a simulator sketch, replace
+/// \code
+/// #include <RH_TCP.h>
+/// RH_TCP driver;
+/// \endcode
+/// with
+/// \code
+/// #include <RH_SHM.h>
+/// RH_SHM driver;
+/// \endcode
+/// and build it with tools/simBuild. Every process that uses the same shared memory object name
+/// (RH_SHM_DEFAULT_NAME unless given to the constructor) is on the same channel.
+/// The object is created by the first process that needs it and stays in /dev/shm until removed
+/// with RH_SHM::removeEther() or rm.
+///
+/// \par Prerequisites
+///
+/// Linux, for futexes.
+class RH_SHM : public RHGenericDriver
+{
+public:
+    /// Constructor
+    /// \param[in] name Name of the POSIX shared memory object to use as the channel. Processes
+    /// using the same name can talk to each other.
+    RH_SHM(const char* name = RH_SHM_DEFAULT_NAME);
+
+    /// Destructor. Unmaps the shared memory, but leaves it for the other processes.
+    virtual ~RH_SHM();
+
+    /// Opens the shared memory object, creating and initialising it if this is the first process
+    /// to use it. Only frames sent after init() are received.
+    /// \return true if initialisation succeeded.
+    virtual bool init();
+
+    /// Tests whether a new message is available from the Driver.
+    /// \return true if a new, complete, error-free uncollected message is available to be retreived by recv()
+    virtual bool available();
+
+    /// Wait until a new message is available from the driver.
+    /// Sleeps on a futex until another process sends a frame.
+    /// \param[in] polldelay Not used
+    virtual void waitAvailable(uint16_t polldelay = 0);
+
+    /// Wait until a new message is available from the driver or the timeout expires.
+    /// Sleeps on a futex until another process sends a frame.
+    /// \param[in] timeout The maximum time to wait in milliseconds
+    /// \param[in] polldelay Not used
+    /// \return true if a message is available as reported by available()
+    virtual bool waitAvailableTimeout(uint16_t timeout, uint16_t polldelay = 0);
+
+    /// If there is a valid message available, copy it to buf and return true
+    /// else return false.
+    /// If a message is copied, *len is set to the length (Caution, 0 length messages are permitted).
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Pointer to the number of octets available in buf. The number be reset to the actual number of octets copied.
+    /// \return true if a valid message was copied to buf
+    virtual bool recv(uint8_t* buf, uint8_t* len);
+
+    /// Puts a message into the shared ring for all the other processes to see.
+    /// Never blocks: the frame is complete when send() returns.
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send
+    /// \return true if the message length was valid and it was sent
+    virtual bool send(const uint8_t* data, uint8_t len);
+
+    /// Returns the maximum message length
+    /// available in this Driver.
+    /// \return The maximum legal message length
+    virtual uint8_t maxMessageLength();
+
+    /// Removes a shared memory object, so that the next process to use it starts a new one.
+    /// Processes that still have it open keep using the old one.
+    /// \param[in] name Name of the shared memory object
+    /// \return true if it was removed
+    static bool removeEther(const char* name = RH_SHM_DEFAULT_NAME);
+
+private:
+    /// Looks for the next frame in the ring that is for this node, and copies it
+    /// into _rxBuf
+    void checkForFrames();
+
+    /// Name of the shared memory object
+    const char* _name;
+
+    /// The mapped shared memory, or NULL before init()
+    RHShmEther* _ether;
+
+    /// Identifies frames sent by this driver, so that it does not receive its own
+    uint32_t    _nodeId;
+
+    /// Sequence number of the next frame to look at in the ring
+    uint64_t    _rxSeq;
+
+    /// Monotonic time in milliseconds when frame _rxSeq was first found unfinished, or 0
+    uint64_t    _rxStallStart;
+
+    /// The received message, without the headers
+    uint8_t     _rxBuf[RH_SHM_MAX_MESSAGE_LEN];
+    uint8_t     _rxBufLen;
+    bool        _rxBufValid;
+};
+
+#endif
+#endif
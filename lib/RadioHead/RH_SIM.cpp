@@ -0,0 +1,204 @@
+// RH_SIM.cpp
+//
+// Driver for a LoRa radio simulated by RHEtherSim
+
+#include <RadioHead.h>
+
+// This can only build on Linux and compatible systems
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <RH_SIM.h>
+
+RH_SIM::RH_SIM(RHEtherSim* ether)
+    : _ether(ether ? ether : RHEtherSim::instance()),
+      _frequency(434.0),
+      _bufLen(0),
+      _rxBufValid(false),
+      _waiter(NULL),
+      _rxLost(0),
+      _lastSNR(0)
+{
+    _promiscuous = false;
+    RHLoRaDefaultModemParams(&_modem);
+    if (_ether)
+	_ether->attach(this);
+}
+
+RH_SIM::~RH_SIM()
+{
+    if (_ether)
+	_ether->detach(this);
+}
+
+bool RH_SIM::init()
+{
+    if (!_ether)
+    {
+	fprintf(stderr, "RH_SIM::init no RHEtherSim to attach to\n");
+	return false;
+    }
+    setModeIdle();
+    return true;
+}
+
+bool RH_SIM::available()
+{
+    if (_mode == RHModeTx)
+	return false;
+    if (!_rxBufValid)
+	setModeRx();
+    return _rxBufValid;
+}
+
+bool RH_SIM::recv(uint8_t* buf, uint8_t* len)
+{
+    if (!available())
+	return false;
+
+    if (buf && len)
+    {
+	if (*len > _bufLen - RH_SIM_HEADER_LEN)
+	    *len = _bufLen - RH_SIM_HEADER_LEN;
+	memcpy(buf, _buf + RH_SIM_HEADER_LEN, *len);
+    }
+    _rxBufValid = false;
+    return true;
+}
+
+bool RH_SIM::send(const uint8_t* data, uint8_t len)
+{
+    if (len > RH_SIM_MAX_MESSAGE_LEN || !_ether)
+	return false;
+
+    waitPacketSent(); // Make sure we dont interrupt an outgoing message
+    if (!waitCAD())
+	return false;  // Check channel activity
+
+    _mode = RHModeTx;
+    _lastAirtime = RHLoRaAirtime(&_modem, len + RH_SIM_HEADER_LEN);
+    _ether->transmit(this, data, len);
+    return true;
+}
+
+uint8_t RH_SIM::maxMessageLength()
+{
+    return RH_SIM_MAX_MESSAGE_LEN;
+}
+
+void RH_SIM::waitAvailable(uint16_t polldelay)
+{
+    (void)polldelay; // Not used
+    while (!available())
+	_ether->block(this, RH_ETHER_SIM_FOREVER);
+}
+
+bool RH_SIM::waitAvailableTimeout(uint16_t timeout, uint16_t polldelay)
+{
+    (void)polldelay; // Not used
+    uint64_t deadline = _ether->now() + (uint64_t)timeout * 1000;
+    while (!available())
+    {
+	if (_ether->now() >= deadline)
+	    return false;
+	_ether->block(this, deadline);
+    }
+    return true;
+}
+
+bool RH_SIM::waitPacketSent()
+{
+    while (_mode == RHModeTx)
+	_ether->block(this, RH_ETHER_SIM_FOREVER);
+    return true;
+}
+
+bool RH_SIM::waitPacketSent(uint16_t timeout)
+{
+    uint64_t deadline = _ether->now() + (uint64_t)timeout * 1000;
+    while (_mode == RHModeTx)
+    {
+	if (_ether->now() >= deadline)
+	    return false;
+	_ether->block(this, deadline);
+    }
+    return true;
+}
+
+bool RH_SIM::isChannelActive()
+{
+    return _ether && _ether->channelActive(this);
+}
+
+bool RH_SIM::sleep()
+{
+    _mode = RHModeSleep;
+    return true;
+}
+
+void RH_SIM::setModeIdle()
+{
+    if (_mode != RHModeIdle)
+	_mode = RHModeIdle;
+}
+
+void RH_SIM::setModeRx()
+{
+    if (_mode != RHModeRx && _mode != RHModeTx)
+	_mode = RHModeRx;
+}
+
+bool RH_SIM::setFrequency(float centre)
+{
+    _frequency = centre;
+    return true;
+}
+
+void RH_SIM::setSpreadingFactor(uint8_t sf)
+{
+    if (sf < 6)
+	sf = 6;
+    else if (sf > 12)
+	sf = 12;
+    _modem.spreadingFactor = sf;
+}
+
+void RH_SIM::setSignalBandwidth(long sbw)
+{
+    _modem.bandwidth = sbw;
+}
+
+void RH_SIM::setCodingRate4(uint8_t denominator)
+{
+    if (denominator < 5)
+	denominator = 5;
+    else if (denominator > 8)
+	denominator = 8;
+    _modem.codingRate4 = denominator;
+}
+
+void RH_SIM::setPreambleLength(uint16_t bytes)
+{
+    _modem.preambleLength = bytes;
+}
+
+const RHLoRaModemParams& RH_SIM::modemParams() const
+{
+    return _modem;
+}
+
+uint8_t RH_SIM::thisAddress() const
+{
+    return _thisAddress;
+}
+
+uint16_t RH_SIM::rxLost()
+{
+    return _rxLost;
+}
+
+int RH_SIM::lastSNR()
+{
+    return _lastSNR;
+}
+
+#endif
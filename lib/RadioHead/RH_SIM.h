@@ -0,0 +1,198 @@
+// RH_SIM.h
+//
+// Driver for a LoRa radio simulated by RHEtherSim
+#ifndef RH_SIM_h
+#define RH_SIM_h
+
+#include <RHGenericDriver.h>
+#include <RHLoRaAirtime.h>
+#include <RHEtherSim.h>
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+// Max number of octets the simulated radio can hold, like the SX127x FIFO
+#define RH_SIM_MAX_PAYLOAD_LEN 255
+
+// The length of the headers we add to the payload, as RH_RF95 does
+#define RH_SIM_HEADER_LEN 4
+
+// This is the maximum message length that can be supported by this driver.
+#define RH_SIM_MAX_MESSAGE_LEN (RH_SIM_MAX_PAYLOAD_LEN - RH_SIM_HEADER_LEN)
+
+// RSSI and SNR reported for packets received over a perfect link. Weaker links, with a lower 
+// delivery probability, report proportionally lower RSSI and SNR
+#define RH_SIM_DEFAULT_RSSI -60
+#define RH_SIM_DEFAULT_SNR  10
+
+/////////////////////////////////////////////////////////////////////
+/// \class RH_SIM RH_SIM.h <RH_SIM.h>
+/// \brief Driver to send and receive unaddressed, unreliable datagrams over a LoRa channel
+/// simulated by RHEtherSim
+///
+/// \par Overview
+///
+/// RH_SIM behaves like an RH_RF95 as far as the RadioHead manager classes can tell: it has the
+/// same maximum message length, carries the 4 RadioHead headers in the payload, goes idle after
+/// transmitting and after receiving a valid packet, and takes as long to transmit a packet as a
+/// real SX127x with the same modem settings.
+///
+/// Unlike RH_TCP, all the blocking functions (waitAvailable(), waitAvailableTimeout() and
+/// waitPacketSent()) suspend the calling node in RHEtherSim's virtual time rather than polling,
+/// so idle nodes cost no CPU.
+///
+/// \code
+/// RHEtherSim ether;
+/// RH_SIM driver(&ether);
+/// RHMesh manager(driver, 1);
+/// \endcode
+///
+/// See RHEtherSim for details of the channel model and how to build and run simulations.
+class RH_SIM : public RHGenericDriver
+{
+public:
+    /// Constructor
+    /// \param[in] ether The simulated channel this radio is on. Defaults to RHEtherSim::instance()
+    RH_SIM(RHEtherSim* ether = NULL);
+
+    /// Destructor. Removes the radio from the channel.
+    virtual ~RH_SIM();
+
+    /// Initialise the Driver transport hardware and software.
+    /// \return true if initialisation succeeded.
+    virtual bool init();
+
+    /// Tests whether a new message is available
+    /// from the Driver.
+    /// If there is no uncollected message and the radio is not transmitting,
+    /// this puts the radio into RHModeRx.
+    /// \return true if a new, complete, error-free uncollected message is available to be retreived by recv()
+    virtual bool available();
+
+    /// Turns the receiver on if it not already on.
+    /// If there is a valid message available, copy it to buf and return true
+    /// else return false.
+    /// If a message is copied, *len is set to the length (Caution, 0 length messages are permitted).
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Pointer to the number of octets available in buf. The number be reset to the actual number of octets copied.
+    /// \return true if a valid message was copied to buf
+    virtual bool recv(uint8_t* buf, uint8_t* len);
+
+    /// Waits until any previous transmit packet is finished being transmitted with waitPacketSent().
+    /// Then optionally waits for Channel Activity Detection (CAD)
+    /// to show the channnel is clear by calling waitCAD().
+    /// Then starts transmitting the message on the simulated channel.
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send (> 0)
+    /// \return true if the message length was valid and it was correctly queued for transmit
+    virtual bool send(const uint8_t* data, uint8_t len);
+
+    /// Returns the maximum message length
+    /// available in this Driver.
+    /// \return The maximum legal message length
+    virtual uint8_t maxMessageLength();
+
+    /// Suspends the calling node until a message is available.
+    /// \param[in] polldelay Ignored
+    virtual void waitAvailable(uint16_t polldelay = 0);
+
+    /// Suspends the calling node until a message is available or the timeout expires.
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \param[in] polldelay Ignored
+    /// \return true if a message is available
+    virtual bool waitAvailableTimeout(uint16_t timeout, uint16_t polldelay = 0);
+
+    /// Suspends the calling node until the transmitter is no longer transmitting.
+    virtual bool waitPacketSent();
+
+    /// Suspends the calling node until the transmitter is no longer transmitting,
+    /// or until the timeout occurs, whichever happens first.
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \return true if the radio completed transmission within the timeout period. False if it timed out.
+    virtual bool waitPacketSent(uint16_t timeout);
+
+    /// Simulated Channel Activity Detection.
+    /// \return true if any packet, decodable or not, is currently arriving at this radio
+    virtual bool isChannelActive();
+
+    /// Puts the radio into low power sleep mode, in which it receives nothing.
+    /// \return true
+    virtual bool sleep();
+
+    /// If current mode is Rx or Tx changes it to Idle.
+    void setModeIdle();
+
+    /// Puts the radio into receive mode, if it is not already transmitting.
+    void setModeRx();
+
+    /// Sets the centre frequency. Only radios on the same frequency can hear each other.
+    /// \param[in] centre Frequency in MHz.
+    /// \return true
+    bool setFrequency(float centre);
+
+    /// Sets the LoRa spreading factor used to compute the time on air.
+    /// \param[in] sf 6 to 12
+    void setSpreadingFactor(uint8_t sf);
+
+    /// Sets the LoRa signal bandwidth used to compute the time on air.
+    /// \param[in] sbw Bandwidth in Hz
+    void setSignalBandwidth(long sbw);
+
+    /// Sets the LoRa coding rate used to compute the time on air.
+    /// \param[in] denominator 5 to 8, for coding rates 4/5 to 4/8
+    void setCodingRate4(uint8_t denominator);
+
+    /// Sets the preamble length used to compute the time on air.
+    /// \param[in] bytes Preamble length in symbols
+    void setPreambleLength(uint16_t bytes);
+
+    /// Returns the modem settings used to compute the time on air of packets from this radio
+    const RHLoRaModemParams& modemParams() const;
+
+    /// Returns the address of this node
+    uint8_t thisAddress() const;
+
+    /// Returns the simulated SNR of the last received message
+    /// \return SNR in dB
+    virtual int lastSNR();
+
+    /// Returns the count of packets lost while this radio was listening, whether due to
+    /// collisions, link loss or not collecting the previous message in time.
+    uint16_t rxLost();
+
+protected:
+    friend class RHEtherSim;
+
+    /// The simulated channel
+    RHEtherSim*         _ether;
+
+    /// Centre frequency in MHz
+    float               _frequency;
+
+    /// Modem settings for airtime calculations
+    RHLoRaModemParams   _modem;
+
+    /// Packets currently arriving at this radio
+    std::vector<RHEtherSim::Reception*> _receptions;
+
+    /// The received packet, including the 4 headers
+    uint8_t             _buf[RH_SIM_MAX_PAYLOAD_LEN];
+
+    /// Number of octets in _buf
+    uint8_t             _bufLen;
+
+    /// True when there is a valid message in _buf
+    bool                _rxBufValid;
+
+    /// The node suspended waiting on this radio, if any
+    RHEtherSim::Node*   _waiter;
+
+    /// Count of packets lost while listening
+    uint16_t            _rxLost;
+
+    /// Simulated SNR of the last received message, dB
+    int8_t              _lastSNR;
+};
+
+#endif
+
+#endif
@@ -30,8 +30,16 @@ bool RH_Serial::init()
 // Call this often
 bool RH_Serial::available()
 {
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+    // Unix version driver in RHutil/HardwareSerial buffers its input, so scan it where it is
+    const uint8_t* data;
+    size_t len;
+    while (!_rxBufValid && (len = _serial.peekBytes(&data)) > 0)
+	_serial.skip(handleRx(data, len));
+#else
     while (!_rxBufValid &&_serial.available())
 	handleRx(_serial.read());
+#endif
     return _rxBufValid;
 }
 
@@ -103,7 +111,8 @@ void  RH_Serial::handleRx(uint8_t ch)
 	{
 	    if (ch == ETX)
 	    {
-		// add fcs for DLE, ETX
+		// fcs for the whole frame, then DLE, ETX
+		_rxFcs = RHcrc_ccitt_update_buf(_rxFcs, _rxBuf, _rxBufLen);
 		_rxFcs = RHcrc_ccitt_update(_rxFcs, DLE);
 		_rxFcs = RHcrc_ccitt_update(_rxFcs, ETX);
 		_rxState = RxStateWaitFCS1; // End frame
@@ -138,6 +147,29 @@ void  RH_Serial::handleRx(uint8_t ch)
     }
 }
 
+size_t RH_Serial::handleRx(const uint8_t* data, size_t len)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    while (p < end && !_rxBufValid)
+    {
+	if (_rxState == RxStateIdle || _rxState == RxStateData)
+	{
+	    // Only a DLE changes the state, so take everything up to the next one at once
+	    const uint8_t* dle = (const uint8_t*)memchr(p, DLE, end - p);
+	    if (!dle)
+		dle = end;
+	    if (_rxState == RxStateData)
+		appendRxBuf(p, dle - p);
+	    p = dle;
+	    if (p == end)
+		break;
+	}
+	handleRx(*p++);
+    }
+    return p - data;
+}
+
 void RH_Serial::clearRxBuf()
 {
     _rxBufValid = false;
@@ -149,14 +181,22 @@ void RH_Serial::appendRxBuf(uint8_t ch)
 {
     if (_rxBufLen < RH_SERIAL_MAX_PAYLOAD_LEN)
     {
-	// Normal data, save and add to FCS
+	// Normal data, save. The FCS is calculated over the whole buffer at the end of the frame
 	_rxBuf[_rxBufLen++] = ch;
-	_rxFcs = RHcrc_ccitt_update(_rxFcs, ch);
     }
     // If the buffer overflows, we dont record the trailing data, and the FCS will be wrong,
     // causing the message to be dropped when the FCS is received
 }
 
+void RH_Serial::appendRxBuf(const uint8_t* data, size_t len)
+{
+    // As above, for a run of data
+    if (len > (size_t)(RH_SERIAL_MAX_PAYLOAD_LEN - _rxBufLen))
+	len = RH_SERIAL_MAX_PAYLOAD_LEN - _rxBufLen;
+    memcpy(_rxBuf + _rxBufLen, data, len);
+    _rxBufLen += len;
+}
+
 // Check whether the latest received message is complete and uncorrupted
 void RH_Serial::validateRxBuf()
 {
@@ -204,35 +244,45 @@ bool RH_Serial::send(const uint8_t* data, uint8_t len)
     if (!waitCAD()) 
 	return false;  // Check channel activity
 
-    _txFcs = 0xffff;    // Initial value
-    _serial.write(DLE); // Not in FCS
-    _serial.write(STX); // Not in FCS
-    // First the 4 headers
-    txData(_txHeaderTo);
-    txData(_txHeaderFrom);
-    txData(_txHeaderId);
-    txData(_txHeaderFlags);
-    // Now the payload
-    while (len--)
-	txData(*data++);
-    // End of message
-    _serial.write(DLE);
+    uint8_t headers[RH_SERIAL_HEADER_LEN] = { _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags };
+    _txFcs = RHcrc_ccitt_update_buf(0xffff, headers, sizeof(headers));
+    _txFcs = RHcrc_ccitt_update_buf(_txFcs, data, len);
     _txFcs = RHcrc_ccitt_update(_txFcs, DLE);
-    _serial.write(ETX);
     _txFcs = RHcrc_ccitt_update(_txFcs, ETX);
 
-    // Now send the calculated FCS for this message
-    _serial.write((_txFcs >> 8) & 0xff);
-    _serial.write(_txFcs & 0xff);
+    // DLE STX (not in FCS), then the 4 headers
+    uint8_t start[2 + 2 * RH_SERIAL_HEADER_LEN];
+    uint8_t startLen = 0;
+    start[startLen++] = DLE;
+    start[startLen++] = STX;
+    for (uint8_t i = 0; i < RH_SERIAL_HEADER_LEN; i++)
+    {
+	if (headers[i] == DLE)    // DLE stuffing required?
+	    start[startLen++] = DLE; // Not in FCS
+	start[startLen++] = headers[i];
+    }
+    _serial.write(start, startLen);
+    // Now the payload
+    txData(data, len);
+    // End of message, then the calculated FCS for this message
+    uint8_t trailer[4] = { DLE, ETX, (uint8_t)((_txFcs >> 8) & 0xff), (uint8_t)(_txFcs & 0xff) };
+    _serial.write(trailer, sizeof(trailer));
     return true;
 }
 
-void  RH_Serial::txData(uint8_t ch)
+void  RH_Serial::txData(const uint8_t* data, uint8_t len)
 {
-    if (ch == DLE)    // DLE stuffing required?
-	_serial.write(DLE); // Not in FCS
-    _serial.write(ch);
-    _txFcs = RHcrc_ccitt_update(_txFcs, ch);
+    // Write runs of data up to and including each DLE, then the extra DLE to stuff it
+    while (len)
+    {
+	const uint8_t* dle = (const uint8_t*)memchr(data, DLE, len);
+	uint8_t count = dle ? dle - data + 1 : len;
+	_serial.write(data, count);
+	if (dle)
+	    _serial.write(DLE); // Not in FCS
+	data += count;
+	len -= count;
+    }
 }
 
 uint8_t RH_Serial::maxMessageLength()
@@ -229,19 +229,29 @@ protected:
     /// the receiver state machine
     void  handleRx(uint8_t ch);
 
+    /// Handles a run of characters received from the serial port, up to the end of the first
+    /// good frame. Runs of data between DLEs are copied to the Rx buffer at once.
+    /// \param[in] data The characters
+    /// \param[in] len The number of characters
+    /// \return The number of characters used
+    size_t handleRx(const uint8_t* data, size_t len);
+
     /// Empties the Rx buffer
     void  clearRxBuf();
 
     /// Adds a charater to the Rx buffer
     void  appendRxBuf(uint8_t ch);
 
+    /// Adds a run of characters to the Rx buffer
+    void  appendRxBuf(const uint8_t* data, size_t len);
+
     /// Checks whether the Rx buffer contains valid data that is complete and uncorrupted
     /// Check the FCS, the TO address, and extracts the headers
     void  validateRxBuf();
 
-    /// Sends a single data octet to the serial port.
-    /// Implements DLE stuffing and keeps track of the senders FCS
-    void  txData(uint8_t ch);
+    /// Sends data octets to the serial port, a run at a time.
+    /// Implements DLE stuffing. The FCS is calculated separately
+    void  txData(const uint8_t* data, uint8_t len);
 
     /// Reference to the HardwareSerial port we will use
     HardwareSerial& _serial;
@@ -249,7 +259,7 @@ protected:
     /// The current state of the Rx state machine
     RxState         _rxState;
 
-    /// Progressive FCS calc (CCITT CRC-16 covering all received data (but not stuffed DLEs), plus trailing DLE, ETX)
+    /// FCS calc (CCITT CRC-16 covering all received data (but not stuffed DLEs), plus trailing DLE, ETX), done at the end of the frame
     uint16_t        _rxFcs;
 
     /// The received FCS at the end of the current message
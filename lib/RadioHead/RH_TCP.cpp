@@ -17,14 +17,30 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <time.h>
 #include <string>
 
+// Returns microseconds on a clock that never goes backwards
+static uint64_t monotonicMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 RH_TCP::RH_TCP(const char* server)
     : _server(server),
+      _socket(-1),
+      _socketBufHead(0),
+      _socketBufTail(0),
       _rxBufLen(0),
       _rxBufValid(false),
-      _socket(-1)
+      _txEnd(0)
 {
+    RHLoRaDefaultModemParams(&_modem);
 }
     
 bool RH_TCP::init()
@@ -38,9 +54,7 @@ bool RH_TCP::connectToServer()
 {
     struct addrinfo hints;
     struct addrinfo *result, *rp;
-    int sfd, s;
-    struct sockaddr_storage peer_addr;
-    socklen_t peer_addr_len;
+    int s;
 
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_UNSPEC;    // Allow IPv4 or IPv6
@@ -84,14 +98,15 @@ bool RH_TCP::connectToServer()
 	close(_socket);
     }
 
+    freeaddrinfo(result);           /* No longer needed */
+
     if (rp == NULL) 
     {               /* No address succeeded */
 	fprintf(stderr, "RH_TCP::connect could not connect to %s\n", _server);
+	_socket = -1;
 	return false;
     }
 
-    freeaddrinfo(result);           /* No longer needed */
-
     // Now make the socket non-blocking
     int on = 1;
     int rc = ioctl(_socket, FIONBIO, (char *)&on);
@@ -102,6 +117,8 @@ bool RH_TCP::connectToServer()
 	_socket = -1;
 	return false;
     }
+    // Messages are small and each one should go out at once
+    setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
     return true;
 }
 
@@ -111,79 +128,106 @@ void RH_TCP::clearRxBuf()
     _rxBufLen = 0;
 }
 
-bool RH_TCP::checkForEvents()
+void RH_TCP::closeSocket()
 {
-    #define RH_TCP_SOCKETBUF_LEN 500
-    static uint8_t socketBuf[RH_TCP_SOCKETBUF_LEN]; // Room for several messages
-    static uint16_t socketBufLen = 0;
+    close(_socket);
+    _socket = -1;
+}
 
+void RH_TCP::copyFromSocketBuf(uint16_t offset, uint8_t* dest, uint16_t len)
+{
+    // The ring may wrap in the middle
+    uint16_t start = (_socketBufTail + offset) & (RH_TCP_SOCKETBUF_LEN - 1);
+    uint16_t first = RH_TCP_SOCKETBUF_LEN - start;
+    if (first > len)
+	first = len;
+    memcpy(dest, _socketBuf + start, first);
+    memcpy(dest + first, _socketBuf, len - first);
+}
+
+bool RH_TCP::checkForEvents()
+{
     if (_socket < 0)
 	return false;
 
-    // Read at most the amount of space we have left in the buffer
-    ssize_t count = read(_socket, socketBuf + socketBufLen, sizeof(socketBuf) - socketBufLen);
-    if (count < 0)
+    // Read as much as will fit into the free part of the ring, which may be in 2 pieces
+    uint16_t used = _socketBufHead - _socketBufTail;
+    if (used < RH_TCP_SOCKETBUF_LEN)
     {
-	if (errno != EAGAIN)
+	uint16_t head = _socketBufHead & (RH_TCP_SOCKETBUF_LEN - 1);
+	uint16_t tail = _socketBufTail & (RH_TCP_SOCKETBUF_LEN - 1);
+	struct iovec iov[2];
+	int iovcnt = 1;
+	iov[0].iov_base = _socketBuf + head;
+	if (head >= tail)
 	{
-	    fprintf(stderr,"RH_TCP::checkForEvents read error: %s\n", strerror(errno));
-	    close(_socket);
-	    _socket = -1;
-	    return false;
+	    iov[0].iov_len = RH_TCP_SOCKETBUF_LEN - head;
+	    iov[1].iov_base = _socketBuf;
+	    iov[1].iov_len = tail;
+	    iovcnt = tail ? 2 : 1;
 	}
-    }
-    else if (count == 0)
-    {
-	// End of file
-	fprintf(stderr,"RH_TCP::checkForEvents unexpected end of file on read\n");
-	close(_socket);
-	_socket = -1;
-	return false;
-    }
-    else
-    {
-	socketBufLen += count;
-	while (socketBufLen >= 5)
+	else
+	    iov[0].iov_len = tail - head;
+	ssize_t count = readv(_socket, iov, iovcnt);
+	if (count < 0)
 	{
-	    RHTcpTypeMessage* message = ((RHTcpTypeMessage*)socketBuf);
-	    uint32_t len = ntohl(message->length);
-	    uint32_t messageLen = len + sizeof(message->length);
-	    if (len > sizeof(socketBuf) - sizeof(message->length))
+	    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
 	    {
-		// Bogus length
-		fprintf(stderr, "RH_TCP::checkForEvents read ridiculous length: %d. Corrupt message stream? Aborting\n", len);
-		close(_socket);
-		_socket = -1;
+		fprintf(stderr,"RH_TCP::checkForEvents read error: %s\n", strerror(errno));
+		closeSocket();
 		return false;
 	    }
-	    if (socketBufLen >= len + sizeof(message->length))
+	}
+	else if (count == 0)
+	{
+	    // End of file
+	    fprintf(stderr,"RH_TCP::checkForEvents unexpected end of file on read\n");
+	    closeSocket();
+	    return false;
+	}
+	else
+	    _socketBufHead += count;
+    }
+
+    // Handle the complete messages in the ring, in place. Stop at the first packet for us,
+    // so that it is not overwritten before it is collected, and leave the rest in the ring for later
+    while (!_rxBufValid)
+    {
+	used = _socketBufHead - _socketBufTail;
+	uint32_t len;
+	if (used < sizeof(len))
+	    break;
+	copyFromSocketBuf(0, (uint8_t*)&len, sizeof(len));
+	len = ntohl(len);
+	if (len > sizeof(((RHTcpMessage*)0)->payload))
+	{
+	    // Bogus length
+	    fprintf(stderr, "RH_TCP::checkForEvents read ridiculous length: %d. Corrupt message stream? Aborting\n", len);
+	    closeSocket();
+	    return false;
+	}
+	if (used < sizeof(len) + len)
+	    break; // Rest of it not here yet
+	if (len >= 5)
+	{
+	    // type, to, from, id, flags
+	    uint8_t header[5];
+	    copyFromSocketBuf(sizeof(len), header, sizeof(header));
+	    if (header[0] == RH_TCP_MESSAGE_TYPE_PACKET)
 	    {
-		// Got at least all of this message
-		if (message->type == RH_TCP_MESSAGE_TYPE_PACKET && len >= 5)
-		{
-		    // REVISIT: need to check if we are actually receiving?
-		    // Its a new packet, extract the headers and payload
-		    RHTcpPacket* packet = ((RHTcpPacket*)socketBuf);
-		    _rxHeaderTo    = packet->to;
-		    _rxHeaderFrom  = packet->from;
-		    _rxHeaderId    = packet->id;
-		    _rxHeaderFlags = packet->flags;
-		    uint32_t payloadLen = len - 5;
-		    if (payloadLen <= sizeof(_rxBuf))
-		    {
-			// Enough room in our receiver buffer
-			memcpy(_rxBuf, packet->payload, payloadLen);
-			_rxBufLen = payloadLen;
-			_rxBufFull = true;
-		    }
-		}
-		// check for other message types here
-		// Now remove the used message by copying the trailing bytes (maybe start of a new message?)
-		// to the top of the buffer
-		memcpy(socketBuf, socketBuf + messageLen, sizeof(socketBuf) - messageLen);
-		socketBufLen -= messageLen;
+		// REVISIT: need to check if we are actually receiving?
+		// Its a new packet, extract the headers and payload
+		_rxHeaderTo    = header[1];
+		_rxHeaderFrom  = header[2];
+		_rxHeaderId    = header[3];
+		_rxHeaderFlags = header[4];
+		_rxBufLen = len - 5;
+		copyFromSocketBuf(sizeof(len) + sizeof(header), _rxBuf, _rxBufLen);
+		validateRxBuf();
 	    }
 	}
+	// check for other message types here
+	_socketBufTail += sizeof(len) + len;
     }
     return true; // No faults
 }
@@ -200,17 +244,22 @@ void RH_TCP::validateRxBuf()
     }
 }
 
+void RH_TCP::checkTxDone()
+{
+    if (_mode == RHModeTx && monotonicMicros() >= _txEnd)
+    {
+	_txGood++;
+	_mode = RHModeIdle;
+    }
+}
+
 bool RH_TCP::available()
 {
+    checkTxDone();
     if (_socket < 0)
 	return false;
-    if (checkForEvents())
-	return false;        // Som sort of IO failre
-    if (_rxBufFull)
-    {
-	validateRxBuf();
-	_rxBufFull= false;
-    }
+    if (!checkForEvents())
+	return false;        // Some sort of IO failure
     return _rxBufValid;
 }
 
@@ -223,29 +272,31 @@ void RH_TCP::waitAvailable(uint16_t polldelay)
 // Block until something is available or timeout expires
 bool RH_TCP::waitAvailableTimeout(uint16_t timeout, uint16_t polldelay)
 {
-    int            max_fd;
-    fd_set         input;
-    int            result;
-
-    FD_ZERO(&input);
-    FD_SET(_socket, &input);
-    max_fd = _socket + 1;
-
-    if (timeout)
-    {
-	struct timeval timer;
-	// Timeout is in milliseconds
-	timer.tv_sec  = timeout / 1000;
-	timer.tv_usec = (timeout % 1000) * 1000;
-	result = select(max_fd, &input, NULL, NULL, &timer);
-    }
-    else
+    uint64_t deadline = monotonicMicros() + (uint64_t)timeout * 1000;
+    // Messages may already be waiting in the ring, or arrive a piece at a time, so keep
+    // going until a complete one is available
+    while (!available())
     {
-	result = select(max_fd, &input, NULL, NULL, NULL);
+	if (_socket < 0)
+	    return false;
+	int wait = -1; // Forever
+	if (timeout)
+	{
+	    uint64_t t = monotonicMicros();
+	    if (t >= deadline)
+		return false;
+	    wait = (deadline - t + 999) / 1000;
+	}
+	struct pollfd fds;
+	fds.fd = _socket;
+	fds.events = POLLIN;
+	if (poll(&fds, 1, wait) < 0 && errno != EINTR)
+	{
+	    fprintf(stderr, "RH_TCP::waitAvailableTimeout: poll failed %s\n", strerror(errno));
+	    return false;
+	}
     }
-    if (result < 0)
-	fprintf(stderr, "RH_TCP::waitAvailableTimeout: select failed %s\n", strerror(errno));
-    return result > 0;
+    return true;
 }
 
 bool RH_TCP::recv(uint8_t* buf, uint8_t* len)
@@ -265,12 +316,47 @@ bool RH_TCP::recv(uint8_t* buf, uint8_t* len)
 
 bool RH_TCP::send(const uint8_t* data, uint8_t len)
 {
+    if (len > RH_TCP_MAX_MESSAGE_LEN)
+	return false;
+
+    waitPacketSent(); // Make sure we dont interrupt an outgoing message
     if (!waitCAD()) 
 	return false;  // Check channel activity (prob not possible for this driver?)
 
-    bool ret = sendPacket(data, len);
-    delay(10); // Wait for transmit to succeed. REVISIT: depends on length and speed
-    return ret;
+    // The ether server holds the packet for its time on air. Stay in Tx mode for as long,
+    // so that waitPacketSent() returns when the packet would have left a real radio
+    _lastAirtime = RHLoRaAirtime(&_modem, len + RH_TCP_HEADER_LEN);
+    if (!sendPacket(data, len))
+	return false;
+    _txEnd = monotonicMicros() + _lastAirtime;
+    _mode = RHModeTx;
+    return true;
+}
+
+bool RH_TCP::waitPacketSent()
+{
+    while (_mode == RHModeTx)
+    {
+	uint64_t t = monotonicMicros();
+	if (t < _txEnd)
+	    usleep(_txEnd - t);
+	checkTxDone();
+    }
+    return true;
+}
+
+bool RH_TCP::waitPacketSent(uint16_t timeout)
+{
+    uint64_t deadline = monotonicMicros() + (uint64_t)timeout * 1000;
+    if (_mode == RHModeTx && _txEnd > deadline)
+    {
+	// Signed, so that a deadline already passed by the time we get here does not wrap
+	int64_t remaining = (int64_t)(deadline - monotonicMicros());
+	if (remaining > 0)
+	    usleep(remaining);
+	return false;
+    }
+    return waitPacketSent();
 }
 
 uint8_t RH_TCP::maxMessageLength()
@@ -284,6 +370,50 @@ void RH_TCP::setThisAddress(uint8_t address)
     sendThisAddress(_thisAddress);
 }
 
+void RH_TCP::setModemParams(const RHLoRaModemParams& params)
+{
+    _modem = params;
+}
+
+const RHLoRaModemParams& RH_TCP::modemParams() const
+{
+    return _modem;
+}
+
+bool RH_TCP::writeAll(struct iovec* iov, int iovcnt)
+{
+    while (iovcnt)
+    {
+	ssize_t sent = writev(_socket, iov, iovcnt);
+	if (sent < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return false;
+	    // Socket buffer full, wait for the server to catch up
+	    struct pollfd fds;
+	    fds.fd = _socket;
+	    fds.events = POLLOUT;
+	    poll(&fds, 1, -1);
+	    continue;
+	}
+	// Skip over what went, in case it was not all of it
+	while (iovcnt && (size_t)sent >= iov->iov_len)
+	{
+	    sent -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt)
+	{
+	    iov->iov_base = (uint8_t*)iov->iov_base + sent;
+	    iov->iov_len -= sent;
+	}
+    }
+    return true;
+}
+
 bool RH_TCP::sendThisAddress(uint8_t thisAddress)
 {
     if (_socket < 0)
@@ -292,14 +422,17 @@ bool RH_TCP::sendThisAddress(uint8_t thisAddress)
     m.length = htonl(2);
     m.type = RH_TCP_MESSAGE_TYPE_THISADDRESS;
     m.thisAddress = thisAddress;
-    ssize_t sent = write(_socket, &m, sizeof(m));
-    return sent > 0;
+    struct iovec iov;
+    iov.iov_base = &m;
+    iov.iov_len = sizeof(m);
+    return writeAll(&iov, 1);
 }
 
 bool RH_TCP::sendPacket(const uint8_t* data, uint8_t len)
 {
     if (_socket < 0)
 	return false;
+    // The length and 5 octets of header, then the caller's data straight from its buffer
     RHTcpPacket m;
     m.length = htonl(len + 5); // 5 octets of header
     m.type  = RH_TCP_MESSAGE_TYPE_PACKET;
@@ -307,9 +440,12 @@ bool RH_TCP::sendPacket(const uint8_t* data, uint8_t len)
     m.from  = _txHeaderFrom;
     m.id    = _txHeaderId;
     m.flags = _txHeaderFlags;
-    memcpy(m.payload, data, len);
-    ssize_t sent = write(_socket, &m, len + 9); // length + 5 octets header
-    return sent > 0;
+    struct iovec iov[2];
+    iov[0].iov_base = &m;
+    iov[0].iov_len = 9; // length + 5 octets header
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    return writeAll(iov, len ? 2 : 1);
 }
 
 #endif
@@ -7,6 +7,12 @@
 
 #include <RHGenericDriver.h>
 #include <RHTcpProtocol.h>
+#include <RHLoRaAirtime.h>
+
+// Octets of RHTcpProtocol messages buffered from the server. Must be a power of 2
+#define RH_TCP_SOCKETBUF_LEN 2048
+
+struct iovec;
 
 /////////////////////////////////////////////////////////////////////
 /// \class RH_TCP RH_TCP.h <RH_TCP.h>
@@ -50,6 +56,20 @@
 /// You can change the listen port and the simulated baud rate with 
 /// command line arguments passed to etherSimulator.pl
 ///
+/// For more than a few dozen clients, use tools/etherServer.cpp instead of etherSimulator.pl.
+/// It speaks the same protocol and reads the same config file, but is a native epoll server that
+/// can carry thousands of clients. It holds each packet for its LoRa time on air
+/// (see RHLoRaAirtime.h), destroys packets that overlap at a receiver, and can add a delay per link.
+/// \code
+/// g++ -O2 -I . -I RHutil tools/etherServer.cpp RHLoRaAirtime.cpp -o etherServer
+/// ./etherServer -c tools/chain.conf -s 7 -w 125000 -r 5
+/// \endcode
+///
+/// send() returns as soon as the packet has been passed to the server. The driver then stays in
+/// RHModeTx for the time on air of the packet, computed from the modem settings given to
+/// setModemParams() (SF7, 125kHz, 4/5 by default), so waitPacketSent() returns when a real radio
+/// would have finished transmitting. Use the same settings as the server.
+///
 /// \par Implementation
 ///
 /// etherServer.pl is a conventional server written in Perl.
@@ -124,6 +144,16 @@ public:
     /// \return true if the message length was valid and it was correctly queued for transmit
     virtual bool send(const uint8_t* data, uint8_t len);
 
+    /// Blocks until the current packet has been on the air for its full time on air
+    /// \return true
+    virtual bool waitPacketSent();
+
+    /// Blocks until the current packet has been on the air for its full time on air, or
+    /// the timeout expires
+    /// \param[in] timeout The maximum time to wait in milliseconds
+    /// \return true if the packet was sent before the timeout expired
+    virtual bool waitPacketSent(uint16_t timeout);
+
     /// Returns the maximum message length 
     /// available in this Driver.
     /// \return The maximum legal message length
@@ -140,6 +170,14 @@ public:
     /// \param[in] address The address of this node.
     void setThisAddress(uint8_t address);
 
+    /// Sets the LoRa modem settings used to compute the time on air of transmitted packets.
+    /// These should match the settings the ether server was started with.
+    /// \param[in] params The modem settings
+    void setModemParams(const RHLoRaModemParams& params);
+
+    /// Returns the modem settings used to compute the time on air of transmitted packets
+    const RHLoRaModemParams& modemParams() const;
+
 protected:
 
 private:
@@ -154,6 +192,25 @@ private:
     /// Clear the receive buffer
     void clearRxBuf();
 
+    /// Closes the connection to the server after an error
+    void closeSocket();
+
+    /// Copies octets out of the socket ring buffer, which may wrap, without consuming them
+    /// \param[in] offset Offset from the oldest unconsumed octet
+    /// \param[out] dest Where to copy to
+    /// \param[in] len Number of octets to copy
+    void copyFromSocketBuf(uint16_t offset, uint8_t* dest, uint16_t len);
+
+    /// Returns to RHModeIdle if the time on air of the current transmission has passed
+    void checkTxDone();
+
+    /// Writes all of the given buffers to the server with as few system calls as possible,
+    /// waiting for room in the socket if necessary
+    /// \param[in] iov The buffers. Modified if the socket takes only part of them at a time
+    /// \param[in] iovcnt The number of buffers
+    /// \return true if successful
+    bool writeAll(struct iovec* iov, int iovcnt);
+
     /// Sends thisAddress to the ether simulator server
     /// in a RHTcpThisAddress message.
     /// \param[in] thisAddress The node address of this node
@@ -174,17 +231,25 @@ private:
     /// The TCP socket used to communicate with the message server
     int         _socket;
 
+    /// Ring buffer of RHTcpProtocol messages read from the server. The indexes run freely
+    /// and are masked when used, so head - tail is the number of octets in the ring
+    uint8_t     _socketBuf[RH_TCP_SOCKETBUF_LEN];
+    uint16_t    _socketBufHead;
+    uint16_t    _socketBufTail;
+
     /// Buffer to receive RHTcpProtocol messages
     uint8_t     _rxBuf[RH_TCP_MAX_PAYLOAD_LEN + 5];
     uint16_t    _rxBufLen;
     bool        _rxBufValid;
 
-    /// Check whether the latest received message is complete and uncorrupted
-    void            validateRxBuf();
+    /// Modem settings for airtime calculations
+    RHLoRaModemParams _modem;
 
-    // Used in the interrupt handlers
-    /// Buf is filled but not validated
-    volatile bool   _rxBufFull;
+    /// When the current transmission ends, in microseconds on the monotonic clock
+    uint64_t    _txEnd;
+
+    /// Check whether the latest received message is addressed to us, and if so make it available
+    void            validateRxBuf();
 
 };
 
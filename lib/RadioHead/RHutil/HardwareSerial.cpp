@@ -13,12 +13,13 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <termios.h>
-#include <sys/ioctl.h>
 #include <sys/select.h>
 
 HardwareSerial::HardwareSerial(const char* deviceName)
     : _deviceName(deviceName),
-      _device(-1)
+      _device(-1),
+      _rxHead(0),
+      _rxTail(0)
 {
     // Override device name from environment
     char* e = getenv("RH_HARDWARESERIAL_DEVICE_NAME");
@@ -44,45 +45,92 @@ void HardwareSerial::flush()
 
 int HardwareSerial::peek(void)
 {
-    printf("HardwareSerial::peek not implemented\n");
-    return 0;
+    if (!available())
+	return -1;
+    return _rxBuf[_rxTail];
 }
 
-int HardwareSerial::available()
+size_t HardwareSerial::fill()
 {
-    int bytes;
-
-    if (ioctl(_device, FIONREAD, &bytes) != 0)
+    if (_rxTail == _rxHead)
+	_rxTail = _rxHead = 0; // Empty, start again at the beginning
+    if (_device == -1 || _rxHead == sizeof(_rxBuf))
+	return 0;
+    // The port is set up with VMIN and VTIME 0, so this returns at once with whatever is there
+    ssize_t result = ::read(_device, _rxBuf + _rxHead, sizeof(_rxBuf) - _rxHead);
+    if (result < 0)
     {
-	fprintf(stderr, "HardwareSerial::available ioctl failed: %s\n", strerror(errno));
+	if (errno != EAGAIN && errno != EINTR)
+	    fprintf(stderr, "HardwareSerial::fill read failed: %s\n", strerror(errno));
 	return 0;
     }
-    return bytes;
+    _rxHead += result;
+    return result;
+}
+
+int HardwareSerial::available()
+{
+    if (_rxTail == _rxHead)
+	fill();
+    return _rxHead - _rxTail;
 }
 
 int HardwareSerial::read()
 {
-    uint8_t data;
-    ssize_t result = ::read(_device, &data, 1);
-    if (result != 1)
+    if (!available())
     {
-	fprintf(stderr, "HardwareSerial::read read failed: %s\n", strerror(errno));
+	fprintf(stderr, "HardwareSerial::read nothing available\n");
 	return 0;
     }
-//    printf("got: %02x\n", data);
-    return data;
+//    printf("got: %02x\n", _rxBuf[_rxTail]);
+    return _rxBuf[_rxTail++];
+}
+
+size_t HardwareSerial::readBytes(uint8_t* buf, size_t len)
+{
+    size_t count = available();
+    if (count > len)
+	count = len;
+    memcpy(buf, _rxBuf + _rxTail, count);
+    _rxTail += count;
+    return count;
+}
+
+size_t HardwareSerial::peekBytes(const uint8_t** data)
+{
+    size_t count = available(); // May move the buffered octets
+    *data = _rxBuf + _rxTail;
+    return count;
+}
+
+void HardwareSerial::skip(size_t len)
+{
+    if (len > _rxHead - _rxTail)
+	len = _rxHead - _rxTail;
+    _rxTail += len;
 }
 
 size_t HardwareSerial::write(uint8_t ch)
 {
-    size_t result = ::write(_device, &ch, 1);
-    if (result != 1)
+    return write(&ch, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
     {
-	fprintf(stderr, "HardwareSerial::write failed: %s\n", strerror(errno));
-	return 0;
+	ssize_t result = ::write(_device, buf + done, len - done);
+	if (result < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "HardwareSerial::write failed: %s\n", strerror(errno));
+	    break;
+	}
+	done += result;
     }
-//    printf("sent: %02x\n", ch);
-    return 1; // OK
+    return done;
 }
 
 bool HardwareSerial::openDevice()
@@ -198,6 +246,10 @@ bool HardwareSerial::setBaud(int baud)
     // Raw output
     options.c_oflag &= ~(OPOST | OCRNL | ONLCR);
 
+    // read() returns at once with whatever is available, so it never blocks
+    options.c_cc[VMIN] = 0;
+    options.c_cc[VTIME] = 0;
+
     // Set the options in the port
     if (tcsetattr(_device, TCSANOW, &options) != 0)
     {
@@ -218,6 +270,9 @@ void HardwareSerial::waitAvailable()
 // Block until something is available or timeout expires
 bool HardwareSerial::waitAvailableTimeout(uint16_t timeout)
 {
+    if (_rxTail != _rxHead)
+	return true; // Already buffered, the device may have nothing more
+
     int            max_fd;
     fd_set         input;
     int            result;
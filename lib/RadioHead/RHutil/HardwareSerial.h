@@ -6,6 +6,10 @@
 #define HardwareSerial_h
 
 #include <stdio.h>
+#include <stdint.h>
+
+// Octets read from the device at a time, and buffered until they are consumed
+#define HARDWARESERIAL_RX_BUF_LEN 4096
 
 /////////////////////////////////////////////////////////////////////
 /// \class HardwareSerial HardwareSerial.h <RHutil/HardwareSerial.h>
@@ -19,6 +23,11 @@
 /// The device port is configured for 8 bits, no parity, 1 stop bit and full raw transparency, so it can be used
 /// to send and receive any 8 bit character. A limited range of baud rates is supported.
 ///
+/// Input is read from the device up to HARDWARESERIAL_RX_BUF_LEN octets at a time into a buffer,
+/// so available(), read() and peek() only make a system call when the buffer is empty. Callers that can
+/// handle many octets at once, such as RH_Serial, can look into the buffer with peekBytes() and then
+/// consume what they used with skip(), without copying.
+///
 /// \par Device Names
 ///
 /// Device naming conventions vary from OS to OS. ON linux, an FTDI serial port may have a name like
@@ -54,11 +63,11 @@ public:
     void flush();
 
     /// Peek at the nex available character without consuming it.
-    /// CAUTION: Not implemented.
+    /// \return The next available character, or -1 if none is available
     int peek(void);
 
     /// Returns the number of bytes immediately available to be read from the
-    /// device.
+    /// device. If none are buffered, reads whatever the device has, without waiting.
     /// \return 0 if none available else the number of characters available for immediate reading
     int available();
 
@@ -69,11 +78,24 @@ public:
 
     /// Transmit a single character oin the serial port.
     /// Returns immediately.
-    /// IO errors are repored by printing aa message to stderr.
+    /// IO errors are reported by printing a message to stderr.
     /// \param[in] ch The character to send. Anything in the range 0x00 to 0xff is permitted
     /// \return 1 if successful else 0
     size_t write(uint8_t ch);
 
+    /// Transmit a number of characters on the serial port with as few system calls as possible.
+    /// IO errors are reported by printing a message to stderr.
+    /// \param[in] buf The characters to send
+    /// \param[in] len The number of characters to send
+    /// \return The number of characters sent
+    size_t write(const uint8_t* buf, size_t len);
+
+    /// Reads up to len characters that are available, without waiting for more.
+    /// \param[out] buf Where to put them
+    /// \param[in] len The maximum number to read
+    /// \return The number of characters read
+    size_t readBytes(uint8_t* buf, size_t len);
+
     // These are not usually in HardwareSerial but we 
     // need them in a Unix environment
 
@@ -86,15 +108,34 @@ public:
     /// \return true if a message is available as reported by available()
     bool waitAvailableTimeout(uint16_t timeout);
 
+    /// Gives direct access to the characters that are available, without consuming them.
+    /// Reads from the device only if none are buffered. Consume them with skip().
+    /// \param[out] data Set to the first available character
+    /// \return The number of characters available at data
+    size_t peekBytes(const uint8_t** data);
+
+    /// Consumes characters returned by peekBytes()
+    /// \param[in] len The number of characters to consume. No more than peekBytes() returned.
+    void skip(size_t len);
+
 protected:
     bool openDevice();
     bool closeDevice();
     bool setBaud(int baud);
 
+    /// Reads whatever the device has into the empty part of the buffer, without waiting
+    /// \return The number of octets read
+    size_t fill();
+
 private:
     const char* _deviceName;
     int         _device; // file desriptor
     int         _baud;
+
+    /// Input read from the device. The unconsumed octets are from _rxTail to _rxHead
+    uint8_t     _rxBuf[HARDWARESERIAL_RX_BUF_LEN];
+    size_t      _rxHead;
+    size_t      _rxTail;
 };
 
 #endif
@@ -1909,11 +1909,54 @@ these examples and explanations and extend them to suit your needs.
  #define RH_MUTEX_INIT(X) pthread_mutex_init(&X, NULL)
  #define RH_MUTEX_LOCK(X) pthread_mutex_lock(&X)
  #define RH_MUTEX_UNLOCK(X) pthread_mutex_unlock(&X)						   
+ // Recursive mutexes for the managers, whose public functions call each other
+ #define RH_RECURSIVE_MUTEX_INIT(X) rhRecursiveMutexInit(&X)
+ #define RH_MUTEX_GUARD(X) RHMutexGuard rhMutexGuard(X)
+ inline int rhRecursiveMutexInit(pthread_mutex_t* mutex)
+ {
+     pthread_mutexattr_t attr;
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+     int ret = pthread_mutex_init(mutex, &attr);
+     pthread_mutexattr_destroy(&attr);
+     return ret;
+ }
+ // Holds a mutex until the end of the enclosing block
+ class RHMutexGuard
+ {
+ public:
+     RHMutexGuard(pthread_mutex_t& mutex) : _mutex(mutex) { pthread_mutex_lock(&_mutex); }
+     ~RHMutexGuard() { pthread_mutex_unlock(&_mutex); }
+ private:
+     pthread_mutex_t& _mutex;
+ };
+#elif (RH_PLATFORM == RH_PLATFORM_ESP32)
+ // loop() and any other tasks run under FreeRTOS, so the managers always lock with a FreeRTOS
+ // recursive mutex. The driver lock (RH_MUTEX_LOCK) stays empty, since it is taken in the interrupt handler
+ #include <freertos/FreeRTOS.h>
+ #include <freertos/semphr.h>
+ #define RH_DECLARE_MUTEX(X) SemaphoreHandle_t X;
+ #define RH_MUTEX_INIT(X)
+ #define RH_MUTEX_LOCK(X)
+ #define RH_MUTEX_UNLOCK(X)
+ #define RH_RECURSIVE_MUTEX_INIT(X) (X = xSemaphoreCreateRecursiveMutex())
+ #define RH_MUTEX_GUARD(X) RHMutexGuard rhMutexGuard(X)
+ // Holds a mutex until the end of the enclosing block
+ class RHMutexGuard
+ {
+ public:
+     RHMutexGuard(SemaphoreHandle_t mutex) : _mutex(mutex) { xSemaphoreTakeRecursive(_mutex, portMAX_DELAY); }
+     ~RHMutexGuard() { xSemaphoreGiveRecursive(_mutex); }
+ private:
+     SemaphoreHandle_t _mutex;
+ };
 #else
  #define RH_DECLARE_MUTEX(X)
  #define RH_MUTEX_INIT(X)
  #define RH_MUTEX_LOCK(X)
  #define RH_MUTEX_UNLOCK(X)
+ #define RH_RECURSIVE_MUTEX_INIT(X)
+ #define RH_MUTEX_GUARD(X)
 #endif
 
 // This is the address that indicates a broadcast
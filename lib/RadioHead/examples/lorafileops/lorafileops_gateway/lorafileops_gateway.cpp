@@ -0,0 +1,85 @@
+// lorafileops_gateway.cpp
+// -*- mode: C++ -*-
+//
+// Example program demonstrating how to use
+// RHLoRaFileOpsGateway to run one RHMesh node over 2 radios supported by
+// the LoRa-file-ops Linux driver, such as the SX1278, on different frequencies.
+// Messages heard on either radio are routed by the one mesh,
+// so nodes on one frequency can reach nodes on the other through this gateway.
+// See See https://github.com/starnight/LoRa/tree/file-ops
+//
+// You can build this in the top level RadioHead directory with something like:
+// cd RadioHead
+// g++ -o lorafileops_gateway -pthread -I . RHLoRaFileOpsGateway.cpp RH_LoRaFileOps.cpp RHMesh.cpp RHRouter.cpp RHReliableDatagram.cpp RHDatagram.cpp RHGenericDriver.cpp RHListenBeforeTalk.cpp tools/simMain.cpp examples/lorafileops/lorafileops_gateway/lorafileops_gateway.cpp
+//
+// And run with
+// sudo ./lorafileops_gateway
+//  (root needed to open /dev/loraSPI0.0 and /dev/loraSPI0.1
+//
+// Ensure RadioHead LoRa compatible mesh nodes are running on each frequency
+// with modem config RH_RF95::Bw125Cr45Sf2048
+// eg examples/rf22/rf22_mesh_client/rf22_mesh_client.pde adapted for RH_RF95
+
+#include <RHLoRaFileOpsGateway.h>
+#include <RHMesh.h>
+
+// The mesh address of this gateway
+#define GATEWAY_ADDRESS 1
+
+// The radios
+RH_LoRaFileOps lora0("/dev/loraSPI0.0");
+RH_LoRaFileOps lora1("/dev/loraSPI0.1");
+
+// Makes the radios look like one driver to the mesh
+RHLoRaFileOpsGateway gateway;
+
+// Class to manage message delivery and receipt, using the gateway declared above
+RHMesh manager(gateway, GATEWAY_ADDRESS);
+
+void setup()
+{
+  gateway.addRadio(&lora0);
+  gateway.addRadio(&lora1);
+  if (!manager.init()) // Initialises the radios too
+    Serial.println("init failed");
+  // Defaults after init are:
+  // Centre frequency 434.0 MHz
+  // 13dBm transmit power
+  // Bandwidth 125kHz
+  // Spreading Factor 2048
+  // CRC on
+
+  // Put the second radio on another frequency
+  lora1.setFrequency(433000000);
+
+  // This gateway does not need the RSSI and SNR of each packet, so save 2 ioctls per packet
+  lora0.setReadMetadata(false);
+  lora1.setReadMetadata(false);
+
+  // Collect packets from both radios in the background, even while the mesh is sending
+  if (!gateway.start())
+    Serial.println("start failed");
+}
+
+uint8_t data[] = "And hello back to you from the gateway";
+// Dont put this on the stack:
+uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+
+void loop()
+{
+  uint8_t len = sizeof(buf);
+  uint8_t from;
+  if (manager.recvfromAckTimeout(buf, &len, 1000, &from))
+  {
+    Serial.print("got request from : 0x");
+    Serial.print(from, HEX);
+    Serial.print(" on radio ");
+    Serial.print(gateway.lastRadio());
+    Serial.print(": ");
+    Serial.println((char*)buf);
+
+    // Send a reply back to the originator client
+    if (manager.sendtoWait(data, sizeof(data), from) != RH_ROUTER_ERROR_NONE)
+      Serial.println("sendtoWait failed");
+  }
+}
@@ -0,0 +1,105 @@
+// rf95_spi_benchmark.pde
+// -*- mode: C++ -*-
+// Example sketch measuring the SPI bus time RH_RF95 spends on each received packet.
+// First it times the SPI accesses made to collect a packet, made one bus transaction
+// at a time as RH_RF95 used to, and batched with spiBatch() as it does now, for several packet lengths.
+// No other radio is needed for that. Then it listens for packets, eg from rf95_client,
+// and prints the time spent handling their interrupts, as counted by RH_RF95::interruptStats().
+// With RH_RF95_DEFERRED_INTERRUPTS (the default on ESP32) that is the time taken by
+// serviceInterrupt(), which is nearly all SPI.
+
+#include <SPI.h>
+#include <RH_RF95.h>
+
+// Singleton instance of the radio driver
+RH_RF95 rf95;
+//RH_RF95 rf95(5, 2); // Rocket Scream Mini Ultra Pro with the RFM95W
+//RH_RF95 rf95(8, 3); // Adafruit Feather M0 with RFM95 
+
+// Need this on Arduino Zero with SerialUSB port (eg RocketScream Mini Ultra Pro)
+//#define Serial SerialUSB
+
+#define ITERATIONS 100
+
+uint8_t regs[RH_RF95_IRQ_BURST_LEN];
+uint8_t fifo[RH_RF95_MAX_PAYLOAD_LEN];
+
+// The accesses to collect a packet of len octets, one bus transaction each
+unsigned long timeSeparate(uint8_t len)
+{
+  unsigned long start = micros();
+  for (int i = 0; i < ITERATIONS; i++)
+  {
+    rf95.spiBurstRead(RH_RF95_IRQ_BURST_FIRST, regs, sizeof(regs));
+    rf95.spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0); // Writing 0 clears no flags
+    rf95.spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, 0);
+    rf95.spiBurstRead(RH_RF95_REG_00_FIFO, fifo, len);
+  }
+  return (micros() - start) / ITERATIONS;
+}
+
+// The same accesses, as RH_RF95::serviceInterrupt() makes them
+unsigned long timeBatched(uint8_t len)
+{
+  unsigned long start = micros();
+  for (int i = 0; i < ITERATIONS; i++)
+  {
+    rf95.spiBurstRead(RH_RF95_IRQ_BURST_FIRST, regs, sizeof(regs));
+    RHSPIDriver::Access accesses[] = {
+      { RH_RF95_REG_12_IRQ_FLAGS | RH_SPI_WRITE_MASK, 0, 0, NULL },
+      { RH_RF95_REG_0D_FIFO_ADDR_PTR | RH_SPI_WRITE_MASK, 0, 0, NULL },
+      { RH_RF95_REG_00_FIFO, 0, len, fifo },
+    };
+    rf95.spiBatch(accesses, 3);
+  }
+  return (micros() - start) / ITERATIONS;
+}
+
+void setup() 
+{
+  Serial.begin(9600);
+  while (!Serial) ; // Wait for serial port to be available
+  if (!rf95.init())
+    Serial.println("init failed");  
+  // Defaults after init are 434.0MHz, 13dBm, Bw = 125 kHz, Cr = 4/5, Sf = 128chips/symbol, CRC on
+
+  // The FIFO can be read in any mode but sleep. Stay in standby so that no packet arrives
+  // and no interrupt is serviced while the reads are being timed
+  rf95.setModeIdle();
+  Serial.println("SPI bus time per received packet, us");
+  Serial.println("length\tseparate\tbatched");
+  uint8_t lengths[] = { 8, 32, 64, 128, RH_RF95_MAX_PAYLOAD_LEN };
+  for (uint8_t i = 0; i < sizeof(lengths); i++)
+  {
+    Serial.print(lengths[i]);
+    Serial.print("\t");
+    Serial.print(timeSeparate(lengths[i]));
+    Serial.print("\t\t");
+    Serial.println(timeBatched(lengths[i]));
+  }
+  Serial.println("Listening");
+  rf95.clearInterruptStats();
+}
+
+void loop()
+{
+  if (rf95.waitAvailableTimeout(1000))
+  {
+    uint8_t buf[RH_RF95_MAX_MESSAGE_LEN];
+    uint8_t len = sizeof(buf);
+    if (rf95.recv(buf, &len))
+    {
+      const RH_RF95::InterruptStats& stats = rf95.interruptStats();
+      Serial.print("got ");
+      Serial.print(len);
+      Serial.print(" octets. Interrupts: ");
+      Serial.print(stats.interrupts);
+      Serial.print(", isr mean us: ");
+      Serial.print(stats.isrTotalMicros / stats.interrupts);
+      Serial.print(", service mean us: ");
+      Serial.print(stats.services ? stats.serviceTotalMicros / stats.services : 0);
+      Serial.print(", service max us: ");
+      Serial.println(stats.serviceMaxMicros);
+    }
+  }
+}
@@ -0,0 +1,223 @@
+// simulator_encrypted_authenticated.pde
+// -*- mode: C++ -*-
+// Example simulation of RHEncryptedDriver with an authenticated cipher (ChaChaPoly),
+// using the RHEtherSim discrete event simulator and the RH_SIM driver.
+// A sender sends a run of encrypted messages to a receiver. An attacker listening in promiscuous mode
+// records them, and when the sender has finished, sends each one again unchanged (a replay), with
+// a byte of the ciphertext changed, and with the counter changed to one the receiver has not seen.
+// Checks that the receiver got every message from the sender exactly once and intact, that it
+// rejected every message from the attacker, and exits with status 1 if any check fails.
+// Requires the Crypto library from arduinolibs: http://rweather.github.io/arduinolibs/crypto.html
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead
+// CRYPTO=whatever/arduinolibs/libraries/Crypto
+// tools/etherSimBuild examples/simulator/simulator_encrypted_authenticated/simulator_encrypted_authenticated.pde
+//   -DRH_ENABLE_ENCRYPTION_MODULE -I $CRYPTO RHEncryptedDriver.cpp
+//   $CRYPTO/Crypto.cpp $CRYPTO/Cipher.cpp $CRYPTO/AuthenticatedCipher.cpp $CRYPTO/BlockCipher.cpp
+//   $CRYPTO/ChaCha.cpp $CRYPTO/ChaChaPoly.cpp $CRYPTO/Poly1305.cpp
+// (all on one line)
+// Run with
+// ./simulator_encrypted_authenticated [messages]
+// Set RH_ETHER_SIM_SEED in the environment to get a different (but repeatable) run
+
+#include <RHEncryptedDriver.h>
+#include <RH_SIM.h>
+#include <ChaChaPoly.h>
+
+#define MAX_MESSAGES 100
+
+#define SENDER_ADDRESS   1
+#define RECEIVER_ADDRESS 2
+#define ATTACKER_ADDRESS 3
+
+// The sender and receiver share this key. The attacker does not know it
+static const uint8_t key[32] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+				 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32 };
+
+// A message recorded by the attacker
+struct Recording
+{
+    uint8_t  to;
+    uint8_t  from;
+    uint8_t  id;
+    uint8_t  flags;
+    uint8_t  len;
+    uint8_t  data[RH_SIM_MAX_MESSAGE_LEN];
+};
+
+static unsigned int  numMessages = 20;
+static RHEtherSim*   theEther;
+static ChaChaPoly    senderCipher;
+static ChaChaPoly    receiverCipher;
+static RH_SIM*       senderDriver;
+static RH_SIM*       receiverDriver;
+static RH_SIM*       attackerDriver;
+static RHEncryptedDriver* sender;
+static RHEncryptedDriver* receiver;
+
+static Recording     recordings[MAX_MESSAGES];
+static unsigned int  numRecordings = 0;
+static unsigned int  numAttacks = 0;
+static unsigned int  received[MAX_MESSAGES]; // Times each message was delivered
+static unsigned int  corrupt = 0;            // Messages delivered that the sender did not send
+static bool          senderDone = false;
+static bool          attackerDone = false;
+
+static void runSender(void* /* arg */)
+{
+    if (!sender->init())
+    {
+	Serial.println("init failed");
+	return;
+    }
+    sender->setThisAddress(SENDER_ADDRESS);
+    sender->setHeaderFrom(SENDER_ADDRESS);
+    sender->setHeaderTo(RECEIVER_ADDRESS);
+    // A real node would restore this from EEPROM
+    sender->setNonceCounter(1000);
+    for (unsigned int i = 0; i < numMessages; i++)
+    {
+	char data[20];
+	snprintf(data, sizeof(data), "message %u", i);
+	sender->setHeaderId(i);
+	if (!sender->send((uint8_t*)data, strlen(data) + 1))
+	    Serial.println("send failed");
+	sender->waitPacketSent();
+	delay(500);
+    }
+    senderDone = true;
+}
+
+static void runReceiver(void* /* arg */)
+{
+    if (!receiver->init())
+    {
+	Serial.println("init failed");
+	return;
+    }
+    receiver->setThisAddress(RECEIVER_ADDRESS);
+    while (1)
+    {
+	uint8_t buf[RH_SIM_MAX_MESSAGE_LEN];
+	uint8_t len = sizeof(buf) - 1;
+	if (!receiver->waitAvailableTimeout(60000) || !receiver->recv(buf, &len))
+	    continue;
+	buf[len] = 0;
+	unsigned int i;
+	char expected[20];
+	if (   sscanf((char*)buf, "message %u", &i) == 1 && i < numMessages
+	    && snprintf(expected, sizeof(expected), "message %u", i) > 0
+	    && len == strlen(expected) + 1 && !strcmp((char*)buf, expected)
+	    && receiver->headerFrom() == SENDER_ADDRESS)
+	    received[i]++;
+	else
+	    corrupt++;
+    }
+}
+
+// Sends a recorded message, with the same headers as the sender used
+static void sendRecording(const Recording* r)
+{
+    attackerDriver->setHeaderTo(r->to);
+    attackerDriver->setHeaderFrom(r->from);
+    attackerDriver->setHeaderId(r->id);
+    attackerDriver->setHeaderFlags(r->flags, 0xff);
+    attackerDriver->send(r->data, r->len);
+    attackerDriver->waitPacketSent();
+    numAttacks++;
+    delay(500);
+}
+
+static void runAttacker(void* /* arg */)
+{
+    if (!attackerDriver->init())
+    {
+	Serial.println("init failed");
+	return;
+    }
+    attackerDriver->setThisAddress(ATTACKER_ADDRESS);
+    attackerDriver->setPromiscuous(true);
+    while (!senderDone)
+    {
+	Recording r;
+	r.len = sizeof(r.data);
+	if (   attackerDriver->waitAvailableTimeout(1000)
+	    && attackerDriver->recv(r.data, &r.len)
+	    && attackerDriver->headerFrom() == SENDER_ADDRESS
+	    && numRecordings < numMessages)
+	{
+	    r.to = attackerDriver->headerTo();
+	    r.from = attackerDriver->headerFrom();
+	    r.id = attackerDriver->headerId();
+	    r.flags = attackerDriver->headerFlags();
+	    recordings[numRecordings++] = r;
+	}
+    }
+
+    delay(1000);
+    for (unsigned int i = 0; i < numRecordings; i++)
+    {
+	Recording r = recordings[i];
+	// Sent again unchanged: the counter has been seen before
+	sendRecording(&r);
+	// Ciphertext changed: the tag does not match
+	r.data[RH_ENCRYPTED_DRIVER_NONCE_LEN] ^= 0x01;
+	sendRecording(&r);
+	// Counter moved past any the receiver has seen: the tag does not match that either
+	r = recordings[i];
+	r.data[0] ^= 0x80;
+	sendRecording(&r);
+    }
+    attackerDone = true;
+}
+
+// Waits for the sender and attacker, then checks the results
+static void report(void* /* arg */)
+{
+    while (!attackerDone)
+	delay(1000);
+    // Give the receiver time to collect the last messages
+    delay(1000);
+
+    unsigned int delivered = 0, duplicates = 0;
+    for (unsigned int i = 0; i < numMessages; i++)
+    {
+	if (received[i])
+	    delivered++;
+	if (received[i] > 1)
+	    duplicates++;
+    }
+    printf("%u of %u delivered, %u duplicates, %u corrupt, %u of %u attacks rejected\n",
+	   delivered, numMessages, duplicates, corrupt, receiver->rxBad(), numAttacks);
+    // Every message from the sender must have arrived, and nothing from the attacker
+    if (   delivered != numMessages || duplicates || corrupt
+	|| numRecordings != numMessages || receiver->rxBad() != numAttacks)
+    {
+	printf("FAILED\n");
+	exit(1);
+    }
+    theEther->stop();
+}
+
+void simSetup(RHEtherSim& ether)
+{
+    if (_simulator_argc >= 2)
+	numMessages = atoi(_simulator_argv[1]);
+    if (numMessages > MAX_MESSAGES)
+	numMessages = MAX_MESSAGES;
+    theEther = &ether;
+    memset(received, 0, sizeof(received));
+
+    senderCipher.setKey(key, sizeof(key));
+    receiverCipher.setKey(key, sizeof(key));
+    senderDriver = new RH_SIM(&ether);
+    receiverDriver = new RH_SIM(&ether);
+    attackerDriver = new RH_SIM(&ether);
+    sender = new RHEncryptedDriver(*senderDriver, senderCipher);
+    receiver = new RHEncryptedDriver(*receiverDriver, receiverCipher);
+    ether.spawn(runReceiver, NULL);
+    ether.spawn(runAttacker, NULL);
+    ether.spawn(runSender, NULL);
+    ether.spawn(report, NULL);
+}
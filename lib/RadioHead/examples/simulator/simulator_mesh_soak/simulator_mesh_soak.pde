@@ -0,0 +1,132 @@
+// simulator_mesh_soak.pde
+// -*- mode: C++ -*-
+// Example simulation showing how to soak test RHMesh with many nodes in a single process
+// using the RHEtherSim discrete event simulator and the RH_SIM driver.
+// Every node periodically sends a message to a randomly chosen node in its group,
+// and forwards traffic for the others the rest of the time.
+// Messages are sent with sendtoQueued(), so nodes keep routing while their own route discoveries
+// are in progress.
+// Nodes are split into groups of up to 250 on different frequencies, since RadioHead
+// addresses are only 8 bits.
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead 
+// tools/etherSimBuild examples/simulator/simulator_mesh_soak/simulator_mesh_soak.pde
+// Run with
+// ./simulator_mesh_soak [nodes [hours [topology.conf]]]
+// eg ./simulator_mesh_soak 100 24 tools/chain.conf
+// Set RH_ETHER_SIM_SEED in the environment to get a different (but repeatable) run
+
+#include <RHMesh.h>
+#include <RH_SIM.h>
+
+#define GROUP_SIZE 250
+
+// Mean interval between messages sent by each node, in ms
+#define SEND_INTERVAL 60000
+
+struct SoakNode
+{
+    RH_SIM*  driver;
+    RHMesh*  manager;
+    RHPacketBuffer packet; // Relayed messages are forwarded straight from here
+    uint8_t  address;
+    uint8_t  groupSize;
+    uint32_t sent;
+    uint32_t failed;
+    uint32_t received;
+};
+
+static SoakNode*     nodes;
+static unsigned int  numNodes = 20;
+static unsigned long duration; // ms
+
+static void runNode(void* arg)
+{
+    SoakNode* node = (SoakNode*)arg;
+    uint8_t data[] = "Hello World!";
+
+    if (!node->manager->init())
+    {
+	Serial.println("init failed");
+	return;
+    }
+    while (1)
+    {
+	// Listen and route for a while
+	unsigned long listenUntil = millis() + random(SEND_INTERVAL / 2, SEND_INTERVAL * 3 / 2);
+	while ((long)(listenUntil - millis()) > 0)
+	{
+	    uint8_t from;
+	    unsigned long timeLeft = listenUntil - millis();
+	    if (node->manager->recvfromAckTimeout(node->packet, timeLeft > 60000 ? 60000 : timeLeft, &from))
+		node->received++;
+	}
+
+	if (node->groupSize < 2)
+	    continue;
+	uint8_t to = random(1, node->groupSize + 1);
+	if (to == node->address)
+	    continue;
+	node->sent++;
+	uint8_t ret = node->manager->sendtoQueued(data, sizeof(data), to);
+	if (ret != RH_ROUTER_ERROR_NONE && ret != RH_ROUTER_ERROR_QUEUED)
+	    node->failed++;
+    }
+}
+
+static void report(void* arg)
+{
+    RHEtherSim* ether = (RHEtherSim*)arg;
+    delay(duration);
+    uint32_t sent = 0, failed = 0, received = 0, retransmissions = 0, discoveryFailures = 0;
+    uint32_t rebroadcasts = 0, suppressed = 0, duplicates = 0, reevaluations = 0;
+    for (unsigned int i = 0; i < numNodes; i++)
+    {
+	sent += nodes[i].sent;
+	failed += nodes[i].failed;
+	received += nodes[i].received;
+	retransmissions += nodes[i].manager->retransmissions();
+	discoveryFailures += nodes[i].manager->discoveryFailures();
+	rebroadcasts += nodes[i].manager->rebroadcasts();
+	suppressed += nodes[i].manager->rebroadcastsSuppressed();
+	duplicates += nodes[i].manager->broadcastDuplicates();
+	reevaluations += nodes[i].manager->routeReevaluations();
+    }
+    printf("simulator_mesh_soak: %u nodes, %lu s\n", numNodes, duration / 1000);
+    printf("  sent:            %u\n", sent);
+    printf("  failed:          %u\n", failed);
+    printf("  received:        %u\n", received);
+    printf("  no route found:  %u\n", discoveryFailures);
+    printf("  retransmissions: %u\n", retransmissions);
+    printf("  rebroadcasts:    %u (%u suppressed, %u duplicates dropped)\n", rebroadcasts, suppressed, duplicates);
+    printf("  routes re-evaluated on link degradation: %u\n", reevaluations);
+    ether->stop();
+}
+
+void simSetup(RHEtherSim& ether)
+{
+    float hours = 1.0;
+    if (_simulator_argc >= 2)
+	numNodes = atoi(_simulator_argv[1]);
+    if (_simulator_argc >= 3)
+	hours = atof(_simulator_argv[2]);
+    if (_simulator_argc >= 4 && !ether.readConfig(_simulator_argv[3]))
+	exit(1);
+    duration = (unsigned long)(hours * 3600000);
+
+    nodes = new SoakNode[numNodes];
+    for (unsigned int i = 0; i < numNodes; i++)
+    {
+	unsigned int group = i / GROUP_SIZE;
+	unsigned int groupStart = group * GROUP_SIZE;
+	nodes[i].address = (i % GROUP_SIZE) + 1;
+	nodes[i].groupSize = (numNodes - groupStart) < GROUP_SIZE ? (numNodes - groupStart) : GROUP_SIZE;
+	nodes[i].sent = nodes[i].failed = nodes[i].received = 0;
+	nodes[i].driver = new RH_SIM(&ether);
+	nodes[i].driver->setFrequency(915.0 + group * 0.2);
+	nodes[i].manager = new RHMesh(*nodes[i].driver, nodes[i].address);
+	ether.spawn(runNode, &nodes[i]);
+    }
+    ether.spawn(report, &ether);
+}
@@ -0,0 +1,176 @@
+// simulator_reliable_windowed.pde
+// -*- mode: C++ -*-
+// Example simulation comparing windowed and stop-and-wait transfers with RHReliableDatagram,
+// using the RHEtherSim discrete event simulator and the RH_SIM driver.
+// One pair of nodes sends a run of messages with sendtoWait(), another pair sends the same run with
+// sendtoWindowed() and waitWindowed(), on a different frequency so they do not interfere.
+// Both links lose packets, so acknowledgements, retransmissions and duplicate detection are exercised.
+// Checks that every message the sender was told was delivered did arrive, and that none arrived
+// more than once, prints the time each transfer took, and exits with status 1 if any check fails.
+// With the default link probability every message is delivered. On worse links some are given up on.
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead
+// tools/etherSimBuild examples/simulator/simulator_reliable_windowed/simulator_reliable_windowed.pde
+// Run with
+// ./simulator_reliable_windowed [messages [link probability]]
+// eg ./simulator_reliable_windowed 200 0.7
+// Set RH_ETHER_SIM_SEED in the environment to get a different (but repeatable) run
+
+#include <RHReliableDatagram.h>
+#include <RH_SIM.h>
+
+#define MAX_MESSAGES 1000
+
+struct Transfer
+{
+    const char*         name;
+    bool                windowed;
+    RH_SIM*             senderDriver;
+    RH_SIM*             receiverDriver;
+    RHReliableDatagram* sender;
+    RHReliableDatagram* receiver;
+    uint8_t             senderAddress;
+    uint8_t             receiverAddress;
+    uint16_t            received[MAX_MESSAGES]; // Times each message was delivered
+    bool                acked[MAX_MESSAGES];    // The sender was told the message was delivered
+    unsigned long       elapsed;                // ms
+    bool                done;
+};
+
+static Transfer      transfers[2];
+static unsigned int  numMessages = 200;
+static RHEtherSim*   theEther;
+
+static void runSender(void* arg)
+{
+    Transfer* t = (Transfer*)arg;
+    if (!t->sender->init())
+    {
+	Serial.println("init failed");
+	return;
+    }
+    t->sender->setRetries(10);
+    bool windowOk = true;
+    unsigned long start = millis();
+    for (unsigned int i = 0; i < numMessages; i++)
+    {
+	uint8_t data[20];
+	memset(data, 0, sizeof(data));
+	data[0] = i >> 8;
+	data[1] = i;
+#if RH_RELIABLE_WINDOW_SIZE > 0
+	if (t->windowed)
+	{
+	    if (!t->sender->sendtoWindowed(data, sizeof(data), t->receiverAddress))
+		windowOk = false; // An earlier message was given up on, but we do not know which
+	    continue;
+	}
+#endif
+	t->acked[i] = t->sender->sendtoWait(data, sizeof(data), t->receiverAddress);
+    }
+#if RH_RELIABLE_WINDOW_SIZE > 0
+    // All or nothing, since the window does not say which messages failed
+    if (t->windowed && t->sender->waitWindowed() && windowOk)
+	for (unsigned int i = 0; i < numMessages; i++)
+	    t->acked[i] = true;
+#endif
+    t->elapsed = millis() - start;
+    t->done = true;
+}
+
+static void runReceiver(void* arg)
+{
+    Transfer* t = (Transfer*)arg;
+    if (!t->receiver->init())
+    {
+	Serial.println("init failed");
+	return;
+    }
+    while (1)
+    {
+	uint8_t buf[RH_MAX_MESSAGE_LEN];
+	uint8_t len = sizeof(buf);
+	uint8_t from;
+	if (   t->receiver->recvfromAckTimeout(buf, &len, 60000, &from)
+	    && from == t->senderAddress && len >= 2)
+	{
+	    unsigned int i = (buf[0] << 8) | buf[1];
+	    if (i < numMessages)
+		t->received[i]++;
+	}
+    }
+}
+
+// Waits for both senders, then checks the results
+static void report(void* /* arg */)
+{
+    while (!transfers[0].done || !transfers[1].done)
+	delay(1000);
+    // Give the receivers time to collect the last messages
+    delay(1000);
+
+    bool ok = true;
+    for (unsigned int j = 0; j < 2; j++)
+    {
+	Transfer* t = &transfers[j];
+	unsigned int delivered = 0, acked = 0, duplicates = 0, lost = 0;
+	for (unsigned int i = 0; i < numMessages; i++)
+	{
+	    if (t->received[i])
+		delivered++;
+	    if (t->acked[i])
+		acked++;
+	    if (t->received[i] > 1)
+		duplicates++;
+	    if (t->acked[i] && !t->received[i])
+		lost++;
+	}
+	printf("%s: %u of %u delivered, %u acknowledged, %u duplicates, %u retransmissions, %lu ms\n",
+	       t->name, delivered, numMessages, acked, duplicates, t->sender->retransmissions(), t->elapsed);
+	// Every message the sender was told about must have arrived, and none more than once
+	if (lost || duplicates)
+	{
+	    printf("%s: FAILED\n", t->name);
+	    ok = false;
+	}
+    }
+    if (!ok)
+	exit(1);
+    theEther->stop();
+}
+
+void simSetup(RHEtherSim& ether)
+{
+    float probability = 0.8;
+    if (_simulator_argc >= 2)
+	numMessages = atoi(_simulator_argv[1]);
+    if (_simulator_argc >= 3)
+	probability = atof(_simulator_argv[2]);
+    if (numMessages > MAX_MESSAGES)
+	numMessages = MAX_MESSAGES;
+    theEther = &ether;
+
+    for (unsigned int j = 0; j < 2; j++)
+    {
+	Transfer* t = &transfers[j];
+	memset(t->received, 0, sizeof(t->received));
+	memset(t->acked, 0, sizeof(t->acked));
+	t->name = j ? "windowed" : "stop-and-wait";
+	t->windowed = j;
+	t->senderAddress = 1 + j * 2;
+	t->receiverAddress = 2 + j * 2;
+	t->elapsed = 0;
+	t->done = false;
+	t->senderDriver = new RH_SIM(&ether);
+	t->receiverDriver = new RH_SIM(&ether);
+	t->senderDriver->setFrequency(915.0 + j * 0.2);
+	t->receiverDriver->setFrequency(915.0 + j * 0.2);
+	t->sender = new RHReliableDatagram(*t->senderDriver, t->senderAddress);
+	t->receiver = new RHReliableDatagram(*t->receiverDriver, t->receiverAddress);
+	ether.setLinkProbability(t->senderAddress, t->receiverAddress, probability);
+	ether.spawn(runReceiver, t);
+	ether.spawn(runSender, t);
+    }
+    ether.spawn(report, NULL);
+}
@@ -0,0 +1,305 @@
+// askDecode.cpp
+// Decodes RH_ASK messages from sampled receiver output with RHASKDecoder, and reports
+// the decode rate and error statistics.
+// With no file arguments, the samples come from a generator of RH_ASK transmissions on many channels,
+// with sample noise, idle receiver noise and transmitter clock error, and every decoded message is
+// checked against what was sent.
+// With file arguments, each file is the capture of one receiver output at 8 samples per bit,
+// 1 octet per sample, 0 for low and anything else for high (eg sigrok-cli -O binary from one channel).
+// Build with
+// cd whatever/RadioHead
+// g++ -O3 -march=native -I . -I RHutil tools/askDecode.cpp RHASKDecoder.cpp RHCRC.cpp -o askDecode
+// Run with
+// ./askDecode [-c channels] [-m messages] [-n sampleflipprobability] [-d clockerrorppm] [-q] [-s seed]
+// ./askDecode capture1.bin [capture2.bin ...]
+
+#include <RadioHead.h>
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <RHASKDecoder.h>
+#include <RHCRC.h>
+
+// Sample times decoded per call to RHASKDecoder::decode()
+#define BLOCK_SAMPLES 4096
+
+// Samples per second of the receiver output RH_ASK takes at its default 2000 bps
+#define REAL_TIME_SAMPLE_RATE (2000 * RH_ASK_RX_SAMPLES_PER_BIT)
+
+// The symbols RH_ASK sends before each message: preamble then start symbol
+static const uint8_t preamble[RH_ASK_PREAMBLE_LEN] = {0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x38, 0x2c};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Small repeatable random number generator, so that the contents of each message can be
+// worked out again from its channel and sequence number when it is received
+static uint32_t xorshift(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Contents of message seq on channel: the 4 headers, then data.
+// The id and flags headers carry the sequence number
+static uint8_t makeMessage(uint16_t channel, uint16_t seq, uint8_t* buf)
+{
+    uint32_t state = ((uint32_t)channel << 16 | seq) * 2654435761u + 1;
+    uint8_t len = 1 + xorshift(&state) % RH_ASK_MAX_MESSAGE_LEN;
+    buf[0] = RH_BROADCAST_ADDRESS;
+    buf[1] = channel;
+    buf[2] = seq;
+    buf[3] = seq >> 8;
+    for (uint8_t i = 0; i < len; i++)
+	buf[RH_ASK_HEADER_LEN + i] = xorshift(&state);
+    return RH_ASK_HEADER_LEN + len;
+}
+
+// One simulated RH_ASK transmitter and receiver
+class Transmitter
+{
+public:
+    Transmitter() : _seq(0), _symbol(0), _numSymbols(0), _phase(0), _gap(0) {}
+
+    void setup(uint16_t channel, uint32_t seed, double noise, double ppm, bool idleNoise)
+    {
+	_channel = channel;
+	_random = seed * 2654435761u + channel + 1;
+	_noise = noise * 4294967296.0;
+	_samplesPerBit = RH_ASK_RX_SAMPLES_PER_BIT * (1.0 + ppm / 1e6);
+	_idleNoise = idleNoise;
+	_gap = xorshift(&_random) % 2000;
+    }
+
+    // Encodes the next message into 6 bit symbols, as RH_ASK::send() does
+    void nextMessage()
+    {
+	uint8_t msg[RH_ASK_MAX_PAYLOAD_LEN];
+	uint8_t len = makeMessage(_channel, _seq++, msg);
+	uint8_t count = len + 3;
+	uint16_t crc = RHcrc_ccitt_update(0xffff, count);
+	crc = ~RHcrc_ccitt_update_buf(crc, msg, len);
+	_numSymbols = 0;
+	for (uint8_t i = 0; i < RH_ASK_PREAMBLE_LEN; i++)
+	    _symbols[_numSymbols++] = preamble[i];
+	addByte(count);
+	for (uint8_t i = 0; i < len; i++)
+	    addByte(msg[i]);
+	addByte(crc & 0xff);
+	addByte(crc >> 8);
+	_symbol = 0;
+	_phase = 0;
+    }
+
+    // Returns the next sample of the receiver output
+    uint8_t next(uint32_t messages)
+    {
+	uint8_t sample;
+	if (_symbol >= _numSymbols)
+	{
+	    // Between messages. Cheap receivers output noise when there is no carrier
+	    if (_gap)
+	    {
+		_gap--;
+		return _idleNoise ? xorshift(&_random) & 1 : 0;
+	    }
+	    if (_seq >= messages)
+		return _idleNoise ? xorshift(&_random) & 1 : 0;
+	    nextMessage();
+	    _gap = 200 + xorshift(&_random) % 2000;
+	}
+	// Symbols are sent LSB first, each bit for _samplesPerBit samples
+	uint16_t bit = _phase / _samplesPerBit;
+	sample = (_symbols[_symbol] >> bit) & 1;
+	_phase += 1;
+	if (_phase >= 6 * _samplesPerBit)
+	{
+	    _phase -= 6 * _samplesPerBit;
+	    _symbol++;
+	}
+	if (xorshift(&_random) < _noise)
+	    sample ^= 1;
+	return sample;
+    }
+
+    uint16_t sent() { return _seq; }
+    bool     done(uint32_t messages) { return _seq >= messages && _symbol >= _numSymbols; }
+
+private:
+    void addByte(uint8_t b)
+    {
+	_symbols[_numSymbols++] = RHASKDecoder::encodeSymbol(b >> 4);
+	_symbols[_numSymbols++] = RHASKDecoder::encodeSymbol(b & 0xf);
+    }
+
+    uint16_t _channel;
+    uint16_t _seq;
+    uint32_t _random;
+    uint32_t _noise;
+    double   _samplesPerBit;
+    bool     _idleNoise;
+    uint8_t  _symbols[RH_ASK_PREAMBLE_LEN + 2 * RH_ASK_MAX_PAYLOAD_LEN];
+    uint16_t _symbol;
+    uint16_t _numSymbols;
+    double   _phase;
+    uint32_t _gap;
+};
+
+// Checks each good message against what was sent
+static uint32_t corrupt;
+static void checkMessage(void* /* arg */, uint16_t channel, const uint8_t* buf, uint8_t len)
+{
+    uint8_t expected[RH_ASK_MAX_PAYLOAD_LEN];
+    uint16_t seq = buf[2] | ((uint16_t)buf[3] << 8);
+    uint8_t expectedLen = makeMessage(channel, seq, expected);
+    if (len != expectedLen || buf[1] != (uint8_t)channel || memcmp(buf, expected, len) != 0)
+	corrupt++;
+}
+
+static void printStats(const char* name, const RHASKDecoder::Stats& stats)
+{
+    printf("%s good %u, bad FCS %u, bad length %u, bad symbols %u, start symbols %u\n",
+	   name, stats.good, stats.badFcs, stats.badLength, stats.badSymbols, stats.starts);
+}
+
+static void printRate(uint64_t samples, uint16_t channels, double elapsed)
+{
+    double rate = samples * channels / elapsed;
+    printf("  decoded %.0f M samples in %.3f s: %.1f M samples/s, %.0f channels in real time at 2000 bps\n",
+	   samples * channels / 1e6, elapsed, rate / 1e6, rate / REAL_TIME_SAMPLE_RATE);
+}
+
+static int generate(uint16_t channels, uint32_t messages, double noise, double ppm, bool idleNoise, uint32_t seed)
+{
+    RHASKDecoder decoder(channels);
+    decoder.setHandler(checkMessage);
+    std::vector<Transmitter> transmitters(channels);
+    for (uint16_t c = 0; c < channels; c++)
+    {
+	// Spread the clock errors over +-ppm
+	double error = channels > 1 ? ppm * (2.0 * c / (channels - 1) - 1) : ppm;
+	transmitters[c].setup(c, seed, noise, error, idleNoise);
+    }
+
+    std::vector<uint8_t> block((size_t)BLOCK_SAMPLES * channels);
+    uint64_t samples = 0;
+    double elapsed = 0;
+    bool done = false;
+    while (!done)
+    {
+	done = true;
+	for (uint32_t t = 0; t < BLOCK_SAMPLES; t++)
+	    for (uint16_t c = 0; c < channels; c++)
+		block[(size_t)t * channels + c] = transmitters[c].next(messages);
+	for (uint16_t c = 0; c < channels; c++)
+	    done = done && transmitters[c].done(messages);
+
+	double start = now();
+	decoder.decode(&block[0], BLOCK_SAMPLES);
+	elapsed += now() - start;
+	samples += BLOCK_SAMPLES;
+    }
+
+    RHASKDecoder::Stats total = decoder.totalStats();
+    uint32_t sent = (uint32_t)channels * messages;
+    printf("askDecode: %u channels, %u messages each, sample noise %g, clock error +-%g ppm%s\n",
+	   channels, messages, noise, ppm, idleNoise ? ", noise between messages" : "");
+    printRate(samples, channels, elapsed);
+    printf("  sent %u, received %u (%.2f%%), missed %u, corrupt but passed FCS %u\n",
+	   sent, total.good, 100.0 * total.good / sent, sent - (total.good - corrupt), corrupt);
+    printStats("  decoder:", total);
+    return corrupt ? 1 : 0;
+}
+
+static int decodeFiles(int numFiles, char** files)
+{
+    uint16_t channels = numFiles;
+    std::vector<std::vector<uint8_t> > captures(channels);
+    size_t longest = 0;
+    for (uint16_t c = 0; c < channels; c++)
+    {
+	FILE* f = fopen(files[c], "rb");
+	if (!f)
+	{
+	    perror(files[c]);
+	    return 1;
+	}
+	uint8_t buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+	    captures[c].insert(captures[c].end(), buf, buf + n);
+	fclose(f);
+	if (captures[c].size() > longest)
+	    longest = captures[c].size();
+    }
+
+    RHASKDecoder decoder(channels);
+    std::vector<uint8_t> block((size_t)BLOCK_SAMPLES * channels);
+    double elapsed = 0;
+    for (size_t pos = 0; pos < longest; pos += BLOCK_SAMPLES)
+    {
+	uint32_t n = longest - pos < BLOCK_SAMPLES ? longest - pos : BLOCK_SAMPLES;
+	for (uint32_t t = 0; t < n; t++)
+	    for (uint16_t c = 0; c < channels; c++)
+		block[(size_t)t * channels + c] = pos + t < captures[c].size() ? captures[c][pos + t] : 0;
+	double start = now();
+	decoder.decode(&block[0], n);
+	elapsed += now() - start;
+    }
+
+    printf("askDecode: %u captures\n", channels);
+    printRate(longest, channels, elapsed);
+    for (uint16_t c = 0; c < channels; c++)
+    {
+	char name[300];
+	snprintf(name, sizeof(name), "  %s:", files[c]);
+	printStats(name, decoder.stats(c));
+    }
+    if (channels > 1)
+	printStats("  total:", decoder.totalStats());
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    uint16_t channels = 64;
+    uint32_t messages = 100;
+    double noise = 0.02;
+    double ppm = 1000;
+    bool idleNoise = true;
+    uint32_t seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:m:n:d:qs:")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'c': channels = atoi(optarg); break;
+	    case 'm': messages = atoi(optarg); break;
+	    case 'n': noise = atof(optarg); break;
+	    case 'd': ppm = atof(optarg); break;
+	    case 'q': idleNoise = false; break;
+	    case 's': seed = atoi(optarg); break;
+	    default:
+		fprintf(stderr, "usage: %s [-c channels] [-m messages] [-n sampleflipprobability] [-d clockerrorppm] [-q] [-s seed] [capture ...]\n", argv[0]);
+		return 1;
+	}
+    }
+    if (optind < argc)
+	return decodeFiles(argc - optind, argv + optind);
+    if (channels < 1 || messages > 65536)
+	return 1;
+    return generate(channels, messages, noise, ppm, idleNoise, seed);
+}
+
+#endif
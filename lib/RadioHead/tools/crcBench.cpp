@@ -0,0 +1,175 @@
+// crcBench.cpp
+// Host benchmark for the RHCRC routines. Checks the configured implementation against
+// the original bit at a time versions, then reports the throughput of each.
+// Build the RH_CRC_TABLES variants to compare, eg:
+// cd whatever/RadioHead
+// g++ -O2 -I . -I RHutil tools/crcBench.cpp RHCRC.cpp -o crcBench
+// g++ -O2 -I . -I RHutil -DRH_CRC_TABLES=1 tools/crcBench.cpp RHCRC.cpp -o crcBench1
+// Run with
+// ./crcBench [megabytes]
+
+#include <RadioHead.h>
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <RHCRC.h>
+
+// The original bit at a time versions, for reference
+static uint16_t refCrc16(uint16_t crc, uint8_t a)
+{
+    crc ^= a;
+    for (int i = 0; i < 8; ++i)
+	crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+    return crc;
+}
+
+static uint16_t refXmodem(uint16_t crc, uint8_t data)
+{
+    crc ^= (uint16_t)data << 8;
+    for (int i = 0; i < 8; i++)
+	crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    return crc;
+}
+
+static uint16_t refCcitt(uint16_t crc, uint8_t data)
+{
+    data ^= crc & 0xff;
+    data ^= data << 4;
+    return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+static uint8_t refIbutton(uint8_t crc, uint8_t data)
+{
+    crc ^= data;
+    for (int i = 0; i < 8; i++)
+	crc = (crc & 1) ? (crc >> 1) ^ 0x8C : (crc >> 1);
+    return crc;
+}
+
+typedef uint16_t (*ByteFn)(uint16_t crc, uint8_t data);
+typedef uint16_t (*BufFn)(uint16_t crc, const uint8_t* buf, uint16_t len);
+
+// 8 bit iButton CRC adapted to the 16 bit signatures
+static uint16_t refIbutton16(uint16_t crc, uint8_t data) { return refIbutton(crc, data); }
+static uint16_t ibutton16(uint16_t crc, uint8_t data) { return RHcrc_ibutton_update(crc, data); }
+static uint16_t ibuttonBuf16(uint16_t crc, const uint8_t* buf, uint16_t len) { return RHcrc_ibutton_update_buf(crc, buf, len); }
+
+typedef struct
+{
+    const char* name;
+    ByteFn      ref;
+    ByteFn      byte;
+    BufFn       buf;
+} Crc;
+
+static const Crc crcs[] =
+{
+    { "crc16",   refCrc16,     RHcrc16_update,       RHcrc16_update_buf },
+    { "xmodem",  refXmodem,    RHcrc_xmodem_update,  RHcrc_xmodem_update_buf },
+    { "ccitt",   refCcitt,     RHcrc_ccitt_update,   RHcrc_ccitt_update_buf },
+    { "ibutton", refIbutton16, ibutton16,            ibuttonBuf16 },
+};
+
+// Messages the size RadioHead drivers carry
+#define MESSAGE_LEN 255
+#define BUFFER_LEN  65535
+
+static uint8_t data[BUFFER_LEN];
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool check(const Crc& crc)
+{
+    // Every length and alignment up to a message, from a few starting values
+    for (uint16_t start = 0; start < 3; start++)
+    {
+	uint16_t init = start == 0 ? 0 : start == 1 ? 0xffff : 0x1d0f;
+	if (crc.ref == refIbutton16)
+	    init &= 0xff;
+	for (uint16_t offset = 0; offset < 8; offset++)
+	{
+	    for (uint16_t len = 0; len <= MESSAGE_LEN; len++)
+	    {
+		uint16_t expected = init;
+		uint16_t byByte = init;
+		for (uint16_t i = 0; i < len; i++)
+		{
+		    expected = crc.ref(expected, data[offset + i]);
+		    byByte = crc.byte(byByte, data[offset + i]);
+		}
+		uint16_t byBuf = crc.buf(init, data + offset, len);
+		if (byByte != expected || byBuf != expected)
+		{
+		    printf("%s: mismatch at len %u offset %u: expected 0x%04x, got 0x%04x byte at a time, 0x%04x from buffer\n",
+			   crc.name, len, offset, expected, byByte, byBuf);
+		    return false;
+		}
+	    }
+	}
+    }
+    return true;
+}
+
+// Returns MB/s for the CRC of the whole data buffer, message by message, repeated to make up megabytes
+static double timeByte(ByteFn fn, unsigned megabytes, uint16_t* result)
+{
+    uint16_t crc = 0xffff;
+    unsigned long total = (unsigned long)megabytes * 1000000;
+    double start = now();
+    for (unsigned long done = 0; done < total; done += BUFFER_LEN)
+	for (uint16_t i = 0; i < BUFFER_LEN; i++)
+	    crc = fn(crc, data[i]);
+    double elapsed = now() - start;
+    *result = crc;
+    return megabytes / elapsed;
+}
+
+static double timeBuf(BufFn fn, unsigned megabytes, uint16_t* result)
+{
+    uint16_t crc = 0xffff;
+    unsigned long total = (unsigned long)megabytes * 1000000;
+    double start = now();
+    for (unsigned long done = 0; done < total; done += BUFFER_LEN)
+	for (uint16_t i = 0; i < BUFFER_LEN; i += MESSAGE_LEN)
+	    crc = fn(crc, data + i, MESSAGE_LEN);
+    double elapsed = now() - start;
+    *result = crc;
+    return megabytes / elapsed;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned megabytes = argc >= 2 ? atoi(argv[1]) : 100;
+    srandom(1);
+    for (unsigned i = 0; i < sizeof(data); i++)
+	data[i] = random();
+
+    printf("crcBench: RH_CRC_TABLES %d, %u MB, %u octet messages\n", RH_CRC_TABLES, megabytes, MESSAGE_LEN);
+    printf("%-8s %12s %12s %12s\n", "", "bitwise", "byte", "buffer");
+    bool ok = true;
+    for (unsigned i = 0; i < sizeof(crcs) / sizeof(crcs[0]); i++)
+    {
+	const Crc& crc = crcs[i];
+	if (!check(crc))
+	{
+	    ok = false;
+	    continue;
+	}
+	uint16_t r1, r2, r3;
+	double ref = timeByte(crc.ref, megabytes, &r1);
+	double byByte = timeByte(crc.byte, megabytes, &r2);
+	double byBuf = timeBuf(crc.buf, megabytes, &r3);
+	// Printing the results keeps the compiler from discarding the work
+	printf("%-8s %7.0f MB/s %7.0f MB/s %7.0f MB/s  (%04x %04x %04x)\n", crc.name, ref, byByte, byBuf, r1, r2, r3);
+    }
+    return ok ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,669 @@
+// etherServer.cpp
+// Simulates the luminiferous ether for RH_TCP clients, as etherSimulator.pl does,
+// but as a single threaded epoll server that can carry thousands of clients.
+// Speaks the protocol in RHTcpProtocol.h, and reads the same config file format.
+//
+// Each packet is held for its time on air before it is delivered, computed from the LoRa modem
+// settings given on the command line (see RHLoRaAirtime.h), or from -b bits per second
+// as etherSimulator.pl does. Packets that overlap in time at a receiver destroy each other,
+// and a client that is transmitting does not hear anything.
+// In addition to the etherSimulator.pl config lines
+// probability:nodea:nodeb:probability
+// the config file can contain
+// default:probability       (probability for pairs not listed, 1.0 if not given. 0.0 means out of range)
+// delay:nodea:nodeb:ms      (extra delivery delay between the nodes, in milliseconds)
+// defaultdelay:ms           (delay for pairs not listed, 0 if not given)
+//
+// Build with
+// cd whatever/RadioHead
+// g++ -O2 -I . -I RHutil tools/etherServer.cpp RHLoRaAirtime.cpp -o etherServer
+// Run with
+// ./etherServer [-c configfile] [-p port] [-b bitspersec] [-s sf] [-w bandwidth] [-r codingrate4] [-l preamble] [-x seed] [-v]
+// Print the counters at any time with kill -USR1, and on exit with ^C
+
+#include <RadioHead.h>
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <RHTcpProtocol.h>
+#include <RHLoRaAirtime.h>
+
+// Largest message a client may send: type octet, 4 headers and the payload
+#define MAX_MESSAGE_LEN (1 + RH_TCP_MAX_PAYLOAD_LEN)
+
+// Octets of input buffered for each client. Holds many messages, so one read() usually
+// drains everything the client has sent
+#define INPUT_BUF_LEN 4096
+
+// Packets queued for a client that is not reading its socket are dropped beyond this
+#define MAX_OUTPUT_QUEUE 256
+
+// Packets written to a client in one writev()
+#define MAX_WRITEV 64
+
+// Events handled per epoll_wait()
+#define MAX_EVENTS 256
+
+// A packet ready to send to clients as an RHTcpPacket message, shared by all its receptions
+struct Packet
+{
+    uint32_t refs;
+    uint16_t len;                                   // Octets in data
+    uint8_t  data[sizeof(uint32_t) + MAX_MESSAGE_LEN];
+};
+
+struct Client;
+
+// A packet arriving at one client
+struct Reception
+{
+    Packet*  packet;
+    Client*  client;    // NULL if the client has gone
+    uint64_t start;     // Microseconds
+    uint64_t end;
+    bool     lost;      // Lost to the link probability
+    bool     collided;  // Overlapped another reception, or the client transmitted
+};
+
+struct Client
+{
+    int      fd;
+    int      address;   // -1 until the client sends RH_TCP_MESSAGE_TYPE_THISADDRESS
+    size_t   index;     // In clients
+    uint64_t txEnd;     // End of the current transmission
+    bool     dirty;     // Has output waiting to be flushed
+    bool     polledOut; // Waiting for EPOLLOUT
+    uint8_t  in[INPUT_BUF_LEN];
+    uint32_t inLen;
+    std::deque<Packet*>     out;
+    uint32_t outOffset; // Octets of out.front() already written
+    std::vector<Reception*> receptions; // Arriving now
+};
+
+// Receptions in order of end time
+struct LaterEnd
+{
+    bool operator()(const Reception* a, const Reception* b) const { return a->end > b->end; }
+};
+
+static struct
+{
+    uint32_t clients;
+    uint32_t transmissions;
+    uint32_t deliveries;
+    uint32_t collisions;
+    uint32_t halfDuplexLosses;
+    uint32_t linkLosses;
+    uint32_t overruns;
+    uint32_t protocolErrors;
+    uint64_t airtime;
+} stats;
+
+static std::vector<Client*> clients;
+static std::vector<Client*> dirtyClients;
+static std::priority_queue<Reception*, std::vector<Reception*>, LaterEnd> receptions;
+static float    links[256 * 256];
+static uint32_t delays[256 * 256];  // Microseconds
+static float    defaultLink = 1.0;
+static uint32_t defaultDelay = 0;
+static RHLoRaModemParams modem;
+static uint32_t bps = 0;            // If set, airtime is from bits per second instead of modem
+static bool     verbose = false;
+static int      epollFd;
+static int      timerFd;
+static int      listenFd;
+static volatile sig_atomic_t stopRequested = 0;
+static volatile sig_atomic_t statsRequested = 0;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void signalHandler(int sig)
+{
+    if (sig == SIGUSR1)
+	statsRequested = 1;
+    else
+	stopRequested = 1;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-c configfile] [-p port] [-b bitspersec] [-s sf] [-w bandwidth] [-r codingrate4] [-l preamble] [-x seed] [-v]\n", name);
+    exit(1);
+}
+
+static bool readConfig(const char* filename)
+{
+    FILE* f = fopen(filename, "r");
+    if (!f)
+    {
+	fprintf(stderr, "Could not open config file %s: %s\n", filename, strerror(errno));
+	return false;
+    }
+    char line[200];
+    while (fgets(line, sizeof(line), f))
+    {
+	unsigned int a, b;
+	float value;
+	if (sscanf(line, "probability:%u:%u:%f", &a, &b, &value) == 3 && a < 256 && b < 256)
+	{
+	    links[a * 256 + b] = value;
+	    links[b * 256 + a] = value; // Bidirectional
+	}
+	else if (sscanf(line, "delay:%u:%u:%f", &a, &b, &value) == 3 && a < 256 && b < 256)
+	{
+	    delays[a * 256 + b] = value * 1000;
+	    delays[b * 256 + a] = value * 1000;
+	}
+	else if (sscanf(line, "default:%f", &value) == 1)
+	    defaultLink = value;
+	else if (sscanf(line, "defaultdelay:%f", &value) == 1)
+	    defaultDelay = value * 1000;
+    }
+    fclose(f);
+    return true;
+}
+
+static float linkProbability(int from, int to)
+{
+    if (from < 0 || to < 0)
+	return defaultLink;
+    float probability = links[from * 256 + to];
+    return probability < 0.0 ? defaultLink : probability;
+}
+
+static uint32_t linkDelay(int from, int to)
+{
+    if (from < 0 || to < 0)
+	return defaultDelay;
+    uint32_t delay = delays[from * 256 + to];
+    return delay == 0xffffffff ? defaultDelay : delay;
+}
+
+// Time on air of a packet of len octets including the 4 headers, in microseconds
+static uint32_t airtime(uint16_t len)
+{
+    if (bps)
+	return (uint64_t)len * 8 * 1000000 / bps;
+    return RHLoRaAirtime(&modem, len);
+}
+
+static void releasePacket(Packet* packet)
+{
+    if (--packet->refs == 0)
+	delete packet;
+}
+
+static void watchOutput(Client* client, bool on)
+{
+    if (client->polledOut == on)
+	return;
+    struct epoll_event event;
+    event.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = client;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, client->fd, &event);
+    client->polledOut = on;
+}
+
+static void closeClient(Client* client)
+{
+    if (verbose)
+	printf("etherServer: client %d disconnected\n", client->address);
+    close(client->fd); // Also removes it from the epoll set
+    for (size_t i = 0; i < client->receptions.size(); i++)
+	client->receptions[i]->client = NULL;
+    while (!client->out.empty())
+    {
+	releasePacket(client->out.front());
+	client->out.pop_front();
+    }
+    // Swap the last client into its place
+    clients[client->index] = clients.back();
+    clients[client->index]->index = client->index;
+    clients.pop_back();
+    stats.clients--;
+    // Freed by flushDirtyClients(), after any other events for it in this epoll batch
+    client->fd = -1;
+    if (!client->dirty)
+    {
+	client->dirty = true;
+	dirtyClients.push_back(client);
+    }
+}
+
+// Writes as many of the queued packets as the socket will take, several at a time
+// Returns false if the client was closed
+static bool flushOutput(Client* client)
+{
+    while (!client->out.empty())
+    {
+	struct iovec iov[MAX_WRITEV];
+	int count = 0;
+	size_t total = 0;
+	for (std::deque<Packet*>::iterator it = client->out.begin();
+	     it != client->out.end() && count < MAX_WRITEV; it++, count++)
+	{
+	    iov[count].iov_base = (*it)->data;
+	    iov[count].iov_len = (*it)->len;
+	    total += (*it)->len;
+	}
+	iov[0].iov_base = client->out.front()->data + client->outOffset;
+	iov[0].iov_len -= client->outOffset;
+	total -= client->outOffset;
+	ssize_t sent = writev(client->fd, iov, count);
+	if (sent < 0)
+	{
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	    if (errno == EINTR)
+		continue;
+	    closeClient(client);
+	    return false;
+	}
+	// Drop the packets that were completely written
+	size_t done = sent + client->outOffset;
+	while (!client->out.empty() && done >= client->out.front()->len)
+	{
+	    done -= client->out.front()->len;
+	    releasePacket(client->out.front());
+	    client->out.pop_front();
+	}
+	client->outOffset = done;
+	if ((size_t)sent < total || client->out.empty())
+	    break; // Socket full, or all written
+    }
+    watchOutput(client, !client->out.empty());
+    return true;
+}
+
+static void queueOutput(Client* client, Packet* packet)
+{
+    if (client->out.size() >= MAX_OUTPUT_QUEUE)
+    {
+	// Not reading its socket. A real radio would have overwritten its buffer
+	stats.overruns++;
+	return;
+    }
+    packet->refs++;
+    client->out.push_back(packet);
+    if (!client->dirty)
+    {
+	client->dirty = true;
+	dirtyClients.push_back(client);
+    }
+}
+
+static void flushDirtyClients()
+{
+    for (size_t i = 0; i < dirtyClients.size(); i++)
+    {
+	Client* client = dirtyClients[i];
+	client->dirty = false;
+	if (client->fd < 0)
+	    delete client; // Closed while it was dirty
+	else if (!client->polledOut) // Else waiting for EPOLLOUT anyway
+	    flushOutput(client);
+    }
+    dirtyClients.clear();
+}
+
+// Starts the transmission of a packet from a client to all the clients that can hear it
+// data is the 4 headers and the payload, as carried in RHTcpPacket
+static void transmit(Client* sender, const uint8_t* data, uint16_t len)
+{
+    uint64_t start = now();
+    uint32_t duration = airtime(len);
+    stats.transmissions++;
+    stats.airtime += duration;
+
+    // Half duplex: anything the sender was receiving is lost
+    sender->txEnd = start + duration;
+    for (size_t i = 0; i < sender->receptions.size(); i++)
+    {
+	if (!sender->receptions[i]->collided)
+	{
+	    sender->receptions[i]->collided = true;
+	    stats.halfDuplexLosses++;
+	}
+    }
+
+    Packet* packet = new Packet;
+    packet->refs = 1; // Ours, until all the receptions are made
+    packet->len = sizeof(uint32_t) + 1 + len;
+    uint32_t length = htonl(1 + len);
+    memcpy(packet->data, &length, sizeof(length));
+    packet->data[sizeof(uint32_t)] = RH_TCP_MESSAGE_TYPE_PACKET;
+    memcpy(packet->data + sizeof(uint32_t) + 1, data, len);
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+	Client* client = clients[i];
+	if (client == sender)
+	    continue;
+	float probability = linkProbability(sender->address, client->address);
+	if (probability <= 0.0)
+	    continue; // Out of range, does not even interfere
+
+	Reception* reception = new Reception;
+	reception->packet = packet;
+	reception->client = client;
+	reception->start = start + linkDelay(sender->address, client->address);
+	reception->end = reception->start + duration;
+	reception->lost = drand48() >= probability;
+	reception->collided = false;
+	packet->refs++;
+
+	if (client->txEnd > reception->start)
+	{
+	    reception->collided = true;
+	    stats.halfDuplexLosses++;
+	}
+	// Collides with everything else arriving at this client. Receptions that have ended
+	// have already been removed, but with link delays another may start later than this one
+	for (size_t j = 0; j < client->receptions.size(); j++)
+	{
+	    Reception* other = client->receptions[j];
+	    if (other->start < reception->end && reception->start < other->end)
+	    {
+		if (!other->collided)
+		{
+		    other->collided = true;
+		    stats.collisions++;
+		}
+		if (!reception->collided)
+		{
+		    reception->collided = true;
+		    stats.collisions++;
+		}
+	    }
+	}
+	client->receptions.push_back(reception);
+	receptions.push(reception);
+    }
+    releasePacket(packet);
+}
+
+// Delivers the packets whose time on air has finished
+static void deliver()
+{
+    uint64_t t = now();
+    while (!receptions.empty() && receptions.top()->end <= t)
+    {
+	Reception* reception = receptions.top();
+	receptions.pop();
+	Client* client = reception->client;
+	if (client)
+	{
+	    for (size_t i = 0; i < client->receptions.size(); i++)
+	    {
+		if (client->receptions[i] == reception)
+		{
+		    client->receptions[i] = client->receptions.back();
+		    client->receptions.pop_back();
+		    break;
+		}
+	    }
+	    if (reception->collided)
+		; // Already counted
+	    else if (reception->lost)
+		stats.linkLosses++;
+	    else
+	    {
+		stats.deliveries++;
+		queueOutput(client, reception->packet);
+	    }
+	}
+	releasePacket(reception->packet);
+	delete reception;
+    }
+
+    // Wake up for the next one
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (!receptions.empty())
+    {
+	uint64_t end = receptions.top()->end;
+	spec.it_value.tv_sec = end / 1000000;
+	spec.it_value.tv_nsec = (end % 1000000) * 1000;
+    }
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Handles the complete messages in the client input buffer
+// Returns false if the client sent something impossible
+static bool handleInput(Client* client)
+{
+    uint32_t offset = 0;
+    while (client->inLen - offset >= sizeof(uint32_t))
+    {
+	uint32_t length;
+	memcpy(&length, client->in + offset, sizeof(length));
+	length = ntohl(length);
+	if (length < 1 || length > MAX_MESSAGE_LEN)
+	{
+	    fprintf(stderr, "etherServer: client %d sent bad length %u. Disconnecting\n", client->address, length);
+	    stats.protocolErrors++;
+	    return false;
+	}
+	if (client->inLen - offset < sizeof(uint32_t) + length)
+	    break; // Rest of it not here yet
+	const uint8_t* message = client->in + offset + sizeof(uint32_t);
+	if (message[0] == RH_TCP_MESSAGE_TYPE_THISADDRESS && length >= 2)
+	{
+	    client->address = message[1];
+	    if (verbose)
+		printf("etherServer: client is address %d\n", client->address);
+	}
+	else if (message[0] == RH_TCP_MESSAGE_TYPE_PACKET && length >= 5)
+	    transmit(client, message + 1, length - 1);
+	offset += sizeof(uint32_t) + length;
+    }
+    // Only the start of the last message, if any, is left to move
+    client->inLen -= offset;
+    if (client->inLen && offset)
+	memmove(client->in, client->in + offset, client->inLen);
+    return true;
+}
+
+static void readInput(Client* client)
+{
+    ssize_t count = read(client->fd, client->in + client->inLen, sizeof(client->in) - client->inLen);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	return;
+    if (count <= 0)
+    {
+	closeClient(client);
+	return;
+    }
+    client->inLen += count;
+    if (!handleInput(client))
+	closeClient(client);
+}
+
+static void acceptClients()
+{
+    while (1)
+    {
+	int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+	{
+	    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		fprintf(stderr, "etherServer: accept failed: %s\n", strerror(errno));
+	    return;
+	}
+	// Packets are small and latency matters
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	Client* client = new Client;
+	client->fd = fd;
+	client->address = -1;
+	client->txEnd = 0;
+	client->dirty = false;
+	client->polledOut = false;
+	client->inLen = 0;
+	client->outOffset = 0;
+	client->index = clients.size();
+	clients.push_back(client);
+	stats.clients++;
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = client;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+	{
+	    fprintf(stderr, "etherServer: epoll_ctl failed: %s\n", strerror(errno));
+	    closeClient(client);
+	}
+    }
+}
+
+static void printStats()
+{
+    printf("etherServer: clients %u, transmissions %u, deliveries %u, collisions %u, half duplex losses %u, "
+	   "link losses %u, overruns %u, protocol errors %u, airtime %.3f s\n",
+	   stats.clients, stats.transmissions, stats.deliveries, stats.collisions, stats.halfDuplexLosses,
+	   stats.linkLosses, stats.overruns, stats.protocolErrors, stats.airtime / 1e6);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    const char* config = NULL;
+    int port = 4000;
+    long seed = time(NULL);
+    RHLoRaDefaultModemParams(&modem);
+    for (size_t i = 0; i < 256 * 256; i++)
+    {
+	links[i] = -1.0;   // Use defaultLink
+	delays[i] = 0xffffffff; // Use defaultDelay
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hc:p:b:s:w:r:l:x:v")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'c': config = optarg; break;
+	    case 'p': port = atoi(optarg); break;
+	    case 'b': bps = atoi(optarg); break;
+	    case 's': modem.spreadingFactor = atoi(optarg); break;
+	    case 'w': modem.bandwidth = atol(optarg); break;
+	    case 'r': modem.codingRate4 = atoi(optarg); break;
+	    case 'l': modem.preambleLength = atoi(optarg); break;
+	    case 'x': seed = atol(optarg); break;
+	    case 'v': verbose = true; break;
+	    default: usage(argv[0]);
+	}
+    }
+    if (config && !readConfig(config))
+	return 1;
+    srand48(seed);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signalHandler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGUSR1, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); // Write errors are handled where they happen
+
+    listenFd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    int off = 0;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)); // IPv4 too
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0)
+    {
+	fprintf(stderr, "etherServer: could not listen on port %d: %s\n", port, strerror(errno));
+	return 1;
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.ptr = &timerFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event);
+
+    if (bps)
+	printf("etherServer: listening on port %d, %u bits per second\n", port, bps);
+    else
+	printf("etherServer: listening on port %d, SF%u, %u Hz, 4/%u, preamble %u\n",
+	       port, modem.spreadingFactor, modem.bandwidth, modem.codingRate4, modem.preambleLength);
+    fflush(stdout);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopRequested)
+    {
+	int count = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+	if (count < 0 && errno != EINTR)
+	{
+	    fprintf(stderr, "etherServer: epoll_wait failed: %s\n", strerror(errno));
+	    return 1;
+	}
+	for (int i = 0; i < count; i++)
+	{
+	    void* ptr = events[i].data.ptr;
+	    if (ptr == &listenFd)
+		acceptClients();
+	    else if (ptr == &timerFd)
+	    {
+		// Just drain the count. A spurious wakeup does no harm: deliver() checks the time anyway
+		uint64_t expirations;
+		ssize_t got = read(timerFd, &expirations, sizeof(expirations));
+		(void)got;
+	    }
+	    else
+	    {
+		Client* client = (Client*)ptr;
+		if (client->fd < 0)
+		    continue; // Closed while handling an earlier event
+		if ((events[i].events & EPOLLOUT) && !flushOutput(client))
+		    continue;
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		    readInput(client);
+	    }
+	}
+	// Deliver after the whole batch of input, so that packets sent at the same time collide,
+	// then send everything that became due in as few writes as possible
+	deliver();
+	flushDirtyClients();
+	if (statsRequested)
+	{
+	    statsRequested = 0;
+	    printStats();
+	}
+    }
+    printStats();
+    return 0;
+}
+
+#endif
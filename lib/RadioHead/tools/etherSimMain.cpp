@@ -0,0 +1,57 @@
+// etherSimMain.cpp
+// Lets RadioHead sketches run many simulated nodes within a single Linux process,
+// on the virtual clock of an RHEtherSim discrete event simulator.
+// Instead of setup() and loop(), the sketch provides simSetup(), which spawns the nodes.
+
+#include <RadioHead.h>
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) 
+
+#include <stdio.h>
+#include <RHutil/simulator.h>
+#include <RHEtherSim.h>
+
+SerialSimulator Serial;
+
+// Function we expect to find in the sketch
+extern void simSetup(RHEtherSim& ether);
+
+int    _simulator_argc;
+char** _simulator_argv;
+
+int main(int argc, char** argv)
+{
+    // Let simulated program have access to argc and argv
+    _simulator_argc = argc;
+    _simulator_argv = argv;
+    // Seed from the environment so runs are repeatable
+    const char* seed = getenv("RH_ETHER_SIM_SEED");
+    RHEtherSim ether(seed ? strtoul(seed, NULL, 0) : 1);
+    simSetup(ether);
+    ether.run();
+    ether.printStats();
+    return 0;
+}
+
+// Suspends the calling node in virtual time
+void delay(unsigned long ms)
+{
+    RHEtherSim::instance()->sleep((uint64_t)ms * 1000);
+}
+
+// Arduino equivalent, virtual milliseconds since the start of the simulation
+unsigned long millis()
+{
+    return RHEtherSim::instance()->millis();
+}
+
+long random(long from, long to)
+{
+    return RHEtherSim::instance()->random(from, to);
+}
+
+long random(long to)
+{
+    return random(0, to);
+}
+
+#endif
@@ -126,6 +126,8 @@ void setup()
   navigationManager.InitializeUtils(compass, Serial2);
 
   // Initialize Lora Module
+  // DIO0 is wired on every hardware version, so let the radio task sleep until RxDone
+  CompassUtils::ArduinoLora.SetReceiveMode(ArduinoLoRaDriver::RECEIVE_MODE_INTERRUPT);
   auto success = loraManager.Init();
 
 #if DEBUG == 1
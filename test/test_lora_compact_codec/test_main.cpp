@@ -0,0 +1,139 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <unity.h>
+
+#include "LoraManager.h"
+#include "HelperClasses/LoRaDriver/LoraCompactCodec.h"
+
+// Round trips the documents the real message classes produce through the compact codec.
+// If MessageBase or MessagePing gain, lose or rename a key, Encode() stops taking the compact
+// path and these tests fail, instead of the messages silently going back to MessagePack.
+
+namespace
+{
+    const uint32_t TEST_TIME = 1735689600UL; // 2025-01-01T00:00:00Z
+    const size_t MAX_PAYLOAD_LENGTH = 255;   // SX127x FIFO
+
+    // Fills every field the schema knows with a value of its kind
+    template <typename Schema>
+    void FillFromSchema(JsonDocument &doc)
+    {
+        auto fields = Schema::Fields();
+
+        doc[LORA_COMPACT_TYPE_KEY] = Schema::Type;
+
+        for (size_t i = 0; i < Schema::FieldCount; i++)
+        {
+            switch (fields[i].kind)
+            {
+                case LoraCompactCodec::FIELD_UINT8:
+                    doc[fields[i].key] = (uint8_t)(0x40 + i);
+                    break;
+                case LoraCompactCodec::FIELD_VARUINT:
+                    doc[fields[i].key] = (uint32_t)(0x12345 * (i + 1));
+                    break;
+                case LoraCompactCodec::FIELD_BOOL:
+                    doc[fields[i].key] = true;
+                    break;
+                case LoraCompactCodec::FIELD_LATLON:
+                    doc[fields[i].key] = i % 2 ? -122.4194155 : 37.7749295;
+                    break;
+                case LoraCompactCodec::FIELD_EPOCH_SECONDS:
+                    doc[fields[i].key] = TEST_TIME;
+                    break;
+                case LoraCompactCodec::FIELD_STRING:
+                    doc[fields[i].key] = "Wayfinder";
+                    break;
+            }
+        }
+    }
+
+    // Builds a message of the given class from a fully populated document, serializes it the way
+    // the radio task does, and checks the result goes out compact and comes back unchanged
+    template <typename Message, typename Schema>
+    void RoundTrip()
+    {
+        TEST_ASSERT_EQUAL_UINT8(Schema::Type, Message::MessageType());
+
+        StaticJsonDocument<512> input;
+        FillFromSchema<Schema>(input);
+
+        auto message = Message::MessageFactory(input);
+        TEST_ASSERT_NOT_NULL(message);
+
+        StaticJsonDocument<512> sent;
+        message->serialize(sent);
+        delete message;
+
+        uint8_t buffer[MAX_PAYLOAD_LENGTH];
+        auto length = LoraCompactCodec::Encode(sent, buffer, sizeof(buffer));
+
+        // Zero means a key or value type the schema does not cover, and a MessagePack fallback
+        TEST_ASSERT_GREATER_THAN(0, length);
+        TEST_ASSERT_TRUE(LoraCompactCodec::IsCompactFrame(buffer, length));
+
+        StaticJsonDocument<512> received;
+        TEST_ASSERT_TRUE(LoraCompactCodec::Decode(buffer, length, received));
+        TEST_ASSERT_EQUAL(sent.size(), received.size());
+
+        for (JsonPairConst kv : sent.as<JsonObjectConst>())
+        {
+            JsonVariantConst value = received[kv.key().c_str()];
+            TEST_ASSERT_FALSE_MESSAGE(value.isNull(), kv.key().c_str());
+
+            if (kv.value().is<const char *>())
+            {
+                TEST_ASSERT_EQUAL_STRING_MESSAGE(kv.value().as<const char *>(), value.as<const char *>(), kv.key().c_str());
+            }
+            else if (kv.value().is<uint32_t>())
+            {
+                TEST_ASSERT_EQUAL_UINT32_MESSAGE(kv.value().as<uint32_t>(), value.as<uint32_t>(), kv.key().c_str());
+            }
+            else
+            {
+                // Fixed point latitude and longitude
+                TEST_ASSERT_DOUBLE_WITHIN_MESSAGE(1.0 / LORA_COMPACT_LATLON_SCALE, kv.value().as<double>(), value.as<double>(), kv.key().c_str());
+            }
+        }
+    }
+}
+
+void test_message_base_round_trip()
+{
+    RoundTrip<MessageBase, LoraCompactCodec::MessageBaseSchema>();
+}
+
+void test_message_ping_round_trip()
+{
+    RoundTrip<MessagePing, LoraCompactCodec::MessagePingSchema>();
+}
+
+void test_unknown_key_falls_back()
+{
+    StaticJsonDocument<256> doc;
+    FillFromSchema<LoraCompactCodec::MessagePingSchema>(doc);
+    doc["NotInSchema"] = 1;
+
+    uint8_t buffer[MAX_PAYLOAD_LENGTH];
+    TEST_ASSERT_EQUAL(0, LoraCompactCodec::Encode(doc, buffer, sizeof(buffer)));
+}
+
+void setup()
+{
+    // Give the serial monitor time to attach
+    delay(2000);
+
+    // Same types as main.cpp registers
+    MessageBase::SetMessageType(0x01);
+    MessagePing::SetMessageType(0x02);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_message_base_round_trip);
+    RUN_TEST(test_message_ping_round_trip);
+    RUN_TEST(test_unknown_key_falls_back);
+    UNITY_END();
+}
+
+void loop()
+{
+}